@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___ARENA_H__
+#define ___ARENA_H__
+
+#include <stdlib.h>
+#include <cstddef>
+#include <new>
+#include <string>
+
+
+namespace util
+{
+
+    /*
+       Monotonic arena: allocations are carved out of large blocks and never
+       freed one by one; release() drops them all in one step, keeping the
+       blocks for the next round, so a steady state does not touch the heap.
+     */
+    class arena_t
+    {
+        private:
+            enum { ARENA_BLOCK_SIZE = 64 * 1024 };
+
+            struct block_t
+            {
+                block_t * next;
+                size_t size;
+            };
+
+            block_t * _blocks;   // in use, the current one first
+            block_t * _free;     // kept by release()
+            size_t _used;        // in the current block
+            size_t _in_use;      // bytes handed out since release()
+
+            unsigned long _allocs;
+            unsigned long _heap_blocks;
+            size_t _high_water;
+
+            arena_t( const arena_t& );
+            arena_t & operator=( const arena_t& );
+
+
+            static size_t header() throw()
+            {
+                return (sizeof(block_t) + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+            }
+
+
+            bool new_block( size_t n ) throw()
+            {
+                block_t ** p = &_free;
+
+                // first kept block large enough
+                while (*p && (*p)->size < n)
+                {
+                    p = &(*p)->next;
+                }
+
+                block_t * b = *p;
+
+                if (b)
+                {
+                    *p = b->next;
+                }
+                else
+                {
+                    const size_t size = n > size_t( ARENA_BLOCK_SIZE ) ? n : size_t( ARENA_BLOCK_SIZE );
+
+                    b = (block_t *) malloc( header() + size );
+                    if (!b) return false;
+
+                    b->size = size;
+                    ++_heap_blocks;
+                }
+
+                b->next = _blocks;
+                _blocks = b;
+                _used = 0;
+
+                return true;
+            }
+
+
+        public:
+            arena_t() throw() :
+                _blocks(0), _free(0), _used(0), _in_use(0),
+                _allocs(0), _heap_blocks(0), _high_water(0) {}
+
+
+            ~arena_t()
+            {
+                release();
+
+                while (_free)
+                {
+                    block_t * b = _free;
+                    _free = b->next;
+                    free( b );
+                }
+            }
+
+
+            void * allocate( size_t n, size_t align )
+            {
+                size_t ofs = _blocks ? (_used + align - 1) & ~(align - 1) : 0;
+
+                if (! _blocks || ofs + n > _blocks->size)
+                {
+                    if (! new_block( n )) throw std::bad_alloc();
+                    ofs = 0;
+                }
+
+                _used = ofs + n;
+                _in_use += n;
+                ++_allocs;
+
+                if (_in_use > _high_water) _high_water = _in_use;
+
+                return (char *) _blocks + header() + ofs;
+            }
+
+
+            // Every allocation is dropped, the blocks are kept
+            void release() throw()
+            {
+                while (_blocks)
+                {
+                    block_t * b = _blocks;
+                    _blocks = b->next;
+                    b->next = _free;
+                    _free = b;
+                }
+
+                _used = 0;
+                _in_use = 0;
+            }
+
+
+            //--------------------------------------------------------------------------
+
+
+            unsigned long allocs() const throw() { return _allocs; }
+            unsigned long heap_blocks() const throw() { return _heap_blocks; }
+            size_t high_water() const throw() { return _high_water; }
+
+
+            //--------------------------------------------------------------------------
+
+
+            // Arena used by the arena_allocator_t objects constructed
+            // by the calling thread, 0 for the heap
+            static arena_t *& current() throw()
+            {
+                static thread_local arena_t * arena = 0;
+                return arena;
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Makes arena the current one of the calling thread within a scope;
+       at the end of the scope everything allocated from it is released
+     */
+    class arena_scope_t
+    {
+        private:
+            arena_t & _arena;
+            arena_t * _prev;
+
+            arena_scope_t( const arena_scope_t& );
+            arena_scope_t & operator=( const arena_scope_t& );
+
+        public:
+            explicit arena_scope_t( arena_t & arena ) throw() :
+                _arena(arena), _prev( arena_t::current() )
+            {
+                arena_t::current() = &_arena;
+            }
+
+
+            ~arena_scope_t()
+            {
+                arena_t::current() = _prev;
+                _arena.release();
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Allocator binding a container to the arena current at its construction
+       (or to the heap when there is none). Such containers must not outlive
+       the scope of that arena.
+     */
+    template <class T> class arena_allocator_t
+    {
+        private:
+            template <class U> friend class arena_allocator_t;
+
+            arena_t * _arena;
+
+        public:
+            typedef T value_type;
+
+            arena_allocator_t() throw() : _arena( arena_t::current() ) {}
+
+            template <class U>
+            arena_allocator_t( const arena_allocator_t<U> & other ) throw() :
+                _arena( other._arena ) {}
+
+
+            T * allocate( size_t n )
+            {
+                return _arena ?
+                    (T *) _arena->allocate( n * sizeof(T), alignof(T) ) :
+                    (T *) ::operator new( n * sizeof(T) );
+            }
+
+
+            void deallocate( T * p, size_t ) throw()
+            {
+                if (! _arena) ::operator delete( p );
+            }
+
+
+            template <class U>
+            bool operator == ( const arena_allocator_t<U> & other ) const throw()
+            {
+                return _arena == other._arena;
+            }
+
+
+            template <class U>
+            bool operator != ( const arena_allocator_t<U> & other ) const throw()
+            {
+                return _arena != other._arena;
+            }
+    };
+
+
+    typedef std::basic_string< char, std::char_traits<char>, arena_allocator_t<char> > arena_string_t;
+
+}
+
+#endif
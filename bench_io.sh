@@ -0,0 +1,38 @@
+#!/bin/sh
+### bench_io.sh - compare the --batch I/O engines ###################
+
+# Usage: bench_io.sh <spidyboot> [ <work_dir> [ <n_images> [ <payload_kb> ] ] ]
+#
+# Creates <n_images> synthetic payloads of <payload_kb> KB in <work_dir>
+# (e.g. a tmpfs or an ext4 mount point) and builds the corresponding
+# spi-flash images by means of "--batch --io stdio" and "--batch --io uring".
+
+SPIDYBOOT=${1:?"usage: $0 <spidyboot> [ <work_dir> [ <n_images> [ <payload_kb> ] ] ]"}
+WORKDIR=${2:-/tmp}/spidyboot_bench.$$
+IMAGES=${3:-64}
+PAYLOAD_KB=${4:-1024}
+RUNS=3
+
+mkdir -p "$WORKDIR/in" "$WORKDIR/out" || exit 1
+trap 'rm -rf "$WORKDIR"' EXIT
+
+echo "Creating $IMAGES payloads of $PAYLOAD_KB KB in $WORKDIR"
+
+i=0
+while [ $i -lt $IMAGES ]; do
+    dd if=/dev/urandom of="$WORKDIR/in/u-boot_$i.bin" \
+        bs=1024 count=$PAYLOAD_KB 2>/dev/null || exit 1
+    echo "--tga 11000000 --spi -s $WORKDIR/in/u-boot_$i.bin" \
+        "-d $WORKDIR/out/spi_u-boot_$i.bin" >> "$WORKDIR/jobs.txt"
+    i=$((i+1))
+done
+
+for engine in stdio uring; do
+    run=0
+    while [ $run -lt $RUNS ]; do
+        rm -f "$WORKDIR"/out/*
+        sync
+        "$SPIDYBOOT" --batch "$WORKDIR/jobs.txt" --io $engine || exit 1
+        run=$((run+1))
+    done
+done
@@ -0,0 +1,202 @@
+#!/bin/sh
+### bench_pipeline.sh - end-to-end image generation benchmark ########
+
+# Usage: bench_pipeline.sh [ -s <sizes> ] [ -r <runs> ] [ -p <n_pairs> ]
+#                          [ -o <results.csv> ] [ -b <baseline.csv> ]
+#                          [ -t <tolerance_%> ]
+#                          <spidyboot> [ <work_dir> ... ]
+#
+# For each <work_dir> (default: /dev/shm and /var/tmp, i.e. tmpfs and disk)
+# and for each payload size (default: 64K 1M 16M 256M 2G) creates a synthetic
+# payload and a synthetic .cfg file of <n_pairs> register writes, then runs
+# the real command line code paths:
+#
+#   spi   : --cfg <cfg> --spi -s <payload> -d <image>
+#   pipe  : --cfg <cfg> --spi -s - -d - < <payload> > /dev/null
+#   patch : --cfg <cfg> --patch <image>
+#
+# with cold and warm page cache. Each measure is the best of <runs> runs of
+# "spidyboot --stats", which reports elapsed time, peak RSS and the number
+# of read/write syscalls of the run. MB/s are computed on the image size, so
+# for "patch" (which only rewrites the preamble) they just track the run time.
+#
+# The results are printed as a table and can be saved as CSV (-o) to be used
+# later as a baseline (-b): any MB/s drop, or RSS or syscall increase, larger
+# than <tolerance_%> (default 10) is reported and makes the script exit 1.
+#
+# A cold cache needs root (/proc/sys/vm/drop_caches); otherwise the page cache
+# of the payload and of the image is dropped by means of "dd iflag=nocache".
+# On tmpfs the files live in the page cache, so cold and warm are the same.
+
+USAGE="usage: $0 [ -s <sizes> ] [ -r <runs> ] [ -p <n_pairs> ] [ -o <results.csv> ] [ -b <baseline.csv> ] [ -t <tolerance_%> ] <spidyboot> [ <work_dir> ... ]"
+
+SIZES="64K 1M 16M 256M 2G"
+RUNS=3
+PAIRS=96
+RESULTS=
+BASELINE=
+TOLERANCE=10
+
+while getopts "s:r:p:o:b:t:" opt; do
+    case $opt in
+        s) SIZES=$OPTARG ;;
+        r) RUNS=$OPTARG ;;
+        p) PAIRS=$OPTARG ;;
+        o) RESULTS=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        t) TOLERANCE=$OPTARG ;;
+        *) echo "$USAGE" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+
+SPIDYBOOT=${1:?"$USAGE"}
+shift
+[ $# -gt 0 ] || set -- /dev/shm /var/tmp
+
+if [ -n "$BASELINE" ] && [ ! -r "$BASELINE" ]; then
+    echo "cannot read baseline $BASELINE" >&2
+    exit 1
+fi
+
+CSV=`mktemp` || exit 1
+WORKDIRS=
+trap 'rm -rf "$CSV" $WORKDIRS' EXIT
+
+echo "dir,fs,cache,size,step,seconds,mb_s,max_rss_kb,syscalls" > "$CSV"
+
+
+# size with K/M/G suffix -> KB
+size_kb()
+{
+    case $1 in
+        *K) echo ${1%K} ;;
+        *M) echo $((${1%M} * 1024)) ;;
+        *G) echo $((${1%G} * 1024 * 1024)) ;;
+        *)  echo $(($1 / 1024)) ;;
+    esac
+}
+
+
+drop_cache()
+{
+    sync
+    if ! echo 3 2>/dev/null > /proc/sys/vm/drop_caches; then
+        for f in "$@"; do
+            [ -f "$f" ] && dd if="$f" iflag=nocache count=0 2>/dev/null
+        done
+    fi
+}
+
+
+# run <step> <cache> <payload> <image>: best of $RUNS runs, as
+# "seconds max_rss_kb syscalls"
+run()
+{
+    step=$1; cache=$2; payload=$3; image=$4
+    best=
+
+    if [ $cache = warm ]; then
+        run_once $step "$payload" "$image" || return 1
+    fi
+
+    i=0
+    while [ $i -lt $RUNS ]; do
+        [ $cache = cold ] && drop_cache "$payload" "$image"
+        run_once $step "$payload" "$image" || return 1
+        sed -n 's/^stats: \([0-9.]*\) s elapsed.*, \([0-9]*\) KB max RSS, \([0-9]*\) read + \([0-9]*\) write.*/\1 \2 \3 \4/p' \
+            "$WORKDIR/stats" > "$WORKDIR/m"
+        read sec rss r w < "$WORKDIR/m" || { echo "no --stats output" >&2; return 1; }
+        best=`echo "$best" | awk -v s=$sec -v m=$rss -v c=$((r + w)) \
+            '{ if ($1 == "" || s < $1) print s, m, c; else print }'`
+        i=$((i+1))
+    done
+
+    echo $best
+}
+
+
+run_once()
+{
+    case $1 in
+        spi)   "$SPIDYBOOT" --stats --cfg "$WORKDIR/synth.cfg" \
+                   --spi -s "$2" -d "$3" > /dev/null ;;
+        pipe)  "$SPIDYBOOT" --stats --cfg "$WORKDIR/synth.cfg" \
+                   --spi -s - -d - < "$2" > /dev/null ;;
+        patch) "$SPIDYBOOT" --stats --cfg "$WORKDIR/synth.cfg" \
+                   --patch "$3" > /dev/null ;;
+    esac 2> "$WORKDIR/stats"
+}
+
+
+for dir in "$@"; do
+    WORKDIR=$dir/spidyboot_bench.$$
+    WORKDIRS="$WORKDIRS $WORKDIR"
+    mkdir -p "$WORKDIR" || exit 1
+    fs=`stat -f -c %T "$dir" 2>/dev/null || echo unknown`
+
+    # synthetic DDR controller setup: register writes and some delays
+    n=0
+    while [ $n -lt $PAIRS ]; do
+        if [ $((n % 16)) -eq 15 ]; then
+            echo "sleep 100"
+        else
+            printf "writemem.l 0xFE00%04X 0x%08X\n" $((0x8000 + n * 4)) $((n * 0x01010101))
+        fi
+        n=$((n+1))
+    done > "$WORKDIR/synth.cfg"
+
+    for size in $SIZES; do
+        kb=`size_kb $size`
+        free_kb=`df -Pk "$dir" | awk 'NR == 2 { print $4 }'`
+
+        # payload + image, plus some room
+        if [ $((kb * 2 + 1024)) -gt "${free_kb:-0}" ]; then
+            echo "$dir: not enough space for $size, skipped" >&2
+            continue
+        fi
+
+        echo "$dir ($fs): creating a $size payload" >&2
+        dd if=/dev/urandom of="$WORKDIR/payload.bin" bs=1024 count=$kb \
+            2>/dev/null || exit 1
+
+        for cache in cold warm; do
+            for step in spi pipe patch; do
+                set -- `run $step $cache "$WORKDIR/payload.bin" "$WORKDIR/image.bin"`
+                [ $# -eq 3 ] || exit 1
+                echo "$dir,$fs,$cache,$size,$step,$1,$3,$2" | awk -F, -v kb=$kb -v OFS=, \
+                    '{ mbs = $6 > 0 ? (kb + 1) / 1024 / $6 : 0;
+                       print $1, $2, $3, $4, $5, $6, sprintf("%.1f", mbs), $8, $7 }' >> "$CSV"
+            done
+        done
+
+        rm -f "$WORKDIR/payload.bin" "$WORKDIR/image.bin"
+    done
+done
+
+
+awk -F, 'NR > 1 { printf "%-20s %-8s %-5s %5s %-6s %10.6f s %9s MB/s %8s KB %7s syscalls\n",
+    $1, $2, $3, $4, $5, $6, $7, $8, $9 }' "$CSV"
+
+[ -n "$RESULTS" ] && cp "$CSV" "$RESULTS"
+
+[ -z "$BASELINE" ] && exit 0
+
+echo
+echo "Compared to $BASELINE (tolerance $TOLERANCE%):"
+
+awk -F, -v tol=$TOLERANCE '
+    FNR == 1 { next }
+    NR == FNR { key = $1 FS $3 FS $4 FS $5; mbs[key] = $7; rss[key] = $8; sys[key] = $9; next }
+    {
+        key = $1 FS $3 FS $4 FS $5
+        if (! (key in mbs)) next
+        what = ""
+        if ($7 < mbs[key] * (1 - tol / 100)) what = what sprintf(" MB/s %s -> %s", mbs[key], $7)
+        if ($8 > rss[key] * (1 + tol / 100)) what = what sprintf(" RSS %s -> %s KB", rss[key], $8)
+        if ($9 > sys[key] * (1 + tol / 100)) what = what sprintf(" syscalls %s -> %s", sys[key], $9)
+        if (what != "") { printf "REGRESSION %s %s %s %s:%s\n", $1, $3, $4, $5, what; bad++ }
+        n++
+    }
+    END { printf "%d measures compared, %d regressions\n", n, bad; exit bad > 0 }
+' "$BASELINE" "$CSV"
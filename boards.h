@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___BOARDS_H__
+#define ___BOARDS_H__
+
+#include <string>
+#include <string.h>
+
+
+/*
+   Board profiles: the config_<name>.dat files shipped with spidyboot,
+   turned into tables at build time (see gen_boards.cmake), so --board
+   applies them with no file I/O or parsing.
+ */
+struct board_pair_t
+{
+    unsigned int ofs;
+    unsigned int value;
+};
+
+
+struct board_profile_t
+{
+    const char * name;
+    const board_pair_t * pairs;
+    unsigned int n_pairs;
+
+
+    //--------------------------------------------------------------------------
+
+
+    static unsigned int count() throw();
+    static const board_profile_t & at( unsigned int idx ) throw();
+
+
+    //--------------------------------------------------------------------------
+
+
+    // A board is selected by its full name (e.g. ddr3_1gb_p1010rdb_800M) or
+    // by an unambiguous tail of it (e.g. p1010rdb_800M)
+    static const board_profile_t * find( const std::string & name, std::string & msg )
+    {
+        const board_profile_t * found = 0;
+
+        for (unsigned int i = 0; i < count(); ++i)
+        {
+            const board_profile_t & b = at( i );
+            const size_t len = strlen( b.name );
+
+            if (name == b.name)
+            {
+                return &b;
+            }
+
+            if (name.size() < len &&
+                    b.name[ len - name.size() - 1 ] == '_' &&
+                    name == b.name + len - name.size())
+            {
+                if (found)
+                {
+                    msg = "'" + name + "' is ambiguous: " + found->name + ", " + b.name;
+                    return 0;
+                }
+
+                found = &b;
+            }
+        }
+
+        if (! found)
+        {
+            msg = "unknown board '" + name + "' (see --list-boards)";
+        }
+
+        return found;
+    }
+};
+
+
+#include "boards_db.h"
+
+
+//------------------------------------------------------------------------------
+
+
+inline unsigned int board_profile_t::count() throw()
+{
+    return sizeof(board_profiles) / sizeof(board_profiles[0]);
+}
+
+
+inline const board_profile_t & board_profile_t::at( unsigned int idx ) throw()
+{
+    return board_profiles[ idx ];
+}
+
+#endif
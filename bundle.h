@@ -0,0 +1,622 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___BUNDLE_H__
+#define ___BUNDLE_H__
+
+#ifndef WIN32
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "preamble.h"
+#include "layout.h"
+#include "txn.h"
+
+
+/*
+   Bundle of the spi-flash images of several board variants (--bundle).
+   The variants differ in their preamble and usually share the user's
+   code, which is stored once:
+
+     header     64 bytes: magic "SPBUNDL1", number of variants, number
+                of payloads, offsets of the index, of the payload table
+                and of the preambles
+     index      64 bytes per variant, sorted by name: the name (NUL
+                padded, up to 55 bytes) and the number of its payload
+     payloads   32 bytes per payload: offset, length, FNV-1a hash
+     preambles  1024 bytes per variant, in the order of the index
+     data       the payloads (what follows the preamble in the images)
+
+   Numbers are big endian, as in the preamble. A bundle is read through
+   a memory map: a variant is found by a binary search of the index, and
+   only the pages of its entry, of its preamble and of its payload are
+   ever read.
+ */
+class image_bundle_t
+{
+    public:
+        enum
+        {
+            HEADER_SIZE   = 64,
+            ENTRY_SIZE    = 64,
+            NAME_SIZE     = 56,
+            PAYLOAD_SIZE  = 32,
+            PREAMBLE_SIZE = preamble_layout_t::SIZE
+        };
+
+        struct stats_t
+        {
+            unsigned long variants;
+            unsigned long payloads;
+            unsigned long skipped;
+            unsigned long long bytes;       // of the bundle
+            unsigned long long image_bytes; // of the images bundled
+
+            stats_t() throw() : variants(0), payloads(0), skipped(0), bytes(0), image_bytes(0) {}
+        };
+
+    private:
+        int _fd;
+        const unsigned char * _map;
+        size_t _size;
+
+        unsigned int _n_variants;
+        unsigned int _n_payloads;
+        unsigned long long _index_ofs;
+        unsigned long long _payload_ofs;
+        unsigned long long _preamble_ofs;
+
+
+        static const char * magic() throw() { return "SPBUNDL1"; }
+        enum { MAGIC_SIZE = 8 };
+
+
+        static unsigned long long get_be( const unsigned char * p, int n ) throw()
+        {
+            unsigned long long v = 0;
+
+            for (int i = 0; i < n; ++i) v = (v << 8) | p[i];
+
+            return v;
+        }
+
+
+        static void put_be( unsigned char * p, unsigned long long v, int n ) throw()
+        {
+            for (int i = n - 1; i >= 0; --i, v >>= 8) p[i] = (unsigned char) v;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // An image to bundle
+        struct source_t
+        {
+            std::string name;
+            std::string path;
+            unsigned char preamble[ PREAMBLE_SIZE ];
+            unsigned long long len;        // of the payload
+            unsigned long long hash;
+            unsigned int payload;
+        };
+
+
+        static bool by_name( const source_t * a, const source_t * b ) throw()
+        {
+            return a->name < b->name;
+        }
+
+
+        // FNV-1a 64 of len bytes of fd at ofs
+        static bool hash_range( int fd, off_t ofs, unsigned long long len,
+                unsigned long long & hash ) throw()
+        {
+            std::vector< unsigned char > buf( 1024 * 1024 );
+
+            hash = 0xcbf29ce484222325ULL;
+
+            while (len > 0)
+            {
+                const size_t chunk = len > buf.size() ? buf.size() : size_t( len );
+                const ssize_t rb = pread( fd, &buf[0], chunk, ofs );
+
+                if (rb < 0 && errno == EINTR) continue;
+                if (rb <= 0) return false;
+
+                for (ssize_t i = 0; i < rb; ++i)
+                {
+                    hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+                }
+
+                ofs += rb;
+                len -= rb;
+            }
+
+            return true;
+        }
+
+
+        // Same hash is not enough: the payloads are compared before being
+        // shared
+        static bool same_payload( const source_t & a, const source_t & b ) throw()
+        {
+            const int fa = ::open( a.path.c_str(), O_RDONLY );
+            const int fb = ::open( b.path.c_str(), O_RDONLY );
+
+            std::vector< unsigned char > ba( 1024 * 1024 ), bb( ba.size() );
+            unsigned long long ofs = 0;
+            bool same = fa >= 0 && fb >= 0;
+
+            while (same && ofs < a.len)
+            {
+                const size_t chunk = a.len - ofs > ba.size() ? ba.size() : size_t( a.len - ofs );
+
+                same = pread( fa, &ba[0], chunk, PREAMBLE_SIZE + ofs ) == ssize_t( chunk ) &&
+                    pread( fb, &bb[0], chunk, PREAMBLE_SIZE + ofs ) == ssize_t( chunk ) &&
+                    memcmp( &ba[0], &bb[0], chunk ) == 0;
+
+                ofs += chunk;
+            }
+
+            if (fa >= 0) ::close( fa );
+            if (fb >= 0) ::close( fb );
+
+            return same;
+        }
+
+
+        // Reads preamble and payload hash of the image path; false if
+        // it is not a spi-flash image (errno = 0) or cannot be read
+        static bool load_source( const std::string & path, source_t & src ) throw()
+        {
+            const int fd = ::open( path.c_str(), O_RDONLY );
+            struct stat st;
+
+            if (fd < 0) return false;
+
+            bool ok = fstat( fd, &st ) == 0;
+
+            if (ok && (! S_ISREG( st.st_mode ) || st.st_size < PREAMBLE_SIZE ||
+                        pread( fd, src.preamble, PREAMBLE_SIZE, 0 ) != PREAMBLE_SIZE ||
+                        ! preamble_cview_t( src.preamble, PREAMBLE_SIZE ).has_boot_sign()))
+            {
+                errno = 0;
+                ok = false;
+            }
+
+            if (ok)
+            {
+                src.path = path;
+                src.len = st.st_size - PREAMBLE_SIZE;
+                ok = hash_range( fd, PREAMBLE_SIZE, src.len, src.hash );
+            }
+
+            const int err = errno;
+            ::close( fd );
+            errno = err;
+
+            return ok;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        const unsigned char * entry( unsigned int i ) const throw()
+        {
+            return _map + _index_ofs + (unsigned long long) i * ENTRY_SIZE;
+        }
+
+
+        // Offset and length of the payload of variant i, checked against
+        // the size of the bundle
+        bool payload_range( unsigned int i, unsigned long long & ofs,
+                unsigned long long & len ) const throw()
+        {
+            const unsigned long long p = get_be( entry( i ) + NAME_SIZE, 4 );
+
+            if (p >= _n_payloads) return false;
+
+            const unsigned char * e = _map + _payload_ofs + p * PAYLOAD_SIZE;
+
+            ofs = get_be( e, 8 );
+            len = get_be( e + 8, 8 );
+
+            return ofs <= _size && len <= _size - ofs;
+        }
+
+
+    public:
+        image_bundle_t() throw() :
+            _fd(-1), _map(0), _size(0), _n_variants(0), _n_payloads(0),
+            _index_ofs(0), _payload_ofs(0), _preamble_ofs(0) {}
+
+
+        ~image_bundle_t() throw()
+        {
+            close();
+        }
+
+
+        // Variant of an image file: its name without directory and extension
+        static std::string variant_name( const std::string & path )
+        {
+            const size_t slash = path.rfind( '/' );
+            std::string name = slash == std::string::npos ? path : path.substr( slash + 1 );
+            const size_t dot = name.rfind( '.' );
+
+            return dot == std::string::npos || dot == 0 ? name : name.substr( 0, dot );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Write the bundle of the images to fd, at offset 0. Files not
+        // being spi-flash images are skipped; the variant names must be
+        // unique
+        static bool create( const std::vector< std::string > & images, int fd,
+                stats_t & stats, std::string & msg )
+        {
+            std::vector< source_t > src;
+            std::vector< source_t * > order;
+            std::vector< const source_t * > payloads;
+
+            src.reserve( images.size() );
+
+            for (size_t i = 0; i < images.size(); ++i)
+            {
+                source_t s;
+
+                if (! load_source( images[i], s ))
+                {
+                    if (errno)
+                    {
+                        msg = "\"" + images[i] + "\": " + strerror( errno );
+                        return false;
+                    }
+
+                    ++stats.skipped;
+                    continue;
+                }
+
+                s.name = variant_name( images[i] );
+
+                if (s.name.empty() || s.name.size() >= NAME_SIZE)
+                {
+                    msg = "\"" + images[i] + "\": variant name empty or too long";
+                    return false;
+                }
+
+                // the payloads already seen are few, a linear search will do
+                s.payload = (unsigned int) payloads.size();
+
+                for (size_t p = 0; p < payloads.size(); ++p)
+                {
+                    if (payloads[p]->len == s.len && payloads[p]->hash == s.hash &&
+                            same_payload( *payloads[p], s ))
+                    {
+                        s.payload = (unsigned int) p;
+                        break;
+                    }
+                }
+
+                src.push_back( s );
+
+                if (s.payload == payloads.size())
+                {
+                    payloads.push_back( &src.back() );
+                }
+
+                stats.image_bytes += PREAMBLE_SIZE + s.len;
+            }
+
+            for (size_t i = 0; i < src.size(); ++i) order.push_back( &src[i] );
+
+            std::sort( order.begin(), order.end(), by_name );
+
+            for (size_t i = 1; i < order.size(); ++i)
+            {
+                if (order[i]->name == order[i - 1]->name)
+                {
+                    msg = "variant \"" + order[i]->name + "\" found twice (\"" +
+                        order[i - 1]->path + "\", \"" + order[i]->path + "\")";
+                    return false;
+                }
+            }
+
+            const unsigned long long index_ofs = HEADER_SIZE;
+            const unsigned long long payload_ofs = index_ofs + order.size() * ENTRY_SIZE;
+            const unsigned long long preamble_ofs = payload_ofs + payloads.size() * PAYLOAD_SIZE;
+            unsigned long long data_ofs = preamble_ofs + order.size() * PREAMBLE_SIZE;
+
+            std::vector< unsigned char > head( size_t( data_ofs ), 0 );
+            std::vector< unsigned long long > at( payloads.size() );
+
+            memcpy( &head[0], magic(), MAGIC_SIZE );
+            put_be( &head[8], order.size(), 4 );
+            put_be( &head[12], payloads.size(), 4 );
+            put_be( &head[16], index_ofs, 8 );
+            put_be( &head[24], payload_ofs, 8 );
+            put_be( &head[32], preamble_ofs, 8 );
+
+            for (size_t i = 0; i < order.size(); ++i)
+            {
+                unsigned char * e = &head[ size_t( index_ofs + i * ENTRY_SIZE ) ];
+
+                memcpy( e, order[i]->name.c_str(), order[i]->name.size() );
+                put_be( e + NAME_SIZE, order[i]->payload, 4 );
+
+                memcpy( &head[ size_t( preamble_ofs + i * PREAMBLE_SIZE ) ],
+                        order[i]->preamble, PREAMBLE_SIZE );
+            }
+
+            for (size_t p = 0; p < payloads.size(); ++p)
+            {
+                unsigned char * e = &head[ size_t( payload_ofs + p * PAYLOAD_SIZE ) ];
+
+                at[p] = data_ofs;
+
+                put_be( e, at[p], 8 );
+                put_be( e + 8, payloads[p]->len, 8 );
+                put_be( e + 16, payloads[p]->hash, 8 );
+
+                data_ofs += (payloads[p]->len + 7) & ~7ULL;
+            }
+
+            if (! util::pwrite_all( fd, &head[0], head.size(), 0 ))
+            {
+                msg = strerror( errno );
+                return false;
+            }
+
+            // the payloads are copied by the kernel, from the images
+            for (size_t p = 0; p < payloads.size(); ++p)
+            {
+                const int in = ::open( payloads[p]->path.c_str(), O_RDONLY );
+                const long long n = in < 0 ? -1 :
+                    util::copy_range( in, PREAMBLE_SIZE, fd, off_t( at[p] ), payloads[p]->len );
+
+                const int err = errno;
+                if (in >= 0) ::close( in );
+
+                if (n != (long long) payloads[p]->len)
+                {
+                    msg = "\"" + payloads[p]->path + "\": " +
+                        (n < 0 ? strerror( err ) : "changed while being read");
+                    return false;
+                }
+            }
+
+            // the padding of the last payload
+            if (ftruncate( fd, off_t( data_ofs ) ) != 0)
+            {
+                msg = strerror( errno );
+                return false;
+            }
+
+            stats.variants = order.size();
+            stats.payloads = payloads.size();
+            stats.bytes = data_ofs;
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool open( const std::string & path, std::string & msg )
+        {
+            close();
+
+            struct stat st;
+
+            _fd = ::open( path.c_str(), O_RDONLY );
+
+            if (_fd < 0 || fstat( _fd, &st ) != 0)
+            {
+                msg = strerror( errno );
+                close();
+                return false;
+            }
+
+            _size = size_t( st.st_size );
+
+            void * map = _size >= HEADER_SIZE ?
+                mmap( 0, _size, PROT_READ, MAP_SHARED, _fd, 0 ) : MAP_FAILED;
+
+            if (map == MAP_FAILED || memcmp( map, magic(), MAGIC_SIZE ) != 0)
+            {
+                msg = map == MAP_FAILED && _size >= HEADER_SIZE ?
+                    strerror( errno ) : "not a spidyboot bundle";
+
+                if (map != MAP_FAILED) munmap( map, _size );
+                close();
+                return false;
+            }
+
+            _map = (const unsigned char *) map;
+            _n_variants = unsigned( get_be( _map + 8, 4 ) );
+            _n_payloads = unsigned( get_be( _map + 12, 4 ) );
+            _index_ofs = get_be( _map + 16, 8 );
+            _payload_ofs = get_be( _map + 24, 8 );
+            _preamble_ofs = get_be( _map + 32, 8 );
+
+            // the tables must lie in the file (a bundle cut short)
+            if (_index_ofs > _size || _payload_ofs > _size || _preamble_ofs > _size ||
+                    (_size - _index_ofs) / ENTRY_SIZE < _n_variants ||
+                    (_size - _payload_ofs) / PAYLOAD_SIZE < _n_payloads ||
+                    (_size - _preamble_ofs) / PREAMBLE_SIZE < _n_variants)
+            {
+                msg = "bundle truncated or corrupted";
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+
+        void close() throw()
+        {
+            if (_map) munmap( (void *) _map, _size );
+            if (_fd >= 0) ::close( _fd );
+
+            _map = 0;
+            _fd = -1;
+            _size = 0;
+            _n_variants = _n_payloads = 0;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        unsigned int size() const throw()
+        {
+            return _n_variants;
+        }
+
+
+        std::string name( unsigned int i ) const
+        {
+            const char * n = (const char *) entry( i );
+
+            return std::string( n, strnlen( n, NAME_SIZE - 1 ) );
+        }
+
+
+        unsigned int payload_of( unsigned int i ) const throw()
+        {
+            return unsigned( get_be( entry( i ) + NAME_SIZE, 4 ) );
+        }
+
+
+        // Index of the variant called name, -1 if there is none
+        int find( const std::string & name ) const throw()
+        {
+            if (name.empty() || name.size() >= NAME_SIZE) return -1;
+
+            char key[ NAME_SIZE ] = { 0 };
+            memcpy( key, name.c_str(), name.size() );
+
+            unsigned int lo = 0, hi = _n_variants;
+
+            while (lo < hi)
+            {
+                const unsigned int mid = lo + (hi - lo) / 2;
+                const int c = memcmp( entry( mid ), key, NAME_SIZE );
+
+                if (c == 0) return int( mid );
+
+                if (c < 0) lo = mid + 1;
+                else hi = mid;
+            }
+
+            return -1;
+        }
+
+
+        const unsigned char * preamble( unsigned int i ) const throw()
+        {
+            return _map + _preamble_ofs + (unsigned long long) i * PREAMBLE_SIZE;
+        }
+
+
+        // Bytes of the image of variant i, -1 if its payload is not in the
+        // bundle
+        long long image_size( unsigned int i ) const throw()
+        {
+            unsigned long long ofs = 0, len = 0;
+
+            return payload_range( i, ofs, len ) ? (long long) (PREAMBLE_SIZE + len) : -1;
+        }
+
+
+        // Copy the payload of variant i to dst at dst_ofs (a negative
+        // dst_ofs writes at the current position of dst, e.g. a pipe)
+        bool copy_payload( unsigned int i, int dst, off_t dst_ofs, std::string & msg ) const
+        {
+            unsigned long long ofs = 0, len = 0;
+
+            if (! payload_range( i, ofs, len ))
+            {
+                msg = "bundle truncated or corrupted";
+                return false;
+            }
+
+            const long long n = util::copy_range( _fd, off_t( ofs ), dst, dst_ofs, len );
+
+            if (n != (long long) len)
+            {
+                msg = n < 0 ? strerror( errno ) : "bundle truncated";
+                return false;
+            }
+
+            return true;
+        }
+
+
+        // Write the image of variant i to dst: preamble (e.g. the one of
+        // the variant, edited), then the payload. A stream (e.g. a pipe)
+        // is written at its current position, a file from offset 0
+        bool write_image( unsigned int i, const unsigned char * preamble, int dst,
+                bool stream, std::string & msg ) const
+        {
+            for (size_t done = 0; stream && done < PREAMBLE_SIZE; )
+            {
+                const ssize_t wb = write( dst, preamble + done, PREAMBLE_SIZE - done );
+
+                if (wb < 0 && errno == EINTR) continue;
+
+                if (wb <= 0)
+                {
+                    msg = strerror( errno );
+                    return false;
+                }
+
+                done += wb;
+            }
+
+            if (! stream && ! util::pwrite_all( dst, preamble, PREAMBLE_SIZE, 0 ))
+            {
+                msg = strerror( errno );
+                return false;
+            }
+
+            return copy_payload( i, dst, stream ? -1 : PREAMBLE_SIZE, msg );
+        }
+};
+
+
+#endif // WIN32
+
+#endif
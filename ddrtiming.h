@@ -0,0 +1,475 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___DDRTIMING_H__
+#define ___DDRTIMING_H__
+
+#include <stdio.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "preamble.h"
+
+
+/*
+   Computes the delays a pair list needs around DDR_SDRAM_CFG[MEM_EN] of
+   each QorIQ DDR controller it programs, and rewrites the delay pairs
+   (address 0x40000001, "sleep" in .cfg files) accordingly.
+
+   - Before MEM_EN the DDR clocks must be stable: 500 us for DDR3, 200 us
+     for DDR1/DDR2 (the same figures used by u-boot).
+   - After MEM_EN the controller runs the JEDEC init sequence (MRS, ZQ
+     calibration, write leveling) and then, if DDR_SDRAM_CFG_2[D_INIT] is
+     set, writes DDR_DATA_INIT into the whole memory.
+
+   The DDR clock period is not part of the register set: it is bounded by
+   DDR_SDRAM_INTERVAL[REFINT] (tREFI <= 7.8 us), which can only make the
+   computed delays longer than needed. A 10% margin is added on top.
+ */
+class ddr_delays_t
+{
+    public:
+        enum
+        {
+            DELAY_ADDR = 0x40000001
+        };
+
+        enum mode_t
+        {
+            REPORT,     // analyze only
+            MERGE,      // one delay pair on each side of MEM_EN, same total
+            FIX         // set the delays to the computed minimum
+        };
+
+        struct ctrl_t
+        {
+            unsigned int base;          // register block of the controller
+            int sdram_type;             // DDR_SDRAM_CFG[SDRAM_TYPE]
+            unsigned int bus_bytes;
+            unsigned long long size;    // bytes, enabled chip selects
+            bool d_init;
+            double tck_ns;              // upper bound of the DDR clock period
+            unsigned int init_clks;     // controller init sequence
+
+            double req_pre_us;          // required before MEM_EN
+            double req_post_us;         // required after MEM_EN
+            unsigned long long pre;     // configured delay counts
+            unsigned long long post;
+            unsigned long long new_pre; // after rewrite
+            unsigned long long new_post;
+        };
+
+    private:
+        // DDR controller register offsets
+        enum
+        {
+            CS0_BNDS            = 0x000,
+            CS0_CONFIG          = 0x080,
+            TIMING_CFG_3        = 0x100,
+            TIMING_CFG_0        = 0x104,
+            TIMING_CFG_1        = 0x108,
+            DDR_SDRAM_CFG       = 0x110,
+            DDR_SDRAM_CFG_2     = 0x114,
+            DDR_SDRAM_INTERVAL  = 0x124,
+            DDR_ZQ_CNTL         = 0x170,
+            DDR_WRLVL_CNTL      = 0x174,
+            REGS_SIZE           = 0x1000,
+
+            MEM_EN              = 0x80000000,
+            D_INIT              = 0x00000010,
+            ZQ_EN               = 0x80000000,
+            WRLVL_EN            = 0x80000000,
+            CS_EN               = 0x80000000
+        };
+
+        enum
+        {
+            SDRAM_TYPE_DDR1 = 2,
+            SDRAM_TYPE_DDR2 = 3,
+            SDRAM_TYPE_DDR3 = 7
+        };
+
+        typedef std::map< unsigned int, unsigned int > regs_t;
+
+        unsigned int _unit_ns;
+
+
+        //--------------------------------------------------------------------------
+
+
+        static bool is_delay( const cfg_pair_t & p ) throw()
+        {
+            return p.addr == DELAY_ADDR;
+        }
+
+
+        static unsigned int reg( const regs_t & regs, unsigned int ofs ) throw()
+        {
+            regs_t::const_iterator i = regs.find( ofs );
+            return i == regs.end() ? 0 : i->second;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Decode the registers of a controller, as written before MEM_EN
+        bool decode( const regs_t & regs, ctrl_t & c, std::string & msg ) const
+        {
+            const unsigned int cfg = reg( regs, DDR_SDRAM_CFG );
+            const unsigned int cfg_2 = reg( regs, DDR_SDRAM_CFG_2 );
+            const unsigned int refint = reg( regs, DDR_SDRAM_INTERVAL ) >> 16;
+
+            if (refint == 0)
+            {
+                msg = "DDR_SDRAM_INTERVAL[REFINT] not set";
+                return false;
+            }
+
+            c.sdram_type = (cfg >> 24) & 0x7;
+            c.bus_bytes = 8 >> ((cfg >> 19) & 0x3);
+            c.d_init = (cfg_2 & D_INIT) != 0;
+            c.tck_ns = 7800.0 / refint;
+
+            c.size = 0;
+
+            for (unsigned int cs = 0; cs < 4; ++cs)
+            {
+                const unsigned int bnds = reg( regs, CS0_BNDS + 8*cs );
+
+                if (reg( regs, CS0_CONFIG + 4*cs ) & CS_EN)
+                {
+                    const unsigned int sa = (bnds >> 16) & 0xfff;
+                    const unsigned int ea = bnds & 0xfff;
+
+                    if (ea >= sa)
+                    {
+                        c.size += (unsigned long long) (ea - sa + 1) << 24;
+                    }
+                }
+            }
+
+            // refresh cycle time
+            const unsigned int t1 = reg( regs, TIMING_CFG_1 );
+            const unsigned int t3 = reg( regs, TIMING_CFG_3 );
+            const unsigned int trfc = ((t1 >> 12) & 0xf) + 8 + ((t3 >> 16) & 0xf) * 16;
+
+            // mode register set cycle time
+            unsigned int tmrd = reg( regs, TIMING_CFG_0 ) & 0xf;
+            tmrd = tmrd ? tmrd : 4;
+
+            if (c.sdram_type == SDRAM_TYPE_DDR3)
+            {
+                // tXPR, 4 MRS, tMOD, ZQCL
+                const unsigned int zq = reg( regs, DDR_ZQ_CNTL );
+                const unsigned int tzqinit = (zq & ZQ_EN) ? 1U << ((zq >> 24) & 0xf) : 512;
+
+                c.init_clks = trfc + unsigned( ceil( 10.0 / c.tck_ns ) ) + 4 * tmrd + 12 + tzqinit;
+
+                // write leveling: 32 steps at most, WRLVL_SMPL samples each
+                const unsigned int wl = reg( regs, DDR_WRLVL_CNTL );
+
+                if (wl & WRLVL_EN)
+                {
+                    c.init_clks += (1U << ((wl >> 24) & 0x7)) + (1U << ((wl >> 20) & 0x7)) +
+                        (1U << ((wl >> 16) & 0x7)) +
+                        32 * ((wl >> 12) & 0xf) * (1U << ((wl >> 8) & 0x7));
+                }
+            }
+            else
+            {
+                // DLL lock, precharge, 2 refresh, MRS
+                c.init_clks = 200 + 2 * trfc + 4 * tmrd;
+            }
+
+            double post_clks = c.init_clks;
+
+            if (c.d_init)
+            {
+                // one burst of 2*bus_bytes per clock, plus the refreshes
+                post_clks += double( c.size ) / (2 * c.bus_bytes) * (1.0 + double( trfc ) / refint);
+            }
+
+            const double margin = 1.1;
+
+            c.req_pre_us = margin * (c.sdram_type == SDRAM_TYPE_DDR3 ? 500.0 : 200.0);
+            c.req_post_us = margin * post_clks * c.tck_ns / 1000.0;
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        unsigned long long to_count( double us ) const throw()
+        {
+            return (unsigned long long) ceil( us * 1000.0 / _unit_ns );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Replace the pairs in [from, to) with a run of delay pairs of 
+        // <count> (none if count is 0); returns the new end of the run
+        static size_t replace_run( std::vector< cfg_pair_t > & pairs,
+                size_t from, size_t to, unsigned long long count )
+        {
+            pairs.erase( pairs.begin() + from, pairs.begin() + to );
+
+            while (count > 0)
+            {
+                cfg_pair_t p;
+                p.addr = DELAY_ADDR;
+                p.data = count > 0xffffffffULL ? 0xffffffffU : unsigned( count );
+
+                pairs.insert( pairs.begin() + from++, p );
+                count -= p.data;
+            }
+
+            return from;
+        }
+
+
+        // Sum the delay pairs in [from, to), skipping the other writes
+        static unsigned long long sum_delays( const std::vector< cfg_pair_t > & pairs,
+                size_t from, size_t to ) throw()
+        {
+            unsigned long long sum = 0;
+
+            for (size_t i = from; i < to; ++i)
+            {
+                if (is_delay( pairs[i] ))
+                {
+                    sum += pairs[i].data;
+                }
+            }
+
+            return sum;
+        }
+
+
+        // Set the delay pairs in [from, to) to <count> in all: the delay
+        // closest to MEM_EN (the last one if before, the first one if after)
+        // takes it and the others are dropped; with no delay in there, the
+        // run goes right next to MEM_EN
+        static void rewrite( std::vector< cfg_pair_t > & pairs,
+                size_t from, size_t to, unsigned long long count, bool before )
+        {
+            size_t keep = before ? to : from;
+            bool found = false;
+
+            for (size_t i = to; i-- > from; )
+            {
+                if (! is_delay( pairs[i] ))
+                {
+                    continue;
+                }
+
+                if (found && before)
+                {
+                    pairs.erase( pairs.begin() + i );
+                    --keep;
+                }
+                else
+                {
+                    if (found)
+                    {
+                        pairs.erase( pairs.begin() + keep );
+                    }
+
+                    keep = i;
+                }
+
+                found = true;
+            }
+
+            replace_run( pairs, keep, keep + (found ? 1 : 0), count );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+    public:
+        // unit_ns: duration of a unit of delay
+        explicit ddr_delays_t( unsigned int unit_ns ) throw() :
+            _unit_ns( unit_ns ? unit_ns : 1 ) {}
+
+
+        static bool parse_mode( const std::string & name, mode_t & mode ) throw()
+        {
+            if (name == "report") mode = REPORT;
+            else if (name == "merge") mode = MERGE;
+            else if (name == "fix") mode = FIX;
+            else return false;
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        /*
+           Analyze (and, depending on mode, rewrite) the pair list: ctrls
+           receives a record for each DDR_SDRAM_CFG[MEM_EN] write found.
+           The delays before MEM_EN are those from the first write to the 
+           controller registers on, the delays after it run up to the first
+           write to the next controller (or the end of the list), wherever
+           they sit among the other writes
+         */
+        bool run( std::vector< cfg_pair_t > & pairs, mode_t mode,
+                std::vector< ctrl_t > & ctrls, std::string & msg )
+        {
+            std::map< unsigned int, regs_t > regs; // by controller base
+            std::map< unsigned int, size_t > first; // since the last MEM_EN
+            std::vector< size_t > at, from; // MEM_EN writes, start of their config
+
+            for (size_t i = 0; i < pairs.size(); ++i)
+            {
+                const cfg_pair_t p = pairs[i];
+
+                if (is_delay( p ))
+                {
+                    continue;
+                }
+
+                const unsigned int base = p.addr & ~(unsigned int)(REGS_SIZE - 1);
+                const unsigned int ofs = p.addr & (REGS_SIZE - 1);
+
+                if (! first.count( base ))
+                {
+                    first[ base ] = i;
+                }
+
+                if (ofs != DDR_SDRAM_CFG || ! (p.data & MEM_EN) ||
+                        ! regs[ base ].count( DDR_SDRAM_INTERVAL ))
+                {
+                    regs[ base ][ ofs ] = p.data;
+                    continue;
+                }
+
+                // MEM_EN of a controller
+                ctrl_t c;
+                c.base = base;
+
+                if (! decode( regs[ base ], c, msg ))
+                {
+                    return false;
+                }
+
+                regs[ base ][ ofs ] = p.data;
+                ctrls.push_back( c );
+                at.push_back( i );
+                from.push_back( first[ base ] );
+                first.clear();
+            }
+
+            for (size_t k = 0; k < ctrls.size(); ++k)
+            {
+                ctrl_t & c = ctrls[k];
+                const size_t post_to = k + 1 < ctrls.size() ? from[ k + 1 ] : pairs.size();
+
+                c.pre = sum_delays( pairs, from[k], at[k] );
+                c.post = sum_delays( pairs, at[k] + 1, post_to );
+
+                // report shows what fix would do
+                c.new_pre = mode == MERGE ? c.pre : to_count( c.req_pre_us );
+                c.new_post = mode == MERGE ? c.post : to_count( c.req_post_us );
+            }
+
+            // from the last controller back, so that the indexes still hold
+            for (size_t k = ctrls.size(); mode != REPORT && k-- > 0; )
+            {
+                const size_t post_to = k + 1 < ctrls.size() ? from[ k + 1 ] : pairs.size();
+
+                rewrite( pairs, at[k] + 1, post_to, ctrls[k].new_post, false );
+                rewrite( pairs, from[k], at[k], ctrls[k].new_pre, true );
+            }
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        double to_us( unsigned long long count ) const throw()
+        {
+            return double( count ) * _unit_ns / 1000.0;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        void show( const std::vector< ctrl_t > & ctrls, mode_t mode, FILE * out ) const
+        {
+            double saved = 0;
+
+            for (size_t i = 0; i < ctrls.size(); ++i)
+            {
+                const ctrl_t & c = ctrls[i];
+
+                fprintf(out, "DDR controller @0x%08x: %s, %u-bit, %llu MB, "
+                        "tCK <= %.3f ns (%.0f MHz), data init %s\n",
+                        c.base,
+                        c.sdram_type == SDRAM_TYPE_DDR3 ? "DDR3" :
+                        c.sdram_type == SDRAM_TYPE_DDR2 ? "DDR2" :
+                        c.sdram_type == SDRAM_TYPE_DDR1 ? "DDR1" : "unknown SDRAM type",
+                        c.bus_bytes * 8, c.size >> 20,
+                        c.tck_ns, 1000.0 / c.tck_ns,
+                        c.d_init ? "on" : "off");
+
+                fprintf(out, "  before MEM_EN: %10.1f us required, %10.1f us configured (0x%llx)%s\n",
+                        c.req_pre_us, to_us( c.pre ), c.pre,
+                        to_us( c.pre ) < c.req_pre_us ? " TOO SHORT" : "");
+
+                fprintf(out, "  after  MEM_EN: %10.1f us required, %10.1f us configured (0x%llx)%s\n",
+                        c.req_post_us, to_us( c.post ), c.post,
+                        to_us( c.post ) < c.req_post_us ? " TOO SHORT" : "");
+
+                fprintf(out, "  %s 0x%llx before, 0x%llx after MEM_EN\n",
+                        mode == REPORT ? "minimum      :" : "rewritten to :",
+                        c.new_pre, c.new_post);
+
+                saved += to_us( c.pre + c.post ) - to_us( c.new_pre + c.new_post );
+            }
+
+            if (ctrls.empty())
+            {
+                fprintf(out, "No DDR_SDRAM_CFG[MEM_EN] write found\n");
+            }
+            else
+            {
+                fprintf(out, "Boot time %s%s: %.1f us (delay unit %u ns)\n",
+                        saved >= 0 ? "saved" : "added",
+                        mode == REPORT ? " by fix" : "",
+                        fabs( saved ), _unit_ns);
+            }
+        }
+};
+
+#endif
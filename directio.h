@@ -0,0 +1,425 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___DIRECTIO_H__
+#define ___DIRECTIO_H__
+
+#ifdef WIN32
+#include <windows.h>
+#include <malloc.h>
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace util
+{
+
+    /*
+       Heap buffer whose address and size are multiple of a given alignment,
+       as required by O_DIRECT transfers.
+     */
+    class aligned_buffer_t
+    {
+        private:
+            void * _ptr;
+            size_t _size;
+
+            aligned_buffer_t( const aligned_buffer_t& );
+            aligned_buffer_t& operator=( const aligned_buffer_t& );
+
+        public:
+            aligned_buffer_t() throw() : _ptr(0), _size(0) {}
+
+
+            bool alloc( size_t size, size_t alignment ) throw()
+            {
+                release();
+
+                size = (size + alignment - 1) & ~(alignment - 1);
+
+#ifdef WIN32
+                _ptr = _aligned_malloc( size, alignment );
+#else
+                if (posix_memalign( &_ptr, alignment, size ) != 0)
+                {
+                    _ptr = 0;
+                }
+#endif
+                _size = _ptr ? size : 0;
+
+                return _ptr != 0;
+            }
+
+
+            void release() throw()
+            {
+                if (_ptr)
+                {
+#ifdef WIN32
+                    _aligned_free( _ptr );
+#else
+                    free( _ptr );
+#endif
+                    _ptr = 0;
+                    _size = 0;
+                }
+            }
+
+
+            unsigned char * data() const throw()
+            {
+                return static_cast<unsigned char*>(_ptr);
+            }
+
+
+            size_t size() const throw()
+            {
+                return _size;
+            }
+
+
+            ~aligned_buffer_t() throw()
+            {
+                release();
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    struct io_stats_t
+    {
+        unsigned long long bytes;       // of the file
+        unsigned long long io_bytes;    // transferred, block padding included
+        double seconds;
+        bool direct;
+
+        io_stats_t() throw() : bytes(0), io_bytes(0), seconds(0), direct(false) {}
+
+        double mb_per_sec() const throw()
+        {
+            return seconds > 0 ? (double(io_bytes) / (1024.0*1024.0)) / seconds : 0;
+        }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    inline double now_sec() throw()
+    {
+#ifdef WIN32
+        return double(GetTickCount()) / 1000.0;
+#else
+        struct timeval tv;
+        gettimeofday( &tv, 0 );
+        return double(tv.tv_sec) + double(tv.tv_usec) / 1e6;
+#endif
+    }
+
+
+#ifndef WIN32
+
+    /*
+       Output file opened (whenever the filesystem allows it) with O_DIRECT.
+       Every transfer must use buffers, offsets and lengths aligned to
+       align(); the logical file length is fixed up by finish().
+     */
+    class direct_file_t
+    {
+        private:
+            int _fd;
+            bool _direct;
+            bool _blkdev;
+            size_t _align;
+
+            direct_file_t( const direct_file_t& );
+            direct_file_t& operator=( const direct_file_t& );
+
+        public:
+            enum { DEFAULT_ALIGN = 4096 };
+
+
+            direct_file_t() throw() :
+                _fd(-1), _direct(false), _blkdev(false), _align(DEFAULT_ALIGN) {}
+
+
+            bool open( const std::string& filename, bool truncate ) throw()
+            {
+                close();
+
+                int flags = O_RDWR | (truncate ? O_CREAT | O_TRUNC : 0);
+
+#ifdef O_DIRECT
+                _fd = ::open( filename.c_str(), flags | O_DIRECT, 0644 );
+
+                // Some filesystems (e.g. tmpfs) refuse O_DIRECT
+                _direct = _fd >= 0;
+
+                if (_fd < 0 && errno == EINVAL)
+#endif
+                {
+                    _fd = ::open( filename.c_str(), flags, 0644 );
+                }
+
+                if (_fd < 0)
+                {
+                    return false;
+                }
+
+                struct stat st;
+
+                if (fstat( _fd, &st ) == 0)
+                {
+                    _blkdev = S_ISBLK( st.st_mode );
+
+                    if (st.st_blksize > 0 && size_t(st.st_blksize) > _align)
+                    {
+                        _align = st.st_blksize;
+                    }
+                }
+
+                return true;
+            }
+
+
+            bool is_open() const throw() { return _fd >= 0; }
+            bool is_direct() const throw() { return _direct; }
+            bool is_blkdev() const throw() { return _blkdev; }
+            size_t align() const throw() { return _align; }
+
+
+            size_t round_up( size_t len ) const throw()
+            {
+                return (len + _align - 1) & ~(_align - 1);
+            }
+
+
+            bool write_at( const unsigned char * buf, size_t len, off_t ofs ) throw()
+            {
+                while (len > 0)
+                {
+                    ssize_t wb = pwrite( _fd, buf, len, ofs );
+
+                    if (wb < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    if (wb <= 0)
+                    {
+                        return false;
+                    }
+
+                    buf += wb;
+                    len -= wb;
+                    ofs += wb;
+                }
+
+                return true;
+            }
+
+
+            ssize_t read_at( unsigned char * buf, size_t len, off_t ofs ) throw()
+            {
+                size_t total = 0;
+
+                while (total < len)
+                {
+                    ssize_t rb = pread( _fd, buf + total, len - total, ofs + total );
+
+                    if (rb < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    if (rb < 0)
+                    {
+                        return -1;
+                    }
+
+                    if (rb == 0)
+                    {
+                        break;
+                    }
+
+                    total += rb;
+                }
+
+                return ssize_t(total);
+            }
+
+
+            // Works for block devices too, where st_size is zero
+            off_t size() const throw()
+            {
+                return lseek( _fd, 0, SEEK_END );
+            }
+
+
+            // Trim the block padding off a regular file
+            bool finish( off_t logical_len ) throw()
+            {
+                if (_blkdev)
+                {
+                    return true;
+                }
+
+                return ftruncate( _fd, logical_len ) == 0;
+            }
+
+
+            bool close() throw()
+            {
+                if (_fd >= 0)
+                {
+                    bool ok = ::close( _fd ) == 0;
+                    _fd = -1;
+                    return ok;
+                }
+
+                return true;
+            }
+
+
+            ~direct_file_t() throw()
+            {
+                close();
+            }
+    };
+
+#endif // WIN32
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Runs fill() on a reader thread while drain() consumes the other
+       buffer, so that reading the next chunk overlaps writing the current one.
+
+       fill( slot ) returns the number of bytes stored into bufs[slot]
+       (0 at end of input, <0 on error); it must fill the whole buffer
+       unless the input is exhausted.
+       drain( slot, len ) returns false to abort the copy.
+     */
+    template <class F, class D>
+    bool double_buffered_copy( F fill, D drain )
+    {
+        struct slot_t
+        {
+            long long len;
+            bool full;
+        } slot[2] = { { 0, false }, { 0, false } };
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        bool abort = false;
+
+        std::thread reader( [&]()
+        {
+            for (int i = 0; ; i ^= 1)
+            {
+                {
+                    std::unique_lock<std::mutex> lock( mtx );
+                    cv.wait( lock, [&]() { return abort || ! slot[i].full; } );
+
+                    if (abort)
+                    {
+                        break;
+                    }
+                }
+
+                long long len = fill( i );
+
+                std::lock_guard<std::mutex> lock( mtx );
+                slot[i].len = len;
+                slot[i].full = true;
+                cv.notify_all();
+
+                if (len <= 0)
+                {
+                    break;
+                }
+            }
+        });
+
+        bool ok = true;
+
+        for (int i = 0; ; i ^= 1)
+        {
+            long long len = 0;
+
+            {
+                std::unique_lock<std::mutex> lock( mtx );
+                cv.wait( lock, [&]() { return slot[i].full; } );
+                len = slot[i].len;
+            }
+
+            if (len <= 0)
+            {
+                ok = len == 0;
+                break;
+            }
+
+            ok = drain( i, size_t(len) );
+
+            std::lock_guard<std::mutex> lock( mtx );
+            slot[i].full = false;
+
+            if (! ok)
+            {
+                abort = true;
+            }
+
+            cv.notify_all();
+
+            if (! ok)
+            {
+                break;
+            }
+        }
+
+        reader.join();
+
+        return ok;
+    }
+
+}
+
+#endif
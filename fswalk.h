@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___FSWALK_H__
+#define ___FSWALK_H__
+
+#ifndef WIN32
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+
+
+namespace util
+{
+
+    /*
+       Calls f( path ) for every regular file in directory <dir> and appends
+       its subdirectories to dirs. Symbolic links are not followed.
+     */
+    template <class F> bool read_dir( const std::string & dir, F & f, 
+            std::vector< std::string > & dirs )
+    {
+        DIR * d = opendir( dir.c_str() );
+
+        if (! d)
+        {
+            return false;
+        }
+
+        bool ok = true;
+        struct dirent * e = 0;
+
+        while ((e = readdir( d )) != 0)
+        {
+            const std::string name = e->d_name;
+
+            if (name == "." || name == "..")
+            {
+                continue;
+            }
+
+            const std::string path =
+                dir.empty() || dir[ dir.size() - 1 ] == '/' ? dir + name : dir + "/" + name;
+
+            unsigned char type = e->d_type;
+
+            // the file type is not always filled in by the filesystem
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+
+                if (lstat( path.c_str(), &st ) < 0)
+                {
+                    ok = false;
+                    continue;
+                }
+
+                type = S_ISDIR( st.st_mode ) ? DT_DIR : S_ISREG( st.st_mode ) ? DT_REG : 0;
+            }
+
+            if (type == DT_DIR)
+            {
+                dirs.push_back( path );
+            }
+            else if (type == DT_REG)
+            {
+                f( path );
+            }
+        }
+
+        closedir( d );
+
+        return ok;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Calls f( path ) for every regular file found below directory <dir>.
+       The directories still to be read are shared by n_threads threads (the
+       calling one included), so that a deep tree, or one on a slow or 
+       remote filesystem, is not listed one directory at a time; f must then
+       be safe to call from several threads at once.
+     */
+    template <class F> bool walk_dir( const std::string & dir, F & f, 
+            unsigned int n_threads = 1 )
+    {
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector< std::string > dirs( 1, dir );
+        unsigned int busy = 0;
+        bool ok = true;
+
+        auto walker = [&]()
+        {
+            std::unique_lock< std::mutex > lock( mtx );
+
+            for (;;)
+            {
+                // done once no directory is left and none is being read
+                cv.wait( lock, [&]() { return ! dirs.empty() || busy == 0; } );
+
+                if (dirs.empty())
+                {
+                    return;
+                }
+
+                const std::string d = dirs.back();
+                std::vector< std::string > found;
+
+                dirs.pop_back();
+                ++busy;
+                lock.unlock();
+
+                const bool d_ok = read_dir( d, f, found );
+
+                lock.lock();
+                ok = d_ok && ok;
+                dirs.insert( dirs.end(), found.begin(), found.end() );
+                --busy;
+                cv.notify_all();
+            }
+        };
+
+        std::vector< std::thread > threads;
+
+        for (unsigned int i = 1; i < n_threads; ++i)
+        {
+            threads.push_back( std::thread( walker ) );
+        }
+
+        walker();
+
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            threads[i].join();
+        }
+
+        return ok;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Calls f( path ) for every regular file matching <pattern>, which is
+       a file, a directory (walked recursively, by n_threads threads, see
+       walk_dir) or a shell glob pattern. "-" reads the list of the paths 
+       from the standard input, one per line.
+     */
+    template <class F> bool walk_paths( const std::string & pattern, F f, 
+            unsigned int n_threads = 1 )
+    {
+        if (pattern == "-")
+        {
+            char line[ 4096 ];
+            bool ok = true;
+
+            while (fgets( line, sizeof(line), stdin ))
+            {
+                std::string path( line );
+
+                while (! path.empty() &&
+                        (path[ path.size() - 1 ] == '\n' || path[ path.size() - 1 ] == '\r'))
+                {
+                    path.erase( path.size() - 1 );
+                }
+
+                if (! path.empty() && ! walk_paths( path, f, n_threads ))
+                {
+                    ok = false;
+                }
+            }
+
+            return ok;
+        }
+
+        struct stat st;
+
+        if (stat( pattern.c_str(), &st ) == 0)
+        {
+            if (S_ISDIR( st.st_mode ))
+            {
+                return walk_dir( pattern, f, n_threads );
+            }
+
+            f( pattern );
+            return true;
+        }
+
+        if (pattern.find_first_of( "*?[" ) == std::string::npos)
+        {
+            return false;
+        }
+
+        glob_t g;
+
+        if (glob( pattern.c_str(), 0, 0, &g ) != 0)
+        {
+            return false;
+        }
+
+        bool ok = true;
+
+        for (size_t i = 0; i < g.gl_pathc; ++i)
+        {
+            const std::string path = g.gl_pathv[i];
+
+            if (stat( path.c_str(), &st ) == 0 && S_ISDIR( st.st_mode ))
+            {
+                ok = walk_dir( path, f, n_threads ) && ok;
+            }
+            else
+            {
+                f( path );
+            }
+        }
+
+        globfree( &g );
+
+        return ok;
+    }
+
+}
+
+#endif // WIN32
+
+#endif
@@ -0,0 +1,132 @@
+#
+# Generates the board profile tables (boards_db.h) from the config_*.dat
+# files, so that --board needs no file I/O or parsing at run time.
+#
+# Usage: cmake -DDAT_DIR=<dir> -DOUT=<boards_db.h> -P gen_boards.cmake
+#
+
+if(NOT DAT_DIR OR NOT OUT)
+    message(FATAL_ERROR "usage: cmake -DDAT_DIR=<dir> -DOUT=<file> -P gen_boards.cmake")
+endif()
+
+file(GLOB DAT_FILES "${DAT_DIR}/config_*.dat")
+list(SORT DAT_FILES)
+
+set(TABLES "")
+set(PROFILES "")
+
+# Reads the pairs of DAT into the list ${OUT_VAR} ("<offset>:<value>", as
+# written), expanding its includes and applying its
+# overrides as --dat does; CHAIN holds the files being read (cycles)
+function(read_dat DAT CHAIN OUT_VAR OK_VAR)
+    set(${OK_VAR} FALSE PARENT_SCOPE)
+    get_filename_component(DIR "${DAT}" PATH)
+
+    list(FIND CHAIN "${DAT}" CYCLE)
+    if(NOT CYCLE EQUAL -1)
+        message(WARNING "${DAT}: include cycle, board skipped")
+        return()
+    endif()
+    list(APPEND CHAIN "${DAT}")
+
+    if(NOT EXISTS "${DAT}")
+        message(WARNING "${DAT}: not found, board skipped")
+        return()
+    endif()
+
+    file(READ "${DAT}" CONTENT)
+    string(REPLACE ";" "," CONTENT "${CONTENT}")
+    string(REPLACE "\r" "" CONTENT "${CONTENT}")
+    string(REPLACE "\n" ";" LINES "${CONTENT}")
+
+    set(PAIRS ${${OUT_VAR}})
+
+    foreach(LINE ${LINES})
+        # line-style comments, as accepted by --dat
+        string(REGEX REPLACE "(//|#).*$" "" LINE "${LINE}")
+        string(STRIP "${LINE}" LINE)
+
+        if(LINE STREQUAL "")
+            # empty line
+        elseif(LINE MATCHES "^include[ \t]*\"([^\"]+)\"$")
+            set(INC "${CMAKE_MATCH_1}")
+            if(NOT IS_ABSOLUTE "${INC}")
+                set(INC "${DIR}/${INC}")
+            endif()
+            read_dat("${INC}" "${CHAIN}" PAIRS INC_OK)
+            if(NOT INC_OK)
+                return()
+            endif()
+        elseif(LINE MATCHES "^(override[ \t]+)?([0-9a-fA-F]+)[ \t]*:[ \t]*([0-9a-fA-F]+)$")
+            set(OFS "${CMAKE_MATCH_2}")
+            set(VALUE "${CMAKE_MATCH_3}")
+
+            if(CMAKE_MATCH_1)
+                # the last pair at the same offset gets the value
+                set(FOUND -1)
+                set(I 0)
+                string(REGEX REPLACE "^0+(.)" "\\1" KEY "${OFS}")
+                string(TOLOWER "${KEY}" KEY)
+                foreach(PAIR ${PAIRS})
+                    string(REGEX REPLACE "^0*([0-9a-fA-F]+):.*$" "\\1" PAIR_KEY "${PAIR}")
+                    string(TOLOWER "${PAIR_KEY}" PAIR_KEY)
+                    if(PAIR_KEY STREQUAL KEY)
+                        set(FOUND ${I})
+                    endif()
+                    math(EXPR I "${I} + 1")
+                endforeach()
+
+                if(FOUND EQUAL -1)
+                    message(WARNING "${DAT}: override of ${OFS}, which is not set before, board skipped")
+                    return()
+                endif()
+
+                list(REMOVE_AT PAIRS ${FOUND})
+                list(LENGTH PAIRS LEN)
+                if(FOUND LESS LEN)
+                    list(INSERT PAIRS ${FOUND} "${OFS}:${VALUE}")
+                else()
+                    list(APPEND PAIRS "${OFS}:${VALUE}")
+                endif()
+            else()
+                list(APPEND PAIRS "${OFS}:${VALUE}")
+            endif()
+        else()
+            message(WARNING "${DAT}: cannot parse '${LINE}', board skipped")
+            return()
+        endif()
+    endforeach()
+
+    set(${OUT_VAR} ${PAIRS} PARENT_SCOPE)
+    set(${OK_VAR} TRUE PARENT_SCOPE)
+endfunction()
+
+
+foreach(DAT ${DAT_FILES})
+    get_filename_component(NAME "${DAT}" NAME_WE)
+    string(REGEX REPLACE "^config_" "" NAME "${NAME}")
+    string(MAKE_C_IDENTIFIER "${NAME}" ID)
+
+    set(DAT_PAIRS "")
+    read_dat("${DAT}" "" DAT_PAIRS VALID)
+
+    set(PAIRS "")
+    set(N 0)
+
+    foreach(PAIR ${DAT_PAIRS})
+        string(REPLACE ":" ", 0x" PAIR "${PAIR}")
+        set(PAIRS "${PAIRS}    { 0x${PAIR} },\n")
+        math(EXPR N "${N} + 1")
+    endforeach()
+
+    if(VALID AND N GREATER 0)
+        set(TABLES "${TABLES}static constexpr board_pair_t board_${ID}[] =\n{\n${PAIRS}};\n\n")
+        set(PROFILES "${PROFILES}    { \"${NAME}\", board_${ID}, ${N} },\n")
+    endif()
+endforeach()
+
+set(HEADER "// Generated by gen_boards.cmake from the config_*.dat files, do not edit\n\n")
+set(HEADER "${HEADER}${TABLES}")
+set(HEADER "${HEADER}static constexpr board_profile_t board_profiles[] =\n{\n${PROFILES}};\n")
+
+file(WRITE "${OUT}" "${HEADER}")
@@ -0,0 +1,728 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___GZSTREAM_H__
+#define ___GZSTREAM_H__
+
+// zlib is optional (HAVE_ZLIB is defined by the build when it is found)
+#if defined(__GLIBC__) && defined(HAVE_ZLIB)
+#define HAVE_GZ_STREAM
+#endif
+
+#ifdef HAVE_GZ_STREAM
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+#include "workqueue.h"
+#include "txn.h"
+
+
+namespace util
+{
+
+    // Output files named *.gz are written gzip compressed
+    inline bool gz_name( const std::string & filename ) throw()
+    {
+        return filename.size() > 3 && filename.compare( filename.size() - 3, 3, ".gz" ) == 0;
+    }
+
+
+    // Input files are recognized by their content (the gzip magic)
+    inline bool gz_file( const std::string & filename ) throw()
+    {
+        unsigned char magic[ 2 ] = { 0 };
+        const int fd = filename == "-" ? -1 : open( filename.c_str(), O_RDONLY );
+
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        const bool gz = read( fd, magic, 2 ) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+        close( fd );
+
+        return gz;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Decompresses a gzip file on its own thread, ahead of the reader:
+       the decompressed chunks wait in a bounded queue, so that inflating
+       the next chunk overlaps with the writes of the current one.
+     */
+    class gz_reader_t
+    {
+        private:
+            enum { CHUNK_SIZE = 256 * 1024, QUEUE_DEPTH = 8 };
+
+            typedef std::shared_ptr< std::vector< char > > chunk_t;
+
+            gzFile _gz;
+            work_queue_t< chunk_t > _queue;
+            std::thread _thread;
+            std::atomic< bool > _stop;
+            bool _error;          // set before the queue is closed
+
+            chunk_t _chunk;
+            size_t _pos;
+            unsigned long long _tell;
+
+
+            void inflate_all()
+            {
+                while (! _stop)
+                {
+                    chunk_t chunk( new std::vector< char >( CHUNK_SIZE ) );
+                    const int n = gzread( _gz, &(*chunk)[0], CHUNK_SIZE );
+
+                    if (n <= 0)
+                    {
+                        int err = Z_OK;
+                        gzerror( _gz, &err );
+
+                        _error = n < 0 || (err != Z_OK && err != Z_STREAM_END);
+                        break;
+                    }
+
+                    chunk->resize( size_t( n ) );
+                    _queue.push( chunk );
+                }
+
+                _queue.close();
+            }
+
+
+        public:
+            explicit gz_reader_t( gzFile gz ) :
+                _gz(gz), _queue( QUEUE_DEPTH ), _stop(false), _error(false), _pos(0), _tell(0)
+            {
+                _thread = std::thread( [this]() { inflate_all(); } );
+            }
+
+
+            ssize_t read( char * buf, size_t size )
+            {
+                size_t done = 0;
+
+                while (done < size)
+                {
+                    if (! _chunk || _pos == _chunk->size())
+                    {
+                        if (! _queue.pop( _chunk ))
+                        {
+                            _chunk.reset();
+                            break;
+                        }
+
+                        _pos = 0;
+                    }
+
+                    const size_t n = std::min( size - done, _chunk->size() - _pos );
+
+                    memcpy( buf + done, &(*_chunk)[ _pos ], n );
+                    _pos += n;
+                    done += n;
+                }
+
+                if (done == 0 && _error)
+                {
+                    errno = EIO;
+                    return -1;
+                }
+
+                _tell += done;
+                return ssize_t( done );
+            }
+
+
+            unsigned long long tell() const throw()
+            {
+                return _tell;
+            }
+
+
+            // The reader may stop early (e.g. after the preamble): the
+            // inflating thread is then stopped too
+            bool close()
+            {
+                _stop = true;
+
+                chunk_t chunk;
+                while (_queue.pop( chunk )) {}
+
+                _thread.join();
+
+                return gzclose( _gz ) == Z_OK && ! _error;
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Writes a gzip file, its blocks being compressed in parallel (each
+       one on its own, ended by a sync flush, the last one by the final
+       block) and written in order; at most two blocks per thread are held
+       in memory.
+
+       The first HEAD_LEN bytes (the preamble of an image) are kept in a
+       stored (not compressed) deflate block, written last at the start of
+       the file: being of known size, they can be patched after the rest
+       of the image has been written, as in an uncompressed file. Seeking
+       is allowed within them and within the block being filled only.
+       Outputs that are not regular files get no head and cannot seek.
+     */
+    class gz_writer_t
+    {
+        public:
+            enum
+            {
+                HEAD_LEN = 1024,
+                BLOCK_LEN = 256 * 1024,
+                GZ_HEADER_SIZE = 10,
+                STORED_HEADER_SIZE = 5
+            };
+
+        private:
+            struct block_t
+            {
+                std::vector< unsigned char > in;
+                std::vector< unsigned char > out;
+                size_t len;
+                unsigned long crc;
+                bool last;
+                bool done;
+                bool ok;
+            };
+
+            typedef std::shared_ptr< block_t > block_ptr_t;
+
+            int _fd;
+            int _level;
+            bool _seekable;
+            bool _error;
+
+            std::vector< unsigned char > _head;
+            std::vector< unsigned char > _cur;    // block being filled
+            unsigned long long _cur_base;
+            unsigned long long _pos;
+            unsigned long long _out;              // where the next block goes
+
+            unsigned long _crc;                   // of the blocks written
+            unsigned long long _len;
+
+            std::deque< block_ptr_t > _pending;   // in file order
+            work_queue_t< block_ptr_t > _queue;
+            std::vector< std::thread > _workers;
+            std::mutex _mtx;
+            std::condition_variable _done;
+
+
+            static void header( unsigned char * h ) throw()
+            {
+                static const unsigned char gz[ GZ_HEADER_SIZE ] =
+                    { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 }; // deflate, Unix
+
+                memcpy( h, gz, GZ_HEADER_SIZE );
+            }
+
+
+            static void put_le32( unsigned char * p, unsigned long v ) throw()
+            {
+                for (int i = 0; i < 4; ++i, v >>= 8) p[i] = (unsigned char) v;
+            }
+
+
+            void compress( block_t & b ) const
+            {
+                z_stream z;
+                memset( &z, 0, sizeof(z) );
+
+                b.crc = crc32( 0L, b.in.empty() ? Z_NULL : &b.in[0], uInt( b.in.size() ) );
+                b.ok = deflateInit2( &z, _level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY ) == Z_OK;
+
+                if (! b.ok) return;
+
+                b.out.resize( deflateBound( &z, uLong( b.in.size() ) ) + 16 );
+
+                z.next_in = b.in.empty() ? Z_NULL : &b.in[0];
+                z.avail_in = uInt( b.in.size() );
+                z.next_out = &b.out[0];
+                z.avail_out = uInt( b.out.size() );
+
+                const int ret = deflate( &z, b.last ? Z_FINISH : Z_SYNC_FLUSH );
+
+                b.ok = b.last ? ret == Z_STREAM_END :
+                    (ret == Z_OK && z.avail_in == 0 && z.avail_out != 0);
+                b.out.resize( z.total_out );
+                b.in.clear();
+
+                deflateEnd( &z );
+            }
+
+
+            bool put( const unsigned char * p, size_t n )
+            {
+                const bool ok = _seekable ?
+                    pwrite_all( _fd, p, n, off_t( _out ) ) : write_all( p, n );
+
+                _out += n;
+                return ok;
+            }
+
+
+            bool write_all( const unsigned char * p, size_t n ) throw()
+            {
+                while (n > 0)
+                {
+                    const ssize_t wb = ::write( _fd, p, n );
+
+                    if (wb < 0 && errno == EINTR) continue;
+                    if (wb <= 0) return false;
+
+                    p += wb;
+                    n -= wb;
+                }
+
+                return true;
+            }
+
+
+            // Write the blocks compressed so far, in order; with wait, all of
+            // the blocks but <keep>
+            void drain( bool wait, size_t keep )
+            {
+                while (true)
+                {
+                    block_ptr_t b;
+
+                    {
+                        std::unique_lock< std::mutex > lock( _mtx );
+
+                        if (_pending.size() <= keep && wait) break;
+                        if (_pending.empty()) break;
+
+                        if (wait)
+                        {
+                            _done.wait( lock, [this]() { return _pending.front()->done; } );
+                        }
+                        else if (! _pending.front()->done)
+                        {
+                            break;
+                        }
+
+                        b = _pending.front();
+                        _pending.pop_front();
+                    }
+
+                    if (! b->ok || ! put( b->out.empty() ? 0 : &b->out[0], b->out.size() ))
+                    {
+                        _error = true;
+                    }
+
+                    _crc = crc32_combine( _crc, b->crc, z_off_t( b->len ) );
+                    _len += b->len;
+                }
+            }
+
+
+            void dispatch( bool last )
+            {
+                if (_workers.empty())
+                {
+                    const unsigned int n = std::thread::hardware_concurrency();
+
+                    for (unsigned int i = 0; i < (n ? n : 1); ++i)
+                    {
+                        _workers.push_back( std::thread( [this]()
+                        {
+                            block_ptr_t b;
+
+                            while (_queue.pop( b ))
+                            {
+                                compress( *b );
+
+                                std::lock_guard< std::mutex > lock( _mtx );
+                                b->done = true;
+                                _done.notify_all();
+                            }
+                        }));
+                    }
+                }
+
+                block_ptr_t b( new block_t );
+                b->in.swap( _cur );
+                b->len = b->in.size();
+                b->last = last;
+                b->done = false;
+                b->ok = false;
+                b->crc = 0;
+
+                _cur_base += b->len;
+
+                {
+                    std::lock_guard< std::mutex > lock( _mtx );
+                    _pending.push_back( b );
+                }
+
+                _queue.push( b );
+
+                // bounded memory: the writes catch up with the compression
+                drain( false, 0 );
+                drain( true, 2 * _workers.size() );
+            }
+
+
+        public:
+            gz_writer_t( int fd, int level ) :
+                _fd(fd), _level(level), _seekable(false), _error(false),
+                _cur_base(0), _pos(0), _out(0), _crc( crc32( 0L, Z_NULL, 0 ) ), _len(0),
+                _queue( 1024 )
+            {
+                struct stat st;
+
+                _seekable = fstat( fd, &st ) == 0 && S_ISREG( st.st_mode );
+
+                if (_seekable)
+                {
+                    // room for the gzip header and the stored head
+                    _cur_base = HEAD_LEN;
+                    _out = GZ_HEADER_SIZE + STORED_HEADER_SIZE + HEAD_LEN;
+                }
+                else
+                {
+                    unsigned char h[ GZ_HEADER_SIZE ];
+                    header( h );
+
+                    _error = ! put( h, sizeof(h) );
+                }
+            }
+
+
+            ~gz_writer_t()
+            {
+                _queue.close();
+
+                for (size_t i = 0; i < _workers.size(); ++i) _workers[i].join();
+            }
+
+
+            bool write( const unsigned char * p, size_t n )
+            {
+                while (n > 0 && ! _error)
+                {
+                    size_t k = 0;
+
+                    if (_pos < _cur_base)
+                    {
+                        // the head (writes are sequential or within it)
+                        k = std::min( n, size_t( HEAD_LEN - _pos ) );
+
+                        if (_head.size() < _pos + k) _head.resize( size_t( _pos + k ) );
+                        memcpy( &_head[ size_t( _pos ) ], p, k );
+                    }
+                    else
+                    {
+                        const size_t ofs = size_t( _pos - _cur_base );
+
+                        k = std::min( n, size_t( BLOCK_LEN ) - std::min( ofs, size_t( BLOCK_LEN ) ) );
+
+                        if (k == 0)
+                        {
+                            dispatch( false );
+                            continue;
+                        }
+
+                        if (_cur.size() < ofs + k) _cur.resize( ofs + k );
+                        memcpy( &_cur[ ofs ], p, k );
+                    }
+
+                    _pos += k;
+                    p += k;
+                    n -= k;
+                }
+
+                return ! _error;
+            }
+
+
+            unsigned long long tell() const throw()
+            {
+                return _pos;
+            }
+
+
+            unsigned long long end() const throw()
+            {
+                return _cur.empty() && _cur_base == HEAD_LEN && _seekable ?
+                    _head.size() : _cur_base + _cur.size();
+            }
+
+
+            // Only the head and the block being filled can be sought
+            bool seek( unsigned long long pos ) throw()
+            {
+                const bool in_head = _seekable && pos <= _head.size() && pos < HEAD_LEN;
+                const bool in_cur = pos >= _cur_base && pos <= _cur_base + _cur.size();
+
+                if (! in_head && ! in_cur)
+                {
+                    return false;
+                }
+
+                _pos = pos;
+                return true;
+            }
+
+
+            bool close()
+            {
+                unsigned char t[ 8 ];
+
+                if (! _seekable || _cur_base > HEAD_LEN || ! _cur.empty())
+                {
+                    dispatch( true );
+                    drain( true, 0 );
+                }
+                else
+                {
+                    // all of it in the head: a plain gzip file
+                    _cur.swap( _head );
+                    _cur_base = 0;
+                    _out = GZ_HEADER_SIZE;
+                    _seekable = true;
+
+                    dispatch( true );
+                    drain( true, 0 );
+
+                    _head.clear();
+                }
+
+                unsigned long crc = _crc;
+                unsigned long long len = _len;
+
+                if (! _head.empty())
+                {
+                    const unsigned long head_crc = crc32( 0L, &_head[0], uInt( _head.size() ) );
+
+                    crc = crc32_combine( head_crc, _crc, z_off_t( _len ) );
+                    len += _head.size();
+                }
+
+                put_le32( t, crc );
+                put_le32( t + 4, (unsigned long) len );
+
+                bool ok = ! _error && put( t, sizeof(t) );
+
+                // then header and head, in front of the blocks
+                if (ok && _seekable)
+                {
+                    std::vector< unsigned char > h( GZ_HEADER_SIZE );
+                    header( &h[0] );
+
+                    if (! _head.empty())
+                    {
+                        const size_t n = _head.size();
+
+                        h.push_back( 0 ); // stored block, not final
+                        h.push_back( (unsigned char) n );
+                        h.push_back( (unsigned char) (n >> 8) );
+                        h.push_back( (unsigned char) ~n );
+                        h.push_back( (unsigned char) (~n >> 8) );
+                        h.insert( h.end(), _head.begin(), _head.end() );
+                    }
+
+                    ok = pwrite_all( _fd, &h[0], h.size(), 0 );
+                }
+
+                return ::close( _fd ) == 0 && ok;
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    namespace gz_stream
+    {
+        inline ssize_t read( void * cookie, char * buf, size_t size )
+        {
+            return static_cast< gz_reader_t* >( cookie )->read( buf, size );
+        }
+
+
+        inline ssize_t write( void * cookie, const char * buf, size_t size )
+        {
+            gz_writer_t * w = static_cast< gz_writer_t* >( cookie );
+
+            if (! w->write( (const unsigned char*) buf, size ))
+            {
+                errno = EIO;
+                return -1;
+            }
+
+            return ssize_t(size);
+        }
+
+
+        inline int read_seek( void * cookie, off64_t * pos, int whence )
+        {
+            // ftell() only
+            if (whence != SEEK_CUR || *pos != 0)
+            {
+                errno = ESPIPE;
+                return -1;
+            }
+
+            *pos = off64_t( static_cast< gz_reader_t* >( cookie )->tell() );
+            return 0;
+        }
+
+
+        inline int write_seek( void * cookie, off64_t * pos, int whence )
+        {
+            gz_writer_t * w = static_cast< gz_writer_t* >( cookie );
+
+            const long long from =
+                whence == SEEK_SET ? 0 :
+                whence == SEEK_CUR ? (long long) w->tell() : (long long) w->end();
+
+            if (from + *pos < 0 || ! w->seek( (unsigned long long) (from + *pos) ))
+            {
+                errno = ESPIPE;
+                return -1;
+            }
+
+            *pos = off64_t( w->tell() );
+            return 0;
+        }
+
+
+        inline int read_close( void * cookie )
+        {
+            gz_reader_t * r = static_cast< gz_reader_t* >( cookie );
+
+            const bool ok = r->close();
+            delete r;
+
+            return ok ? 0 : EOF;
+        }
+
+
+        inline int write_close( void * cookie )
+        {
+            gz_writer_t * w = static_cast< gz_writer_t* >( cookie );
+
+            const bool ok = w->close();
+            delete w;
+
+            return ok ? 0 : EOF;
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Opens filename ("rb" or "wb") as a stream of the data it holds
+       gzip compressed; fclose() waits for the whole file to be written
+     */
+    inline FILE * gz_fopen( const std::string & filename, const char * mode,
+            int level = Z_DEFAULT_COMPRESSION )
+    {
+        cookie_io_functions_t io;
+        memset( &io, 0, sizeof(io) );
+
+        if (mode[0] == 'r')
+        {
+            const int fd = open( filename.c_str(), O_RDONLY );
+            gzFile gz = fd < 0 ? 0 : gzdopen( fd, "rb" );
+
+            if (! gz)
+            {
+                if (fd >= 0) close( fd );
+                return 0;
+            }
+
+            gzbuffer( gz, 128 * 1024 );
+
+            io.read = gz_stream::read;
+            io.seek = gz_stream::read_seek;
+            io.close = gz_stream::read_close;
+
+            gz_reader_t * r = new gz_reader_t( gz );
+            FILE * f = fopencookie( r, "rb", io );
+
+            if (! f)
+            {
+                r->close();
+                delete r;
+            }
+
+            return f;
+        }
+
+        const int fd = open( filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+
+        if (fd < 0)
+        {
+            return 0;
+        }
+
+        io.write = gz_stream::write;
+        io.seek = gz_stream::write_seek;
+        io.close = gz_stream::write_close;
+
+        gz_writer_t * w = new gz_writer_t( fd, level );
+        FILE * f = fopencookie( w, "wb", io );
+
+        if (! f)
+        {
+            w->close();
+            delete w;
+        }
+
+        return f;
+    }
+
+}
+
+#endif // HAVE_GZ_STREAM
+
+#endif
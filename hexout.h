@@ -0,0 +1,502 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___HEXOUT_H__
+#define ___HEXOUT_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GLIBC__)
+#define HAVE_HEX_STREAM
+#endif
+
+
+namespace util
+{
+
+    struct hex_cfg_t
+    {
+        enum format_t
+        {
+            BIN,
+            SREC,
+            IHEX
+        };
+
+        format_t format;
+        unsigned int base;   // address of the first byte of the image
+        bool skip_erased;    // do not emit records made of 0xFF only
+
+        hex_cfg_t() throw() : format(BIN), base(0), skip_erased(false) {}
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    enum { HEX_RECORD_SIZE = 16 };
+
+
+    // Encode a record (HEX_RECORD_SIZE bytes at most) as upper case hex
+    // digits, dst must have room for 2*n chars. Returns the sum of the bytes
+    inline unsigned int hex_encode( const unsigned char * src, size_t n, char * dst ) throw()
+    {
+#ifdef __SSE2__
+        if (n == HEX_RECORD_SIZE)
+        {
+            const __m128i v = _mm_loadu_si128( (const __m128i*) src );
+            const __m128i mask = _mm_set1_epi8( 0x0f );
+
+            const __m128i hi = _mm_and_si128( _mm_srli_epi16( v, 4 ), mask );
+            const __m128i lo = _mm_and_si128( v, mask );
+
+            // nibble + '0', plus 7 more for 'A'..'F'
+            const __m128i nine = _mm_set1_epi8( 9 );
+            const __m128i zero = _mm_set1_epi8( '0' );
+            const __m128i seven = _mm_set1_epi8( 7 );
+
+            const __m128i ch = _mm_add_epi8( _mm_add_epi8( hi, zero ),
+                    _mm_and_si128( _mm_cmpgt_epi8( hi, nine ), seven ) );
+            const __m128i cl = _mm_add_epi8( _mm_add_epi8( lo, zero ),
+                    _mm_and_si128( _mm_cmpgt_epi8( lo, nine ), seven ) );
+
+            _mm_storeu_si128( (__m128i*) dst, _mm_unpacklo_epi8( ch, cl ) );
+            _mm_storeu_si128( (__m128i*) (dst + 16), _mm_unpackhi_epi8( ch, cl ) );
+
+            const __m128i sad = _mm_sad_epu8( v, _mm_setzero_si128() );
+
+            return unsigned( _mm_cvtsi128_si32( sad ) + _mm_extract_epi16( sad, 4 ) );
+        }
+#endif
+
+        static const char digits[] = "0123456789ABCDEF";
+        unsigned int sum = 0;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            dst[ 2*i ] = digits[ src[i] >> 4 ];
+            dst[ 2*i + 1 ] = digits[ src[i] & 0xf ];
+            sum += src[i];
+        }
+
+        return sum;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    inline bool is_erased( const unsigned char * src, size_t n ) throw()
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (src[i] != 0xff)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Encodes a binary image as Motorola S-record (S3 data records, S7
+       termination) or Intel HEX (data and extended linear address records)
+       text, HEX_RECORD_SIZE bytes per record.
+       Bytes may be written at any offset (see seek()); writes to the first
+       <hold> bytes are kept in memory and emitted by close(), so that a
+       header patched after the data has been streamed is only output once.
+     */
+    class hex_writer_t
+    {
+        private:
+            FILE * _dst;
+            hex_cfg_t _cfg;
+
+            unsigned long long _pos;
+            unsigned long long _end;
+
+            unsigned char _rec[ HEX_RECORD_SIZE ];
+            unsigned long long _rec_ofs;
+            size_t _rec_len;
+
+            std::vector< unsigned char > _held;
+            size_t _hold;
+
+            unsigned int _upper; // current IHEX extended linear address
+            bool _error;
+
+
+            //------------------------------------------------------------------
+
+
+            static void put_byte( char * p, unsigned int b ) throw()
+            {
+                static const char digits[] = "0123456789ABCDEF";
+                p[0] = digits[ (b >> 4) & 0xf ];
+                p[1] = digits[ b & 0xf ];
+            }
+
+
+            //------------------------------------------------------------------
+
+
+            bool put_line( const char * line, size_t len ) throw()
+            {
+                if (! _error && fwrite( line, 1, len, _dst ) != len)
+                {
+                    _error = true;
+                }
+
+                return ! _error;
+            }
+
+
+            //------------------------------------------------------------------
+
+
+            bool emit_ihex( unsigned int type, unsigned int addr,
+                    const unsigned char * data, size_t n ) throw()
+            {
+                char line[ 16 + 2*HEX_RECORD_SIZE ];
+                char * p = line;
+
+                *p++ = ':';
+                put_byte( p, unsigned(n) ); p += 2;
+                put_byte( p, addr >> 8 ); p += 2;
+                put_byte( p, addr ); p += 2;
+                put_byte( p, type ); p += 2;
+
+                unsigned int sum = unsigned(n) + (addr >> 8) + addr + type;
+
+                sum += hex_encode( data, n, p );
+                p += 2*n;
+
+                put_byte( p, 0x100 - (sum & 0xff) ); p += 2;
+                *p++ = '\r';
+                *p++ = '\n';
+
+                return put_line( line, p - line );
+            }
+
+
+            //------------------------------------------------------------------
+
+
+            bool emit_srec( char type, unsigned int addr,
+                    const unsigned char * data, size_t n ) throw()
+            {
+                char line[ 16 + 2*HEX_RECORD_SIZE ];
+                char * p = line;
+
+                const unsigned int count = unsigned(n) + 4 + 1;
+
+                *p++ = 'S';
+                *p++ = type;
+                put_byte( p, count ); p += 2;
+
+                unsigned int sum = count;
+
+                for (int shift = 24; shift >= 0; shift -= 8)
+                {
+                    put_byte( p, addr >> shift ); p += 2;
+                    sum += (addr >> shift) & 0xff;
+                }
+
+                sum += hex_encode( data, n, p );
+                p += 2*n;
+
+                put_byte( p, ~sum ); p += 2;
+                *p++ = '\r';
+                *p++ = '\n';
+
+                return put_line( line, p - line );
+            }
+
+
+            //------------------------------------------------------------------
+
+
+            bool emit( unsigned long long ofs, const unsigned char * data, size_t n ) throw()
+            {
+                if (_cfg.skip_erased && is_erased( data, n ))
+                {
+                    return ! _error;
+                }
+
+                const unsigned int addr = unsigned( _cfg.base + ofs );
+
+                if (_cfg.format == hex_cfg_t::SREC)
+                {
+                    return emit_srec( '3', addr, data, n );
+                }
+
+                // an Intel HEX record may not cross a 64 KB boundary (with a
+                // base not 16 aligned it could): the rest goes in another one
+                const size_t room = 0x10000 - (addr & 0xffff);
+
+                if (n > room)
+                {
+                    return emit( ofs, data, room ) && emit( ofs + room, data + room, n - room );
+                }
+
+                if ((addr >> 16) != _upper)
+                {
+                    const unsigned char ula[] = {
+                        (unsigned char) (addr >> 24), (unsigned char) (addr >> 16) };
+
+                    _upper = addr >> 16;
+
+                    if (! emit_ihex( 0x04, 0, ula, sizeof(ula) ))
+                    {
+                        return false;
+                    }
+                }
+
+                return emit_ihex( 0x00, addr & 0xffff, data, n );
+            }
+
+
+            //------------------------------------------------------------------
+
+
+            bool flush_record() throw()
+            {
+                const size_t n = _rec_len;
+                _rec_len = 0;
+
+                return n == 0 || emit( _rec_ofs, _rec, n );
+            }
+
+
+        public:
+            hex_writer_t( FILE * dst, const hex_cfg_t & cfg, size_t hold ) :
+                _dst(dst), _cfg(cfg), _pos(0), _end(0),
+                _rec_ofs(0), _rec_len(0), _hold(hold), _upper(0), _error(false)
+            {
+                if (_cfg.format == hex_cfg_t::SREC)
+                {
+                    put_line( "S0030000FC\r\n", 12 );
+                }
+                else if (_cfg.base >> 16)
+                {
+                    _upper = ~0U; // emit the first extended address record
+                }
+            }
+
+
+            //------------------------------------------------------------------
+
+
+            bool write( const unsigned char * data, size_t n ) throw()
+            {
+                while (n > 0 && ! _error)
+                {
+                    if (_pos < _hold)
+                    {
+                        size_t k = size_t( _hold - _pos );
+                        k = k < n ? k : n;
+
+                        if (_held.size() < _pos + k)
+                        {
+                            _held.resize( size_t(_pos + k), 0xff );
+                        }
+
+                        memcpy( &_held[ size_t(_pos) ], data, k );
+
+                        data += k;
+                        n -= k;
+                        _pos += k;
+                    }
+                    else
+                    {
+                        // records start at offsets multiple of the record size
+                        if (_rec_len && _rec_ofs + _rec_len != _pos)
+                        {
+                            flush_record();
+                        }
+
+                        if (_rec_len == 0)
+                        {
+                            _rec_ofs = _pos;
+                        }
+
+                        size_t k = HEX_RECORD_SIZE - size_t( _pos % HEX_RECORD_SIZE );
+                        k = k < n ? k : n;
+
+                        memcpy( _rec + _rec_len, data, k );
+                        _rec_len += k;
+
+                        data += k;
+                        n -= k;
+                        _pos += k;
+
+                        if (_pos % HEX_RECORD_SIZE == 0)
+                        {
+                            flush_record();
+                        }
+                    }
+
+                    if (_pos > _end)
+                    {
+                        _end = _pos;
+                    }
+                }
+
+                return ! _error;
+            }
+
+
+            //------------------------------------------------------------------
+
+
+            void seek( unsigned long long pos ) throw() { _pos = pos; }
+            unsigned long long tell() const throw() { return _pos; }
+            unsigned long long end() const throw() { return _end; }
+
+
+            //------------------------------------------------------------------
+
+
+            // Emit the pending and the held records, then the termination
+            bool close() throw()
+            {
+                flush_record();
+
+                for (size_t ofs = 0; ofs < _held.size(); ofs += HEX_RECORD_SIZE)
+                {
+                    const size_t n = _held.size() - ofs;
+                    emit( ofs, &_held[ofs], n < HEX_RECORD_SIZE ? n : size_t(HEX_RECORD_SIZE) );
+                }
+
+                if (_cfg.format == hex_cfg_t::SREC)
+                {
+                    emit_srec( '7', _cfg.base, 0, 0 );
+                }
+                else
+                {
+                    put_line( ":00000001FF\r\n", 13 );
+                }
+
+                return ! _error;
+            }
+    };
+
+
+#ifdef HAVE_HEX_STREAM
+
+    //--------------------------------------------------------------------------
+
+
+    namespace hex_stream
+    {
+        inline ssize_t write( void * cookie, const char * buf, size_t size )
+        {
+            hex_writer_t * w = static_cast< hex_writer_t* >( cookie );
+
+            if (! w->write( (const unsigned char*) buf, size ))
+            {
+                errno = EIO;
+                return -1;
+            }
+
+            return ssize_t(size);
+        }
+
+
+        inline int seek( void * cookie, off64_t * pos, int whence )
+        {
+            hex_writer_t * w = static_cast< hex_writer_t* >( cookie );
+
+            const long long from =
+                whence == SEEK_SET ? 0 :
+                whence == SEEK_CUR ? (long long) w->tell() : (long long) w->end();
+
+            if (from + *pos < 0)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            w->seek( (unsigned long long) (from + *pos) );
+            *pos = off64_t( w->tell() );
+
+            return 0;
+        }
+
+
+        inline int close( void * cookie )
+        {
+            hex_writer_t * w = static_cast< hex_writer_t* >( cookie );
+
+            const bool ok = w->close();
+            delete w;
+
+            return ok ? 0 : EOF;
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Returns a write-only stream encoding what is written to it as hex
+       records into <dst>; fclose() of the stream emits the pending records,
+       but leaves <dst> open
+     */
+    inline FILE * hex_fopen( FILE * dst, const hex_cfg_t & cfg, size_t hold )
+    {
+        cookie_io_functions_t io;
+
+        io.read = 0;
+        io.write = hex_stream::write;
+        io.seek = hex_stream::seek;
+        io.close = hex_stream::close;
+
+        hex_writer_t * w = new hex_writer_t( dst, cfg, hold );
+        FILE * f = fopencookie( w, "wb", io );
+
+        if (! f)
+        {
+            delete w;
+        }
+
+        return f;
+    }
+
+#endif // HAVE_HEX_STREAM
+
+}
+
+#endif
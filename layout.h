@@ -0,0 +1,777 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___LAYOUT_H__
+#define ___LAYOUT_H__
+
+#ifndef WIN32
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "tokenizer.h"
+#include "workqueue.h"
+#include "payload.h"
+#include "trace.h"
+
+
+namespace util
+{
+
+    // Copy len bytes from src (at src_ofs) to dst (at dst_ofs) in the
+    // kernel (copy_file_range, reflinks on filesystems supporting them),
+    // falling back to pread/pwrite; stops at the end of src.
+    // A negative dst_ofs writes at the current position of dst, which may
+    // be a pipe (splice). Returns the number of bytes copied, -1 on error
+    inline long long copy_range( int src, off_t src_ofs, int dst, off_t dst_ofs,
+            unsigned long long len ) throw()
+    {
+        unsigned long long done = 0;
+        struct stat st;
+
+        const bool to_pipe = dst_ofs < 0 && fstat( dst, &st ) == 0 && S_ISFIFO( st.st_mode );
+
+#ifdef SPLICE_F_MOVE
+        while (to_pipe && done < len)
+        {
+            loff_t in = src_ofs + done;
+            const size_t chunk = len - done > 0x40000000ULL ? 0x40000000 : size_t(len - done);
+            const ssize_t n = splice( src, &in, dst, 0, chunk, SPLICE_F_MOVE );
+
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && done == 0 && errno == EINVAL) break; // e.g. src not spliceable
+            if (n < 0) return -1;
+            if (n == 0) return (long long) done;
+
+            done += n;
+        }
+#endif
+
+#ifdef SYS_copy_file_range
+        while (! to_pipe && done < len)
+        {
+            loff_t in = src_ofs + done, out = dst_ofs + done;
+            const size_t chunk = len - done > 0x40000000ULL ? 0x40000000 : size_t(len - done);
+            const long n = syscall( SYS_copy_file_range, src, &in, dst, 
+                    dst_ofs < 0 ? (loff_t *) 0 : &out, chunk, 0 );
+
+            if (n < 0 && errno == EINTR) continue;
+
+            if (n < 0 && done == 0 && (errno == ENOSYS || errno == EXDEV ||
+                        errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                break; // not supported between these files
+            }
+
+            if (n < 0) return -1;
+            if (n == 0) return (long long) done;
+
+            done += n;
+        }
+#endif
+
+        std::vector< char > buf( 1024 * 1024 );
+
+        while (done < len)
+        {
+            const size_t chunk = len - done > buf.size() ? buf.size() : size_t(len - done);
+            const ssize_t rb = pread( src, &buf[0], chunk, src_ofs + done );
+
+            if (rb < 0 && errno == EINTR) continue;
+            if (rb < 0) return -1;
+            if (rb == 0) break;
+
+            for (ssize_t w = 0; w < rb; )
+            {
+                const ssize_t wb = dst_ofs < 0 ? 
+                    write( dst, &buf[w], rb - w ) :
+                    pwrite( dst, &buf[w], rb - w, dst_ofs + done + w );
+
+                if (wb < 0 && errno == EINTR) continue;
+                if (wb <= 0) return -1;
+
+                w += wb;
+            }
+
+            done += rb;
+        }
+
+        return (long long) done;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    inline bool fill_range( int dst, off_t ofs, unsigned long long len, unsigned char byte ) throw()
+    {
+        std::vector< char > buf( len < 1024 * 1024 ? size_t(len) : 1024 * 1024, char(byte) );
+        unsigned long long done = 0;
+
+        while (done < len)
+        {
+            const size_t chunk = len - done > buf.size() ? buf.size() : size_t(len - done);
+            const ssize_t wb = pwrite( dst, &buf[0], chunk, ofs + done );
+
+            if (wb < 0 && errno == EINTR) continue;
+            if (wb <= 0) return false;
+
+            done += wb;
+        }
+
+        return true;
+    }
+
+}
+
+
+//------------------------------------------------------------------------------
+
+
+/*
+   Layout of a whole flash part (--layout): a list of named regions, one per
+   line, each holding a source file and/or a fill byte:
+
+      # name     key=value ...
+      flash      size=16M fill=0xff
+      boot       offset=0        size=512K  source=u-boot.bin  boot
+      env        offset=0x80000  size=128K  source=env.bin
+      dtb                        size=64K   source=board.dtb   align=64K
+      data       offset=8M       size=8M    fill=0
+
+   "flash" gives the size of the part (default: the end of the last region)
+   and the fill byte of the gaps (default 0xff). A region with no offset
+   follows the previous one, aligned to its "align" (default 1); a region
+   with no size is as large as its source. The "boot" region holds the
+   preamble followed by the user's code read from its source, as --spi does.
+   Numbers are decimal or 0x-prefixed hex, optionally followed by K or M.
+ */
+struct flash_region_t
+{
+    std::string name;
+    std::string source;
+    unsigned long long offset;
+    unsigned long long size;
+    unsigned long long align;
+    unsigned long long src_len;    // bytes copied from source (0 = unknown)
+    int fill;                      // -1: same as the flash
+    bool boot;
+    bool has_offset;
+    bool has_size;
+    int line;
+
+    flash_region_t() throw() :
+        offset(0), size(0), align(1), src_len(0), fill(-1),
+        boot(false), has_offset(false), has_size(false), line(0) {}
+};
+
+
+//------------------------------------------------------------------------------
+
+
+class flash_layout_t
+{
+    public:
+        enum { PREAMBLE_SIZE = 1024 };
+
+        // Writes the boot region: preamble + user's code from region.source,
+        // at region.offset of fd (dstname); returns the bytes written
+        typedef std::function< bool( const flash_region_t & region, int fd,
+                const std::string & dstname, unsigned long long & len,
+                std::string & msg ) > boot_writer_t;
+
+    private:
+        std::vector< flash_region_t > _regions;
+        unsigned long long _size;
+        bool _has_size;
+        unsigned char _fill;
+
+        std::string _filename;
+
+
+        static bool parse_num( const std::string & s, unsigned long long & n ) throw()
+        {
+            char * end = 0;
+
+            if (s.empty() || s[0] < '0' || s[0] > '9') return false;
+
+            errno = 0;
+            n = strtoull( s.c_str(), &end, 0 );
+
+            if (errno) return false;
+
+            if (*end == 'K' || *end == 'k') { n <<= 10; ++end; }
+            else if (*end == 'M' || *end == 'm') { n <<= 20; ++end; }
+
+            return *end == 0;
+        }
+
+
+        enum extent_kind_t
+        {
+            DATA,
+            ZERO,
+            ERASED
+        };
+
+        struct extent_t
+        {
+            unsigned long long offset;
+            unsigned long long len;
+            extent_kind_t kind;
+        };
+
+
+        static void add_extent( std::vector< extent_t > & extents, 
+                unsigned long long offset, unsigned long long len, extent_kind_t kind )
+        {
+            if (! len) return;
+
+            if (! extents.empty() && extents.back().kind == kind &&
+                    extents.back().offset + extents.back().len == offset)
+            {
+                extents.back().len += len;
+            }
+            else
+            {
+                extents.push_back( { offset, len, kind } );
+            }
+        }
+
+
+        // One line per extent: <offset> <length> data|zero|erased;
+        // only "data" and "zero" extents are to be programmed
+        bool save_extents( const std::string & filename, 
+                const std::vector< extent_t > & extents ) const
+        {
+            static const char * const kinds[] = { "data", "zero", "erased" };
+
+            FILE * f = fopen( filename.c_str(), "w" );
+            if (!f) return false;
+
+            fprintf( f, "# offset length data|zero|erased\n" );
+            fprintf( f, "size 0x%llx\n", _size );
+
+            for (size_t i = 0; i < extents.size(); ++i)
+            {
+                fprintf( f, "0x%08llx 0x%08llx %s\n", 
+                        extents[i].offset, extents[i].len, kinds[ extents[i].kind ] );
+            }
+
+            const bool ok = ! ferror( f );
+
+            return fclose( f ) == 0 && ok;
+        }
+
+
+        std::string where( int line ) const
+        {
+            return _filename + ":" + std::to_string( line ) + ": ";
+        }
+
+
+        bool parse_line( const std::vector< std::string > & words, int line, std::string & msg )
+        {
+            const bool global = words[0] == "flash";
+            flash_region_t r;
+
+            r.name = words[0];
+            r.line = line;
+
+            for (size_t i = 1; i < words.size(); ++i)
+            {
+                const std::string & w = words[i];
+                const size_t eq = w.find( '=' );
+                const std::string key = w.substr( 0, eq );
+                const std::string val = eq == std::string::npos ? "" : w.substr( eq + 1 );
+                unsigned long long n = 0;
+
+                if (key == "boot" && eq == std::string::npos && ! global)
+                {
+                    r.boot = true;
+                    continue;
+                }
+
+                if (eq == std::string::npos)
+                {
+                    msg = where( line ) + "'" + w + "': key=value expected";
+                    return false;
+                }
+
+                if (key == "source" && ! global)
+                {
+                    r.source = val;
+                    continue;
+                }
+
+                if (! parse_num( val, n ))
+                {
+                    msg = where( line ) + "'" + w + "': invalid number";
+                    return false;
+                }
+
+                if (key == "fill" && n <= 0xff)
+                {
+                    if (global) _fill = (unsigned char) n;
+                    else r.fill = int(n);
+                }
+                else if (key == "size" && global)
+                {
+                    _size = n;
+                    _has_size = true;
+                }
+                else if (key == "size")
+                {
+                    r.size = n;
+                    r.has_size = true;
+                }
+                else if (key == "offset" && ! global)
+                {
+                    r.offset = n;
+                    r.has_offset = true;
+                }
+                else if (key == "align" && ! global && n > 0)
+                {
+                    r.align = n;
+                }
+                else
+                {
+                    msg = where( line ) + "'" + w + "' not valid here";
+                    return false;
+                }
+            }
+
+            if (! global)
+            {
+                _regions.push_back( r );
+            }
+
+            return true;
+        }
+
+
+    public:
+        flash_layout_t() throw() : _size(0), _has_size(false), _fill(0xff) {}
+
+
+        const std::vector< flash_region_t > & regions() const throw() { return _regions; }
+        unsigned long long size() const throw() { return _size; }
+        unsigned char fill() const throw() { return _fill; }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool load( const std::string & filename, std::string & msg )
+        {
+            typedef util::tokenizer_t< std::string > tokenizer_t;
+
+            util::file_stream< std::string > fs( filename );
+            tokenizer_t tknzr( fs );
+
+            _filename = filename;
+
+            if ( ! fs.open() )
+            {
+                msg = "Unable to open \"";
+                msg += filename + "\"";
+                return false;
+            }
+
+            tokenizer_t::token_class_set_t blnk_cls;
+            tokenizer_t::token_class_set_t linestyle_comment_cls;
+
+            blnk_cls.insert(" ");
+            blnk_cls.insert("\t");
+            blnk_cls.insert("\r");
+            linestyle_comment_cls.insert("#");
+
+            tknzr.register_token_blank( blnk_cls );
+            tknzr.register_token_linestyle_comment( linestyle_comment_cls );
+
+            tokenizer_t::token_t token;
+            std::vector< std::string > words;
+            int line = 0;
+            bool end = false;
+
+            while ( ! end )
+            {
+                token.value = "";
+
+                end = ! tknzr.get_next_token( token );
+
+                if ( token.tkncls == tokenizer_t::END_OF_STREAM ||
+                        (token.tkncls == tokenizer_t::OTHER &&
+                         ! token.value.empty() && int(token.line) != line) )
+                {
+                    if (! words.empty() && ! parse_line( words, line, msg ))
+                    {
+                        return false;
+                    }
+
+                    words.clear();
+                    line = int(token.line);
+                }
+
+                if ( token.tkncls == tokenizer_t::END_OF_STREAM )
+                {
+                    break;
+                }
+
+                if ( token.tkncls == tokenizer_t::OTHER && ! token.value.empty() )
+                {
+                    words.push_back( token.value );
+                }
+            }
+
+            if (_regions.empty())
+            {
+                msg = "\"" + filename + "\": no regions";
+                return false;
+            }
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Places the regions and checks that they fit the flash with no
+        // overlaps; boot_format is the format of the boot region source
+        bool resolve( payload_reader_t::format_t boot_format, std::string & msg )
+        {
+            unsigned long long next = 0;
+            int n_boot = 0;
+
+            for (size_t i = 0; i < _regions.size(); ++i)
+            {
+                flash_region_t & r = _regions[i];
+
+                if (r.boot && ++n_boot > 1)
+                {
+                    msg = where( r.line ) + "only one boot region is allowed";
+                    return false;
+                }
+
+                if (! r.has_offset)
+                {
+                    r.offset = (next + r.align - 1) / r.align * r.align;
+                }
+                else if (r.offset % r.align)
+                {
+                    msg = where( r.line ) + r.name + ": offset is not aligned";
+                    return false;
+                }
+
+                if (r.source == "-")
+                {
+                    msg = where( r.line ) + r.name + ": the standard input cannot be a source";
+                    return false;
+                }
+
+                if (! r.source.empty())
+                {
+                    struct stat st;
+
+                    if (stat( r.source.c_str(), &st ) != 0)
+                    {
+                        msg = where( r.line ) + r.name + ": \"" + r.source + "\": " + strerror( errno );
+                        return false;
+                    }
+
+                    // a converted boot code has no length before being converted
+                    const bool raw = ! r.boot ||
+                        (boot_format == payload_reader_t::AUTO ?
+                         payload_reader_t::detect_file( r.source ) : boot_format) ==
+                        payload_reader_t::RAW;
+
+                    r.src_len = raw ? (unsigned long long) st.st_size : 0;
+
+                    const unsigned long long len = r.src_len + (r.boot ? PREAMBLE_SIZE : 0);
+
+                    if (! r.has_size && ! raw)
+                    {
+                        msg = where( r.line ) + r.name + ": size needed for a non-raw boot code";
+                        return false;
+                    }
+
+                    if (! r.has_size)
+                    {
+                        r.size = len;
+                    }
+                    else if (len > r.size)
+                    {
+                        msg = where( r.line ) + r.name + ": \"" + r.source + "\" overflows the region by " +
+                            std::to_string( len - r.size ) + " bytes";
+                        return false;
+                    }
+                }
+                else if (r.boot)
+                {
+                    msg = where( r.line ) + r.name + ": the boot region needs a source";
+                    return false;
+                }
+                else if (! r.has_size)
+                {
+                    msg = where( r.line ) + r.name + ": size or source needed";
+                    return false;
+                }
+
+                next = r.offset + r.size;
+            }
+
+            std::vector< flash_region_t > sorted( _regions );
+
+            std::stable_sort( sorted.begin(), sorted.end(),
+                    []( const flash_region_t & a, const flash_region_t & b )
+                    { return a.offset < b.offset; } );
+
+            for (size_t i = 1; i < sorted.size(); ++i)
+            {
+                if (sorted[i].offset < sorted[i-1].offset + sorted[i-1].size)
+                {
+                    msg = where( sorted[i].line ) + sorted[i].name + " overlaps " + sorted[i-1].name;
+                    return false;
+                }
+            }
+
+            const unsigned long long end = sorted.back().offset + sorted.back().size;
+
+            if (! _has_size)
+            {
+                _size = end;
+            }
+            else if (end > _size)
+            {
+                msg = where( sorted.back().line ) + sorted.back().name +
+                    " exceeds the flash size by " + std::to_string( end - _size ) + " bytes";
+                return false;
+            }
+
+            _regions.swap( sorted );
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // How the filler is written: DENSE writes every byte; HOLES leaves
+        // the 0x00 filler as holes of the (sparse) file; EXTENTS also skips
+        // the 0xFF filler, which reads as 0x00 from the file, and lists the
+        // data, zero and erased extents in <dstname>.extents
+        enum fill_mode_t
+        {
+            DENSE,
+            HOLES,
+            EXTENTS
+        };
+
+
+        static bool parse_fill_mode( const std::string & name, fill_mode_t & mode ) throw()
+        {
+            if (name == "dense") mode = DENSE;
+            else if (name == "holes") mode = HOLES;
+            else if (name == "extents") mode = EXTENTS;
+            else return false;
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Writes the whole flash image in a single pass: regions and gaps
+        // are written in parallel, at their own offsets of the same file;
+        // written is the number of bytes actually written
+        bool write( const std::string & dstname, unsigned int n_workers,
+                fill_mode_t mode, boot_writer_t boot_writer, 
+                unsigned long long & written, std::string & msg )
+        {
+            const int fd = open( dstname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+
+            if (fd < 0 || ftruncate( fd, off_t( _size ) ) != 0)
+            {
+                msg = "\"" + dstname + "\": " + strerror( errno );
+                if (fd >= 0) close( fd );
+                return false;
+            }
+
+            struct task_t
+            {
+                const flash_region_t * region;
+                unsigned long long offset;   // gap to fill, if no region
+                unsigned long long size;
+                unsigned long long len;      // data, followed by fill up to size
+                unsigned char fill;
+            };
+
+            std::vector< task_t > tasks;
+            unsigned long long next = 0;
+
+            for (size_t i = 0; i < _regions.size(); ++i)
+            {
+                if (_regions[i].offset > next)
+                {
+                    tasks.push_back( { 0, next, _regions[i].offset - next, 0, _fill } );
+                }
+
+                tasks.push_back( { &_regions[i], _regions[i].offset, _regions[i].size, 0,
+                        (unsigned char) (_regions[i].fill < 0 ? _fill : _regions[i].fill) } );
+                next = _regions[i].offset + _regions[i].size;
+            }
+
+            if (_size > next)
+            {
+                tasks.push_back( { 0, next, _size - next, 0, _fill } );
+            }
+
+            std::mutex mtx;
+            bool ok = true;
+
+            auto fail = [&]( const std::string & err )
+            {
+                std::lock_guard< std::mutex > lock( mtx );
+
+                if (ok) msg = err;
+                ok = false;
+            };
+
+            // filler left to the file system or to the manifest
+            auto skipped = [mode]( unsigned char fill ) 
+            {
+                return (fill == 0x00 && mode != DENSE) || (fill == 0xff && mode == EXTENTS);
+            };
+
+            util::run_workers< size_t >( n_workers,
+                    [&]( util::work_queue_t< size_t > & queue )
+                    {
+                        for (size_t i = 0; i < tasks.size(); ++i) queue.push( i );
+                    },
+                    [&]( size_t i )
+                    {
+                        task_t & t = tasks[i];
+                        const flash_region_t * r = t.region;
+                        unsigned long long len = 0;
+
+                        util::tracer_t::instance().name_thread( "layout worker" );
+                        util::trace_span_t span( r ? "write_region" : "fill_gap" );
+                        span.arg( "region", r ? r->name : "" );
+                        span.arg( "offset", t.offset );
+                        span.arg( "bytes", t.size );
+
+                        if (! r)
+                        {
+                            if (! skipped( t.fill ) && ! util::fill_range( fd, t.offset, t.size, t.fill ))
+                                fail( "\"" + dstname + "\": " + strerror( errno ) );
+                            return;
+                        }
+
+                        if (r->boot)
+                        {
+                            std::string err;
+
+                            if (! boot_writer( *r, fd, dstname, len, err ))
+                            {
+                                fail( r->name + ": " + (err.empty() ? strerror( errno ) : err) );
+                                return;
+                            }
+
+                            if (len > r->size)
+                            {
+                                fail( r->name + ": \"" + r->source + "\" overflows the region by " +
+                                        std::to_string( len - r->size ) + " bytes" );
+                                return;
+                            }
+                        }
+                        else if (! r->source.empty())
+                        {
+                            const int src = open( r->source.c_str(), O_RDONLY );
+                            const long long n = src < 0 ? -1 :
+                                util::copy_range( src, 0, fd, off_t( r->offset ), r->src_len );
+
+                            if (n < 0)
+                            {
+                                fail( r->name + ": \"" + r->source + "\": " + strerror( errno ) );
+                            }
+
+                            if (src >= 0) close( src );
+                            if (n < 0) return;
+
+                            len = n;
+                        }
+
+                        t.len = len;
+
+                        if (len < r->size && ! skipped( t.fill ) &&
+                                ! util::fill_range( fd, r->offset + len, r->size - len, t.fill ))
+                        {
+                            fail( "\"" + dstname + "\": " + strerror( errno ) );
+                        }
+                    });
+
+            if (close( fd ) != 0 && ok)
+            {
+                msg = "\"" + dstname + "\": " + strerror( errno );
+                ok = false;
+            }
+
+            // extents of the image, adjacent ones of the same kind merged
+            std::vector< extent_t > extents;
+            written = 0;
+
+            for (size_t i = 0; i < tasks.size(); ++i)
+            {
+                const task_t & t = tasks[i];
+
+                add_extent( extents, t.offset, t.len, DATA );
+                add_extent( extents, t.offset + t.len, t.size - t.len, 
+                        t.fill == 0x00 ? ZERO : t.fill == 0xff ? ERASED : DATA );
+
+                written += t.len + (skipped( t.fill ) ? 0 : t.size - t.len);
+            }
+
+            if (ok && mode == EXTENTS && ! save_extents( dstname + ".extents", extents ))
+            {
+                msg = "\"" + dstname + ".extents\": " + strerror( errno );
+                ok = false;
+            }
+
+            return ok;
+        }
+};
+
+#endif // WIN32
+
+#endif
@@ -0,0 +1,809 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___PAYLOAD_H__
+#define ___PAYLOAD_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+
+
+/*
+   Converts a boot code file into the raw user's code layout (the same
+   output "objcopy -O binary" would produce: the loadable bytes from the
+   lowest to the highest load address, gaps filled with zero) while
+   copying it to the destination, so no intermediate binary is needed.
+
+   Supported input formats: raw binary, ELF (32/64 bit, either endianness,
+   PT_LOAD segments), Motorola S-record and Intel HEX.
+ */
+class payload_reader_t
+{
+    public:
+        enum format_t
+        {
+            AUTO,
+            RAW,
+            ELF,
+            SREC,
+            IHEX
+        };
+
+        enum
+        {
+            MAX_LEN = 0x80000000U // 2 Gbytes, largest user's code length
+        };
+
+    private:
+        struct segment_t
+        {
+            unsigned long long offset;
+            unsigned long long addr;
+            unsigned long long size;
+
+            bool operator < ( const segment_t& s ) const throw()
+            {
+                return addr < s.addr;
+            }
+        };
+
+        FILE * _src;
+        format_t _format;
+
+        // bytes consumed while detecting the format: the longest S-record or
+        // Intel HEX record fits
+        unsigned char _head[ 1024 ];
+        size_t _head_len;
+
+        bool _has_load_addr;
+        unsigned int _load_addr;
+        bool _has_entry;
+        unsigned int _entry;
+
+        std::vector< segment_t > _segments;
+
+
+        //--------------------------------------------------------------------------
+
+
+        static bool is_hex( int c ) throw()
+        {
+            return (c >= '0' && c <= '9') || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
+        }
+
+
+        static int hex_val( int c ) throw()
+        {
+            return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        }
+
+
+        // Sum of the bytes written as hex digits in [from, to), -1 if they are
+        // not an even number of hex digits
+        static int hex_sum( const unsigned char * p, size_t from, size_t to ) throw()
+        {
+            int sum = 0;
+
+            if ((to - from) % 2)
+            {
+                return -1;
+            }
+
+            for (size_t i = from; i < to; i += 2)
+            {
+                if (! is_hex( p[i] ) || ! is_hex( p[i + 1] ))
+                {
+                    return -1;
+                }
+
+                sum += hex_val( p[i] ) * 16 + hex_val( p[i + 1] );
+            }
+
+            return sum;
+        }
+
+
+        /*
+           A text format is chosen only when the first line is a whole record
+           with a valid checksum, ELF only for a valid e_ident: anything else,
+           e.g. a raw binary starting with "S1" or ':', is RAW
+         */
+        static format_t detect( const unsigned char * p, size_t len ) throw()
+        {
+            if (len >= 16 && p[0] == 0x7f && p[1] == 'E' && p[2] == 'L' && p[3] == 'F')
+            {
+                // class, data encoding, EV_CURRENT
+                return (p[4] == 1 || p[4] == 2) && (p[5] == 1 || p[5] == 2) && p[6] == 1 ?
+                    ELF : RAW;
+            }
+
+            size_t eol = 0;
+
+            while (eol < len && p[eol] != '\n' && p[eol] != '\r') ++eol;
+
+            // S<type><count><address><data><checksum>: count covers all but
+            // itself, the ones' complement of the sum of the bytes is 0xFF
+            if (eol >= 10 && p[0] == 'S' && p[1] >= '0' && p[1] <= '9' &&
+                    is_hex( p[2] ) && is_hex( p[3] ))
+            {
+                const size_t count = hex_val( p[2] ) * 16 + hex_val( p[3] );
+                const int sum = count * 2 + 4 == eol ? hex_sum( p, 2, eol ) : -1;
+
+                return sum >= 0 && (sum & 0xff) == 0xff ? SREC : RAW;
+            }
+
+            // :<count><address><type><data><checksum>: the bytes sum to 0
+            if (eol >= 11 && p[0] == ':' && is_hex( p[1] ) && is_hex( p[2] ))
+            {
+                const size_t count = hex_val( p[1] ) * 16 + hex_val( p[2] );
+                const int sum = count * 2 + 11 == eol ? hex_sum( p, 1, eol ) : -1;
+
+                return sum >= 0 && (sum & 0xff) == 0 ? IHEX : RAW;
+            }
+
+            return RAW;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        static unsigned long long get_uint( const unsigned char * p, int n, bool be ) throw()
+        {
+            unsigned long long v = 0;
+
+            for (int i = 0; i < n; ++i)
+            {
+                v = (v << 8) | p[ be ? i : n - 1 - i ];
+            }
+
+            return v;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool read_at( unsigned long long ofs, unsigned char * buf, size_t len ) throw()
+        {
+            return fseek( _src, long(ofs), SEEK_SET ) == 0 &&
+                fread( buf, 1, len, _src ) == len;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool open_elf( std::string& msg )
+        {
+            unsigned char eh[ 64 ];
+
+            if (! read_at( 0, eh, sizeof(eh) ))
+            {
+                msg = "ELF input must be a seekable file";
+                return false;
+            }
+
+            const bool is64 = eh[4] == 2;
+            const bool be = eh[5] == 2;
+
+            const unsigned long long entry = is64 ? get_uint( eh + 24, 8, be ) : get_uint( eh + 24, 4, be );
+            const unsigned long long phoff = is64 ? get_uint( eh + 32, 8, be ) : get_uint( eh + 28, 4, be );
+            const unsigned int phentsize = unsigned( get_uint( eh + (is64 ? 54 : 42), 2, be ) );
+            const unsigned int phnum = unsigned( get_uint( eh + (is64 ? 56 : 44), 2, be ) );
+
+            if (phnum == 0 || phentsize < (is64 ? 56U : 32U))
+            {
+                msg = "ELF file without program headers";
+                return false;
+            }
+
+            std::vector< unsigned char > ph( phentsize );
+
+            for (unsigned int i = 0; i < phnum; ++i)
+            {
+                if (! read_at( phoff + (unsigned long long) i * phentsize, &ph[0], ph.size() ))
+                {
+                    msg = "truncated ELF program header table";
+                    return false;
+                }
+
+                const unsigned int PT_LOAD = 1;
+
+                if (get_uint( &ph[0], 4, be ) != PT_LOAD)
+                {
+                    continue;
+                }
+
+                segment_t seg;
+
+                seg.offset = is64 ? get_uint( &ph[8], 8, be )  : get_uint( &ph[4], 4, be );
+                seg.addr   = is64 ? get_uint( &ph[24], 8, be ) : get_uint( &ph[12], 4, be );
+                seg.size   = is64 ? get_uint( &ph[32], 8, be ) : get_uint( &ph[16], 4, be );
+
+                if (seg.size > 0)
+                {
+                    _segments.push_back( seg );
+                }
+            }
+
+            if (_segments.empty())
+            {
+                msg = "ELF file without loadable segments";
+                return false;
+            }
+
+            std::sort( _segments.begin(), _segments.end() );
+
+            for (size_t i = 1; i < _segments.size(); ++i)
+            {
+                if (_segments[i].addr < _segments[i-1].addr + _segments[i-1].size)
+                {
+                    msg = "overlapping ELF segments";
+                    return false;
+                }
+            }
+
+            const segment_t & last = _segments.back();
+
+            if (last.addr + last.size - _segments[0].addr > MAX_LEN ||
+                    last.addr + last.size > 0x100000000ULL ||
+                    entry > 0xffffffffULL)
+            {
+                msg = "ELF load addresses exceed the 32-bit address space";
+                return false;
+            }
+
+            _has_load_addr = true;
+            _load_addr = unsigned( _segments[0].addr );
+            _has_entry = true;
+            _entry = unsigned( entry );
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        static bool write_fill( FILE * dst, unsigned long long len, int c )
+        {
+            unsigned char buf[ 4096 ];
+            memset( buf, c, sizeof(buf) );
+
+            while (len > 0)
+            {
+                const size_t n = len < sizeof(buf) ? size_t(len) : sizeof(buf);
+
+                if (fwrite( buf, 1, n, dst ) != n)
+                {
+                    return false;
+                }
+
+                len -= n;
+            }
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool copy_elf( FILE * dst, unsigned long long & len, std::string& msg )
+        {
+            std::vector< unsigned char > buf( 64*1024 );
+            const unsigned long long base = _segments[0].addr;
+
+            len = 0;
+
+            for (size_t i = 0; i < _segments.size(); ++i)
+            {
+                const segment_t & seg = _segments[i];
+
+                if (! write_fill( dst, seg.addr - base - len, 0 ) ||
+                        fseek( _src, long(seg.offset), SEEK_SET ) != 0)
+                {
+                    return false;
+                }
+
+                len = seg.addr - base;
+
+                for (unsigned long long left = seg.size; left > 0; )
+                {
+                    const size_t n = left < buf.size() ? size_t(left) : buf.size();
+
+                    if (fread( &buf[0], 1, n, _src ) != n)
+                    {
+                        msg = "truncated ELF segment";
+                        return false;
+                    }
+
+                    if (fwrite( &buf[0], 1, n, dst ) != n)
+                    {
+                        return false;
+                    }
+
+                    left -= n;
+                    len += n;
+                }
+            }
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Read a text line, starting from the bytes consumed by detect()
+        bool get_line( std::string & line )
+        {
+            line.clear();
+
+            int c = 0;
+
+            while (true)
+            {
+                if (_head_len > 0)
+                {
+                    c = _head[0];
+                    memmove( _head, _head + 1, --_head_len );
+                }
+                else if ((c = fgetc( _src )) == EOF)
+                {
+                    return ! line.empty();
+                }
+
+                if (c == '\n')
+                {
+                    return true;
+                }
+
+                if (c != '\r')
+                {
+                    line += char(c);
+                }
+            }
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        /*
+           Write a data record at address <addr>. Records are expected in
+           ascending order (as produced by objcopy); a record going backwards
+           is written in place, provided the destination is seekable.
+         */
+        bool put_record( FILE * dst, long start, unsigned long long & len,
+                unsigned long long addr, const unsigned char * data, size_t n,
+                std::string & msg )
+        {
+            if (! _has_load_addr)
+            {
+                _has_load_addr = true;
+                _load_addr = unsigned( addr );
+            }
+
+            if (addr < _load_addr)
+            {
+                msg = "record below the first load address";
+                return false;
+            }
+
+            const unsigned long long ofs = addr - _load_addr;
+
+            if (ofs + n > MAX_LEN)
+            {
+                msg = "address range exceeds 2 Gbytes";
+                return false;
+            }
+
+            if (ofs >= len)
+            {
+                if (! write_fill( dst, ofs - len, 0 ) || fwrite( data, 1, n, dst ) != n)
+                {
+                    return false;
+                }
+
+                len = ofs + n;
+                return true;
+            }
+
+            // out of order record
+            if (start < 0 || fseek( dst, start + long(ofs), SEEK_SET ) != 0)
+            {
+                msg = "out of order records need a seekable output";
+                return false;
+            }
+
+            if (ofs + n > len)
+            {
+                len = ofs + n;
+            }
+
+            return fwrite( data, 1, n, dst ) == n &&
+                fseek( dst, start + long(len), SEEK_SET ) == 0;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool decode_hex( const std::string & line, size_t from,
+                std::vector< unsigned char > & bytes ) const
+        {
+            bytes.clear();
+
+            if ((line.size() - from) % 2)
+            {
+                return false;
+            }
+
+            for (size_t i = from; i < line.size(); i += 2)
+            {
+                if (! is_hex( line[i] ) || ! is_hex( line[i+1] ))
+                {
+                    return false;
+                }
+
+                bytes.push_back( (unsigned char) (hex_val( line[i] ) << 4 | hex_val( line[i+1] )) );
+            }
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        static void line_msg( std::string & msg, int line_num, const char * what )
+        {
+            msg = "line " + std::to_string( line_num ) + ": " + what;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool copy_srec( FILE * dst, unsigned long long & len, std::string & msg )
+        {
+            const long start = ftell( dst );
+            std::string line;
+            std::vector< unsigned char > b;
+            int line_num = 0;
+
+            len = 0;
+
+            while (get_line( line ))
+            {
+                ++line_num;
+
+                if (line.empty())
+                {
+                    continue;
+                }
+
+                if (line.size() < 4 || line[0] != 'S' || ! decode_hex( line, 2, b ) ||
+                        b.empty() || size_t(b[0]) + 1 != b.size())
+                {
+                    line_msg( msg, line_num, "invalid S-record" );
+                    return false;
+                }
+
+                unsigned int sum = 0;
+
+                for (size_t i = 0; i < b.size(); ++i)
+                {
+                    sum += b[i];
+                }
+
+                if ((sum & 0xff) != 0xff)
+                {
+                    line_msg( msg, line_num, "S-record checksum error" );
+                    return false;
+                }
+
+                const char type = line[1];
+                const int alen =
+                    (type == '1' || type == '9') ? 2 :
+                    (type == '2' || type == '8') ? 3 :
+                    (type == '3' || type == '7') ? 4 : 0;
+
+                if (alen == 0)
+                {
+                    continue; // S0 header, S5/S6 record count
+                }
+
+                if (int(b.size()) < alen + 2)
+                {
+                    line_msg( msg, line_num, "invalid S-record" );
+                    return false;
+                }
+
+                const unsigned long long addr = get_uint( &b[1], alen, true );
+
+                if (type >= '7')
+                {
+                    _has_entry = true;
+                    _entry = unsigned( addr );
+                    continue;
+                }
+
+                if (! put_record( dst, start, len, addr, &b[1 + alen], b.size() - alen - 2, msg ))
+                {
+                    if (! msg.empty()) line_msg( msg, line_num, msg.c_str() );
+                    return false;
+                }
+            }
+
+            return ferror( _src ) == 0;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool copy_ihex( FILE * dst, unsigned long long & len, std::string & msg )
+        {
+            const long start = ftell( dst );
+            std::string line;
+            std::vector< unsigned char > b;
+            unsigned long long base = 0;
+            int line_num = 0;
+
+            len = 0;
+
+            while (get_line( line ))
+            {
+                ++line_num;
+
+                if (line.empty())
+                {
+                    continue;
+                }
+
+                if (line[0] != ':' || ! decode_hex( line, 1, b ) ||
+                        b.size() < 5 || size_t(b[0]) + 5 != b.size())
+                {
+                    line_msg( msg, line_num, "invalid Intel HEX record" );
+                    return false;
+                }
+
+                unsigned int sum = 0;
+
+                for (size_t i = 0; i < b.size(); ++i)
+                {
+                    sum += b[i];
+                }
+
+                if ((sum & 0xff) != 0)
+                {
+                    line_msg( msg, line_num, "Intel HEX checksum error" );
+                    return false;
+                }
+
+                const unsigned int n = b[0];
+                const unsigned int ofs = unsigned( get_uint( &b[1], 2, true ) );
+                const unsigned char * data = &b[4];
+
+                switch (b[3])
+                {
+                    case 0x00: // data
+                        if (! put_record( dst, start, len, base + ofs, data, n, msg ))
+                        {
+                            if (! msg.empty()) line_msg( msg, line_num, msg.c_str() );
+                            return false;
+                        }
+                        break;
+
+                    case 0x01: // end of file
+                        return true;
+
+                    case 0x02: // extended segment address
+                        base = get_uint( data, 2, true ) << 4;
+                        break;
+
+                    case 0x03: // start segment address (CS:IP)
+                        _has_entry = true;
+                        _entry = unsigned( (get_uint( data, 2, true ) << 4) +
+                                get_uint( data + 2, 2, true ) );
+                        break;
+
+                    case 0x04: // extended linear address
+                        base = get_uint( data, 2, true ) << 16;
+                        break;
+
+                    case 0x05: // start linear address
+                        _has_entry = true;
+                        _entry = unsigned( get_uint( data, 4, true ) );
+                        break;
+
+                    default:
+                        line_msg( msg, line_num, "unknown Intel HEX record type" );
+                        return false;
+                }
+            }
+
+            return ferror( _src ) == 0;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+    public:
+        payload_reader_t( FILE * src, format_t format = AUTO ) throw() :
+            _src(src), _format(format), _head_len(0),
+            _has_load_addr(false), _load_addr(0), _has_entry(false), _entry(0) {}
+
+
+        static bool parse_format( const std::string & name, format_t & format ) throw()
+        {
+            if (name == "auto") format = AUTO;
+            else if (name == "raw") format = RAW;
+            else if (name == "elf") format = ELF;
+            else if (name == "srec") format = SREC;
+            else if (name == "ihex") format = IHEX;
+            else return false;
+
+            return true;
+        }
+
+
+        static const char * format_name( format_t format ) throw()
+        {
+            static const char * const names[] = { "auto", "raw", "elf", "srec", "ihex" };
+            return names[ format ];
+        }
+
+
+        // Detect the format of a file without consuming it
+        static format_t detect_file( const std::string & filename ) throw()
+        {
+            unsigned char buf[ sizeof(_head) ];
+            FILE * f = filename == "-" ? 0 : fopen( filename.c_str(), "rb" );
+
+            if (! f)
+            {
+                return RAW;
+            }
+
+            const size_t rb = fread( buf, 1, sizeof(buf), f );
+            fclose( f );
+
+            return detect( buf, rb );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Detect the format and, for ELF, read the program headers
+        bool open( std::string & msg )
+        {
+            _head_len = fread( _head, 1, sizeof(_head), _src );
+
+            if (_format == AUTO)
+            {
+                _format = detect( _head, _head_len );
+            }
+
+            if (_format == ELF)
+            {
+                return open_elf( msg );
+            }
+
+            return true;
+        }
+
+
+        format_t format() const throw() { return _format; }
+
+        // load address and entry point of ELF files are known after open(),
+        // those of S-record and HEX files after copy()
+        bool has_load_addr() const throw() { return _has_load_addr; }
+        unsigned int load_addr() const throw() { return _load_addr; }
+        bool has_entry() const throw() { return _has_entry; }
+        unsigned int entry() const throw() { return _entry; }
+
+
+        // Length of the raw user's code, if known before copy(): ELF files
+        // and raw regular files (from the current position on)
+        bool known_len( unsigned long long & len ) const throw()
+        {
+            if (_format == ELF && ! _segments.empty())
+            {
+                len = _segments.back().addr + _segments.back().size - _segments[0].addr;
+                return true;
+            }
+
+            struct stat st;
+            const long pos = _format == RAW ? ftell( _src ) : -1;
+
+            if (pos < 0 || fstat( fileno( _src ), &st ) != 0 || 
+                    ! S_ISREG( st.st_mode ) || st.st_size < pos)
+            {
+                return false;
+            }
+
+            len = (unsigned long long) (st.st_size - pos) + _head_len;
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Write the raw user's code to dst, len receives its length
+        bool copy( FILE * dst, unsigned long long & len, std::string & msg )
+        {
+            switch (_format)
+            {
+                case ELF:
+                    return copy_elf( dst, len, msg );
+
+                case SREC:
+                    return copy_srec( dst, len, msg );
+
+                case IHEX:
+                    return copy_ihex( dst, len, msg );
+
+                default:
+                    break;
+            }
+
+            // raw: the bytes consumed by detection come first
+            std::vector< char > buf( 64*1024 );
+
+            if (_head_len && fwrite( _head, 1, _head_len, dst ) != _head_len)
+            {
+                return false;
+            }
+
+            len = _head_len;
+            _head_len = 0;
+
+            while (true)
+            {
+                const size_t rb = fread( &buf[0], 1, buf.size(), _src );
+
+                if (rb > 0 && fwrite( &buf[0], 1, rb, dst ) != rb)
+                {
+                    return false;
+                }
+
+                len += rb;
+
+                if (rb < buf.size())
+                {
+                    return ferror( _src ) == 0;
+                }
+            }
+        }
+};
+
+#endif
@@ -0,0 +1,593 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___PREAMBLE_H__
+#define ___PREAMBLE_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <type_traits>
+
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
+
+
+namespace util
+{
+
+    inline unsigned int bswap32( unsigned int v ) throw()
+    {
+#if defined(_MSC_VER)
+        return _byteswap_ulong( v );
+#elif defined(__GNUC__)
+        return __builtin_bswap32( v );
+#else
+        return (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+#endif
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    inline unsigned int load_be32( const unsigned char * p ) throw()
+    {
+        unsigned int v;
+        memcpy( &v, p, sizeof(v) );
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        return v;
+#else
+        return bswap32( v );
+#endif
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    inline void store_be32( unsigned char * p, unsigned int v ) throw()
+    {
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_BIG_ENDIAN__
+        v = bswap32( v );
+#endif
+        memcpy( p, &v, sizeof(v) );
+    }
+
+}
+
+
+//------------------------------------------------------------------------------
+
+
+/*
+   SPI Bootable image format
+
+   0x00-0x3F Reserved.
+
+   0x40-0x43 BOOT signature. This location should contain the value 0x424F0_4F54,
+   which is the ASCII code for
+   BOOT. The eSPI loader code will search for this signature,
+   initially in 24-bit addressable mode.
+   If the value in this location doesn't match the BOOT
+   signature, then the EEPROM is accessed again, but in 16-bit mode.
+   If the value in this location still does not match the BOOT signature,
+   it means that the eSPI device doesn't contain a valid user code.
+   In such case the eSPI loader code will disable the eSPI and will issue
+   a hardware reset request of the SoC by setting RSTCR[HRESET_REQ].
+
+   0x44-0x47 Reserved
+
+   0x48-0x4B User's code length.
+   Number of bytes in the user's code to be copied.
+   Must be a multiple of 4.
+   4 = User's code length = 2 Gbytes.
+
+   0x4C-0x4F Reserved
+
+   0x50-0x53 Source Address. Contains the starting address of the user's code
+   as an offset from the EEPROM starting address. In 24-bit addressing mode,
+   the 8 most significant bits of this should be written to as zero, because
+   the EEPROM is accessed with a 3-byte (24-bit) address.
+   In 16-bit addressing mode, the 16 most significant bits of this should
+   be written to as zero.
+
+   0x54-0x57 Reserved
+
+   0x58-0x5B Target Address. Contains the target address in the system's local
+   memory address space in which the user's code will be copied to.
+   This is a 32-bit effective address. The core is configured in such a way
+   that the 36-bit real address is equal to this (with 4 most significant bits
+   zero).
+
+   0x5C-0x5F Reserved
+
+   0x60-0x63 Execution Starting Address. Contains the jump address in the
+   system's local memory address space into the user's code first instruction
+   to be executed.
+   This is a 32-bit effective address. The core is configured in such a way
+   that the 36-bit real address is equal to this (with 4 most significant bits
+   zero).
+
+   0x64-0x67 Reserved
+
+   0x68-0x6B N. Number of Config Address/Data pairs.
+
+   0x6C-0x7F Reserved.
+   0x80-0x83 Config Address 1
+   0x84-0x87 Config Data 1
+   0x88-0x8B Config Address 2
+   0x8C-0x8F Config Data 2
+   ...
+   0x80 + 8x(N-1) Config Address N
+   0x80 + 8x(N-1) + 4 Config Data N (Final Config Data N optional)
+   ...
+   User's Code
+ */
+struct preamble_layout_t
+{
+    enum
+    {
+        SIZE               = 1024,
+        FIELD_SIZE         = 4,
+
+        OFS_BOOT_SIGN      = 0x40,
+        OFS_USER_CODE_LEN  = 0x48,
+        OFS_SRC_ADDR       = 0x50,
+        OFS_TARGET_ADDR    = 0x58,
+        OFS_EXEST_ADDR     = 0x60,
+        OFS_CFG_PAIRS_NUM  = 0x68,
+        OFS_FIRST_CFG_ADDR = 0x80,
+        OFS_FIRST_CFG_DATA = 0x84,
+
+        CFG_PAIR_SIZE      = 8,
+        MAX_CFG_PAIRS      = (SIZE - OFS_FIRST_CFG_ADDR) / CFG_PAIR_SIZE,
+
+        BOOT_SIGNATURE     = 0x424F4F54 // "BOOT"
+    };
+
+
+    struct range_t
+    {
+        unsigned int begin;
+        unsigned int end; // one past the last byte
+    };
+
+
+    static constexpr range_t reserved( int i )
+    {
+        return i == 0 ? range_t{ 0x00, 0x40 } :
+               i == 1 ? range_t{ 0x44, 0x48 } :
+               i == 2 ? range_t{ 0x4C, 0x50 } :
+               i == 3 ? range_t{ 0x54, 0x58 } :
+               i == 4 ? range_t{ 0x5C, 0x60 } :
+               i == 5 ? range_t{ 0x64, 0x68 } :
+                        range_t{ 0x6C, 0x80 };
+    }
+
+    enum { RESERVED_RANGES = 7 };
+
+
+    static constexpr bool overlaps_reserved( unsigned int ofs, int i = 0 )
+    {
+        return i < RESERVED_RANGES &&
+            ((ofs + FIELD_SIZE > reserved(i).begin && ofs < reserved(i).end) ||
+             overlaps_reserved( ofs, i + 1 ));
+    }
+
+
+    static constexpr bool is_field( unsigned int ofs )
+    {
+        return ofs % FIELD_SIZE == 0 &&
+            ofs + FIELD_SIZE <= OFS_FIRST_CFG_ADDR &&
+            ! overlaps_reserved( ofs );
+    }
+
+
+    static constexpr unsigned int cfg_addr_ofs( unsigned int idx )
+    {
+        return OFS_FIRST_CFG_ADDR + idx * CFG_PAIR_SIZE;
+    }
+
+
+    static constexpr unsigned int cfg_data_ofs( unsigned int idx )
+    {
+        return OFS_FIRST_CFG_DATA + idx * CFG_PAIR_SIZE;
+    }
+};
+
+
+static_assert( preamble_layout_t::is_field( preamble_layout_t::OFS_BOOT_SIGN ),
+        "BOOT signature overlaps a reserved range" );
+static_assert( preamble_layout_t::is_field( preamble_layout_t::OFS_USER_CODE_LEN ),
+        "user's code length overlaps a reserved range" );
+static_assert( preamble_layout_t::is_field( preamble_layout_t::OFS_SRC_ADDR ),
+        "source address overlaps a reserved range" );
+static_assert( preamble_layout_t::is_field( preamble_layout_t::OFS_TARGET_ADDR ),
+        "target address overlaps a reserved range" );
+static_assert( preamble_layout_t::is_field( preamble_layout_t::OFS_EXEST_ADDR ),
+        "exe start address overlaps a reserved range" );
+static_assert( preamble_layout_t::is_field( preamble_layout_t::OFS_CFG_PAIRS_NUM ),
+        "number of pairs overlaps a reserved range" );
+static_assert( preamble_layout_t::reserved( preamble_layout_t::RESERVED_RANGES - 1 ).end ==
+        preamble_layout_t::OFS_FIRST_CFG_ADDR,
+        "config pairs must follow the last reserved range" );
+static_assert( preamble_layout_t::OFS_FIRST_CFG_DATA ==
+        preamble_layout_t::OFS_FIRST_CFG_ADDR + preamble_layout_t::FIELD_SIZE,
+        "config data must follow config address" );
+static_assert( preamble_layout_t::cfg_data_ofs( preamble_layout_t::MAX_CFG_PAIRS - 1 ) +
+        preamble_layout_t::FIELD_SIZE <= preamble_layout_t::SIZE,
+        "config pairs exceed the preamble" );
+
+
+//------------------------------------------------------------------------------
+
+
+struct cfg_pair_t
+{
+    unsigned int addr;
+    unsigned int data;
+};
+
+
+//------------------------------------------------------------------------------
+
+
+// Iterable range over the Config Address/Data pairs of a preamble
+class cfg_pair_range_t
+{
+    private:
+        const unsigned char * _first;
+        unsigned int _count;
+
+    public:
+        class const_iterator
+        {
+            private:
+                const unsigned char * _p;
+
+            public:
+                explicit const_iterator( const unsigned char * p ) throw() : _p(p) {}
+
+                cfg_pair_t operator * () const throw()
+                {
+                    cfg_pair_t pair = {
+                        util::load_be32( _p ),
+                        util::load_be32( _p + preamble_layout_t::FIELD_SIZE )
+                    };
+
+                    return pair;
+                }
+
+                const_iterator & operator ++ () throw()
+                {
+                    _p += preamble_layout_t::CFG_PAIR_SIZE;
+                    return *this;
+                }
+
+                bool operator == ( const const_iterator& i ) const throw()
+                {
+                    return _p == i._p;
+                }
+
+                bool operator != ( const const_iterator& i ) const throw()
+                {
+                    return _p != i._p;
+                }
+        };
+
+
+        cfg_pair_range_t( const unsigned char * first, unsigned int count ) throw() :
+            _first(first), _count(count) {}
+
+
+        const_iterator begin() const throw()
+        {
+            return const_iterator( _first );
+        }
+
+
+        const_iterator end() const throw()
+        {
+            return const_iterator( _first + _count * preamble_layout_t::CFG_PAIR_SIZE );
+        }
+
+
+        unsigned int size() const throw() { return _count; }
+
+
+        cfg_pair_t operator [] ( unsigned int idx ) const throw()
+        {
+            return * const_iterator( _first + idx * preamble_layout_t::CFG_PAIR_SIZE );
+        }
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/*
+   Typed view over a preamble stored in any byte span (a caller buffer,
+   a mapped image, ...). The view does not own nor copy the data;
+   a view over const bytes is read-only.
+ */
+template <class B> class basic_preamble_view_t
+{
+    private:
+        B * _data;
+        size_t _size;
+
+    public:
+        typedef preamble_layout_t layout_t;
+
+
+        basic_preamble_view_t( B * data, size_t size ) throw() :
+            _data(data), _size(size) {}
+
+
+        template <class B2>
+        basic_preamble_view_t( const basic_preamble_view_t<B2>& v ) throw() :
+            _data(v.data()), _size(v.size()) {}
+
+
+        B * data() const throw() { return _data; }
+        size_t size() const throw() { return _size; }
+
+
+        // The span must at least hold the fixed fields
+        bool valid_size() const throw()
+        {
+            return _data && _size >= size_t( layout_t::OFS_FIRST_CFG_ADDR );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        unsigned int get_dword( unsigned int offset ) const throw()
+        {
+            return offset + layout_t::FIELD_SIZE <= _size ?
+                util::load_be32( _data + offset ) : 0;
+        }
+
+
+        bool patch_dword_at( unsigned int offset, unsigned int data ) const throw()
+        {
+            static_assert( ! std::is_const<B>::value, "read-only preamble view" );
+
+            if (offset + layout_t::FIELD_SIZE > _size)
+            {
+                return false;
+            }
+
+            util::store_be32( _data + offset, data );
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool has_boot_sign() const throw()
+        {
+            return get_dword( layout_t::OFS_BOOT_SIGN ) == layout_t::BOOT_SIGNATURE;
+        }
+
+
+        unsigned int get_user_code_len() const throw()
+        {
+            return get_dword( layout_t::OFS_USER_CODE_LEN );
+        }
+
+
+        void set_user_code_len( unsigned int data ) const throw()
+        {
+            patch_dword_at( layout_t::OFS_USER_CODE_LEN, data );
+        }
+
+
+        unsigned int get_src_addr() const throw()
+        {
+            return get_dword( layout_t::OFS_SRC_ADDR );
+        }
+
+
+        void set_src_addr( unsigned int data ) const throw()
+        {
+            patch_dword_at( layout_t::OFS_SRC_ADDR, data );
+        }
+
+
+        unsigned int get_target_addr() const throw()
+        {
+            return get_dword( layout_t::OFS_TARGET_ADDR );
+        }
+
+
+        void set_target_addr( unsigned int data ) const throw()
+        {
+            patch_dword_at( layout_t::OFS_TARGET_ADDR, data );
+        }
+
+
+        unsigned int get_exest_addr() const throw()
+        {
+            return get_dword( layout_t::OFS_EXEST_ADDR );
+        }
+
+
+        void set_exest_addr( unsigned int data ) const throw()
+        {
+            patch_dword_at( layout_t::OFS_EXEST_ADDR, data );
+        }
+
+
+        unsigned int get_n_cfg_pairs() const throw()
+        {
+            return get_dword( layout_t::OFS_CFG_PAIRS_NUM );
+        }
+
+
+        void set_n_cfg_pairs( unsigned int data ) const throw()
+        {
+            patch_dword_at( layout_t::OFS_CFG_PAIRS_NUM, data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Number of pairs actually stored in the span
+        unsigned int get_cfg_pairs_capacity() const throw()
+        {
+            return _size <= size_t( layout_t::OFS_FIRST_CFG_ADDR ) ? 0 :
+                unsigned( (_size - layout_t::OFS_FIRST_CFG_ADDR) / layout_t::CFG_PAIR_SIZE );
+        }
+
+
+        // Pairs declared by N, cut off at the end of the span
+        cfg_pair_range_t cfg_pairs() const throw()
+        {
+            const unsigned int n = get_n_cfg_pairs();
+            const unsigned int cap = get_cfg_pairs_capacity();
+
+            return cfg_pair_range_t(
+                    _data + layout_t::OFS_FIRST_CFG_ADDR, n < cap ? n : cap );
+        }
+
+
+        bool set_cfg_pair( unsigned int idx, unsigned int addr, unsigned int data ) const throw()
+        {
+            return idx < get_cfg_pairs_capacity() &&
+                patch_dword_at( layout_t::cfg_addr_ofs( idx ), addr ) &&
+                patch_dword_at( layout_t::cfg_data_ofs( idx ), data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        enum warning_t
+        {
+            WARN_BAD_SIGN       = 1,  // not a SPI boot image
+            WARN_HUGE_CODE_LEN  = 2,  // user's code length above 1 MB
+            WARN_TOO_MANY_PAIRS = 4,  // N exceeds the pairs the span can hold
+            WARN_SHORT          = 8   // span shorter than the preamble
+        };
+
+
+        // Sanity checks of the fields, as a combination of warning_t
+        unsigned int get_warnings() const throw()
+        {
+            unsigned int w = 0;
+
+            if (! has_boot_sign()) w |= WARN_BAD_SIGN;
+            if (get_user_code_len() > 1024U*1024U) w |= WARN_HUGE_CODE_LEN;
+            if (get_n_cfg_pairs() > get_cfg_pairs_capacity()) w |= WARN_TOO_MANY_PAIRS;
+            if (_size < size_t( layout_t::SIZE )) w |= WARN_SHORT;
+
+            return w;
+        }
+
+
+        static const char * warning_name( warning_t w ) throw()
+        {
+            switch (w)
+            {
+                case WARN_BAD_SIGN:       return "bad_signature";
+                case WARN_HUGE_CODE_LEN:  return "huge_code_len";
+                case WARN_TOO_MANY_PAIRS: return "too_many_pairs";
+                case WARN_SHORT:          return "short";
+            }
+
+            return "";
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        void show( FILE * out = stdout ) const throw()
+        {
+            char boot_sign[ 5 ] = {0};
+            memcpy( boot_sign, _data + layout_t::OFS_BOOT_SIGN, 4 );
+
+            const unsigned int warnings = get_warnings();
+            bool valid_sign = (warnings & WARN_BAD_SIGN) == 0;
+
+            fprintf(out, " 0x40- 0x43 BOOT signature      :  0x%02x%02x%02x%02x == "
+                    "'%s' %s\n",
+                    boot_sign[0], boot_sign[1], boot_sign[2], boot_sign[3], boot_sign,
+                    valid_sign ? "OK" : "NOT OK");
+
+            if (! valid_sign )
+            {
+                fprintf(out, "WARNING: inalid signature '%s' != 'BOOT'..."
+                        "wrong header format ?\n", boot_sign);
+            }
+
+            unsigned int val = get_user_code_len();
+
+            fprintf(out, " 0x48- 0x4B User's code length  :  0x%08x (%u bytes - %u Kb)\n",
+                    val, val, (val >> 10) + ((val & 1023) ? 1 : 0 ));
+
+            if (warnings & WARN_HUGE_CODE_LEN)
+            {
+                fprintf(out, "WARNING: code length seems uge... wrong header format ?\n");
+            }
+
+            fprintf(out, " 0x50- 0x53 Source Address      :  0x%08x\n", get_src_addr());
+            fprintf(out, " 0x58- 0x5B Target Address      :  0x%08x\n", get_target_addr());
+            fprintf(out, " 0x60- 0x63 Exe Start Address   :  0x%08x\n", get_exest_addr());
+
+            val = get_n_cfg_pairs();
+
+            fprintf(out, " 0x68- 0x6B N.of Adr/Data pairs :  0x%08x (%u)\n", val, val);
+
+            if (warnings & WARN_TOO_MANY_PAIRS)
+            {
+                fprintf(out, "WARNING: too many args, cutting off at 1024 bytes\n");
+            }
+
+            const cfg_pair_range_t pairs = cfg_pairs();
+            int i = 0;
+
+            for ( cfg_pair_range_t::const_iterator it = pairs.begin();
+                    it != pairs.end();
+                    ++it, ++i )
+            {
+                const cfg_pair_t pair = *it;
+
+                fprintf(out, "0x%03x-0x%03x addr[%2i]@0x%08x := 0x%08x\n",
+                        layout_t::cfg_addr_ofs( i ), layout_t::cfg_data_ofs( i ) + 3,
+                        i, pair.addr, pair.data);
+            }
+        }
+};
+
+
+typedef basic_preamble_view_t< unsigned char > preamble_view_t;
+typedef basic_preamble_view_t< const unsigned char > preamble_cview_t;
+
+
+#endif
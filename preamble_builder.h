@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___PREAMBLE_BUILDER_H__
+#define ___PREAMBLE_BUILDER_H__
+
+#include "preamble.h"
+
+
+namespace util
+{
+
+    // Compile-time sequence 0, 1, ..., N-1 (C++11 has no std::index_sequence)
+    template <unsigned int... I> struct index_seq_t
+    {
+        typedef index_seq_t type;
+    };
+
+
+    template <class A, class B> struct concat_index_seq_t;
+
+    template <unsigned int... A, unsigned int... B>
+    struct concat_index_seq_t< index_seq_t< A... >, index_seq_t< B... > >
+    {
+        typedef index_seq_t< A..., (sizeof...(A) + B)... > type;
+    };
+
+
+    // Built by halves, so that the instantiation depth is log2(N)
+    template <unsigned int N> struct make_index_seq_t
+    {
+        typedef typename concat_index_seq_t<
+            typename make_index_seq_t< N / 2 >::type,
+            typename make_index_seq_t< N - N / 2 >::type >::type type;
+    };
+
+    template <> struct make_index_seq_t< 0 > { typedef index_seq_t<> type; };
+    template <> struct make_index_seq_t< 1 > { typedef index_seq_t< 0 > type; };
+
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// A whole preamble as a literal value (e.g. a constexpr object in .rodata)
+struct preamble_image_t
+{
+    unsigned char data[ preamble_layout_t::SIZE ];
+};
+
+
+//------------------------------------------------------------------------------
+
+
+/*
+   Compile-time preamble builder: an immutable value whose setters return
+   a modified copy, so that a whole preamble can be described in a constant
+   expression and turned by image() into a preamble_image_t with no code
+   run at all:
+
+     static constexpr cfg_pair_t ddr[] = { { 0xff702110, 0x470c0008 }, ... };
+
+     constexpr preamble_image_t img = preamble_builder_t()
+         .user_code_len< 0x5a000 >()
+         .target_addr( 0x11000000 )
+         .pairs( ddr )
+         .image();
+
+   The pair table is referenced, not copied: it must be a constexpr array
+   with static storage. Without setters the builder yields the default
+   preamble of spidyboot (see boot_spi_data_t::set_default).
+ */
+class preamble_builder_t
+{
+    public:
+        typedef preamble_layout_t layout_t;
+
+        enum
+        {
+            DEFAULT_USER_CODE_LEN = 0x00080000,
+            DEFAULT_SRC_ADDR      = 0x00000400,
+            DEFAULT_TARGET_ADDR   = 0x11000000,
+            DEFAULT_EXEST_ADDR    = 0x1107F000
+        };
+
+    private:
+        unsigned int _user_code_len;
+        unsigned int _src_addr;
+        unsigned int _target_addr;
+        unsigned int _exest_addr;
+        const cfg_pair_t * _pairs;
+        unsigned int _n_pairs;
+
+
+        constexpr preamble_builder_t( unsigned int user_code_len,
+                unsigned int src_addr,
+                unsigned int target_addr,
+                unsigned int exest_addr,
+                const cfg_pair_t * pairs,
+                unsigned int n_pairs ) :
+            _user_code_len(user_code_len), _src_addr(src_addr),
+            _target_addr(target_addr), _exest_addr(exest_addr),
+            _pairs(pairs), _n_pairs(n_pairs) {}
+
+
+        constexpr unsigned int pair_dword( unsigned int rel ) const
+        {
+            return rel % layout_t::CFG_PAIR_SIZE == 0 ?
+                _pairs[ rel / layout_t::CFG_PAIR_SIZE ].addr :
+                _pairs[ rel / layout_t::CFG_PAIR_SIZE ].data;
+        }
+
+
+        template <unsigned int... I>
+        constexpr preamble_image_t image( util::index_seq_t< I... > ) const
+        {
+            return preamble_image_t{ { byte_at( I )... } };
+        }
+
+
+    public:
+        constexpr preamble_builder_t() :
+            _user_code_len( DEFAULT_USER_CODE_LEN ), _src_addr( DEFAULT_SRC_ADDR ),
+            _target_addr( DEFAULT_TARGET_ADDR ), _exest_addr( DEFAULT_EXEST_ADDR ),
+            _pairs(0), _n_pairs(0) {}
+
+
+        //--------------------------------------------------------------------------
+
+
+        constexpr preamble_builder_t user_code_len( unsigned int v ) const
+        {
+            return preamble_builder_t( v, _src_addr, _target_addr, _exest_addr, _pairs, _n_pairs );
+        }
+
+
+        // Same as user_code_len(v), the length being checked at compile time
+        template <unsigned int LEN>
+        constexpr preamble_builder_t user_code_len() const
+        {
+            static_assert( LEN % 4 == 0, "user's code length must be a multiple of 4" );
+            return user_code_len( LEN );
+        }
+
+
+        constexpr preamble_builder_t src_addr( unsigned int v ) const
+        {
+            return preamble_builder_t( _user_code_len, v, _target_addr, _exest_addr, _pairs, _n_pairs );
+        }
+
+
+        constexpr preamble_builder_t target_addr( unsigned int v ) const
+        {
+            return preamble_builder_t( _user_code_len, _src_addr, v, _exest_addr, _pairs, _n_pairs );
+        }
+
+
+        constexpr preamble_builder_t exest_addr( unsigned int v ) const
+        {
+            return preamble_builder_t( _user_code_len, _src_addr, _target_addr, v, _pairs, _n_pairs );
+        }
+
+
+        template <unsigned int N>
+        constexpr preamble_builder_t pairs( const cfg_pair_t (&p)[ N ] ) const
+        {
+            static_assert( N <= layout_t::MAX_CFG_PAIRS, "too many Config Address/Data pairs" );
+            return preamble_builder_t( _user_code_len, _src_addr, _target_addr, _exest_addr, p, N );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        constexpr unsigned int get_user_code_len() const { return _user_code_len; }
+        constexpr unsigned int get_src_addr() const { return _src_addr; }
+        constexpr unsigned int get_target_addr() const { return _target_addr; }
+        constexpr unsigned int get_exest_addr() const { return _exest_addr; }
+        constexpr unsigned int get_n_cfg_pairs() const { return _n_pairs; }
+
+
+        // To be checked by static_assert when the length is not a template
+        // argument
+        constexpr bool valid() const
+        {
+            return _user_code_len % 4 == 0 && _n_pairs <= layout_t::MAX_CFG_PAIRS;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Value of the 32 bit word at ofs (a multiple of 4)
+        constexpr unsigned int dword_at( unsigned int ofs ) const
+        {
+            return
+                ofs == layout_t::OFS_BOOT_SIGN     ? unsigned( layout_t::BOOT_SIGNATURE ) :
+                ofs == layout_t::OFS_USER_CODE_LEN ? _user_code_len :
+                ofs == layout_t::OFS_SRC_ADDR      ? _src_addr :
+                ofs == layout_t::OFS_TARGET_ADDR   ? _target_addr :
+                ofs == layout_t::OFS_EXEST_ADDR    ? _exest_addr :
+                ofs == layout_t::OFS_CFG_PAIRS_NUM ? _n_pairs :
+                ofs >= layout_t::OFS_FIRST_CFG_ADDR &&
+                    ofs < layout_t::cfg_addr_ofs( _n_pairs ) ?
+                        pair_dword( ofs - layout_t::OFS_FIRST_CFG_ADDR ) :
+                0;
+        }
+
+
+        // Byte at ofs, fields being stored big endian
+        constexpr unsigned char byte_at( unsigned int ofs ) const
+        {
+            return (unsigned char)
+                (dword_at( ofs & ~3U ) >> (8 * (3 - (ofs & 3U))));
+        }
+
+
+        constexpr preamble_image_t image() const
+        {
+            return image( util::make_index_seq_t< layout_t::SIZE >::type() );
+        }
+};
+
+
+static_assert( preamble_builder_t().valid(), "invalid default preamble" );
+static_assert( preamble_builder_t().byte_at( preamble_layout_t::OFS_BOOT_SIGN ) == 'B' &&
+        preamble_builder_t().byte_at( preamble_layout_t::OFS_BOOT_SIGN + 3 ) == 'T',
+        "BOOT signature must be stored big endian" );
+
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___SCAN_H__
+#define ___SCAN_H__
+
+#ifndef WIN32
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <mutex>
+#include <atomic>
+
+#include "preamble.h"
+
+
+/*
+   Reads the preamble of SPI images (one pread per file, nothing else
+   of the image is touched) and prints one record per image, either as
+   JSON Lines or CSV. scan_file() can be called from several threads.
+ */
+class image_scanner_t
+{
+    public:
+        enum format_t
+        {
+            JSONL,
+            CSV
+        };
+
+    private:
+        format_t _format;
+        FILE * _out;
+        std::mutex _out_mtx;
+
+        std::atomic< unsigned long > _files;
+        std::atomic< unsigned long > _valid;
+        std::atomic< unsigned long > _errors;
+
+
+        //--------------------------------------------------------------------------
+
+
+        static void append_fmt( std::string & s, const char * fmt, unsigned int v )
+        {
+            char buf[ 32 ];
+            snprintf( buf, sizeof(buf), fmt, v );
+            s += buf;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        static void append_json_str( std::string & s, const std::string & v )
+        {
+            s += '"';
+
+            for (size_t i = 0; i < v.size(); ++i)
+            {
+                const unsigned char c = v[i];
+
+                if (c == '"' || c == '\\')
+                {
+                    s += '\\';
+                    s += c;
+                }
+                else if (c < 0x20)
+                {
+                    append_fmt( s, "\\u%04x", c );
+                }
+                else
+                {
+                    s += c;
+                }
+            }
+
+            s += '"';
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        static void append_csv_str( std::string & s, const std::string & v )
+        {
+            if (v.find_first_of( ",\"\r\n" ) == std::string::npos)
+            {
+                s += v;
+                return;
+            }
+
+            s += '"';
+
+            for (size_t i = 0; i < v.size(); ++i)
+            {
+                if (v[i] == '"') s += '"';
+                s += v[i];
+            }
+
+            s += '"';
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        void format_jsonl( std::string & rec,
+                const std::string & filename,
+                long long size,
+                const preamble_cview_t & v,
+                int err ) const
+        {
+            rec = "{\"file\":";
+            append_json_str( rec, filename );
+
+            if (err)
+            {
+                rec += ",\"error\":";
+                append_json_str( rec, strerror( err ) );
+                rec += "}\n";
+                return;
+            }
+
+            const unsigned int warnings = v.get_warnings();
+
+            rec += ",\"size\":" + std::to_string( size );
+            rec += warnings ? ",\"valid\":false" : ",\"valid\":true";
+            rec += ",\"warnings\":[";
+
+            for (unsigned int w = 1, n = 0; w <= preamble_cview_t::WARN_SHORT; w <<= 1)
+            {
+                if (warnings & w)
+                {
+                    rec += n++ ? ",\"" : "\"";
+                    rec += preamble_cview_t::warning_name( preamble_cview_t::warning_t( w ) );
+                    rec += "\"";
+                }
+            }
+
+            append_fmt( rec, "],\"boot_sign\":\"0x%08x\"",
+                    v.get_dword( preamble_layout_t::OFS_BOOT_SIGN ) );
+            append_fmt( rec, ",\"user_code_len\":%u", v.get_user_code_len() );
+            append_fmt( rec, ",\"src_addr\":\"0x%08x\"", v.get_src_addr() );
+            append_fmt( rec, ",\"target_addr\":\"0x%08x\"", v.get_target_addr() );
+            append_fmt( rec, ",\"exe_addr\":\"0x%08x\"", v.get_exest_addr() );
+            append_fmt( rec, ",\"n_pairs\":%u", v.get_n_cfg_pairs() );
+            rec += ",\"pairs\":[";
+
+            const cfg_pair_range_t pairs = v.cfg_pairs();
+            bool first = true;
+
+            for (cfg_pair_range_t::const_iterator i = pairs.begin(); i != pairs.end(); ++i)
+            {
+                const cfg_pair_t pair = *i;
+
+                rec += first ? "" : ",";
+                append_fmt( rec, "[\"0x%08x\",", pair.addr );
+                append_fmt( rec, "\"0x%08x\"]", pair.data );
+                first = false;
+            }
+
+            rec += "]}\n";
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        void format_csv( std::string & rec,
+                const std::string & filename,
+                long long size,
+                const preamble_cview_t & v,
+                int err ) const
+        {
+            rec.clear();
+            append_csv_str( rec, filename );
+
+            if (err)
+            {
+                rec += ",,,,,,,,,,,";
+                append_csv_str( rec, strerror( err ) );
+                rec += "\n";
+                return;
+            }
+
+            const unsigned int warnings = v.get_warnings();
+
+            rec += "," + std::to_string( size );
+            rec += warnings ? ",0," : ",1,";
+
+            for (unsigned int w = 1, n = 0; w <= preamble_cview_t::WARN_SHORT; w <<= 1)
+            {
+                if (warnings & w)
+                {
+                    rec += n++ ? "|" : "";
+                    rec += preamble_cview_t::warning_name( preamble_cview_t::warning_t( w ) );
+                }
+            }
+
+            append_fmt( rec, ",0x%08x", v.get_dword( preamble_layout_t::OFS_BOOT_SIGN ) );
+            append_fmt( rec, ",%u", v.get_user_code_len() );
+            append_fmt( rec, ",0x%08x", v.get_src_addr() );
+            append_fmt( rec, ",0x%08x", v.get_target_addr() );
+            append_fmt( rec, ",0x%08x", v.get_exest_addr() );
+            append_fmt( rec, ",%u,", v.get_n_cfg_pairs() );
+
+            const cfg_pair_range_t pairs = v.cfg_pairs();
+            bool first = true;
+
+            for (cfg_pair_range_t::const_iterator i = pairs.begin(); i != pairs.end(); ++i)
+            {
+                const cfg_pair_t pair = *i;
+
+                rec += first ? "" : ";";
+                append_fmt( rec, "0x%08x=", pair.addr );
+                append_fmt( rec, "0x%08x", pair.data );
+                first = false;
+            }
+
+            rec += ",\n";
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+    public:
+        image_scanner_t( format_t format, FILE * out ) throw() :
+            _format(format), _out(out), _files(0), _valid(0), _errors(0) {}
+
+
+        void header()
+        {
+            if (_format == CSV)
+            {
+                fprintf(_out, "file,size,valid,warnings,boot_sign,user_code_len,"
+                        "src_addr,target_addr,exe_addr,n_pairs,pairs,error\n");
+            }
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool scan_file( const std::string & filename )
+        {
+            unsigned char data[ preamble_layout_t::SIZE ];
+            ssize_t rb = -1;
+            struct stat st;
+            int err = 0;
+
+            const int fd = open( filename.c_str(), O_RDONLY );
+
+            if (fd < 0 || fstat( fd, &st ) < 0)
+            {
+                err = errno;
+            }
+            else
+            {
+                do
+                {
+                    rb = pread( fd, data, sizeof(data), 0 );
+                }
+                while (rb < 0 && errno == EINTR);
+
+                if (rb < 0)
+                {
+                    err = errno;
+                }
+            }
+
+            if (fd >= 0)
+            {
+                close( fd );
+            }
+
+            const preamble_cview_t v( data, rb > 0 ? size_t(rb) : 0 );
+
+            std::string rec;
+
+            if (_format == CSV)
+            {
+                format_csv( rec, filename, err ? 0 : st.st_size, v, err );
+            }
+            else
+            {
+                format_jsonl( rec, filename, err ? 0 : st.st_size, v, err );
+            }
+
+            ++_files;
+
+            if (err)
+            {
+                ++_errors;
+            }
+            else if (! v.get_warnings())
+            {
+                ++_valid;
+            }
+
+            std::lock_guard< std::mutex > lock( _out_mtx );
+            return fwrite( rec.data(), 1, rec.size(), _out ) == rec.size() && ! err;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        unsigned long files() const throw() { return _files; }
+        unsigned long valid() const throw() { return _valid; }
+        unsigned long errors() const throw() { return _errors; }
+};
+
+#endif // WIN32
+
+#endif
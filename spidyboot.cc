@@ -31,6 +31,8 @@
 #ifdef WIN32
 #include "targetver.h"
 #include <tchar.h>
+#include <io.h>
+#include <fcntl.h>
 #endif
 
 #include <stdlib.h>
@@ -39,6 +41,36 @@
 #include <string>
 
 #include "tokenizer.h"
+#include "directio.h"
+#include "uring.h"
+#include "preamble.h"
+#include "preamble_builder.h"
+#include "workqueue.h"
+#include "fswalk.h"
+#include "scan.h"
+#include "payload.h"
+#include "hexout.h"
+#include "boards.h"
+#include "ddrtiming.h"
+#include "trace.h"
+#include "arena.h"
+#include "layout.h"
+#include "verify.h"
+#include "txn.h"
+#include "bundle.h"
+#include "gzstream.h"
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#include <sys/mman.h>
+#endif
 
 
 //------------------------------------------------------------------------------
@@ -56,7 +88,19 @@ class mc_config_t
         typedef unsigned int addr_t;
         typedef unsigned int value_t;
 
-        typedef std::list< std::pair< addr_t, value_t> > assignlist_t;
+        // parse state and pair lists are allocated from the current arena
+        // (see build_preamble)
+        typedef std::pair< addr_t, value_t > assign_t;
+        typedef std::list< assign_t, util::arena_allocator_t< assign_t > > assignlist_t;
+
+        // pseudo address of the pairs written by "sleep" 
+        enum { SLEEP_ADDR = 0x40000001 }; // TODO verify...
+
+        static addr_t rebase_addr( addr_t base, addr_t newbase, addr_t addr )
+        {
+            return (addr & base) == base ? (addr ^ base) | newbase : addr;
+        }
+
 
         static void rebase_immr( addr_t base, addr_t newbase, assignlist_t & lst )
         {
@@ -64,16 +108,77 @@ class mc_config_t
                     i != lst.end();
                     ++i )
             {
-                if ((i->first & base) == base) 
-                {
-                    i->first ^= base;
-                    i->first |= newbase;
-                }
+                i->first = rebase_addr( base, newbase, i->first );
             }
         }
 
+        // fragments parsed, taken from and dropped from the cache (see --stats)
+        struct parse_stats_t
+        {
+            unsigned long parsed;
+            unsigned long reused;
+            unsigned long evicted;
+        };
+
     private:
-        typedef util::tokenizer_t< std::string > tokenizer_t;
+        typedef util::arena_string_t string_t;
+        typedef util::tokenizer_t< string_t > tokenizer_t;
+
+        // A parsed .cfg/.dat file: its pairs, overrides and includes, in the
+        // order they are written. The includes are kept unexpanded, so that
+        // a fragment does not depend on the files it includes
+        struct op_t
+        {
+            enum kind_t { PAIR, OVERRIDE, INCLUDE };
+
+            kind_t kind;
+            assign_t pair;
+            std::string path;   // INCLUDE, as written
+            int line;
+        };
+
+        typedef std::vector< op_t > fragment_t;
+        typedef std::shared_ptr< const fragment_t > fragment_ptr_t;
+
+        struct cached_fragment_t
+        {
+            unsigned long long hash;
+            unsigned long long used;    // cache tick of the last use
+            fragment_ptr_t frag;
+        };
+
+        // Fragments parsed so far, by kind and real path: a file shared by
+        // many configurations (e.g. the jobs of a batch) is parsed once, and
+        // again only if its content changes.
+        // The cache lives on the heap, not in parse_arena: the arena is 
+        // released at the end of each job, while a fragment is there to be 
+        // reused by the jobs that follow. It is bounded to MAX_OPS ops in 
+        // all (a few MB), dropping the least recently used files first
+        struct fragment_cache_t
+        {
+            enum { MAX_OPS = 64 * 1024 };
+
+            std::mutex mtx;
+            std::map< std::string, cached_fragment_t > map;
+            size_t ops;
+            unsigned long long tick;
+            parse_stats_t stats;
+
+            fragment_cache_t() : ops(0), tick(0) 
+            { 
+                stats.parsed = stats.reused = stats.evicted = 0; 
+            }
+        };
+
+        static fragment_cache_t & fragment_cache()
+        {
+            static fragment_cache_t cache;
+            return cache;
+        }
+
+        // where the last error was found
+        std::string _err_file;
+        int _err_line;
 
         bool get_token( 
                 tokenizer_t::token_t & token, 
@@ -113,7 +218,7 @@ class mc_config_t
         //--------------------------------------------------------------------------
 
 
-        bool extr_exp_tkn( const std::string & expected_token, tokenizer_t & tknzr )
+        bool extr_exp_tkn( const char * expected_token, tokenizer_t & tknzr )
         {
             tokenizer_t::token_t token;
 
@@ -121,11 +226,41 @@ class mc_config_t
                 return false;
             }
 
-            if ( token != expected_token ) 
+            if ( token.value != expected_token ) 
+            {
+                return false;
+            }
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // include "<file>": the path is the text between the quotes
+        bool parse_include( tokenizer_t & tknzr, std::string& msg, fragment_t& frag )
+        {
+            tokenizer_t::token_t token;
+            const size_t line = size_t( tknzr.get_line_num() );
+            op_t op = { op_t::INCLUDE, assign_t(), "", int(line) };
+
+            if ( get_token( token, tknzr ) && token.value == "\"" && token.line == line )
+            {
+                while ( tknzr.get_next_token( token ) && token.line == line && 
+                        token.value != "\"" )
+                {
+                    op.path += token.value.c_str();
+                }
+            }
+
+            if ( token.value != "\"" || token.line != line || op.path.empty() )
             {
+                msg = "include needs a file name between quotes";
                 return false;
             }
 
+            frag.push_back( op );
             return true;
         }
 
@@ -133,7 +268,7 @@ class mc_config_t
         //--------------------------------------------------------------------------
 
 
-        bool parse_cfg( tokenizer_t & tknzr, std::string& msg, assignlist_t& lst )
+        bool parse_cfg( tokenizer_t & tknzr, std::string& msg, fragment_t& frag )
         {
             tokenizer_t::token_class_set_t blnk_cls;
             tokenizer_t::token_class_set_t sngt_cls;
@@ -183,10 +318,31 @@ class mc_config_t
                     break;
                 }
 
+                if ( token.value == "include" ) 
+                {
+                    if ( ! parse_include( tknzr, msg, frag ) ) {
+                        syntax_error = true;
+                        break;
+                    }
+
+                    continue;
+                }
+
+                // "override writemem.l": replaces the value last written to
+                // the address (e.g. by an included file) instead of adding
+                // one more write
+                const bool ovr = token.value == "override";
+
+                if ( ovr && ( ! get_token( token, tknzr ) || token.value != "writemem.l" ) )
+                {
+                    msg = "override only applies to writemem.l";
+                    syntax_error = true;
+                    break;
+                }
+
                 if ( token.value == "sleep" ) 
                 {
-                    std::string address = "0x40000001"; // TODO verify...
-                    std::string value;
+                    string_t value;
 
                     if ( ! get_token( token, tknzr ) ) {
                         msg = "value missing";
@@ -196,21 +352,20 @@ class mc_config_t
 
                     value = token.value;
 
-                    addr_t ulAddr = 0;
                     value_t ulVal = 0;
 
-                    sscanf(address.c_str(), "%x", &ulAddr);
                     sscanf(value.c_str(), "%x", &ulVal);
 
-                    lst.push_back( { ulAddr, ulVal } );
+                    frag.push_back( { op_t::PAIR, { addr_t( SLEEP_ADDR ), ulVal }, "", 
+                            tknzr.get_line_num() } );
 
                     continue;
                 }
 
                 if ( token.value == "writemem.l" ) 
                 {
-                    std::string address;
-                    std::string value;
+                    string_t address;
+                    string_t value;
 
                     if ( ! get_token( token, tknzr ) ) 
                     {
@@ -225,7 +380,7 @@ class mc_config_t
                     {
 
                         msg = "invalid address ";
-                        msg += address;
+                        msg += address.c_str();
                         syntax_error = true;
                         break;
                     }
@@ -242,7 +397,7 @@ class mc_config_t
                     if (value.c_str()[0]<'0'|| value.c_str()[0]>'9')
                     {
                         msg = "invalid value ";
-                        msg += value;
+                        msg += value.c_str();
                         syntax_error = true;
                         break;
                     }
@@ -253,13 +408,14 @@ class mc_config_t
                     sscanf(address.c_str(), "%x", &ulAddr);
                     sscanf(value.c_str(), "%x", &ulVal);
 
-                    lst.push_back( { ulAddr, ulVal } );
+                    frag.push_back( { ovr ? op_t::OVERRIDE : op_t::PAIR, { ulAddr, ulVal }, "", 
+                            tknzr.get_line_num() } );
 
                     continue;
                 }
 
                 msg = "Unexpected symbol '";
-                msg += token.value; 
+                msg += token.value.c_str(); 
                 msg += "'";
                 syntax_error = true;
                 break;
@@ -273,7 +429,7 @@ class mc_config_t
         //--------------------------------------------------------------------------
 
 
-        bool parse_dat( tokenizer_t & tknzr, std::string& msg, assignlist_t& lst )
+        bool parse_dat( tokenizer_t & tknzr, std::string& msg, fragment_t& frag )
         {
             tokenizer_t::token_class_set_t blnk_cls;
             tokenizer_t::token_class_set_t sngt_cls;
@@ -282,6 +438,7 @@ class mc_config_t
             blnk_cls.insert(" ");
             blnk_cls.insert("\t");
             sngt_cls.insert(":");
+            sngt_cls.insert("\"");
 
             linestyle_comment_cls.insert("//");
             linestyle_comment_cls.insert("#");
@@ -314,8 +471,29 @@ class mc_config_t
                     break;
                 }
 
-                std::string address;
-                std::string value;
+                if ( token.value == "include" ) 
+                {
+                    if ( ! parse_include( tknzr, msg, frag ) ) {
+                        syntax_error = true;
+                        break;
+                    }
+
+                    continue;
+                }
+
+                // "override <offset> : <value>": the offset must have been
+                // set before (e.g. by an included file)
+                const bool ovr = token.value == "override";
+
+                if ( ovr && ! get_token( token, tknzr ) )
+                {
+                    msg = "offset missing";
+                    syntax_error = true;
+                    break;
+                }
+
+                string_t address;
+                string_t value;
 
                 address = token.value;
 
@@ -341,7 +519,8 @@ class mc_config_t
                 sscanf(address.c_str(), "%x", &ulAddr);
                 sscanf(value.c_str(), "%x", &ulVal);
 
-                lst.push_back( { ulAddr, ulVal } );
+                frag.push_back( { ovr ? op_t::OVERRIDE : op_t::PAIR, { ulAddr, ulVal }, "", 
+                        tknzr.get_line_num() } );
 
             } // while
 
@@ -352,912 +531,5160 @@ class mc_config_t
         //--------------------------------------------------------------------------
 
 
-    public:
-
-
-        //--------------------------------------------------------------------------
-
-
-        bool compile_cfg( const std::string & filename, 
-                assignlist_t& lst, 
-                std::string& msg )
+        static unsigned long long hash_of( const string_t & data ) throw()
         {
-            util::file_stream< std::string> fs( filename );
-            tokenizer_t t( fs );
+            unsigned long long hash = 0xcbf29ce484222325ULL; // FNV-1a 64
 
-            if ( ! fs.open() ) 
+            for (size_t i = 0; i < data.size(); ++i)
             {
-                msg = "Unable to open \"";
-                msg += filename + "\"";
-                return false;
+                hash = (hash ^ (unsigned char) data[i]) * 0x100000001b3ULL;
             }
 
-            bool res = parse_cfg( t, msg, lst );
-            fs.close();
-
-            return res;
+            return hash;
         }
 
 
-        //--------------------------------------------------------------------------
-
-
-        bool compile_dat( const std::string & filename, 
-                assignlist_t& lst, 
-                std::string& msg )
+        // "-" stands for the standard input; data is taken from the arena of
+        // the job, a regular file is read into a buffer of its size. A
+        // directory (which fopen accepts) or a file too big for the arena
+        // fails as a file that cannot be opened
+        static bool read_file( const std::string & filename, string_t & data )
         {
-            util::file_stream< std::string> fs( filename );
-            tokenizer_t t( fs );
+            FILE * f = filename == "-" ? stdin : fopen( filename.c_str(), "r" );
 
-            if ( ! fs.open() ) 
+            if (! f)
             {
-                msg = "Unable to open \"";
-                msg += filename + "\"";
                 return false;
             }
 
-            bool res = parse_dat( t, msg, lst );
-            fs.close();
-
-            return res;
-        }
-
-};
-
+            if (f != stdin)
+            {
+                struct stat st;
 
-//------------------------------------------------------------------------------ 
+                if (fstat( fileno( f ), &st ) != 0 || ! S_ISREG( st.st_mode ))
+                {
+                    fclose( f );
+                    return false;
+                }
 
+                try
+                {
+                    if (st.st_size > 0) data.reserve( size_t( st.st_size ) );
+                }
+                catch (const std::bad_alloc &)
+                {
+                    fclose( f );
+                    return false;
+                }
+            }
 
-class boot_spi_data_t
-{
-    /*
-       SPI Bootable image format
-
-       0x00-0x3F Reserved.
-
-       0x40-0x43 BOOT signature. This location should contain the value 0x424F0_4F54, 
-       which is the ASCII code for
-       BOOT. The eSPI loader code will search for this signature, 
-       initially in 24-bit addressable mode. 
-       If the value in this location doesn't match the BOOT 
-       signature, then the EEPROM is accessed again, but in 16-bit mode. 
-       If the value in this location still does not match the BOOT signature, 
-       it means that the eSPI device doesn't contain a valid user code. 
-       In such case the eSPI loader code will disable the eSPI and will issue 
-       a hardware reset request of the SoC by setting RSTCR[HRESET_REQ].
-
-       0x44-0x47 Reserved
-
-       0x48-0x4B User's code length. 
-       Number of bytes in the user's code to be copied.
-       Must be a multiple of 4.
-       4 = User's code length = 2 Gbytes.
-
-       0x4C-0x4F Reserved
-
-       0x50-0x53 Source Address. Contains the starting address of the user's code 
-       as an offset from the EEPROM starting address. In 24-bit addressing mode, 
-       the 8 most significant bits of this should be written to as zero, because 
-       the EEPROM is accessed with a 3-byte (24-bit) address. 
-       In 16-bit addressing mode, the 16 most significant bits of this should 
-       be written to as zero.
-
-       0x54-0x57 Reserved
-
-       0x58-0x5B Target Address. Contains the target address in the system's local 
-       memory address space in which the user's code will be copied to. 
-       This is a 32-bit effective address. The core is configured in such a way 
-       that the 36-bit real address is equal to this (with 4 most significant bits 
-       zero).
-
-       0x5C-0x5F Reserved
-
-       0x60-0x63 Execution Starting Address. Contains the jump address in the 
-       system's local memory address space into the user's code first instruction 
-       to be executed. 
-       This is a 32-bit effective address. The core is configured in such a way 
-       that the 36-bit real address is equal to this (with 4 most significant bits 
-       zero).
-
-       0x64-0x67 Reserved
-
-       0x68-0x6B N. Number of Config Address/Data pairs. 
-
-       0x6C-0x7F Reserved.
-       0x80-0x83 Config Address 1
-       0x84-0x87 Config Data 1
-       0x88-0x8B Config Address 2
-       0x8C-0x8F Config Data 2
-       ...
-       0x80 + 8x(N-1) Config Address N
-       0x80 + 8x(N-1) + 4 Config Data N (Final Config Data N optional)
-       ...
-       User's Code
-     */
+            char buf[ 64*1024 ];
+            size_t rb = 0;
 
-    private:
+            while ((rb = fread( buf, 1, sizeof(buf), f )) > 0)
+            {
+                data.append( buf, rb );
+            }
 
-        // Default pre-initialized preable 
-        static unsigned char preamble_bin[ 108 ];
+            const bool ok = ferror( f ) == 0;
 
+            if (f != stdin) fclose( f );
 
-        //--------------------------------------------------------------------------
+            return ok;
+        }
 
 
-        unsigned char _data[ 1024 ];
+        // Included files are found relative to the file including them
+        static std::string include_path( const std::string & from, const std::string & path )
+        {
+            const size_t p = from.rfind( '/' );
 
+            if (path[0] == '/' || p == std::string::npos)
+            {
+                return path;
+            }
 
-        //--------------------------------------------------------------------------
+            return from.substr( 0, p + 1 ) + path;
+        }
 
 
-        enum 
+        // The same file reached by different paths is cached once
+        static std::string real_path( const std::string & filename )
         {
-            OFS_USER_CODE_LEN = 0x48,
-            OFS_SRC_ADDR      = 0x50,
-            OFS_TARGET_ADDR   = 0x58,
-            OFS_EXEST_ADDR    = 0x60,
-            OFS_CFG_PAIRS_NUM = 0x68,
-            OFS_FIRST_CFG_ADDR= 0x80,
-            OFS_FIRST_CFG_DATA= 0x84
-        };
-
+#ifdef WIN32
+            char buf[ _MAX_PATH ];
+            return _fullpath( buf, filename.c_str(), sizeof(buf) ) ? buf : filename;
+#else
+            char * p = realpath( filename.c_str(), 0 );
+            const std::string path = p ? p : filename;
 
-        //--------------------------------------------------------------------------
+            free( p );
+            return path;
+#endif
+        }
 
 
-    public:
+        //--------------------------------------------------------------------------
 
 
-        boot_spi_data_t() 
+        bool fail( const std::string & filename, int line ) 
         {
-            memset( _data, 0, sizeof(_data) );
+            _err_file = filename;
+            _err_line = line;
+
+            return false;
         }
 
 
-        //--------------------------------------------------------------------------
+        // Parse len bytes at data (a .cfg if cfg, else a .dat) read from filename
+        bool parse( const char * data, size_t len, bool cfg, 
+                const std::string & filename, fragment_t & frag, std::string& msg )
+        {
+            util::memory_stream< string_t > ms( data, len );
+            tokenizer_t t( ms );
 
+            util::trace_span_t span( cfg ? "parse_cfg" : "parse_dat" );
 
-        void set_default()
-        {
-            memcpy( _data, preamble_bin, sizeof(preamble_bin) );
-        }
+            if (! (cfg ? parse_cfg( t, msg, frag ) : parse_dat( t, msg, frag )))
+            {
+                return fail( filename, t.get_line_num() );
+            }
 
+            span.arg( "file", filename );
+            span.arg( "bytes", ms.tell() );
+            span.arg( "pairs", frag.size() );
 
-        //--------------------------------------------------------------------------
+            return true;
+        }
 
 
-        bool load_from_file( const std::string& filename )
+        // The parsed content of filename: from the cache if the file has not
+        // changed since it was parsed
+        fragment_ptr_t load( const std::string & filename, bool cfg, std::string & msg )
         {
-            FILE * f = fopen( filename.c_str(), "rb" );
+            string_t data;
 
-            if (f) {
-                int rb = fread( _data, 1, sizeof(_data), f );
-                if (rb<sizeof(_data))
+            {
+                util::trace_span_t span( "open" );
+                span.arg( "file", filename );
+
+                if (! read_file( filename, data ))
                 {
-                    fclose(f);
-                    return false;
+                    msg = "Unable to open \"";
+                    msg += filename + "\"";
+                    return fragment_ptr_t();
                 }
-                fclose(f);
-                return true;
             }
-            return false;
-        }
 
+            const std::string key = (cfg ? "cfg:" : "dat:") + real_path( filename );
+            const unsigned long long hash = hash_of( data );
+            fragment_cache_t & cache = fragment_cache();
 
-        //--------------------------------------------------------------------------
+            if (filename != "-")
+            {
+                std::lock_guard< std::mutex > lock( cache.mtx );
+                std::map< std::string, cached_fragment_t >::iterator i = cache.map.find( key );
 
+                if (i != cache.map.end() && i->second.hash == hash)
+                {
+                    ++ cache.stats.reused;
+                    i->second.used = ++ cache.tick;
+                    return i->second.frag;
+                }
+            }
 
-        bool save( const std::string& filename )
-        {
-            FILE * f = fopen( filename.c_str(), "wb" );
+            std::shared_ptr< fragment_t > frag( new fragment_t );
 
-            if (!f) 
+            if (! parse( data.data(), data.size(), cfg, filename, *frag, msg ))
             {
-                return false;
+                return fragment_ptr_t();
             }
 
-            int rb = fwrite( _data, 1, sizeof(_data), f );
+            std::lock_guard< std::mutex > lock( cache.mtx );
+            ++ cache.stats.parsed;
 
-            if (rb< ((int) sizeof(_data)))
+            if (filename != "-" && frag->size() <= fragment_cache_t::MAX_OPS)
             {
-                fclose(f);
-                return false;
+                cache_fragment( cache, key, hash, frag );
             }
 
-            fclose(f);
-            return true;
+            return frag;
         }
 
 
-        //--------------------------------------------------------------------------
-
-
-        bool patch( const std::string& filename )
+        // Store frag under key, making room for it (cache.mtx held)
+        static void cache_fragment( fragment_cache_t & cache, const std::string & key,
+                unsigned long long hash, const fragment_ptr_t & frag )
         {
-            FILE * f = fopen( filename.c_str(), "r+b" );
+            typedef std::map< std::string, cached_fragment_t >::iterator iter_t;
 
-            if (!f)
+            iter_t old = cache.map.find( key );
+
+            if (old != cache.map.end())
             {
-                return false;
+                cache.ops -= old->second.frag->size();
+                cache.map.erase( old );
             }
 
-            if (fseek(f, 0, SEEK_END)<0)
+            while (cache.ops + frag->size() > fragment_cache_t::MAX_OPS)
             {
-                fclose(f);
-                return false;
-            }
+                iter_t lru = cache.map.begin();
 
-            size_t size = ftell(f);
-            fseek(f, 0, SEEK_SET);
+                for (iter_t i = cache.map.begin(); i != cache.map.end(); ++i)
+                {
+                    if (i->second.used < lru->second.used) lru = i;
+                }
 
-            if (int(size) < ( (int) sizeof(_data) ) )
-            {
-                fclose(f);
-                return false;
+                cache.ops -= lru->second.frag->size();
+                cache.map.erase( lru );
+                ++ cache.stats.evicted;
             }
 
-            int rb = fwrite( _data, 1, sizeof(_data), f );
+            cached_fragment_t & c = cache.map[ key ];
+            c.hash = hash;
+            c.used = ++ cache.tick;
+            c.frag = frag;
+            cache.ops += frag->size();
+        }
 
-            if (rb< ((int) sizeof(_data)))
+
+        // Append the pairs of frag, read from filename, to lst: the overrides
+        // replace the values already there, the includes are expanded in
+        // place. chain holds the files being expanded, to detect cycles
+        bool expand( const fragment_t & frag, bool cfg, const std::string & filename,
+                std::vector< std::string > & chain, assignlist_t& lst, std::string& msg )
+        {
+            for (fragment_t::const_iterator i = frag.begin(); i != frag.end(); ++i)
             {
-                fclose(f);
-                return false;
-            }
+                if (i->kind == op_t::PAIR)
+                {
+                    lst.push_back( i->pair );
+                }
+                else if (i->kind == op_t::OVERRIDE)
+                {
+                    assignlist_t::reverse_iterator j = lst.rbegin();
 
-            fclose(f);
-            return true;
-        }
+                    while (j != lst.rend() && j->first != i->pair.first) ++j;
 
+                    if (j == lst.rend())
+                    {
+                        char buf[ 80 ];
+                        snprintf( buf, sizeof(buf), "override of 0x%x, which is not set before",
+                                i->pair.first );
+                        msg = buf;
 
-        //--------------------------------------------------------------------------
+                        return fail( filename, i->line );
+                    }
 
+                    j->second = i->pair.second;
+                }
+                else if (! include( include_path( filename, i->path ), cfg, chain, lst, msg ))
+                {
+                    // the error of the included file is reported as it is
+                    return _err_file.empty() ? fail( filename, i->line ) : false;
+                }
+            }
 
-        bool attach_to( const std::string& srcname, const std::string& dstname )
-        {
-            bool ret = false;
-            FILE * f = 0;
-            char * databuf = 0;
+            return true;
+        }
 
-            do {
-                //open source file
-                f = fopen( srcname.c_str(), "rb" );
 
-                //get file size
-                if (!f) break;
-                if (0>fseek( f, 0, SEEK_END )) break;
-                int len = (int) ftell( f );
-                if (len <0) break;
-                fseek(f, 0, SEEK_SET);
+        bool include( const std::string & filename, bool cfg,
+                std::vector< std::string > & chain, assignlist_t& lst, std::string& msg )
+        {
+            const std::string path = real_path( filename );
 
-                //allocate buffer of file size + header len bytes
-                databuf = new char [ len + sizeof(_data) ];
-                if (! databuf)  break; // no enough memory 
+            if (std::find( chain.begin(), chain.end(), path ) != chain.end())
+            {
+                msg = "include cycle, \"" + filename + "\" is already being included";
+                return false;
+            }
 
-                //set preamble
-                memcpy(databuf, _data, sizeof(_data));
+            fragment_ptr_t frag = load( filename, cfg, msg );
 
-                //append content of source file
-                int rb = fread( databuf+sizeof(_data), 1, len, f );
-                if (rb<len) break;
+            if (! frag)
+            {
+                return false;
+            }
 
-                fclose(f);
+            chain.push_back( path );
+            const bool ok = expand( *frag, cfg, filename, chain, lst, msg );
+            chain.pop_back();
 
-                //create destination file
-                f = fopen( dstname.c_str(), "wb" );
-                if (!f) break; 
+            return ok;
+        }
 
-                //write preamble + data
-                int wb = fwrite( databuf, 1, len + sizeof(_data), f );
-                if (wb<(len + (int) sizeof(_data)))  break;
 
-                ret = true; // terminated succesfully
+        // Prefix msg with where the error is: its line in the file compiled,
+        // file and line in an included one
+        void locate( const std::string & filename, std::string & msg ) const
+        {
+            if (_err_file.empty())
+            {
+                return;
             }
-            while(0);
 
-            if (f) fclose(f);
-            delete [] databuf;
-            return ret;
+            char line[ 32 ];
+            snprintf( line, sizeof(line), "%i", _err_line );
+
+            msg = (_err_file == filename ? "line " + std::string( line ) : 
+                    _err_file + ":" + line) + ": " + msg;
         }
 
 
-        //--------------------------------------------------------------------------
+        bool compile( const std::string & filename, bool cfg, 
+                assignlist_t& lst, std::string& msg )
+        {
+            std::vector< std::string > chain;
 
+            _err_file.clear();
 
-        inline unsigned int get_dword(int offset) const throw()
-        {
-            const unsigned int value = 
-                (_data[offset + 0]<<24) + 
-                (_data[offset + 1]<<16) + 
-                (_data[offset + 2]<<8)  +  
-                (_data[offset + 3]);
+            const bool ok = include( filename, cfg, chain, lst, msg );
+            locate( filename, msg );
 
-            return value;
+            return ok;
         }
 
 
-        //--------------------------------------------------------------------------
+        bool compile( const char * data, size_t len, bool cfg,
+                assignlist_t& lst, std::string& msg )
+        {
+            std::vector< std::string > chain;
+            fragment_t frag;
 
+            _err_file.clear();
 
-        inline void patch_dword_at(int offset, unsigned int data)
-        {
-            _data[offset + 0] = (data>>24) & 0xff;
-            _data[offset + 1] = (data>>16) & 0xff;
-            _data[offset + 2] = (data>> 8) & 0xff;
-            _data[offset + 3] = (data>> 0) & 0xff;
+            const bool ok = parse( data, len, cfg, "<memory>", frag, msg ) &&
+                expand( frag, cfg, "<memory>", chain, lst, msg );
+            locate( "<memory>", msg );
+
+            return ok;
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        inline unsigned int get_user_code_len() const throw()
-        {
-            return get_dword( OFS_USER_CODE_LEN );
-        }
+    public:
+        mc_config_t() : _err_line(0) {}
 
 
-        //--------------------------------------------------------------------------
+        // A .cfg or .dat file may include others (include "<file>", relative
+        // to it) and override what they set (see parse_cfg and parse_dat);
+        // each file is parsed once per run, see fragment_cache_t
+        bool compile_cfg( const std::string & filename, 
+                assignlist_t& lst, 
+                std::string& msg )
+        {
+            return compile( filename, true, lst, msg );
+        }
 
 
-        inline void set_user_code_len( unsigned int data ) throw()
+        bool compile_dat( const std::string & filename, 
+                assignlist_t& lst, 
+                std::string& msg )
         {
-            patch_dword_at( OFS_USER_CODE_LEN, data );
+            return compile( filename, false, lst, msg );
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        inline unsigned int get_src_addr() const throw()
+        // Same as the file versions, over a configuration held in memory
+        // (len bytes at data, read in place); files included are found
+        // relative to the current directory
+        bool compile_cfg( const char * data, size_t len,
+                assignlist_t& lst, 
+                std::string& msg )
+        {
+            return compile( data, len, true, lst, msg );
+        }
+
+
+        bool compile_dat( const char * data, size_t len,
+                assignlist_t& lst, 
+                std::string& msg )
         {
-            return get_dword( OFS_SRC_ADDR );
+            return compile( data, len, false, lst, msg );
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        inline void set_src_addr( unsigned int data ) throw()
+        static parse_stats_t stats()
         {
-            patch_dword_at( OFS_SRC_ADDR, data );
+            fragment_cache_t & cache = fragment_cache();
+            std::lock_guard< std::mutex > lock( cache.mtx );
+
+            return cache.stats;
         }
+};
+
+
+//------------------------------------------------------------------------------ 
+
+
+// Owns a preamble, see preamble_layout_t for its format
+class boot_spi_data_t
+{
+    private:
+
+        // Default pre-initialized preable, built at compile time
+        static constexpr preamble_image_t default_preamble = preamble_builder_t().image();
 
 
         //--------------------------------------------------------------------------
 
 
-        inline unsigned int get_target_addr() const throw()
+        unsigned char _data[ preamble_layout_t::SIZE ];
+
+        // the user's code length comes from the configuration (--bin, 
+        // --dat, --board...), not from the default preamble
+        bool _len_given;
+
+        // the user's code length written is the one fitted to the payload
+        bool _len_fitted;
+
+
+        //--------------------------------------------------------------------------
+
+
+    public:
+
+
+        boot_spi_data_t() : _len_given(false), _len_fitted(false)
         {
-            return get_dword( OFS_TARGET_ADDR );
+            memset( _data, 0, sizeof(_data) );
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        inline void set_target_addr( unsigned int data ) throw()
+        void set_default()
         {
-            patch_dword_at( OFS_TARGET_ADDR, data );
+            memcpy( _data, default_preamble.data, sizeof(_data) );
+            _len_given = false;
         }
 
 
+        bool code_len_given() const throw() { return _len_given; }
+        bool code_len_fitted() const throw() { return _len_fitted; }
+
+
         //--------------------------------------------------------------------------
 
 
-        inline unsigned int get_exest_addr() const throw()
+        // "-" stands for the standard input/output
+        static FILE * open_file( const std::string& filename, const char * mode )
         {
-            return get_dword( OFS_EXEST_ADDR );
+            if (filename == "-")
+            {
+                FILE * f = mode[0] == 'r' ? stdin : stdout;
+#ifdef WIN32
+                _setmode( _fileno(f), _O_BINARY );
+#endif
+                return f;
+            }
+
+#ifdef HAVE_GZ_STREAM
+            // gzip compressed inputs are recognized by their content,
+            // outputs named *.gz are compressed
+            if (mode[0] == 'r' ? util::gz_file( filename ) : util::gz_name( filename ))
+            {
+                return util::gz_fopen( filename, mode );
+            }
+#endif
+
+            return fopen( filename.c_str(), mode );
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        inline void set_exest_addr( unsigned int data ) throw()
+        static bool close_file( FILE * f )
         {
-            patch_dword_at( OFS_EXEST_ADDR, data );
+            if (f == stdin)
+            {
+                return true;
+            }
+
+            if (f == stdout)
+            {
+                return fflush(f) == 0;
+            }
+
+            return fclose(f) == 0;
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        inline unsigned int get_n_cfg_pairs() const throw()
+        // Copy the remaining content of src to dst, without knowing its length
+        static bool copy_stream( FILE * src, FILE * dst, unsigned long long & len )
+        {
+            std::vector< char > buf( 64*1024 );
+
+            len = 0;
+
+            while (true)
+            {
+                size_t rb = fread( &buf[0], 1, buf.size(), src );
+
+                if (rb > 0 && fwrite( &buf[0], 1, rb, dst ) != rb)
+                {
+                    return false;
+                }
+
+                len += rb;
+
+                if (rb < buf.size())
+                {
+                    return ferror(src) == 0;
+                }
+            }
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        void load_from_memory( const unsigned char * data )
         {
-            return get_dword( OFS_CFG_PAIRS_NUM );
+            memcpy( _data, data, sizeof(_data) );
+            _len_given = true;
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        inline void set_n_cfg_pairs( unsigned int data ) throw()
+        bool load_from_file( const std::string& filename )
         {
-            patch_dword_at( OFS_CFG_PAIRS_NUM, data );
+            FILE * f = open_file( filename, "rb" );
+
+            if (f) {
+                size_t rb = fread( _data, 1, sizeof(_data), f );
+                if (rb<sizeof(_data))
+                {
+                    close_file(f);
+                    return false;
+                }
+                close_file(f);
+                _len_given = true;
+                return true;
+            }
+            return false;
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        bool set_cfg_pair( int idx, unsigned int addr, unsigned int data ) throw()
+        bool save( const std::string& filename )
         {
-            int dataofs_addr = OFS_FIRST_CFG_ADDR + (idx<<3);
-            int dataofs_data = OFS_FIRST_CFG_DATA + (idx<<3);
+            FILE * f = open_file( filename, "wb" );
 
-            if (dataofs_addr >= (sizeof(_data)) )
+            if (!f) 
             {
                 return false;
             }
 
-            patch_dword_at( dataofs_addr, addr );
-            patch_dword_at( dataofs_data, data );
+            int rb = fwrite( _data, 1, sizeof(_data), f );
 
-            return true;
+            if (rb< ((int) sizeof(_data)))
+            {
+                close_file(f);
+                return false;
+            }
+
+            return close_file(f);
         }
 
 
         //--------------------------------------------------------------------------
 
 
-        void show() const throw()
+        // Write the pair list as a .cfg file (writemem.l/sleep lines)
+        bool save_cfg( const std::string& filename, const std::string& origin )
         {
-            char boot_sign[ 5 ] = {0};
-            boot_sign[0] = _data[0x40];
-            boot_sign[1] = _data[0x41];
-            boot_sign[2] = _data[0x42];
-            boot_sign[3] = _data[0x43];
+            FILE * f = open_file( filename, "wb" );
+
+            if (!f) 
+            {
+                return false;
+            }
+
+            const cfg_pair_range_t pairs = view().cfg_pairs();
+            bool ok = fprintf( f, "# pairs of \"%s\"\n", origin.c_str() ) > 0;
+
+            for (cfg_pair_range_t::const_iterator i = pairs.begin(); ok && i != pairs.end(); ++i)
+            {
+                const cfg_pair_t pair = *i;
+
+                ok = (pair.addr == mc_config_t::SLEEP_ADDR ?
+                        fprintf( f, "sleep %x\n", pair.data ) :
+                        fprintf( f, "writemem.l 0x%08x 0x%08x\n", pair.addr, pair.data )) > 0;
+            }
+
+            return close_file(f) && ok;
+        }
 
-            bool valid_sign = std::string(boot_sign) == "BOOT";
 
-            printf(" 0x40- 0x43 BOOT signature      :  0x%02x%02x%02x%02x == "
-                    "'%s' %s\n", 
-                    boot_sign[0], boot_sign[1], boot_sign[2], boot_sign[3], boot_sign,
-                    valid_sign ? "OK" : "NOT OK");
+        //--------------------------------------------------------------------------
+
+
+        // Write the preamble as a .dat file: the header fields, the pairs
+        // and any other non zero word
+        bool save_dat( const std::string& filename, const std::string& origin )
+        {
+            FILE * f = open_file( filename, "wb" );
 
-            if (! valid_sign )
+            if (!f) 
             {
-                printf("WARNING: inalid signature '%s' != 'BOOT'..."
-                        "wrong header format ?\n", boot_sign);
+                return false;
             }
 
-            unsigned int val = get_user_code_len();
+            typedef preamble_layout_t layout_t;
 
-            printf(" 0x48- 0x4B User's code length  :  0x%08x (%u bytes - %u Kb)\n", 
-                    val, val, (val >> 10) + ((val & 1023) ? 1 : 0 ));
+            const unsigned int n = get_n_cfg_pairs() < view().get_cfg_pairs_capacity() ?
+                get_n_cfg_pairs() : view().get_cfg_pairs_capacity();
 
-            if ((unsigned) val> 1024U*1024U )
+            bool ok = fprintf( f, "# preamble of \"%s\"\n", origin.c_str() ) > 0;
+
+            for (unsigned int ofs = 0; ok && ofs < sizeof(_data); ofs += layout_t::FIELD_SIZE)
             {
-                printf("WARNING: code length seems uge... wrong header format ?\n");
+                const unsigned int v = get_dword( ofs );
+
+                if (v != 0 || layout_t::is_field( ofs ) || 
+                        (ofs >= layout_t::OFS_FIRST_CFG_ADDR && ofs < layout_t::cfg_addr_ofs( n )))
+                {
+                    ok = fprintf( f, "%03x:%08x\n", ofs, v ) > 0;
+                }
             }
 
-            printf(" 0x50- 0x53 Source Address      :  0x%08x\n", get_src_addr());
-            printf(" 0x58- 0x5B Target Address      :  0x%08x\n", get_target_addr());
-            printf(" 0x60- 0x63 Exe Start Address   :  0x%08x\n", get_exest_addr());
+            return close_file(f) && ok;
+        }
+
 
-            val = get_n_cfg_pairs();
+#ifndef WIN32
+
+        //--------------------------------------------------------------------------
 
-            printf(" 0x68- 0x6B N.of Adr/Data pairs :  0x%08x (%u)\n", val, val);
 
-            if ((unsigned) val> 1024U )
+        // Copy the user's code of the image srcname, found at the source 
+        // address and as long as the preamble says, to dstname; the kernel
+        // copies the data (copy_file_range, or splice to a pipe). 
+        // len receives the number of bytes copied
+        bool extract_to( const std::string& srcname, 
+                const std::string& dstname,
+                unsigned long long& len,
+                std::string& msg )
+        {
+#ifdef HAVE_GZ_STREAM
+            if (util::gz_file( srcname ) || util::gz_name( dstname ))
             {
-                printf("WARNING: too many args, cutting off at 1024 bytes\n");
+                return extract_stream( srcname, dstname, len, msg );
             }
+#endif
+
+            const int src = open( srcname.c_str(), O_RDONLY );
 
-            for ( int i = 0; i<int(val); ++i )
+            if (src < 0)
             {
-                int dataofs_addr = OFS_FIRST_CFG_ADDR + (i<<3);
-                int dataofs_data = OFS_FIRST_CFG_DATA + (i<<3);
+                return false;
+            }
 
-                if (dataofs_addr >= (sizeof(_data)) )
+            const unsigned long long ofs = get_src_addr();
+            const unsigned long long n = get_user_code_len();
+            struct stat st;
+            int dst = -1;
+            bool ret = false;
+
+            do {
+                if (fstat( src, &st ) != 0) break;
+
+                if (ofs + n > (unsigned long long) st.st_size)
                 {
+                    char buf[ 160 ];
+                    snprintf( buf, sizeof(buf), "user's code at 0x%llx (0x%llx bytes) "
+                            "is beyond the end of the image (0x%llx bytes), see --sra and --len",
+                            ofs, n, (unsigned long long) st.st_size );
+                    msg = buf;
                     break;
                 }
 
-                unsigned int addr = get_dword( dataofs_addr );
-                unsigned int data = get_dword( dataofs_data );
+                dst = dstname == "-" ? 
+                    STDOUT_FILENO : open( dstname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
 
-                printf("0x%03x-0x%03x addr[%2i]@0x%08x := 0x%08x\n", 
-                        dataofs_addr, dataofs_data+3, i, addr, data);
-            }
-        }
+                if (dst < 0) break;
 
-        //------------------------------------------------------------------------------
+                const long long rb = util::copy_range( src, off_t( ofs ), dst, 
+                        dstname == "-" ? -1 : 0, n );
 
+                if (rb < 0) break;
 
-};
+                len = (unsigned long long) rb;
+                ret = len == n;
 
+                if (! ret) msg = "image truncated while copying";
+            }
+            while(0);
 
-class cmd_args_t
-{
-    public:
+            close( src );
 
-        struct cfg_t
-        {
-            std::string app_fname;
-            bool show_help;
-            bool show_version;
-            bool show_info;
-            bool rebase;
-            bool replacepreamble;
-            bool patchtrgaddr;
-            bool patchsrcaddr;
-            bool patchexeaddr;
+            if (dst >= 0 && dst != STDOUT_FILENO)
+            {
+                ret = close( dst ) == 0 && ret;
+            }
 
-            mc_config_t::addr_t baddr;
-            mc_config_t::addr_t newaddr;
-            mc_config_t::addr_t trgaddr;
-            mc_config_t::addr_t srcaddr;
-            mc_config_t::addr_t exeaddr;
+            return ret;
+        }
 
-            std::string error;
-            std::string bin_fname;
-            std::string prb_fname;
-            std::string cfg_fname;
-            std::string dat_fname;
-            std::string src_fname;
-            std::string dst_fname;
 
+#ifdef HAVE_GZ_STREAM
+        // Same as extract_to, through stdio streams: a compressed image is
+        // decompressed up to the end of the user's code, a compressed
+        // destination is written as it is copied
+        bool extract_stream( const std::string& srcname, 
+                const std::string& dstname,
+                unsigned long long& len,
+                std::string& msg )
+        {
+            FILE * src = open_file( srcname, "rb" );
 
-            //--------------------------------------------------------------------------
+            if (! src)
+            {
+                return false;
+            }
 
+            const unsigned long long ofs = get_src_addr();
+            const unsigned long long n = get_user_code_len();
+            std::vector< char > buf( 256*1024 );
+            unsigned long long skipped = 0;
+            FILE * dst = 0;
+            bool ret = false;
 
-            inline cfg_t() throw() 
-                :
-                    app_fname("spidyboot"),
-                    show_help(false),
-                    show_version(false),
-                    show_info(false),
-                    rebase(false),
-                    replacepreamble(false),
-                    patchtrgaddr(false),
-                    patchsrcaddr(false),
-                    patchexeaddr(false),
-                    baddr(0),
-                    newaddr(0),
-                    trgaddr(0),
-                    srcaddr(0),
-                    exeaddr(0)
-            {}
-        }
-        config;
+            len = 0;
 
+            do {
+                while (skipped < ofs)
+                {
+                    const size_t rb = fread( &buf[0], 1, 
+                            size_t( std::min( ofs - skipped, (unsigned long long) buf.size() ) ), src );
 
-        //------------------------------------------------------------------------------
+                    if (rb == 0) break;
+                    skipped += rb;
+                }
 
+                if (ferror( src )) break;
 
-        void show_help() const throw()
-        {
-            printf("Usage:\n");
-            printf("%s \n"
-                    "   --help |\n"
-                    "   --ver  |\n"
-                    "   --show \n"
-                    "   --bin <src_binary_file> \n"
-                    "   --cfg <cfg_file> |  --dat <dat_file> \n"
-                    " [ --prb <preamble_file> ] \n"
-                    " [ --spi -s <bootcode_file> -d <spiboot_file> | "
-                    "--patch <spiboot_file> ] \n"
-                    " [ --addr <baddr> <newaddr> ]\n"
-                    " [ --tga <trgaddr> ] \n"
-                    " [ --sra <srcaddr> ] \n"
-                    " [ --exe <exeaddr> ] \n",
-                    config.app_fname.c_str());
+                dst = open_file( dstname, "wb" );
+                if (! dst) break;
 
-            printf("Where:\n--help\n");
-            printf("  Show this help message\n\n");
+                while (len < n)
+                {
+                    const size_t rb = skipped < ofs ? 0 : fread( &buf[0], 1, 
+                            size_t( std::min( n - len, (unsigned long long) buf.size() ) ), src );
 
-            printf("--ver\n");
-            printf("  Show program version\n\n");
+                    if (rb == 0) break;
+                    if (fwrite( &buf[0], 1, rb, dst ) != rb) break;
 
-            printf("--show\n");
-            printf("  Show preamble info\n\n");
+                    len += rb;
+                }
 
-            printf("--bin <src_binary_file>\n");
-            printf("  Read the preamble from <src_binary_file>\n\n");
+                if (ferror( src ) || ferror( dst )) break;
 
-            printf("--cfg <cfg_file>\n");
-            printf("  Modify the preamble by using "
-                    "data read from a DRAM config file\n\n");
+                ret = len == n;
 
-            printf("--dat <dat_file>\n");
-            printf("  Modify the preamble by using "
-                    "data read from a DAT file\n\n");
+                if (! ret)
+                {
+                    char b[ 160 ];
+                    snprintf( b, sizeof(b), "user's code at 0x%llx (0x%llx bytes) "
+                            "is beyond the end of the image (0x%llx bytes), see --sra and --len",
+                            ofs, n, skipped + len );
+                    msg = b;
+                }
+            }
+            while(0);
 
-            printf("--prb <preamble_file> \n");
-            printf("  Save the preamble in the file <preamble_file>\n\n");
+            close_file( src );
 
-            printf("--spi -s <bootcode_file> -d <spiboot_file> \n");
-            printf("  Create a spi-flash image: "
-                    "<spiboot_file> = preamble + <bootcode_file>\n\n");
+            if (dst) ret = close_file( dst ) && ret;
 
-            printf("--patch <spiboot_file>\n");
-            printf("  Patch the preamble of an existing spi-flash image\n\n");
+            return ret;
+        }
+#endif
 
-            printf("--addr <baddr> <newaddr>\n");
-            printf("  Replace the base address <baddr> with new value <newaddr>\n\n");
+#endif // WIN32
 
-            printf("--tga <trgaddr> \n");
-            printf("  Replace the default target address with new value <trgaddr>\n\n");
 
-            printf("--sra <srcaddr> \n");
-            printf("  Replace the default source address with new value <srcaddr>\n\n");
+        //--------------------------------------------------------------------------
 
-            printf("--exe <exeaddr> \n");
-            printf("  Replace the default exe start address with new value <exeaddr>\n");
-        }
 
-        void show_version() const throw()
+        bool patch( const std::string& filename )
         {
-            printf("Version " SPIDYBOOT_VERSION " \n");
-        }
+            // stream the image from stdin to stdout replacing its preamble
+            if (filename == "-")
+            {
+                unsigned char old_data[ sizeof(_data) ];
+                unsigned long long len = 0;
 
+                FILE * src = open_file( "-", "rb" );
+                FILE * dst = open_file( "-", "wb" );
 
-    private:
+                return fread( old_data, 1, sizeof(old_data), src ) == sizeof(old_data) &&
+                    fwrite( _data, 1, sizeof(_data), dst ) == sizeof(_data) &&
+                    copy_stream( src, dst, len ) &&
+                    close_file( dst );
+            }
 
-        enum state_t
-        {
-            CONTINUE_PARSING,
-            GET_BINFILE,
-            GET_CFGFILE,
-            GET_DATFILE,
-            GET_PBLFILE,
-            GET_SRCDSTPARAM,
-            GET_SRCPARAM,
-            GET_SRCFILE,
-            GET_DSTPARAM,
-            GET_DSTFILE,
-            GET_SPIFILE,
-            GET_BADDR,
-            GET_NEWADDR,
-            GET_SRCADDR,
-            GET_TRGADDR,
-            GET_EXEADDR
+            FILE * f = fopen( filename.c_str(), "r+b" );
+
+            if (!f)
+            {
+                return false;
+            }
+
+            if (fseek(f, 0, SEEK_END)<0)
+            {
+                fclose(f);
+                return false;
+            }
+
+            size_t size = ftell(f);
+            fseek(f, 0, SEEK_SET);
+
+            if (int(size) < ( (int) sizeof(_data) ) )
+            {
+                fclose(f);
+                return false;
+            }
+
+            int rb = fwrite( _data, 1, sizeof(_data), f );
+
+            if (rb< ((int) sizeof(_data)))
+            {
+                fclose(f);
+                return false;
+            }
+
+            fclose(f);
+            return true;
+        }
+
+
+#ifndef WIN32
+        // Same as patch, by means of a journal: the image is written
+        // when txn is committed
+        bool patch_journaled( const std::string& filename, util::output_txn_t& txn )
+        {
+            struct stat st;
+
+            if (stat( filename.c_str(), &st ) != 0 || access( filename.c_str(), W_OK ) != 0)
+            {
+                return false;
+            }
+
+            if (st.st_size < (off_t) sizeof(_data))
+            {
+                errno = EINVAL;
+                return false;
+            }
+
+            return txn.stage_patch( filename, _data, sizeof(_data) );
+        }
+#endif
+
+
+        //--------------------------------------------------------------------------
+
+
+        enum attach_flags_t
+        {
+            ATTACH_UPDATE_CODE_LEN = 1,
+            ATTACH_SET_TARGET_ADDR = 2,
+            ATTACH_SET_EXEST_ADDR  = 4,
+            ATTACH_PAD_CODE        = 8   // with 0xFF, to a multiple of 4 bytes
         };
 
-    public:
-        cmd_args_t( int argc, char* argv[] ) throw()
+
+        //--------------------------------------------------------------------------
+
+
+        // User's code length of a payload of len bytes: the boot loader
+        // copies a multiple of 4 bytes
+        static unsigned int fit_code_len( unsigned long long len ) throw()
         {
-            state_t s = CONTINUE_PARSING;
+            return (unsigned int) ((len + 3) & ~3ULL);
+        }
 
-            for (int i = 0;
-                    i<argc;
-                    ++i)
+
+        void set_fitted_code_len( unsigned long long len ) throw()
+        {
+            set_user_code_len( fit_code_len( len ) );
+            _len_fitted = true;
+        }
+
+
+        // With ATTACH_UPDATE_CODE_LEN, set the user's code length before the
+        // copy if the length of the payload is already known, so that the
+        // preamble is not patched afterwards; returns true if it was
+        bool preset_code_len( const payload_reader_t& payload, unsigned int flags )
+        {
+            unsigned long long len = 0;
+
+            if (! (flags & ATTACH_UPDATE_CODE_LEN) || ! payload.known_len( len ))
             {
-                if (i==0)
-                {
-                    config.app_fname = argv[0];
-                    continue;
-                }
+                return false;
+            }
 
-                std::string sArg = argv[ i ];
+            set_fitted_code_len( len );
+            return true;
+        }
 
-                if (s == CONTINUE_PARSING && sArg == "--help") 
-                {
-                    config.show_help = true;
 
-                    if (argc != 2 )
-                    {
-                        config.error = "syntax error";
-                    }
+        //--------------------------------------------------------------------------
 
-                    break;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--ver") 
-                {
-                    config.show_version = true;
 
-                    if (argc != 2 )
-                    {
-                        config.error = "syntax error";
-                    }
+        // Write dstname = preamble + user's code read from srcname, which 
+        // can be a raw binary, an ELF, an S-record or an Intel HEX file.
+        // The image is written as binary or, depending on ofmt, encoded 
+        // as S-record or Intel HEX.
+        // The source is streamed, so its length does not need to be known 
+        // in advance. Depending on flags, the user's code length and the 
+        // target/exec addresses found in the source are stored into the
+        // preamble; the values only known at the end of the stream are 
+        // patched afterwards, provided that the destination is seekable
+        bool attach_to( const std::string& srcname, 
+                const std::string& dstname,
+                std::string& msg,
+                unsigned int flags = 0,
+                payload_reader_t::format_t format = payload_reader_t::RAW,
+                const util::hex_cfg_t& ofmt = util::hex_cfg_t() )
+        {
+            bool ret = false;
+            FILE * src = 0;
+            FILE * dst = 0;
+            FILE * out = 0;
 
-                    break;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--show") 
-                {
-                    config.show_info = true;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--bin" )
-                {
-                    s = GET_BINFILE;
-                }
-                else if (s == GET_BINFILE )
-                {
-                    config.bin_fname = sArg;
+            util::trace_span_t span( "write_spi" );
+            span.arg( "src", srcname );
+            span.arg( "dst", dstname );
 
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--cfg" )
-                {
-                    s = GET_CFGFILE;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--dat" )
-                {
-                    s = GET_DATFILE;
-                }
-                else if (s == GET_CFGFILE )
-                {
-                    config.cfg_fname = sArg;
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == GET_DATFILE )
-                {
-                    config.dat_fname = sArg;
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--prb" )
-                {
-                    s = GET_PBLFILE;
-                }
-                else if (s == GET_PBLFILE )
-                {
-                    config.prb_fname = sArg;
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--spi" )
+            do {
+                util::trace_span_t open_span( "open" );
+                open_span.arg( "file", srcname );
+
+                //open source file
+                src = open_file( srcname, "rb" );
+                if (!src) break;
+
+                payload_reader_t payload( src, format );
+                if (! payload.open( msg )) break;
+
+                open_span.arg( "format", payload_reader_t::format_name( payload.format() ) );
+                open_span.end();
+
+                // ELF addresses are already known, and so is the length
+                // of raw files
+                set_payload_addrs( payload, flags );
+                const bool preset = preset_code_len( payload, flags );
+
+                //create destination file
+                out = open_file( dstname, "wb" );
+                if (!out) break; 
+
+                dst = out;
+
+#ifdef HAVE_HEX_STREAM
+                // S-record/HEX output: the preamble records are emitted last 
+                // when the preamble may be patched after the payload
+                if (ofmt.format != util::hex_cfg_t::BIN)
                 {
-                    s = GET_SRCDSTPARAM;
+                    const bool may_patch = ((flags & ATTACH_UPDATE_CODE_LEN) && ! preset) ||
+                        payload.format() == payload_reader_t::SREC ||
+                        payload.format() == payload_reader_t::IHEX;
+
+                    dst = util::hex_fopen( out, ofmt, may_patch ? sizeof(_data) : 0 );
+                    if (!dst) break;
                 }
-                else if ((s == GET_SRCDSTPARAM || s==GET_SRCPARAM) && sArg == "-s" )
+#endif
+
+                unsigned long long len = 0;
+                if (! write_payload( payload, dst, 0, dstname, flags, len, msg )) break;
+
+                span.arg( "bytes", sizeof(_data) + len );
+
+                ret = true; // terminated succesfully
+            }
+            while(0);
+
+            if (src) close_file(src);
+            if (dst && dst != out) ret = fclose(dst) == 0 && ret;
+            if (out) ret = close_file(out) && ret;
+
+            return ret;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Same as attach_to(), writing at the current position of dst 
+        // (e.g. the boot region of a flash image, see --layout)
+        bool attach_at( const std::string& srcname, 
+                FILE * dst,
+                const std::string& dstname,
+                std::string& msg,
+                unsigned long long& len,
+                unsigned int flags = 0,
+                payload_reader_t::format_t format = payload_reader_t::RAW )
+        {
+            FILE * src = open_file( srcname, "rb" );
+            if (!src) return false;
+
+            payload_reader_t payload( src, format );
+            const long base = ftell( dst );
+
+            bool ret = payload.open( msg ) && base >= 0;
+
+            if (ret)
+            {
+                set_payload_addrs( payload, flags );
+                preset_code_len( payload, flags );
+                ret = write_payload( payload, dst, base, dstname, flags, len, msg );
+            }
+
+            close_file( src );
+
+            return ret;
+        }
+
+
+#ifdef HAVE_CMP_STREAM
+
+        //--------------------------------------------------------------------------
+
+
+        // Compare the image attach_to() would write with the content of
+        // the file of cmp, which receives the outcome; false on errors 
+        // (of srcname, or reading the image)
+        bool compare_to( const std::string& srcname, 
+                util::image_comparer_t& cmp,
+                std::string& msg,
+                unsigned int flags = 0,
+                payload_reader_t::format_t format = payload_reader_t::RAW,
+                const util::hex_cfg_t& ofmt = util::hex_cfg_t() )
+        {
+            FILE * src = open_file( srcname, "rb" );
+            if (!src) return false;
+
+            payload_reader_t payload( src, format );
+            FILE * out = 0;
+            FILE * dst = 0;
+            bool ret = false;
+
+            do {
+                if (! payload.open( msg )) break;
+
+                set_payload_addrs( payload, flags );
+                const bool preset = preset_code_len( payload, flags );
+
+                // the preamble is compared last when it may be patched after 
+                // the payload (S-record/HEX output holds it by itself)
+                const bool may_patch = ((flags & ATTACH_UPDATE_CODE_LEN) && ! preset) ||
+                    payload.format() == payload_reader_t::SREC ||
+                    payload.format() == payload_reader_t::IHEX;
+
+                if (ofmt.format == util::hex_cfg_t::BIN && may_patch)
                 {
-                    s = GET_SRCFILE;
+                    cmp.set_hold( sizeof(_data) );
                 }
-                else if ((s == GET_SRCDSTPARAM || s==GET_DSTPARAM) && sArg == "-d" )
+
+                out = util::cmp_fopen( cmp );
+                if (!out) break;
+
+                dst = out;
+
+                if (ofmt.format != util::hex_cfg_t::BIN)
                 {
-                    s = GET_DSTFILE;
+                    dst = util::hex_fopen( out, ofmt, may_patch ? sizeof(_data) : 0 );
+                    if (!dst) break;
                 }
-                else if ((s == CONTINUE_PARSING) && sArg == "--patch" )
+
+                unsigned long long len = 0;
+                ret = write_payload( payload, dst, 0, srcname, flags, len, msg );
+            }
+            while(0);
+
+            close_file( src );
+
+            if (dst && dst != out) ret = fclose(dst) == 0 && ret;
+            if (out) ret = fclose(out) == 0 && ret;
+
+            if (ret) cmp.finish( true );
+
+            // a difference stops the comparison, it is not an error
+            return (ret || cmp.result() != util::image_comparer_t::SAME) && 
+                cmp.error() == 0;
+        }
+
+#endif // HAVE_CMP_STREAM
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Write preamble + user's code at offset base of dst; the preamble
+        // is rewritten if the code length or the addresses are only known
+        // after the copy
+        bool write_payload( payload_reader_t& payload, 
+                FILE * dst, 
+                long base,
+                const std::string& dstname,
+                unsigned int flags,
+                unsigned long long& len,
+                std::string& msg )
+        {
+            //write preamble + data
+            if (fwrite( _data, 1, sizeof(_data), dst ) != sizeof(_data)) return false;
+
+            if (! payload.copy( dst, len, msg )) return false;
+
+            if (flags & ATTACH_PAD_CODE)
+            {
+                static const unsigned char erased[ 4 ] = { 0xff, 0xff, 0xff, 0xff };
+                const size_t pad = size_t( fit_code_len( len ) - len );
+
+                if (fwrite( erased, 1, pad, dst ) != pad) return false;
+
+                len += pad;
+            }
+
+            // what has been written, if the destination cannot be rewritten
+            unsigned char written[ sizeof(_data) ];
+            memcpy( written, _data, sizeof(_data) );
+
+            bool changed = set_payload_addrs( payload, flags );
+
+            if (flags & ATTACH_UPDATE_CODE_LEN)
+            {
+                // Must be a multiple of 4
+                const unsigned int code_len = fit_code_len( len );
+
+                changed = changed || code_len != get_user_code_len();
+                set_fitted_code_len( len );
+            }
+            else if (len > get_user_code_len())
+            {
+                fprintf(stderr, "Warning: only 0x%x of the %llu bytes of user's code "
+                        "are copied at boot (see --len)\n",
+                        get_user_code_len(), len);
+            }
+
+            if (changed)
+            {
+                if (fflush(dst) != 0)
                 {
-                    s = GET_SPIFILE;
+                    return false;
                 }
-                else if (s == GET_SRCFILE )
+                else if (fseek( dst, base, SEEK_SET ) != 0)
                 {
-                    config.src_fname = sArg;
-                    s = config.dst_fname.empty() ? GET_DSTPARAM : CONTINUE_PARSING;
+                    fprintf(stderr, "Warning: \"%s\" is not seekable, user's code "
+                            "length and addresses not updated (use --len, --tga, --exe)\n", 
+                            dstname.c_str());
+
+                    // the preamble stays the one written (e.g. for --prb)
+                    memcpy( _data, written, sizeof(_data) );
+                    _len_fitted = false;
                 }
-                else if (s == GET_DSTFILE )
+                else if (fwrite( _data, 1, sizeof(_data), dst ) != sizeof(_data)) 
                 {
-                    config.dst_fname = sArg;
-                    s = config.src_fname.empty() ? GET_SRCPARAM : CONTINUE_PARSING;
+                    return false;
                 }
-                else if (s == GET_SPIFILE )
-                {
-                    config.dst_fname = sArg;
-                    config.replacepreamble = true;
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--addr" )
-                {
-                    s = GET_BADDR;
-                }
-                else if (s == CONTINUE_PARSING && sArg == "--tga" )
+            }
+
+            return true;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Copy the load and entry addresses of the payload into the preamble,
+        // returns true if the preamble has been changed
+        bool set_payload_addrs( const payload_reader_t& payload, unsigned int flags )
+        {
+            bool changed = false;
+
+            if ((flags & ATTACH_SET_TARGET_ADDR) && payload.has_load_addr() &&
+                    payload.load_addr() != get_target_addr())
+            {
+                set_target_addr( payload.load_addr() );
+                changed = true;
+            }
+
+            if ((flags & ATTACH_SET_EXEST_ADDR) && payload.has_entry() &&
+                    payload.entry() != get_exest_addr())
+            {
+                set_exest_addr( payload.entry() );
+                changed = true;
+            }
+
+            return changed;
+        }
+
+
+#ifndef WIN32
+
+        //--------------------------------------------------------------------------
+
+
+        // Same as attach_to(), but bypasses the page cache of the destination
+        // (O_DIRECT) and overlaps reading the source with writing the image
+        bool attach_to_direct( const std::string& srcname, 
+                const std::string& dstname,
+                util::io_stats_t& stats,
+                unsigned int flags = 0 )
+        {
+            enum { CHUNK_SIZE = 1024*1024 };
+
+            int src = open( srcname.c_str(), O_RDONLY );
+
+            if (src < 0)
+            {
+                return false;
+            }
+
+            struct stat st;
+
+            if ((flags & ATTACH_UPDATE_CODE_LEN) && fstat( src, &st ) == 0)
+            {
+                set_fitted_code_len( (unsigned long long) st.st_size );
+            }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+            posix_fadvise( src, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+            util::direct_file_t dst;
+            util::aligned_buffer_t buf[2];
+
+            if (! dst.open( dstname, true ) ||
+                    ! buf[0].alloc( CHUNK_SIZE, dst.align() ) ||
+                    ! buf[1].alloc( CHUNK_SIZE, dst.align() ))
+            {
+                close( src );
+                return false;
+            }
+
+            const double t0 = util::now_sec();
+            bool first = true;
+            off_t ofs = 0;
+            unsigned long long io_bytes = 0;
+
+            auto fill = [&]( int slot ) -> long long
+            {
+                unsigned char * p = buf[slot].data();
+                size_t len = 0;
+
+                if (first)
                 {
-                    s = GET_TRGADDR;
+                    //set preamble
+                    memcpy( p, _data, sizeof(_data) );
+                    len = sizeof(_data);
+                    first = false;
                 }
-                else if (s == CONTINUE_PARSING && sArg == "--sra" )
+
+                while (len < buf[slot].size())
                 {
-                    s = GET_SRCADDR;
+                    ssize_t rb = read( src, p + len, buf[slot].size() - len );
+
+                    if (rb < 0 && errno == EINTR) continue;
+                    if (rb < 0) return -1;
+                    if (rb == 0) break;
+
+                    len += rb;
                 }
-                else if (s == CONTINUE_PARSING && sArg == "--exe" )
+
+                return len;
+            };
+
+            auto drain = [&]( int slot, size_t len ) -> bool
+            {
+                size_t wlen = dst.round_up( len );
+
+                // pad the tail as an erased flash area
+                memset( buf[slot].data() + len, 0xff, wlen - len );
+
+                if (! dst.write_at( buf[slot].data(), wlen, ofs ))
                 {
-                    s = GET_EXEADDR;
+                    return false;
                 }
-                else if (s == GET_BADDR )
-                {
-                    unsigned int addr = 0;
-                    sscanf( sArg.c_str(), "%x",  &addr );
-                    config.baddr = addr;
 
-                    s = GET_NEWADDR;
-                }
-                else if (s == GET_NEWADDR )
-                {
-                    unsigned int addr = 0;
-                    sscanf( sArg.c_str(), "%x",  &addr );
-                    config.newaddr = addr;
+                ofs += len;
+                io_bytes += wlen;
+                return true;
+            };
+
+            bool ret = util::double_buffered_copy( fill, drain );
+
+            // the block padding is 0xFF already
+            if (ret && (flags & ATTACH_PAD_CODE))
+            {
+                ofs = off_t( sizeof(_data) + fit_code_len( ofs - sizeof(_data) ) );
+            }
+
+            ret = ret && dst.finish( ofs );
+
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise( src, 0, 0, POSIX_FADV_DONTNEED );
+#endif
+            close( src );
+
+            ret = dst.close() && ret;
+
+            stats.bytes = ofs;
+            stats.io_bytes = io_bytes;
+            stats.seconds = util::now_sec() - t0;
+            stats.direct = dst.is_direct();
+
+            return ret;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        // Same as patch(), by means of O_DIRECT read-modify-write 
+        // of the first block of the image
+        bool patch_direct( const std::string& filename, util::io_stats_t& stats )
+        {
+            util::direct_file_t f;
+            util::aligned_buffer_t buf;
+
+            if (! f.open( filename, false ) || ! buf.alloc( sizeof(_data), f.align() ))
+            {
+                return false;
+            }
+
+            const double t0 = util::now_sec();
+            off_t size = f.size();
+
+            if (size < off_t(sizeof(_data)))
+            {
+                return false;
+            }
+
+            ssize_t rb = f.read_at( buf.data(), buf.size(), 0 );
+
+            if (rb < ssize_t(sizeof(_data)))
+            {
+                return false;
+            }
+
+            memcpy( buf.data(), _data, sizeof(_data) );
+
+            // the whole first block goes back, not just the preamble
+            const size_t wlen = f.round_up( rb );
+
+            if (! f.write_at( buf.data(), wlen, 0 ) || 
+                    ! f.finish( size ) || 
+                    ! f.close())
+            {
+                return false;
+            }
+
+            stats.bytes = sizeof(_data);
+            stats.io_bytes = wlen;
+            stats.seconds = util::now_sec() - t0;
+            stats.direct = f.is_direct();
+
+            return true;
+        }
+
+#endif // WIN32
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline const unsigned char * get_data() const throw()
+        {
+            return _data;
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        static size_t get_data_size() throw()
+        {
+            return sizeof(_data);
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline preamble_view_t view() throw()
+        {
+            return preamble_view_t( _data, sizeof(_data) );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline preamble_cview_t view() const throw()
+        {
+            return preamble_cview_t( _data, sizeof(_data) );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline unsigned int get_dword(int offset) const throw()
+        {
+            return view().get_dword( offset );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline bool patch_dword_at(int offset, unsigned int data)
+        {
+            _len_given = _len_given || offset == preamble_layout_t::OFS_USER_CODE_LEN;
+
+            return offset >= 0 && view().patch_dword_at( offset, data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline unsigned int get_user_code_len() const throw()
+        {
+            return view().get_user_code_len();
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline void set_user_code_len( unsigned int data ) throw()
+        {
+            view().set_user_code_len( data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline unsigned int get_src_addr() const throw()
+        {
+            return view().get_src_addr();
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline void set_src_addr( unsigned int data ) throw()
+        {
+            view().set_src_addr( data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline unsigned int get_target_addr() const throw()
+        {
+            return view().get_target_addr();
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline void set_target_addr( unsigned int data ) throw()
+        {
+            view().set_target_addr( data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline unsigned int get_exest_addr() const throw()
+        {
+            return view().get_exest_addr();
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline void set_exest_addr( unsigned int data ) throw()
+        {
+            view().set_exest_addr( data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline unsigned int get_n_cfg_pairs() const throw()
+        {
+            return view().get_n_cfg_pairs();
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        inline void set_n_cfg_pairs( unsigned int data ) throw()
+        {
+            view().set_n_cfg_pairs( data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        bool set_cfg_pair( int idx, unsigned int addr, unsigned int data ) throw()
+        {
+            return idx >= 0 && view().set_cfg_pair( idx, addr, data );
+        }
+
+
+        //--------------------------------------------------------------------------
+
+
+        void show( FILE * out = stdout ) const throw()
+        {
+            view().show( out );
+        }
+
+        //------------------------------------------------------------------------------
+
+
+};
+
+
+class cmd_args_t
+{
+    public:
+
+        struct cfg_t
+        {
+            std::string app_fname;
+            bool show_help;
+            bool show_version;
+            bool show_info;
+            bool list_boards;
+            bool ddr_delays;
+            bool rebase;
+            bool replacepreamble;
+            bool patchtrgaddr;
+            bool patchsrcaddr;
+            bool patchexeaddr;
+            bool direct_io;
+            bool patchcodelen;
+            bool show_stats;
+            bool verify;
+            bool journal;
+            bool sync;
+
+            mc_config_t::addr_t baddr;
+            mc_config_t::addr_t newaddr;
+            mc_config_t::addr_t trgaddr;
+            mc_config_t::addr_t srcaddr;
+            mc_config_t::addr_t exeaddr;
+            mc_config_t::value_t codelen;
+
+            std::string error;
+            std::string bin_fname;
+            std::string prb_fname;
+            std::vector< std::string > prb_copies; // more --prb destinations
+            std::string cfg_fname;
+            std::string dat_fname;
+            std::string board;
+            std::string src_fname;
+            std::string dst_fname;
+            std::vector< std::string > dst_copies; // more -d destinations
+            std::string batch_fname;
+            std::string io_engine;
+            std::string scan_path;
+            std::string trace_fname;
+            std::string layout_fname;
+            std::string flash_fname;
+            std::string fill_mode;
+            std::string extract_fname;
+            std::string patch_path;
+            std::string bundle_fname;      // --bundle
+            std::string bundle_path;
+            std::string from_bundle_fname; // --bundle-get, --bundle-list
+            std::string variant;
+            bool list_variants;
+            std::string payload_fname;
+            std::string save_cfg_fname;
+            std::string save_dat_fname;
+            std::string out_format;
+            unsigned int jobs;
+            payload_reader_t::format_t in_format;
+            util::hex_cfg_t out_hex;
+            ddr_delays_t::mode_t ddr_mode;
+            unsigned int delay_unit_ns;
+            bool delay_unit_given;
+            unsigned int spi_clock_mhz;
+
+
+            //--------------------------------------------------------------------------
+
+
+            inline cfg_t() throw() 
+                :
+                    app_fname("spidyboot"),
+                    show_help(false),
+                    show_version(false),
+                    show_info(false),
+                    list_boards(false),
+                    ddr_delays(false),
+                    rebase(false),
+                    replacepreamble(false),
+                    patchtrgaddr(false),
+                    patchsrcaddr(false),
+                    patchexeaddr(false),
+                    direct_io(false),
+                    patchcodelen(false),
+                    show_stats(false),
+                    verify(false),
+                    journal(false),
+                    sync(false),
+                    baddr(0),
+                    newaddr(0),
+                    trgaddr(0),
+                    srcaddr(0),
+                    exeaddr(0),
+                    codelen(0),
+                    io_engine("stdio"),
+                    fill_mode("dense"),
+                    list_variants(false),
+                    out_format("jsonl"),
+                    jobs(0),
+                    in_format(payload_reader_t::AUTO),
+                    ddr_mode(ddr_delays_t::REPORT),
+                    delay_unit_ns(1000),
+                    delay_unit_given(false),
+                    spi_clock_mhz(25)
+            {}
+
+
+            // How many of the more -d and --prb destinations are "-"
+            int n_stdout_copies() const throw()
+            {
+                return int( std::count( dst_copies.begin(), dst_copies.end(), "-" ) +
+                        std::count( prb_copies.begin(), prb_copies.end(), "-" ) );
+            }
+
+
+            // The messages go to the standard error when an image or a
+            // preamble goes to the standard output
+            FILE * status_stream() const throw()
+            {
+                return dst_fname == "-" || prb_fname == "-" || n_stdout_copies() > 0 ?
+                    stderr : stdout;
+            }
+        }
+        config;
+
+
+        //------------------------------------------------------------------------------
+
+
+        void show_help() const throw()
+        {
+            printf("Usage:\n");
+            printf("%s \n"
+                    "   --help |\n"
+                    "   --ver  |\n"
+                    "   --list-boards |\n"
+                    "   --show \n"
+                    "   --bin <src_binary_file> \n"
+                    "   --cfg <cfg_file> |  --dat <dat_file> | --board <name> \n"
+                    "   | --extract <spiboot_file> [ -o <payload_file> ] \n"
+                    "   | --bundle-get <bundle_file> <variant> [ -o <spiboot_file> ] \n"
+                    " [ --prb <preamble_file> ... ] [ --save-cfg <cfg_file> ] [ --save-dat <dat_file> ] \n"
+                    " [ --spi -s <bootcode_file> -d <spiboot_file> [ -d <spiboot_file> ... ] | "
+                    "--patch <spiboot_file> | \n"
+                    "   --layout <layout_file> <flash_file> [ --jobs <n> ] \n"
+                    "   [ --fill-mode dense|holes|extents ] ] \n"
+                    " [ --ifmt auto|raw|elf|srec|ihex ] \n"
+                    " [ --ofmt bin|srec|ihex [ --oaddr <addr> ] [ --skip-erased ] ] \n"
+                    " [ --addr <baddr> <newaddr> ]\n"
+                    " [ --tga <trgaddr> ] \n"
+                    " [ --sra <srcaddr> ] \n"
+                    " [ --exe <exeaddr> ] \n"
+                    " [ --len <codelen> ] [ --spi-clock <MHz> ] \n"
+                    " [ --ddr-delays report|merge|fix [ --delay-unit <ns> ] ] \n"
+                    " [ --direct ] \n"
+                    " [ --journal ] [ --sync ] \n"
+                    " [ --verify ] \n"
+                    " [ --stats ] [ --trace <trace_file> ] \n"
+                    " | --batch <job_file> [ --io stdio|uring ] [ --journal ] [ --sync ] \n"
+                    "   [ --verify [ --jobs <n> ] ] \n"
+                    " | --scan <dir|glob> [ --format jsonl|csv ] [ --jobs <n> ] \n"
+                    " | --patch-all <dir|glob> [ --jobs <n> ] \n"
+                    " | --bundle <bundle_file> <dir|glob> [ --sync ] \n"
+                    " | --bundle-list <bundle_file> \n",
+                    config.app_fname.c_str());
+
+            printf("Where:\n--help\n");
+            printf("  Show this help message\n\n");
+
+            printf("--ver\n");
+            printf("  Show program version\n\n");
+
+            printf("--show\n");
+            printf("  Show preamble info\n\n");
+
+            printf("--bin <src_binary_file>\n");
+            printf("  Read the preamble from <src_binary_file>\n\n");
+
+            printf("--cfg <cfg_file>\n");
+            printf("  Modify the preamble by using "
+                    "data read from a DRAM config file\n\n");
+
+            printf("--dat <dat_file>\n");
+            printf("  Modify the preamble by using "
+                    "data read from a DAT file\n");
+            printf("  (both kinds of file may 'include \"<file>\"' and 'override' pairs)\n\n");
+
+            printf("--board <name>\n");
+            printf("  Same as --dat with the built-in profile <name> (see --list-boards);\n"
+                    "  an unambiguous tail of the name is enough, e.g. p1010rdb_800M\n\n");
+
+            printf("--list-boards\n");
+            printf("  List the built-in board profiles\n\n");
+
+            printf("--prb <preamble_file> \n");
+            printf("  Save the preamble in the file <preamble_file>; repeat it to write\n"
+                    "  the same preamble to more files\n\n");
+
+            printf("--extract <spiboot_file> \n");
+            printf("  Read the preamble from the spi-flash image <spiboot_file>\n\n");
+
+            printf("-o <payload_file> \n");
+            printf("  Copy the user's code of the --extract image (at the source address,\n"
+                    "  user's code length bytes; see --sra, --len) to <payload_file>\n\n");
+
+            printf("--save-cfg <cfg_file> \n");
+            printf("  Save the pair list of the preamble as a .cfg file\n\n");
+
+            printf("--save-dat <dat_file> \n");
+            printf("  Save the preamble as a .dat file\n\n");
+
+            printf("--spi -s <bootcode_file> -d <spiboot_file> \n");
+            printf("  Create a spi-flash image: "
+                    "<spiboot_file> = preamble + <bootcode_file>\n"
+                    "  More -d write the same image to more files at once: the image\n"
+                    "  is built once and copied by the kernel to each of them\n\n");
+
+            printf("--layout <layout_file> <flash_file> \n");
+            printf("  Create a whole flash image: the regions listed in <layout_file>\n"
+                    "  (offset, size, source, fill byte, alignment) are written in a\n"
+                    "  single parallel pass; the boot region holds preamble + user's code\n"
+                    "  as --spi does\n\n");
+
+            printf("--fill-mode dense|holes|extents \n");
+            printf("  How --layout writes the filler: every byte (dense, default), 0x00\n"
+                    "  filler as holes of a sparse file (holes), or 0x00 as holes and 0xFF\n"
+                    "  not at all, listing the data/zero/erased extents of the image in\n"
+                    "  <flash_file>.extents for the programmer (extents)\n\n");
+
+            printf("--ifmt auto|raw|elf|srec|ihex \n");
+            printf("  Format of <bootcode_file>: raw binary, ELF, Motorola S-record or\n"
+                    "  Intel HEX (default: detected from its content). The loadable\n"
+                    "  data are converted to the raw user's code while copying; the\n"
+                    "  target and exe start addresses are taken from the file, unless\n"
+                    "  --tga or --exe are given\n\n");
+
+            printf("--ofmt bin|srec|ihex \n");
+            printf("  Format of the <spiboot_file> created by --spi: binary (default),\n"
+                    "  Motorola S-record or Intel HEX\n\n");
+
+            printf("--oaddr <addr> \n");
+            printf("  Address of the image in the S-record/HEX records (default 0)\n\n");
+
+            printf("--skip-erased \n");
+            printf("  Do not emit S-record/HEX records made of 0xFF bytes only\n\n");
+
+            printf("--patch <spiboot_file>\n");
+            printf("  Patch the preamble of an existing spi-flash image\n\n");
+
+            printf("--addr <baddr> <newaddr>\n");
+            printf("  Replace the base address <baddr> with new value <newaddr>\n\n");
+
+            printf("--tga <trgaddr> \n");
+            printf("  Replace the default target address with new value <trgaddr>\n\n");
+
+            printf("--sra <srcaddr> \n");
+            printf("  Replace the default source address with new value <srcaddr>\n\n");
+
+            printf("--exe <exeaddr> \n");
+            printf("  Replace the default exe start address with new value <exeaddr>\n\n");
+
+            printf("--len <codelen> \n");
+            printf("  Replace the default user's code length with new value <codelen>,\n"
+                    "  the one of --bin, --dat, --board included; without it (and with\n"
+                    "  no length in --bin, --dat, --board), --spi and --layout set the\n"
+                    "  user's code length to the size of <bootcode_file>, padded with 0xFF\n"
+                    "  to a multiple of 4 (--show and --stats report the boot copy time\n"
+                    "  saved against the default 0x80000). An exe start address outside\n"
+                    "  the user's code copied at boot gets a warning, or is an error\n"
+                    "  when the length is given by --len\n\n");
+
+            printf("--spi-clock <MHz> \n");
+            printf("  eSPI clock the boot copy time is reported for (default 25 MHz)\n\n");
+
+            printf("--ddr-delays report|merge|fix \n");
+            printf("  Compute the delays required before and after DDR_SDRAM_CFG[MEM_EN]\n"
+                    "  from the DDR controller registers set by the pair list and report\n"
+                    "  them; 'merge' joins the delay pairs before and after MEM_EN into\n"
+                    "  one each, 'fix' rewrites them with the minimum safe values and\n"
+                    "  reports the boot time saved. The delays counted are those from\n"
+                    "  the first write to the controller up to MEM_EN, and from MEM_EN\n"
+                    "  up to the first write to the next controller\n\n");
+
+            printf("--delay-unit <ns> \n");
+            printf("  Duration of one unit of a delay pair, as documented for the boot\n"
+                    "  ROM of the part; 'report' and 'merge' assume 1000 ns without it,\n"
+                    "  'fix' requires it\n\n");
+
+            printf("Any file name may be '-' for the standard input/output; the user's\n"
+                    "code length of an image built from '-' is updated after streaming\n"
+                    "the boot code, unless --len is given or the output is a pipe.\n\n");
+
+            printf("--direct \n");
+            printf("  Write the --spi/--patch image by means of O_DIRECT I/O, bypassing\n"
+                    "  the page cache (e.g. for block devices), and report throughput\n\n");
+
+            printf("--journal \n");
+            printf("  Journal the --patch of an image: the new preamble is saved to\n"
+                    "  <spiboot_file>.journal before the image is written, so that an\n"
+                    "  interrupted patch is completed by the next --patch of the image\n\n");
+
+            printf("--sync \n");
+            printf("  Make the outputs durable before exiting. The output files are always\n"
+                    "  written to a temporary next to them and renamed at the end of the\n"
+                    "  run (or of the --batch); --sync flushes all of them at once, one\n"
+                    "  syncfs() per filesystem before and after the renames, instead of\n"
+                    "  one fsync() per file. With --patch it implies --journal\n\n");
+
+            printf("--verify \n");
+            printf("  Do not write anything: build the preamble in memory and compare the\n"
+                    "  --spi/--patch image and the --prb file with what would be written,\n"
+                    "  stopping at the first difference, whose offset is reported. The exit\n"
+                    "  code is 1 if any file differs. With --batch every job is verified,\n"
+                    "  on --jobs worker threads\n\n");
+
+            printf("--stats \n");
+            printf("  On exit, print to stderr the elapsed time, the peak RSS, the number\n"
+                    "  of read/write syscalls of the run (see bench_pipeline.sh) and the\n"
+                    "  allocations and high-water mark of the parse arena, and how many\n"
+                    "  .cfg/.dat files were parsed or reused (see include)\n\n");
+
+            printf("--trace <trace_file> \n");
+            printf("  Save a timeline of the run (file opens, parsing, preamble patching,\n"
+                    "  output writes, one track per thread) as Chrome trace events,\n"
+                    "  to be loaded by chrome://tracing or Perfetto\n\n");
+
+            printf("--batch <job_file> \n");
+            printf("  Build several images: each line of <job_file> holds the "
+                    "options of one image\n\n");
+
+            printf("--io stdio|uring \n");
+            printf("  I/O engine used by --batch; 'uring' keeps the payload reads and\n"
+                    "  the image writes of many jobs in flight by means of io_uring\n\n");
+
+            printf("--scan <dir|glob> \n");
+            printf("  Read the preamble of every image found in <dir> (recursively, the\n"
+                    "  subdirectories being listed in parallel) or matching <glob> ('-'\n"
+                    "  reads the paths from stdin), check it as --show does and print all\n"
+                    "  its fields, one record per image\n\n");
+
+            printf("--patch-all <dir|glob> \n");
+            printf("  Patch in place the preamble of every image found in <dir|glob> (as\n"
+                    "  --scan) with --cfg, --dat, --board, --addr, --tga, --sra, --exe and\n"
+                    "  --len; images already up to date are not written, the patched ones\n"
+                    "  are synced at the end. One status line per image\n\n");
+
+            printf("--bundle <bundle_file> <dir|glob> \n");
+            printf("  Pack the images found in <dir|glob> (as --scan) into <bundle_file>:\n"
+                    "  one variant per image, named after the file (without extension),\n"
+                    "  the user's code shared by the images being stored once\n\n");
+
+            printf("--bundle-list <bundle_file> \n");
+            printf("  List the variants of <bundle_file>: name, payload number, image size\n\n");
+
+            printf("--bundle-get <bundle_file> <variant> \n");
+            printf("  Read the preamble of <variant> from <bundle_file>; -o <spiboot_file>\n"
+                    "  writes the image of the variant (its preamble, as modified by the\n"
+                    "  other options, followed by its user's code)\n\n");
+
+            printf("--format jsonl|csv \n");
+            printf("  Output format of --scan: JSON Lines (default) or CSV\n\n");
+
+            printf("--jobs <n> \n");
+            printf("  Number of worker threads of --scan, --patch-all, --layout and\n"
+                    "  --batch --verify (default: number of CPUs); --scan and --patch-all\n"
+                    "  list the directories on as many threads\n");
+        }
+
+        void show_version() const throw()
+        {
+            printf("Version " SPIDYBOOT_VERSION " \n");
+        }
+
+
+    private:
+
+        enum state_t
+        {
+            CONTINUE_PARSING,
+            GET_BINFILE,
+            GET_CFGFILE,
+            GET_DATFILE,
+            GET_BOARD,
+            GET_PBLFILE,
+            GET_SRCDSTPARAM,
+            GET_SRCPARAM,
+            GET_SRCFILE,
+            GET_DSTPARAM,
+            GET_DSTFILE,
+            GET_SPIFILE,
+            GET_BADDR,
+            GET_NEWADDR,
+            GET_SRCADDR,
+            GET_TRGADDR,
+            GET_EXEADDR,
+            GET_CODELEN,
+            GET_BATCHFILE,
+            GET_IOENGINE,
+            GET_SCANPATH,
+            GET_FORMAT,
+            GET_JOBS,
+            GET_INFORMAT,
+            GET_OUTFORMAT,
+            GET_OUTADDR,
+            GET_DDRMODE,
+            GET_DELAYUNIT,
+            GET_TRACEFILE,
+            GET_LAYOUTFILE,
+            GET_FLASHFILE,
+            GET_FILLMODE,
+            GET_EXTRACTFILE,
+            GET_PAYLOADFILE,
+            GET_SAVECFGFILE,
+            GET_SAVEDATFILE,
+            GET_PATCHPATH,
+            GET_SPICLOCK,
+            GET_BUNDLEFILE,
+            GET_BUNDLEPATH,
+            GET_FROMBUNDLE,
+            GET_VARIANT,
+            GET_LISTBUNDLE
+        };
+
+    public:
+        cmd_args_t( int argc, char* argv[] ) throw()
+        {
+            state_t s = CONTINUE_PARSING;
+
+            for (int i = 0;
+                    i<argc;
+                    ++i)
+            {
+                if (i==0)
+                {
+                    config.app_fname = argv[0];
+                    continue;
+                }
+
+                std::string sArg = argv[ i ];
+
+                if (s == CONTINUE_PARSING && sArg == "--help") 
+                {
+                    config.show_help = true;
+
+                    if (argc != 2 )
+                    {
+                        config.error = "syntax error";
+                    }
+
+                    break;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--ver") 
+                {
+                    config.show_version = true;
+
+                    if (argc != 2 )
+                    {
+                        config.error = "syntax error";
+                    }
+
+                    break;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--list-boards") 
+                {
+                    config.list_boards = true;
+
+                    if (argc != 2 )
+                    {
+                        config.error = "syntax error";
+                    }
+
+                    break;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--show") 
+                {
+                    config.show_info = true;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--direct") 
+                {
+                    config.direct_io = true;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--stats") 
+                {
+                    config.show_stats = true;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--verify") 
+                {
+                    config.verify = true;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--journal") 
+                {
+                    config.journal = true;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--sync") 
+                {
+                    config.sync = true;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--trace" )
+                {
+                    s = GET_TRACEFILE;
+                }
+                else if (s == GET_TRACEFILE )
+                {
+                    config.trace_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--batch" )
+                {
+                    s = GET_BATCHFILE;
+                }
+                else if (s == GET_BATCHFILE )
+                {
+                    config.batch_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--scan" )
+                {
+                    s = GET_SCANPATH;
+                }
+                else if (s == GET_SCANPATH )
+                {
+                    config.scan_path = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--format" )
+                {
+                    s = GET_FORMAT;
+                }
+                else if (s == GET_FORMAT )
+                {
+                    if (sArg != "jsonl" && sArg != "csv")
+                    {
+                        config.error = std::string("'") + sArg + "' unknown format";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    config.out_format = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--ifmt" )
+                {
+                    s = GET_INFORMAT;
+                }
+                else if (s == GET_INFORMAT )
+                {
+                    if (! payload_reader_t::parse_format( sArg, config.in_format ))
+                    {
+                        config.error = std::string("'") + sArg + "' unknown input format";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--ofmt" )
+                {
+                    s = GET_OUTFORMAT;
+                }
+                else if (s == GET_OUTFORMAT )
+                {
+                    if (sArg == "bin") config.out_hex.format = util::hex_cfg_t::BIN;
+                    else if (sArg == "srec") config.out_hex.format = util::hex_cfg_t::SREC;
+                    else if (sArg == "ihex") config.out_hex.format = util::hex_cfg_t::IHEX;
+                    else
+                    {
+                        config.error = std::string("'") + sArg + "' unknown output format";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--oaddr" )
+                {
+                    s = GET_OUTADDR;
+                }
+                else if (s == GET_OUTADDR )
+                {
+                    sscanf( sArg.c_str(), "%x",  &config.out_hex.base );
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--ddr-delays" )
+                {
+                    s = GET_DDRMODE;
+                }
+                else if (s == GET_DDRMODE )
+                {
+                    if (! ddr_delays_t::parse_mode( sArg, config.ddr_mode ))
+                    {
+                        config.error = std::string("'") + sArg + "' unknown --ddr-delays mode";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    config.ddr_delays = true;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--delay-unit" )
+                {
+                    s = GET_DELAYUNIT;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--spi-clock" )
+                {
+                    s = GET_SPICLOCK;
+                }
+                else if (s == GET_SPICLOCK )
+                {
+                    unsigned int n = 0;
+                    sscanf( sArg.c_str(), "%u",  &n );
+
+                    if (n == 0)
+                    {
+                        config.error = std::string("'") + sArg + "' invalid SPI clock";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    config.spi_clock_mhz = n;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == GET_DELAYUNIT )
+                {
+                    unsigned int n = 0;
+                    sscanf( sArg.c_str(), "%u",  &n );
+
+                    if (n == 0)
+                    {
+                        config.error = std::string("'") + sArg + "' invalid delay unit";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    config.delay_unit_ns = n;
+                    config.delay_unit_given = true;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--skip-erased") 
+                {
+                    config.out_hex.skip_erased = true;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--jobs" )
+                {
+                    s = GET_JOBS;
+                }
+                else if (s == GET_JOBS )
+                {
+                    unsigned int n = 0;
+                    sscanf( sArg.c_str(), "%u",  &n );
+                    config.jobs = n;
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--io" )
+                {
+                    s = GET_IOENGINE;
+                }
+                else if (s == GET_IOENGINE )
+                {
+                    if (sArg != "stdio" && sArg != "uring")
+                    {
+                        config.error = std::string("'") + sArg + "' unknown I/O engine";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    config.io_engine = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--bin" )
+                {
+                    s = GET_BINFILE;
+                }
+                else if (s == GET_BINFILE )
+                {
+                    config.bin_fname = sArg;
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--patch-all" )
+                {
+                    s = GET_PATCHPATH;
+                }
+                else if (s == GET_PATCHPATH )
+                {
+                    config.patch_path = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--bundle" )
+                {
+                    s = GET_BUNDLEFILE;
+                }
+                else if (s == GET_BUNDLEFILE )
+                {
+                    config.bundle_fname = sArg;
+                    s = GET_BUNDLEPATH;
+                }
+                else if (s == GET_BUNDLEPATH )
+                {
+                    config.bundle_path = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--bundle-get" )
+                {
+                    s = GET_FROMBUNDLE;
+                }
+                else if (s == GET_FROMBUNDLE )
+                {
+                    config.from_bundle_fname = sArg;
+                    s = GET_VARIANT;
+                }
+                else if (s == GET_VARIANT )
+                {
+                    config.variant = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--bundle-list" )
+                {
+                    s = GET_LISTBUNDLE;
+                }
+                else if (s == GET_LISTBUNDLE )
+                {
+                    config.from_bundle_fname = sArg;
+                    config.list_variants = true;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--extract" )
+                {
+                    s = GET_EXTRACTFILE;
+                }
+                else if (s == GET_EXTRACTFILE )
+                {
+                    config.extract_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "-o" )
+                {
+                    s = GET_PAYLOADFILE;
+                }
+                else if (s == GET_PAYLOADFILE )
+                {
+                    config.payload_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--save-cfg" )
+                {
+                    s = GET_SAVECFGFILE;
+                }
+                else if (s == GET_SAVECFGFILE )
+                {
+                    config.save_cfg_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--save-dat" )
+                {
+                    s = GET_SAVEDATFILE;
+                }
+                else if (s == GET_SAVEDATFILE )
+                {
+                    config.save_dat_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--cfg" )
+                {
+                    s = GET_CFGFILE;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--dat" )
+                {
+                    s = GET_DATFILE;
+                }
+                else if (s == GET_CFGFILE )
+                {
+                    config.cfg_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == GET_DATFILE )
+                {
+                    config.dat_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--board" )
+                {
+                    s = GET_BOARD;
+                }
+                else if (s == GET_BOARD )
+                {
+                    config.board = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--prb" )
+                {
+                    s = GET_PBLFILE;
+                }
+                else if (s == GET_PBLFILE )
+                {
+                    if (config.prb_fname.empty())
+                    {
+                        config.prb_fname = sArg;
+                    }
+                    else
+                    {
+                        config.prb_copies.push_back( sArg );
+                    }
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--spi" )
+                {
+                    s = GET_SRCDSTPARAM;
+                }
+                else if ((s == GET_SRCDSTPARAM || s==GET_SRCPARAM) && sArg == "-s" )
+                {
+                    s = GET_SRCFILE;
+                }
+                else if ((s == GET_SRCDSTPARAM || s==GET_DSTPARAM || 
+                            (s == CONTINUE_PARSING && ! config.dst_fname.empty() && 
+                             ! config.replacepreamble)) && sArg == "-d" )
+                {
+                    s = GET_DSTFILE;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--layout" )
+                {
+                    s = GET_LAYOUTFILE;
+                }
+                else if (s == GET_LAYOUTFILE )
+                {
+                    config.layout_fname = sArg;
+                    s = GET_FLASHFILE;
+                }
+                else if (s == GET_FLASHFILE )
+                {
+                    config.flash_fname = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--fill-mode" )
+                {
+                    s = GET_FILLMODE;
+                }
+                else if (s == GET_FILLMODE )
+                {
+                    if (sArg != "dense" && sArg != "holes" && sArg != "extents")
+                    {
+                        config.error = std::string("'") + sArg + "' unknown fill mode";
+                        s = CONTINUE_PARSING;
+                        break;
+                    }
+
+                    config.fill_mode = sArg;
+                    s = CONTINUE_PARSING;
+                }
+                else if ((s == CONTINUE_PARSING) && sArg == "--patch" )
+                {
+                    s = GET_SPIFILE;
+                }
+                else if (s == GET_SRCFILE )
+                {
+                    config.src_fname = sArg;
+                    s = config.dst_fname.empty() ? GET_DSTPARAM : CONTINUE_PARSING;
+                }
+                else if (s == GET_DSTFILE )
+                {
+                    if (config.dst_fname.empty())
+                    {
+                        config.dst_fname = sArg;
+                    }
+                    else
+                    {
+                        config.dst_copies.push_back( sArg );
+                    }
+
+                    s = config.src_fname.empty() ? GET_SRCPARAM : CONTINUE_PARSING;
+                }
+                else if (s == GET_SPIFILE )
+                {
+                    config.dst_fname = sArg;
+                    config.replacepreamble = true;
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--addr" )
+                {
+                    s = GET_BADDR;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--tga" )
+                {
+                    s = GET_TRGADDR;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--sra" )
+                {
+                    s = GET_SRCADDR;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--exe" )
+                {
+                    s = GET_EXEADDR;
+                }
+                else if (s == CONTINUE_PARSING && sArg == "--len" )
+                {
+                    s = GET_CODELEN;
+                }
+                else if (s == GET_BADDR )
+                {
+                    unsigned int addr = 0;
+                    sscanf( sArg.c_str(), "%x",  &addr );
+                    config.baddr = addr;
+
+                    s = GET_NEWADDR;
+                }
+                else if (s == GET_NEWADDR )
+                {
+                    unsigned int addr = 0;
+                    sscanf( sArg.c_str(), "%x",  &addr );
+                    config.newaddr = addr;
+
+                    config.rebase = true;
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == GET_TRGADDR )
+                {
+                    unsigned int addr = 0;
+                    sscanf( sArg.c_str(), "%x",  &addr );
+                    config.trgaddr = addr;
+
+                    config.patchtrgaddr = true;
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == GET_SRCADDR )
+                {
+                    unsigned int addr = 0;
+                    sscanf( sArg.c_str(), "%x",  &addr );
+                    config.srcaddr = addr;
+
+                    config.patchsrcaddr = true;
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == GET_EXEADDR )
+                {
+                    unsigned int addr = 0;
+                    sscanf( sArg.c_str(), "%x",  &addr );
+                    config.exeaddr = addr;
+
+                    config.patchexeaddr = true;
+
+                    s = CONTINUE_PARSING;
+                }
+                else if (s == GET_CODELEN )
+                {
+                    unsigned int len = 0;
+                    sscanf( sArg.c_str(), "%x",  &len );
+                    config.codelen = len;
+
+                    config.patchcodelen = true;
+
+                    s = CONTINUE_PARSING;
+                }
+                else //ERROR
+                { 
+                    config.error = std::string("'") + sArg + "' syntax error";
+
+                    break; // error
+                }
+
+            } // for
+
+            switch (s)
+            {
+                case GET_CFGFILE:
+                    config.error = "Missing <cfg_file> argument";
+                    break;
+
+                case GET_DATFILE:
+                    config.error = "Missing <dat_file> argument";
+                    break;
+
+                case GET_BOARD:
+                    config.error = "Missing <name> argument";
+                    break;
+
+                case GET_PBLFILE:
+                    config.error = "Missing <preamble_file> argument";
+                    break;
+
+                case GET_BATCHFILE:
+                    config.error = "Missing <job_file> argument";
+                    break;
+
+                case GET_IOENGINE:
+                    config.error = "Missing I/O engine argument";
+                    break;
+
+                case GET_SCANPATH:
+                    config.error = "Missing <dir|glob> argument";
+                    break;
+
+                case GET_FORMAT:
+                    config.error = "Missing format argument";
+                    break;
+
+                case GET_JOBS:
+                    config.error = "Missing <n> argument";
+                    break;
+
+                case GET_INFORMAT:
+                    config.error = "Missing input format argument";
+                    break;
+
+                case GET_OUTFORMAT:
+                    config.error = "Missing output format argument";
+                    break;
+
+                case GET_OUTADDR:
+                    config.error = "Missing <addr> argument";
+                    break;
+
+                case GET_DDRMODE:
+                    config.error = "Missing --ddr-delays mode argument";
+                    break;
+
+                case GET_DELAYUNIT:
+                    config.error = "Missing <ns> argument";
+                    break;
+
+                case GET_SPICLOCK:
+                    config.error = "Missing <MHz> argument";
+                    break;
+
+                case GET_TRACEFILE:
+                    config.error = "Missing <trace_file> argument";
+                    break;
+
+                case GET_LAYOUTFILE:
+                    config.error = "Missing <layout_file> and <flash_file> arguments";
+                    break;
+
+                case GET_FLASHFILE:
+                    config.error = "Missing <flash_file> argument";
+                    break;
+
+                case GET_FILLMODE:
+                    config.error = "Missing fill mode argument";
+                    break;
+
+                case GET_EXTRACTFILE:
+                    config.error = "Missing <spiboot_file> argument";
+                    break;
+
+                case GET_PAYLOADFILE:
+                    config.error = "Missing <payload_file> argument";
+                    break;
+
+                case GET_SAVECFGFILE:
+                    config.error = "Missing <cfg_file> argument";
+                    break;
+
+                case GET_SAVEDATFILE:
+                    config.error = "Missing <dat_file> argument";
+                    break;
+
+                case GET_PATCHPATH:
+                    config.error = "Missing <dir|glob> argument";
+                    break;
+
+                case GET_BUNDLEFILE:
+                    config.error = "Missing <bundle_file> and <dir|glob> arguments";
+                    break;
+
+                case GET_BUNDLEPATH:
+                    config.error = "Missing <dir|glob> argument";
+                    break;
+
+                case GET_FROMBUNDLE:
+                    config.error = "Missing <bundle_file> and <variant> arguments";
+                    break;
+
+                case GET_VARIANT:
+                    config.error = "Missing <variant> argument";
+                    break;
+
+                case GET_LISTBUNDLE:
+                    config.error = "Missing <bundle_file> argument";
+                    break;
+
+                case GET_BADDR:
+                    config.error = "Missing <baddr> and <newaddr> arguments";
+                    break;
+
+                case GET_NEWADDR:
+                    config.error = "Missing <newaddr> argument";
+                    break;
+
+                case GET_TRGADDR:
+                    config.error = "Missing <trgaddr> argument";
+                    break;
+
+                case GET_SRCADDR:
+                    config.error = "Missing <srcaddr> argument";
+                    break;
+
+                case GET_EXEADDR:
+                    config.error = "Missing <exeaddr> argument";
+                    break;
+
+                case GET_CODELEN:
+                    config.error = "Missing <codelen> argument";
+                    break;
+
+                case GET_SRCDSTPARAM:
+                    config.error = 
+                        "Missing -s <bootcode_file> or -d <spiboot_file> argument";
+                    break;
+
+                case GET_SRCPARAM:
+                    config.error = "Missing -s <bootcode_file> argument";
+                    break;
+
+                case GET_DSTPARAM:
+                    config.error = "Missing -d <spiboot_file> argument";
+                    break;
+
+                default:
+                    if (s != CONTINUE_PARSING)
+                    {
+                        if (config.error.empty())
+                            config.error = "Syntax error";
+                    }
+                    break;
+
+            } // switch     
+
+            if (config.error.empty() && 
+                    ! config.board.empty() && ! config.dat_fname.empty())
+            {
+                config.error = "--board and --dat are mutually exclusive";
+            }
+
+            if (config.error.empty() && 
+                    ! config.layout_fname.empty() && ! config.dst_fname.empty())
+            {
+                config.error = "--layout, --spi and --patch are mutually exclusive";
+            }
+
+            if (config.error.empty() && ! config.extract_fname.empty() &&
+                    (! config.bin_fname.empty() || ! config.dst_fname.empty() || 
+                     ! config.layout_fname.empty()))
+            {
+                config.error = "--extract, --bin, --spi, --patch and --layout are mutually exclusive";
+            }
+
+            if (config.error.empty() && ! config.variant.empty() &&
+                    (! config.extract_fname.empty() || ! config.bin_fname.empty() || 
+                     ! config.dst_fname.empty() || ! config.layout_fname.empty()))
+            {
+                config.error = "--bundle-get, --extract, --bin, --spi, --patch and --layout "
+                    "are mutually exclusive";
+            }
+
+            if (config.error.empty() && 
+                    (config.bundle_fname == "-" || config.from_bundle_fname == "-"))
+            {
+                config.error = "--bundle, --bundle-get and --bundle-list need a bundle file, not '-'";
+            }
+
+            if (config.error.empty() && ! config.patch_path.empty() &&
+                    (! config.dst_fname.empty() || ! config.layout_fname.empty() ||
+                     ! config.extract_fname.empty() || ! config.prb_fname.empty() ||
+                     ! config.save_cfg_fname.empty() || ! config.save_dat_fname.empty() ||
+                     config.ddr_delays || config.verify || config.direct_io))
+            {
+                config.error = "--patch-all only takes the options editing the preamble";
+            }
+
+            if (config.error.empty() && config.ddr_delays && 
+                    config.ddr_mode == ddr_delays_t::FIX && ! config.delay_unit_given)
+            {
+                config.error = "--ddr-delays fix needs --delay-unit";
+            }
+
+            if (config.error.empty() && 
+                    ! config.payload_fname.empty() && 
+                    config.extract_fname.empty() && config.variant.empty())
+            {
+                config.error = "-o only applies to --extract and --bundle-get";
+            }
+
+            if (config.error.empty() && config.extract_fname == "-")
+            {
+                config.error = "--extract needs an image file, not '-'";
+            }
+
+            if (config.error.empty() && config.verify &&
+                    (! config.layout_fname.empty() || ! config.extract_fname.empty() ||
+                     ! config.variant.empty() ||
+                     ! config.save_cfg_fname.empty() || ! config.save_dat_fname.empty() ||
+                     config.direct_io))
+            {
+                config.error = "--verify does not apply to --layout, --extract, --bundle-get, "
+                    "--save-cfg, --save-dat and --direct";
+            }
+
+            if (config.error.empty() && config.journal &&
+                    (! config.replacepreamble || config.dst_fname == "-" || config.direct_io) &&
+                    config.batch_fname.empty())
+            {
+                config.error = "--journal only applies to --patch, not with '-' and --direct";
+            }
+
+            if (config.error.empty() && ! config.dst_copies.empty() && 
+                    (config.replacepreamble || config.src_fname.empty()))
+            {
+                config.error = "More -d only apply to --spi";
+            }
+
+            if (config.error.empty() && config.verify &&
+                    (config.dst_fname == "-" || config.prb_fname == "-" ||
+                     config.n_stdout_copies() > 0))
+            {
+                config.error = "--verify needs image files, not '-'";
+            }
+
+            // the copies are read back from the first destination, that
+            // cannot be the standard output
+            first_not_stdout( config.dst_fname, config.dst_copies );
+            first_not_stdout( config.prb_fname, config.prb_copies );
+
+            if (config.error.empty())
+            {
+                check_std_streams();
+            }
+        }
+
+
+        //------------------------------------------------------------------------------
+
+
+        bool writes_to_stdout() const throw()
+        {
+            return config.dst_fname == "-" || config.prb_fname == "-" ||
+                config.n_stdout_copies() > 0 ||
+                config.payload_fname == "-" || 
+                config.save_cfg_fname == "-" || config.save_dat_fname == "-";
+        }
+
+    private:
+
+        static void first_not_stdout( std::string& first, std::vector< std::string >& copies )
+        {
+            for (size_t i = 0; first == "-" && i < copies.size(); ++i)
+            {
+                std::swap( first, copies[i] );
+            }
+        }
+
+
+        // stdin and stdout ("-") can be used by one file only
+        void check_std_streams() throw()
+        {
+            const bool patch_stdin = config.replacepreamble && config.dst_fname == "-";
+
+            int n_stdin = 
+                (config.bin_fname == "-") +
+                (config.cfg_fname == "-") +
+                (config.dat_fname == "-") +
+                (config.src_fname == "-") +
+                patch_stdin;
+
+            int n_stdout = 
+                (config.dst_fname == "-") + 
+                (config.prb_fname == "-") +
+                config.n_stdout_copies() +
+                (config.payload_fname == "-") +
+                (config.save_cfg_fname == "-") +
+                (config.save_dat_fname == "-");
+
+            if (n_stdin > 1)
+            {
+                config.error = "The standard input can be read by one file only";
+            }
+            else if (n_stdout > 1)
+            {
+                config.error = "The standard output can be written by one file only";
+            }
+            else if (config.direct_io && (n_stdin || n_stdout))
+            {
+                config.error = "--direct cannot be used with '-'";
+            }
+        }
+};
+
+//------------------------------------------------------------------------------
+
+
+static bool direct_io_supported()
+{
+#ifdef WIN32
+    fprintf(stderr, "--direct is not supported on this platform\n");
+    return false;
+#else
+    return true;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// gzip compressed input (by its content) or output (by its name)
+static bool is_compressed( const std::string& filename, bool input )
+{
+#ifdef HAVE_GZ_STREAM
+    return input ? util::gz_file( filename ) : util::gz_name( filename );
+#else
+    (void) filename;
+    (void) input;
+    return false;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// The throughput is that of the blocks actually transferred
+static void show_io_stats( const std::string& filename, const util::io_stats_t& stats )
+{
+    printf("%s: %llu bytes written (%llu transferred) in %.3f s (%.1f MB/s%s)\n",
+            filename.c_str(),
+            stats.bytes,
+            stats.io_bytes,
+            stats.seconds,
+            stats.mb_per_sec(),
+            stats.direct ? ", O_DIRECT" : ", O_DIRECT not supported, buffered");
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// Parse state and pair lists of the job being built (see build_preamble)
+static util::arena_t parse_arena;
+
+
+//------------------------------------------------------------------------------
+
+
+#ifndef WIN32
+// Outputs of the run (or of the whole --batch), committed at its end
+static util::output_txn_t output_txn;
+#endif
+
+
+// Path to write the output fname to: a temporary next to it, renamed over
+// fname by commit_outputs(), so that a failed run leaves fname as it was
+static bool stage_output( const std::string& fname, std::string& path )
+{
+#ifdef WIN32
+    path = fname;
+    return true;
+#else
+    return output_txn.stage( fname, path );
+#endif
+}
+
+
+// Where the output fname is being written
+static const std::string& output_path( const std::string& fname )
+{
+#ifdef WIN32
+    return fname;
+#else
+    return output_txn.path_of( fname );
+#endif
+}
+
+
+// Number of outputs staged so far, see rollback_outputs
+static size_t staged_outputs()
+{
+#ifdef WIN32
+    return 0;
+#else
+    return output_txn.size();
+#endif
+}
+
+
+// Drop the outputs staged after the first <mark> ones (e.g. by a failed job)
+static void rollback_outputs( size_t mark )
+{
+#ifndef WIN32
+    output_txn.rollback( mark );
+#endif
+}
+
+
+static bool commit_outputs()
+{
+#ifndef WIN32
+    util::trace_span_t span( "commit" );
+    span.arg( "files", output_txn.size() );
+
+    std::string msg;
+
+    if (! output_txn.commit( msg ))
+    {
+        fprintf(stderr, "Error committing the outputs : '%s'\n", msg.c_str());
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// Write the output fname, just written, to the more destinations copies
+// at once. The kernel copies the data from fname (copy_file_range, a
+// reflink on filesystems supporting them, or splice to the standard
+// output), so that the image is built and written once whatever the
+// number of destinations. A status line per copy goes to status
+static bool tee_output( const std::string& fname, 
+        const std::vector< std::string >& copies,
+        FILE* status )
+{
+    if (copies.empty())
+    {
+        return true;
+    }
+
+#ifdef WIN32
+    fprintf(stderr, "Error: more destinations are not supported on this platform\n");
+    return false;
+#else
+    util::trace_span_t span( "tee" );
+    span.arg( "file", fname );
+    span.arg( "copies", copies.size() );
+
+    const int src = open( output_path( fname ).c_str(), O_RDONLY );
+    struct stat st;
+
+    if (src < 0 || fstat( src, &st ) != 0)
+    {
+        perror( ("Error reading \"" + fname + "\"").c_str() );
+
+        if (src >= 0) close( src );
+        return false;
+    }
+
+    // staged here, output_txn is not thread safe; then copied at once,
+    // sharing src (the copies read at explicit offsets)
+    std::vector< std::string > paths( copies.size() );
+    std::vector< int > err( copies.size(), 0 );
+
+    for (size_t i = 0; i < copies.size(); ++i)
+    {
+        if (! stage_output( copies[i], paths[i] ))
+        {
+            err[i] = errno;
+        }
+    }
+
+    util::run_workers< size_t >( unsigned( copies.size() ),
+        [&]( util::work_queue_t< size_t >& queue )
+        {
+            for (size_t i = 0; i < copies.size(); ++i) queue.push( i );
+        },
+        [&]( size_t i )
+        {
+            if (err[i]) return;
+
+            const bool out = paths[i] == "-";
+            const int dst = out ? STDOUT_FILENO : 
+                open( paths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+
+            if (dst < 0)
+            {
+                err[i] = errno;
+                return;
+            }
+
+            const long long n = util::copy_range( src, 0, dst, out ? -1 : 0, st.st_size );
+
+            if (n != (long long) st.st_size) err[i] = n < 0 ? errno : EIO;
+            if (! out && close( dst ) != 0 && ! err[i]) err[i] = errno;
+        });
+
+    close( src );
+
+    bool ok = true;
+
+    for (size_t i = 0; i < copies.size(); ++i)
+    {
+        if (err[i])
+        {
+            fprintf(stderr, "Error writing \"%s\" : '%s'\n", 
+                    copies[i].c_str(), strerror( err[i] ));
+            ok = false;
+        }
+        else
+        {
+            fprintf(status, "%s: %llu bytes, copy of %s\n", 
+                    copies[i].c_str(), (unsigned long long) st.st_size, fname.c_str());
+        }
+    }
+
+    return ok;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+#ifndef WIN32
+static double run_start_sec = 0;
+
+
+// Print the resources used by the run (--stats); only read(2)/write(2)
+// family calls are counted, as reported by /proc/self/io
+static void show_run_stats()
+{
+    struct rusage ru;
+    memset( &ru, 0, sizeof(ru) );
+    getrusage( RUSAGE_SELF, &ru );
+
+    unsigned long long syscr = 0, syscw = 0;
+    FILE * io = fopen( "/proc/self/io", "r" );
+
+    if (io)
+    {
+        char line[ 128 ];
+
+        while (fgets( line, sizeof(line), io ))
+        {
+            sscanf( line, "syscr: %llu", &syscr );
+            sscanf( line, "syscw: %llu", &syscw );
+        }
+
+        fclose( io );
+    }
+
+    fprintf(stderr, "stats: %.6f s elapsed, %.3f s user, %.3f s sys, "
+            "%ld KB max RSS, %llu read + %llu write syscalls\n",
+            util::now_sec() - run_start_sec,
+            double(ru.ru_utime.tv_sec) + double(ru.ru_utime.tv_usec) / 1e6,
+            double(ru.ru_stime.tv_sec) + double(ru.ru_stime.tv_usec) / 1e6,
+            ru.ru_maxrss,
+            syscr, syscw);
+
+    fprintf(stderr, "stats: parse arena: %lu allocations, %lu bytes high-water, "
+            "%lu heap blocks\n",
+            parse_arena.allocs(),
+            (unsigned long) parse_arena.high_water(),
+            parse_arena.heap_blocks());
+
+    const mc_config_t::parse_stats_t parse = mc_config_t::stats();
+
+    fprintf(stderr, "stats: cfg/dat files: %lu parsed, %lu taken from the cache, "
+            "%lu dropped from it\n",
+            parse.parsed, parse.reused, parse.evicted);
+}
+#endif
+
+
+//------------------------------------------------------------------------------
+
+
+static std::string trace_fname;
+
+
+// Save the trace recorded during the run (--trace)
+static void save_trace()
+{
+    if (! util::tracer_t::instance().save( trace_fname ))
+    {
+        perror( ("Error writing trace file \"" + trace_fname + "\"").c_str() );
+    }
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// List the built-in board profiles (--list-boards)
+static void show_boards()
+{
+    for (unsigned int i = 0; i < board_profile_t::count(); ++i)
+    {
+        const board_profile_t & b = board_profile_t::at( i );
+
+        printf("%-32s %3u entries\n", b.name, b.n_pairs);
+    }
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// Pair lists given by --cfg, --dat and --board, allocated from the
+// current arena
+struct preamble_edits_t
+{
+    mc_config_t::assignlist_t lst;     // replaces the pairs
+    mc_config_t::assignlist_t datlst;  // words patched at their offset
+};
+
+
+//------------------------------------------------------------------------------
+
+
+// Read the edits of the preamble (--cfg, --dat, --board), rebased by --addr
+static bool load_edits( const cmd_args_t::cfg_t& config, 
+        preamble_edits_t& edits )
+{
+//////////////////////////////////////////////////////////////////////////////
+// Process cfg file (--cfg)
+//
+    if (! config.cfg_fname.empty())
+    {
+        mc_config_t cfg;
+        std::string msg;
+
+        if (! cfg.compile_cfg( config.cfg_fname, edits.lst, msg) )
+        {
+            if (msg.empty())
+            {
+                fprintf(stderr, "Cannot compile file '%s'\n", 
+                        config.cfg_fname.c_str());
+            }
+            else
+            {
+                fprintf(stderr, "Error compiling \"%s\" : '%s'\n", 
+                        config.cfg_fname.c_str(),
+                        msg.c_str());
+            }
+
+            return false;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Process dat file (--dat)
+//
+    if (! config.dat_fname.empty())
+    {
+        mc_config_t cfg;
+        std::string msg;
+
+        if (! cfg.compile_dat( config.dat_fname, edits.datlst, msg) )
+        {
+            if (msg.empty())
+            {
+                fprintf(stderr, "Cannot compile file '%s'\n", 
+                        config.dat_fname.c_str());
+            }
+            else
+            {
+                fprintf(stderr, "Error compiling \"%s\" : '%s'\n", 
+                        config.dat_fname.c_str(),
+                        msg.c_str());
+            }
+
+            return false;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Process built-in board profile (--board)
+//
+    if (! config.board.empty())
+    {
+        util::trace_span_t span( "board" );
+        span.arg( "board", config.board );
+
+        std::string msg;
+        const board_profile_t * board = board_profile_t::find( config.board, msg );
+
+        if (! board)
+        {
+            fprintf(stderr, "Error: %s\n", msg.c_str());
+            return false;
+        }
+
+        for (unsigned int i = 0; i < board->n_pairs; ++i)
+        {
+            edits.datlst.push_back( { board->pairs[i].ofs, board->pairs[i].value } );
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Rebase address (--addr)
+//
+    if (config.rebase)
+    {
+        util::trace_span_t span( "rebase" );
+        span.arg( "pairs", edits.lst.size() );
+
+        mc_config_t::rebase_immr( config.baddr, config.newaddr, edits.lst );
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// Apply the edits and --tga, --sra, --exe, --len to a preamble
+static bool apply_edits( const cmd_args_t::cfg_t& config, 
+        const preamble_edits_t& edits,
+        boot_spi_data_t& boot_spi_data )
+{
+//////////////////////////////////////////////////////////////////////////////
+// Patch preamble 
+//
+    util::trace_span_t patch_span( "patch_preamble" );
+    patch_span.arg( "pairs", edits.lst.size() + edits.datlst.size() );
+
+    //--tga
+    if (config.patchtrgaddr)
+    {
+        boot_spi_data.set_target_addr( config.trgaddr );
+    }
+
+    //--sra
+    if (config.patchsrcaddr)
+    {
+        boot_spi_data.set_src_addr( config.srcaddr );
+    }
+
+    //--exe
+    if (config.patchexeaddr)
+    {
+        boot_spi_data.set_exest_addr( config.exeaddr );
+    }
+
+    // process .cfg patch list
+    if (!edits.lst.empty())
+    {
+        boot_spi_data.set_n_cfg_pairs( edits.lst.size() );
+
+        int idx = 0;
+
+        for (mc_config_t::assignlist_t::const_iterator i = edits.lst.begin();
+                i != edits.lst.end();
+                ++i, ++idx)
+        {
+            boot_spi_data.set_cfg_pair( idx, i->first, i->second );
+        }
+    }
+
+    // process .dat patch list
+    if (!edits.datlst.empty())
+    {
+        for (mc_config_t::assignlist_t::const_iterator i = edits.datlst.begin();
+                i != edits.datlst.end();
+                ++i)
+        {
+            if (! boot_spi_data.patch_dword_at( i->first, i->second ))
+            {
+                fprintf(stderr, "Error: offset 0x%x of \"%s\" is out of the preamble\n",
+                        i->first, config.board.empty() ? 
+                        config.dat_fname.c_str() : config.board.c_str());
+                return false;
+            }
+        }
+    }
+
+    //--len, after the .dat words: most of them set 048 too
+    if (config.patchcodelen)
+    {
+        boot_spi_data.set_user_code_len( config.codelen );
+    }
+
+    patch_span.end();
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// Build the preamble as described by --bin, --cfg, --dat, --board, --addr, 
+// --tga, --sra and --exe
+static bool build_preamble( const cmd_args_t::cfg_t& config, 
+        boot_spi_data_t& boot_spi_data )
+{
+    // everything parsed for this job is dropped at once on return
+    util::arena_scope_t arena_scope( parse_arena );
+
+//////////////////////////////////////////////////////////////////////////////
+// Process bynary file (--bin)
+//
+    if (! config.bin_fname.empty() || ! config.extract_fname.empty())
+    {
+        // --extract: the preamble of the image
+        const std::string& fname = config.bin_fname.empty() ? 
+            config.extract_fname : config.bin_fname;
+
+        util::trace_span_t span( "load_bin" );
+        span.arg( "file", fname );
+        span.arg( "bytes", boot_spi_data_t::get_data_size() );
+
+        if (! boot_spi_data.load_from_file( fname ) )
+        {
+            perror("Error loading file");
+            return false;
+        }
+    }
+    else if (! config.variant.empty())
+    {
+#ifdef WIN32
+        fprintf(stderr, "--bundle-get is not supported on this platform\n");
+        return false;
+#else
+        // --bundle-get: the preamble of the variant
+        util::trace_span_t span( "load_variant" );
+        span.arg( "file", config.from_bundle_fname );
+        span.arg( "variant", config.variant );
+
+        image_bundle_t bundle;
+        std::string msg;
+
+        if (! bundle.open( config.from_bundle_fname, msg ))
+        {
+            fprintf(stderr, "Error reading \"%s\" : '%s'\n", 
+                    config.from_bundle_fname.c_str(), msg.c_str());
+            return false;
+        }
+
+        const int v = bundle.find( config.variant );
+
+        if (v < 0)
+        {
+            fprintf(stderr, "Error: no variant \"%s\" in \"%s\" (see --bundle-list)\n", 
+                    config.variant.c_str(), config.from_bundle_fname.c_str());
+            return false;
+        }
+
+        boot_spi_data.load_from_memory( bundle.preamble( unsigned( v ) ) );
+#endif
+    }
+    else
+    {
+        boot_spi_data.set_default();
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Process cfg, dat and board, patch the preamble
+//
+    preamble_edits_t edits;
+
+    if (! load_edits( config, edits ) || ! apply_edits( config, edits, boot_spi_data ))
+    {
+        return false;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Check or minimize the DDR init delays (--ddr-delays)
+//
+    if (config.ddr_delays)
+    {
+        util::trace_span_t span( "ddr_delays" );
+
+        const cfg_pair_range_t range = boot_spi_data.view().cfg_pairs();
+        std::vector< cfg_pair_t > pairs;
+        std::vector< ddr_delays_t::ctrl_t > ctrls;
+        ddr_delays_t delays( config.delay_unit_ns );
+        std::string msg;
+
+        for (cfg_pair_range_t::const_iterator i = range.begin(); i != range.end(); ++i)
+        {
+            pairs.push_back( *i );
+        }
+
+        if (! delays.run( pairs, config.ddr_mode, ctrls, msg ))
+        {
+            fprintf(stderr, "Error: %s\n", msg.c_str());
+            return false;
+        }
+
+        if (config.ddr_mode != ddr_delays_t::REPORT)
+        {
+            const unsigned int old_n = range.size();
+
+            if (pairs.size() > boot_spi_data.view().get_cfg_pairs_capacity())
+            {
+                fprintf(stderr, "Error: too many pairs after rewriting the delays\n");
+                return false;
+            }
+
+            boot_spi_data.set_n_cfg_pairs( unsigned( pairs.size() ) );
+
+            for (unsigned int idx = 0; idx < old_n || idx < pairs.size(); ++idx)
+            {
+                // clear the pairs left over
+                boot_spi_data.set_cfg_pair( int(idx), 
+                        idx < pairs.size() ? pairs[idx].addr : 0, 
+                        idx < pairs.size() ? pairs[idx].data : 0 );
+            }
+        }
+
+        delays.show( ctrls, config.ddr_mode, config.status_stream() );
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// How the preamble is updated from the user's code: unless a length is given
+// (--len, or the preamble of --bin, --dat, --board...), the user's code 
+// length is fitted to the payload (padded to 4 bytes)
+static unsigned int attach_flags( const cmd_args_t::cfg_t& config, 
+        const boot_spi_data_t& boot_spi_data )
+{
+    unsigned int flags = 0;
+
+    if (! config.patchcodelen && ! boot_spi_data.code_len_given())
+        flags |= boot_spi_data_t::ATTACH_UPDATE_CODE_LEN | boot_spi_data_t::ATTACH_PAD_CODE;
+
+    if (! config.patchtrgaddr)
+        flags |= boot_spi_data_t::ATTACH_SET_TARGET_ADDR;
+
+    if (! config.patchexeaddr)
+        flags |= boot_spi_data_t::ATTACH_SET_EXEST_ADDR;
+
+    return flags;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// An image whose exe start address is not in the user's code copied at
+// boot would not boot: false if so, msg tells why
+static bool code_window_ok( const boot_spi_data_t& boot_spi_data, std::string& msg )
+{
+    const unsigned int len = boot_spi_data.get_user_code_len();
+    const unsigned long long start = boot_spi_data.get_target_addr();
+    const unsigned long long end = start + len;
+    const unsigned int exe = boot_spi_data.get_exest_addr();
+    char buf[ 160 ];
+
+    if (end > 0x100000000ULL)
+    {
+        snprintf( buf, sizeof(buf), "the user's code copied to 0x%08llx "
+                "(0x%x bytes) goes beyond the 32-bit address space", start, len);
+        msg = buf;
+        return false;
+    }
+
+    if (exe < start || exe >= end)
+    {
+        snprintf( buf, sizeof(buf), "the exe start address 0x%08x is outside the user's "
+                "code copied at boot (0x%08llx-0x%08llx), see --tga, --exe, --len",
+                exe, start, end);
+        msg = buf;
+        return false;
+    }
+
+    return true;
+}
+
+
+// An image that would not boot (see code_window_ok) is only an error when
+// --len gave the length, the defaults and the files may be fixed up later
+static bool code_window_fatal( const cmd_args_t::cfg_t& config, 
+        const boot_spi_data_t& boot_spi_data, std::string& msg )
+{
+    if (code_window_ok( boot_spi_data, msg ) || ! config.patchcodelen)
+    {
+        msg.clear();
+        return false;
+    }
+
+    return true;
+}
+
+
+// Warn if the image dstname would not boot (fail, with --len) and, when 
+// the user's code length has been fitted to the payload, report the boot
+// copy time saved against the default length (see --spi-clock) with
+// --show or --stats
+static bool check_code_window( const cmd_args_t::cfg_t& config, 
+        const boot_spi_data_t& boot_spi_data,
+        const std::string& dstname )
+{
+    const unsigned int len = boot_spi_data.get_user_code_len();
+    std::string msg;
+
+    if (! code_window_ok( boot_spi_data, msg ))
+    {
+        fprintf(stderr, "%s: \"%s\": %s\n", 
+                config.patchcodelen ? "Error" : "Warning", dstname.c_str(), msg.c_str());
+
+        if (config.patchcodelen)
+        {
+            return false;
+        }
+    }
+
+    if (! boot_spi_data.code_len_fitted() || ! (config.show_info || config.show_stats))
+    {
+        return true;
+    }
+
+    // the boot loader reads the flash one bit per clock
+    const long long saved = (long long) preamble_builder_t::DEFAULT_USER_CODE_LEN - len;
+    const double ms = fabs( double(saved) ) * 8 / (config.spi_clock_mhz * 1000.0);
+
+    fprintf(config.status_stream(),
+            "%s: user's code length 0x%x (%u bytes), boot copy time %s: %.1f ms "
+            "(default 0x%x, %u MHz)\n",
+            dstname.c_str(), len, len,
+            saved >= 0 ? "saved" : "added",
+            ms,
+            unsigned( preamble_builder_t::DEFAULT_USER_CODE_LEN ),
+            config.spi_clock_mhz);
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+#ifndef WIN32
+// Write the boot region of a flash image (--layout): the same content
+// --spi would write, at the offset of the region
+static bool write_boot_region( const cmd_args_t::cfg_t& config, 
+        boot_spi_data_t& boot_spi_data,
+        const flash_region_t& region, 
+        int fd, 
+        const std::string& dstname,
+        unsigned long long& len,
+        std::string& msg )
+{
+    const payload_reader_t::format_t format = config.in_format == payload_reader_t::AUTO ?
+        payload_reader_t::detect_file( region.source ) : config.in_format;
+
+    // the filler of the region pads the user's code
+    const unsigned int flags = attach_flags( config, boot_spi_data ) & ~boot_spi_data_t::ATTACH_PAD_CODE;
+    const size_t size = boot_spi_data_t::get_data_size();
+
+    if (format == payload_reader_t::RAW)
+    {
+        // preamble, then user's code copied by the kernel
+        const int src = open( region.source.c_str(), O_RDONLY );
+        if (src < 0) return false;
+
+        if (flags & boot_spi_data_t::ATTACH_UPDATE_CODE_LEN)
+        {
+            boot_spi_data.set_fitted_code_len( region.src_len );
+        }
+
+        // known before writing anything
+        if (code_window_fatal( config, boot_spi_data, msg ))
+        {
+            close( src );
+            return false;
+        }
+
+        const long long n = 
+            pwrite( fd, boot_spi_data.get_data(), size, off_t( region.offset ) ) == ssize_t( size ) ?
+            util::copy_range( src, 0, fd, off_t( region.offset + size ), region.src_len ) : -1;
+
+        close( src );
+
+        len = size + n;
+        return n >= 0;
+    }
+
+    // converted user's code, the preamble may be patched after the copy
+    FILE * f = fopen( dstname.c_str(), "r+b" );
+    if (!f) return false;
+
+    bool ret = fseek( f, long( region.offset ), SEEK_SET ) == 0 &&
+        boot_spi_data.attach_at( region.source, f, dstname, msg, len, flags, format );
+
+    ret = fclose( f ) == 0 && ret;
+    len += size;
+
+    return ret && ! code_window_fatal( config, boot_spi_data, msg );
+}
+#endif
+
+
+//------------------------------------------------------------------------------
+
+
+#ifdef HAVE_CMP_STREAM
+// Compare fname with what would be written to it: the preamble only (whole
+// false, --patch), the preamble (--prb) or preamble + srcname (--spi). 
+// Appends one line to report, returns true if the file matches
+static bool verify_file( const cmd_args_t::cfg_t& config, 
+        boot_spi_data_t& boot_spi_data,
+        const std::string& fname,
+        const std::string& srcname,
+        bool whole,
+        std::string& report )
+{
+    util::trace_span_t span( "verify" );
+    span.arg( "file", fname );
+
+    if (is_compressed( fname, true ))
+    {
+        report += fname + ": compressed images cannot be verified\n";
+        return false;
+    }
+
+    const int fd = open( fname.c_str(), O_RDONLY );
+
+    if (fd < 0)
+    {
+        report += fname + ": " + strerror( errno ) + "\n";
+        return false;
+    }
+
+    util::image_comparer_t cmp( fd );
+    std::string msg;
+    bool ok = true;
+
+    if (srcname.empty())
+    {
+        if (cmp.write( boot_spi_data.get_data(), boot_spi_data_t::get_data_size() ))
+        {
+            cmp.finish( whole );
+        }
+    }
+    else
+    {
+        ok = boot_spi_data.compare_to( srcname, cmp, msg, 
+                attach_flags( config, boot_spi_data ), config.in_format, config.out_hex );
+    }
+
+    const int err = cmp.error() ? cmp.error() : errno;
+
+    close( fd );
+
+    if (cmp.error())
+    {
+        report += fname + ": " + strerror( err ) + "\n";
+        return false;
+    }
+
+    if (! ok)
+    {
+        report += fname + ": error reading \"" + srcname + "\" : '" + 
+            (msg.empty() ? std::string( strerror( err ) ) : msg) + "'\n";
+        return false;
+    }
+
+    char line[ 128 ] = "";
+    const unsigned long long ofs = cmp.offset();
+    const char * region = ofs < boot_spi_data_t::get_data_size() ? "preamble" : "user's code";
+
+    switch (cmp.result())
+    {
+        case util::image_comparer_t::SAME:
+            snprintf( line, sizeof(line), ": OK\n" );
+            break;
+
+        case util::image_comparer_t::DIFFERS:
+            snprintf( line, sizeof(line), ": differs at offset 0x%llx (%s)\n", ofs, region );
+            break;
+
+        case util::image_comparer_t::SHORTER:
+            snprintf( line, sizeof(line), ": too short, ends at offset 0x%llx (%s)\n", ofs, region );
+            break;
+
+        case util::image_comparer_t::LONGER:
+            snprintf( line, sizeof(line), ": too long, goes on after offset 0x%llx\n", ofs );
+            break;
+    }
+
+    report += fname + line;
+    span.arg( "result", line + 2 );
+
+    return cmp.result() == util::image_comparer_t::SAME;
+}
+#endif
+
+
+//------------------------------------------------------------------------------
+
+
+// Compare the files --patch, --spi and --prb (all their destinations) would
+// write with the existing ones (--verify), appending the outcome to report; nothing is written
+static bool verify_outputs( const cmd_args_t::cfg_t& config, 
+        boot_spi_data_t& boot_spi_data,
+        std::string& report )
+{
+#ifndef HAVE_CMP_STREAM
+    report += "--verify is not supported on this platform\n";
+    return false;
+#else
+    bool ok = true;
+
+    if ( config.replacepreamble && ! config.dst_fname.empty() )
+    {
+        if (config.out_hex.format != util::hex_cfg_t::BIN)
+        {
+            report += "Error: --ofmt only applies to --spi\n";
+            return false;
+        }
+
+        ok = verify_file( config, boot_spi_data, config.dst_fname, "", false, report ) && ok;
+    }
+
+    if ( ! config.replacepreamble && 
+            ! config.dst_fname.empty() &&
+            ! config.src_fname.empty() )
+    {
+        ok = verify_file( config, boot_spi_data, config.dst_fname, config.src_fname, true, report ) && ok;
+
+        for (size_t i = 0; i < config.dst_copies.size(); ++i)
+        {
+            ok = verify_file( config, boot_spi_data, config.dst_copies[i], config.src_fname, true, report ) && ok;
+        }
+    }
+
+    if ( ! config.prb_fname.empty() )
+    {
+        ok = verify_file( config, boot_spi_data, config.prb_fname, "", true, report ) && ok;
+
+        for (size_t i = 0; i < config.prb_copies.size(); ++i)
+        {
+            ok = verify_file( config, boot_spi_data, config.prb_copies[i], "", true, report ) && ok;
+        }
+    }
+
+    return ok;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// Write the output files requested by --patch, --spi, --layout and --prb
+static bool write_outputs( const cmd_args_t::cfg_t& config, 
+        boot_spi_data_t& boot_spi_data )
+{
+    if ( config.verify )
+    {
+        std::string report;
+        const bool ok = verify_outputs( config, boot_spi_data, report );
+
+        fputs( report.c_str(), stdout );
+        return ok;
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+// Modify the preamble of an existing spi-flash boot image (--patch)
+//
+    if ( config.replacepreamble && ! config.dst_fname.empty() )
+    {
+        util::trace_span_t span( "patch_image" );
+        span.arg( "file", config.dst_fname );
+        span.arg( "bytes", boot_spi_data_t::get_data_size() );
+
+        if (config.out_hex.format != util::hex_cfg_t::BIN)
+        {
+            fprintf(stderr, "Error: --ofmt only applies to --spi\n");
+            return false;
+        }
+
+        if (is_compressed( config.dst_fname, true ))
+        {
+            fprintf(stderr, "Error: --patch does not support compressed images\n");
+            return false;
+        }
+
+#ifndef WIN32
+        // complete the patch an interrupted run left in a journal
+        const int recovered = config.dst_fname == "-" ? 0 :
+            util::patch_journal_t::recover( config.dst_fname );
+
+        if (recovered < 0)
+        {
+            perror( ("Error recovering the journal of \"" + config.dst_fname + "\"").c_str() );
+            return false;
+        }
+
+        if (recovered > 0)
+        {
+            fprintf(stderr, "%s: interrupted patch completed from its journal\n", 
+                    config.dst_fname.c_str());
+        }
+#endif
+
+        if (config.direct_io)
+        {
+            if (! direct_io_supported())
+            {
+                return false;
+            }
+#ifndef WIN32
+            util::io_stats_t stats;
+
+            if (! boot_spi_data.patch_direct( config.dst_fname, stats ))
+            {
+                perror("Error patching spi-flash image file");
+                return false;
+            }
+
+            show_io_stats( config.dst_fname, stats );
+#endif
+        }
+#ifndef WIN32
+        else if ((config.journal || config.sync) && config.dst_fname != "-")
+        {
+            if (! boot_spi_data.patch_journaled( config.dst_fname, output_txn ))
+            {
+                perror("Error patching spi-flash image file");
+                return false;
+            }
+        }
+#endif
+        else if (! boot_spi_data.patch( config.dst_fname ))
+        {
+            perror("Error patching spi-flash image file");
+            return false;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Merge preamble and source boot image in order to create 
+// a new spi-flash boot image (--spi)
+//
+    if ( ! config.replacepreamble && 
+            ! config.dst_fname.empty() &&
+            ! config.src_fname.empty() )
+    {
+        const unsigned int flags = attach_flags( config, boot_spi_data );
+        std::string msg;
+        std::string path;
+
+#ifndef HAVE_HEX_STREAM
+        if (config.out_hex.format != util::hex_cfg_t::BIN)
+        {
+            fprintf(stderr, "Error: --ofmt is not supported on this platform\n");
+            return false;
+        }
+#endif
+
+        if (config.direct_io && config.out_hex.format != util::hex_cfg_t::BIN)
+        {
+            fprintf(stderr, "Error: --direct only supports binary <spiboot_file>\n");
+            return false;
+        }
+        else if (config.direct_io && 
+                (config.in_format == payload_reader_t::AUTO ?
+                 payload_reader_t::detect_file( config.src_fname ) : config.in_format) != 
+                payload_reader_t::RAW)
+        {
+            fprintf(stderr, "Error: --direct only supports raw <bootcode_file>\n");
+            return false;
+        }
+        else if (config.direct_io && 
+                (is_compressed( config.src_fname, true ) || is_compressed( config.dst_fname, false )))
+        {
+            fprintf(stderr, "Error: --direct does not support compressed files\n");
+            return false;
+        }
+        else if (config.direct_io)
+        {
+            if (! direct_io_supported())
+            {
+                return false;
+            }
+#ifndef WIN32
+            util::io_stats_t stats;
+            util::trace_span_t span( "write_spi" );
+            span.arg( "src", config.src_fname );
+            span.arg( "dst", config.dst_fname );
+
+            if (! boot_spi_data.attach_to_direct( config.src_fname, 
+                        config.dst_fname, stats, flags ))
+            {
+                perror("Error creating spi-flash image file");
+                return false;
+            }
+
+            span.arg( "bytes", stats.bytes );
+
+            show_io_stats( config.dst_fname, stats );
+#endif
+        }
+        else if (! stage_output( config.dst_fname, path ) ||
+                ! boot_spi_data.attach_to( config.src_fname, 
+                    path, msg, flags, config.in_format, config.out_hex ))
+        {
+            if (msg.empty())
+            {
+                perror("Error creating spi-flash image file");
+            }
+            else
+            {
+                fprintf(stderr, "Error reading \"%s\" : '%s'\n", 
+                        config.src_fname.c_str(), msg.c_str());
+            }
+
+            return false;
+        }
+
+        if (! tee_output( config.dst_fname, config.dst_copies, 
+                    config.status_stream() ))
+        {
+            return false;
+        }
+
+        if (! check_code_window( config, boot_spi_data, config.dst_fname ))
+        {
+            return false;
+        }
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Compose a whole flash image (--layout)
+//
+    if ( ! config.layout_fname.empty() )
+    {
+#ifdef WIN32
+        fprintf(stderr, "--layout is not supported on this platform\n");
+        return false;
+#else
+        if (config.out_hex.format != util::hex_cfg_t::BIN || config.direct_io)
+        {
+            fprintf(stderr, "Error: --ofmt and --direct do not apply to --layout\n");
+            return false;
+        }
+
+        flash_layout_t layout;
+        flash_layout_t::fill_mode_t mode = flash_layout_t::DENSE;
+        unsigned long long written = 0;
+        std::string msg;
+        const double t0 = util::now_sec();
+
+        flash_layout_t::parse_fill_mode( config.fill_mode, mode );
+
+        if (! layout.load( config.layout_fname, msg ) || 
+                ! layout.resolve( config.in_format, msg ) ||
+                ! layout.write( config.flash_fname, 
+                    config.jobs ? config.jobs : util::default_workers(),
+                    mode,
+                    [&]( const flash_region_t& region, int fd, const std::string& dstname,
+                        unsigned long long& len, std::string& err )
+                    {
+                        return write_boot_region( config, boot_spi_data, 
+                                region, fd, dstname, len, err );
+                    },
+                    written, msg ))
+        {
+            fprintf(stderr, "Error: %s\n", msg.c_str());
+            return false;
+        }
+
+        const double elapsed = util::now_sec() - t0;
+
+        printf("%s: %u regions, %llu bytes, %llu written in %.3f s (%.1f MB/s)\n",
+                config.flash_fname.c_str(),
+                unsigned( layout.regions().size() ),
+                layout.size(),
+                written,
+                elapsed,
+                elapsed > 0 ? double(written) / (1024.0*1024.0) / elapsed : 0.0);
+
+        for (size_t i = 0; i < layout.regions().size(); ++i)
+        {
+            if (layout.regions()[i].boot && 
+                    ! check_code_window( config, boot_spi_data, config.flash_fname ))
+            {
+                return false;
+            }
+        }
+#endif
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Write the image of a variant out of a bundle (--bundle-get -o)
+//
+#ifndef WIN32
+    if ( ! config.variant.empty() && ! config.payload_fname.empty() )
+    {
+        util::trace_span_t span( "write_variant" );
+        span.arg( "src", config.from_bundle_fname );
+        span.arg( "variant", config.variant );
+        span.arg( "dst", config.payload_fname );
+
+        image_bundle_t bundle;
+        std::string msg;
+        std::string path;
+        int v = -1;
+
+        if (bundle.open( config.from_bundle_fname, msg ))
+        {
+            v = bundle.find( config.variant );
+            if (v < 0) msg = "no variant \"" + config.variant + "\"";
+        }
+
+        if (v < 0)
+        {
+            fprintf(stderr, "Error reading \"%s\" : '%s'\n", 
+                    config.from_bundle_fname.c_str(), msg.c_str());
+            return false;
+        }
+
+        if (! stage_output( config.payload_fname, path ))
+        {
+            perror("Error creating spi-flash image file");
+            return false;
+        }
+
+        // the preamble is the one of the variant, edited by the other options;
+        // the payload is copied by the kernel (splice to a pipe)
+        const bool stream = path == "-";
+        const int fd = stream ? STDOUT_FILENO : 
+            open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+
+        const bool ok = fd >= 0 && 
+            bundle.write_image( unsigned( v ), boot_spi_data.get_data(), fd, stream, msg );
+
+        if (fd < 0)
+        {
+            perror("Error creating spi-flash image file");
+        }
+        else if (! ok)
+        {
+            fprintf(stderr, "Error writing \"%s\" : '%s'\n", 
+                    config.payload_fname.c_str(), msg.c_str());
+        }
+
+        if (! stream && fd >= 0) close( fd );
+        if (! ok) return false;
+
+        span.arg( "bytes", bundle.image_size( unsigned( v ) ) );
+    }
+#endif
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Copy the user's code out of an existing spi-flash image (--extract)
+//
+    if ( ! config.extract_fname.empty() && ! config.payload_fname.empty() )
+    {
+#ifdef WIN32
+        fprintf(stderr, "--extract is not supported on this platform\n");
+        return false;
+#else
+        util::trace_span_t span( "extract" );
+        span.arg( "src", config.extract_fname );
+        span.arg( "dst", config.payload_fname );
+
+        unsigned long long len = 0;
+        std::string msg;
+        std::string path;
+
+        if (! stage_output( config.payload_fname, path ) ||
+                ! boot_spi_data.extract_to( config.extract_fname, path, len, msg ))
+        {
+            if (msg.empty())
+            {
+                perror("Error extracting the user's code");
+            }
+            else
+            {
+                fprintf(stderr, "Error extracting the user's code of \"%s\" : '%s'\n", 
+                        config.extract_fname.c_str(), msg.c_str());
+            }
+
+            return false;
+        }
+
+        span.arg( "bytes", len );
+#endif
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Write the pair list as a .cfg file, the preamble as a .dat file
+// (--save-cfg, --save-dat)
+//
+    const std::string& origin = ! config.extract_fname.empty() ? config.extract_fname :
+        ! config.variant.empty() ? config.variant :
+        ! config.bin_fname.empty() ? config.bin_fname :
+        ! config.cfg_fname.empty() ? config.cfg_fname :
+        ! config.dat_fname.empty() ? config.dat_fname : config.board;
+
+    std::string path;
+
+    if ( ! config.save_cfg_fname.empty() && 
+            (! stage_output( config.save_cfg_fname, path ) ||
+             ! boot_spi_data.save_cfg( path, origin )) )
+    {
+        perror("Error creating cfg file");
+        return false;
+    }
+
+    if ( ! config.save_dat_fname.empty() && 
+            (! stage_output( config.save_dat_fname, path ) ||
+             ! boot_spi_data.save_dat( path, origin )) )
+    {
+        perror("Error creating dat file");
+        return false;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Create a new preable binary file (--prb)
+//
+    if ( ! config.prb_fname.empty() )
+    {
+        util::trace_span_t span( "write_prb" );
+        span.arg( "file", config.prb_fname );
+        span.arg( "bytes", boot_spi_data_t::get_data_size() );
+
+        if (! stage_output( config.prb_fname, path ) || 
+                ! boot_spi_data.save( path ))
+        {
+            perror("Error creating preamble file");
+            return false;
+        }
+
+        if (! tee_output( config.prb_fname, config.prb_copies, 
+                    config.status_stream() ))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+struct batch_job_t
+{
+    int line;
+    std::vector< std::string > args;
+    cmd_args_t::cfg_t config;
+    boot_spi_data_t boot_spi_data;
+};
+
+typedef std::list< batch_job_t > batch_t;
+
+
+//------------------------------------------------------------------------------
+
+
+// Read a job file: one image per line, options separated by blanks
+static bool load_batch( const std::string& filename, batch_t& jobs, std::string& msg )
+{
+    typedef util::tokenizer_t< std::string > tokenizer_t;
+
+    util::file_stream< std::string > fs( filename );
+    tokenizer_t tknzr( fs );
+
+    if ( ! fs.open() ) 
+    {
+        msg = "Unable to open \"";
+        msg += filename + "\"";
+        return false;
+    }
+
+    tokenizer_t::token_class_set_t blnk_cls;
+    tokenizer_t::token_class_set_t linestyle_comment_cls;
+
+    blnk_cls.insert(" ");
+    blnk_cls.insert("\t");
+    blnk_cls.insert("\r");
+    linestyle_comment_cls.insert("#");
+
+    tknzr.register_token_blank( blnk_cls );
+    tknzr.register_token_linestyle_comment( linestyle_comment_cls );
+
+    tokenizer_t::token_t token;
+    bool end = false;
+
+    while ( ! end ) 
+    {
+        token.value = "";
+
+        end = ! tknzr.get_next_token( token );
+
+        if ( token.tkncls == tokenizer_t::END_OF_STREAM ) 
+        {
+            break;
+        }
+
+        if ( token.tkncls != tokenizer_t::OTHER || token.value.empty() ) 
+        {
+            continue;
+        }
+
+        if ( jobs.empty() || jobs.back().line != int(token.line) )
+        {
+            jobs.push_back( batch_job_t() );
+            jobs.back().line = int(token.line);
+        }
+
+        jobs.back().args.push_back( token.value );
+    }
+
+    fs.close();
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+static long long file_size( const std::string& filename )
+{
+    struct stat st;
+    return stat( filename.c_str(), &st ) == 0 ? (long long) st.st_size : 0;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+#ifdef HAVE_IO_URING
+
+// Whether the io_uring engine can write the outputs of a job: it copies a
+// raw payload after the preamble, or the preamble alone, as they are. 
+// Otherwise why names what needs the stdio path
+static bool uring_capable( const cmd_args_t::cfg_t& config, 
+        const boot_spi_data_t& boot_spi_data, const char *& why )
+{
+    const bool spi = ! config.replacepreamble && 
+        ! config.dst_fname.empty() && ! config.src_fname.empty();
+
+    // the user's code is copied as it is, padding it needs stdio
+    const long long code_len = spi && 
+        (attach_flags( config, boot_spi_data ) & boot_spi_data_t::ATTACH_UPDATE_CODE_LEN) ? 
+        file_size( config.src_fname ) : 0;
+
+    why = 0;
+
+    if (config.direct_io) why = "--direct";
+    else if (config.out_hex.format != util::hex_cfg_t::BIN) why = "S-record/HEX output";
+    else if (! config.src_fname.empty() && 
+            config.in_format != payload_reader_t::RAW &&
+            (config.in_format != payload_reader_t::AUTO ||
+             payload_reader_t::detect_file( config.src_fname ) != payload_reader_t::RAW))
+    {
+        why = "ELF, S-record or HEX payload";
+    }
+    else if (is_compressed( config.src_fname, true ) ||
+            is_compressed( config.dst_fname, ! config.replacepreamble ) ||
+            is_compressed( config.prb_fname, false )) 
+    {
+        why = "gzip compressed file";
+    }
+    else if (! config.layout_fname.empty()) why = "--layout";
+    else if (config.verify) why = "--verify";
+    else if (! config.extract_fname.empty()) why = "--extract";
+    else if (config.replacepreamble && (config.journal || config.sync)) why = "journaled --patch";
+    else if (code_len % 4) why = "user's code padded to 4 bytes";
+    else if (! config.dst_copies.empty() || ! config.prb_copies.empty()) why = "more destinations";
+    else if (! config.save_cfg_fname.empty() || ! config.save_dat_fname.empty()) 
+    {
+        why = "--save-cfg/--save-dat";
+    }
+
+    return why == 0;
+}
+
+
+// Queue the outputs of every job the io_uring engine can write (see 
+// uring_capable) and run them at once; the others are written by stdio
+// first, and counted in n_stdio (with the reason, under --stats)
+static bool write_outputs_uring( const cmd_args_t::cfg_t& batch_config,
+        batch_t& jobs, 
+        util::uring_copier_t& copier,
+        unsigned long long& bytes,
+        unsigned int& n_stdio )
+{
+    const std::string& batch_fname = batch_config.batch_fname;
+    std::vector< util::copy_req_t > reqs;
+    std::vector< batch_job_t* > owner;
+    std::vector< std::string > names;
+
+    n_stdio = 0;
+
+    for (batch_t::iterator i = jobs.begin(); i != jobs.end(); ++i)
+    {
+        const cmd_args_t::cfg_t& config = i->config;
+        const char * why = 0;
+
+        const bool spi = ! config.replacepreamble && 
+            ! config.dst_fname.empty() && ! config.src_fname.empty();
+
+        if (! uring_capable( config, i->boot_spi_data, why ))
+        {
+            const size_t mark = staged_outputs();
+
+            ++n_stdio;
+
+            if (batch_config.show_stats)
+            {
+                fprintf(stderr, "%s:%i: written by stdio: %s\n", 
+                        batch_fname.c_str(), i->line, why);
+            }
+
+            if (! write_outputs( config, i->boot_spi_data ))
+            {
+                rollback_outputs( mark );
+                return false;
+            }
+
+            if ( config.verify )
+            {
+                continue;
+            }
+
+            if ( ! config.replacepreamble && ! config.dst_fname.empty() )
+            {
+                bytes += file_size( output_path( config.dst_fname ) );
+            }
+
+            if ( ! config.layout_fname.empty() )
+            {
+                bytes += file_size( config.flash_fname );
+            }
+
+            continue;
+        }
+
+        // one request per output, all starting with the preamble
+        util::copy_req_t prb;
+        prb.prefix = i->boot_spi_data.get_data();
+        prb.prefix_len = boot_spi_data_t::get_data_size();
+
+        if ( config.replacepreamble && ! config.dst_fname.empty() )
+        {
+            util::copy_req_t req = prb;
+            req.dst = config.dst_fname;
+            req.truncate = false;
+            req.min_size = req.prefix_len;
+            reqs.push_back( req );
+            owner.push_back( &*i );
+            names.push_back( config.dst_fname );
+        }
+
+        // the new files are staged as the stdio engine does
+        if ( spi )
+        {
+            util::copy_req_t req = prb;
+            req.src = config.src_fname;
+
+            if (attach_flags( config, i->boot_spi_data ) & boot_spi_data_t::ATTACH_UPDATE_CODE_LEN)
+            {
+                const long long code_len = file_size( config.src_fname );
+
+                if (code_len > 0)
+                {
+                    i->boot_spi_data.set_fitted_code_len( (unsigned long long) code_len );
+                }
+            }
+
+            if (! output_txn.stage( config.dst_fname, req.dst ))
+            {
+                perror("Error creating spi-flash image file");
+                return false;
+            }
+
+            reqs.push_back( req );
+            owner.push_back( &*i );
+            names.push_back( config.dst_fname );
+        }
+
+        if ( ! config.prb_fname.empty() )
+        {
+            util::copy_req_t req = prb;
+
+            if (! output_txn.stage( config.prb_fname, req.dst ))
+            {
+                perror("Error creating preamble file");
+                return false;
+            }
+
+            reqs.push_back( req );
+            owner.push_back( &*i );
+            names.push_back( config.prb_fname );
+        }
+    }
+
+    util::trace_span_t span( "uring_copy" );
+    span.arg( "requests", reqs.size() );
+
+    bool ret = copier.run( reqs );
+
+    span.end();
+
+    for (size_t i = 0; i < reqs.size(); ++i)
+    {
+        bytes += reqs[i].written;
+
+        if (! reqs[i].err && ! reqs[i].src.empty() &&
+                ! check_code_window( owner[i]->config, owner[i]->boot_spi_data, names[i] ))
+        {
+            if (reqs[i].dst != names[i])
+            {
+                output_txn.discard( reqs[i].dst );
+            }
+
+            ret = false;
+        }
+
+        if (reqs[i].err)
+        {
+            if (reqs[i].dst != names[i])
+            {
+                output_txn.discard( reqs[i].dst );
+            }
+
+            fprintf(stderr, "%s:%i: error writing \"%s\"%s%s : '%s'\n",
+                    batch_fname.c_str(), owner[i]->line,
+                    names[i].c_str(), 
+                    reqs[i].src.empty() ? "" : " from ",
+                    reqs[i].src.c_str(),
+                    strerror( reqs[i].err ));
+        }
+    }
+
+    return ret;
+}
+
+#endif // HAVE_IO_URING
+
+
+//------------------------------------------------------------------------------
+
+
+// Verify the images of every job (--batch --verify): the comparisons run
+// on the worker threads, each one with its own bounded buffers
+static int verify_batch( const cmd_args_t::cfg_t& batch_config, batch_t& jobs )
+{
+    const double t0 = util::now_sec();
+    unsigned int failed = 0;
+    std::mutex mtx;
+
+    util::run_workers< batch_job_t* >( 
+            batch_config.jobs ? batch_config.jobs : util::default_workers(),
+            [&]( util::work_queue_t< batch_job_t* > & queue )
+            {
+                for (batch_t::iterator i = jobs.begin(); i != jobs.end(); ++i)
+                {
+                    queue.push( &*i );
+                }
+            },
+            [&]( batch_job_t * job ) 
+            { 
+                util::tracer_t::instance().name_thread( "verify worker" );
+
+                std::string report;
+                const bool ok = verify_outputs( job->config, job->boot_spi_data, report );
+
+                std::lock_guard< std::mutex > lock( mtx );
+                fputs( report.c_str(), stdout );
+
+                if (! ok) ++failed;
+            });
+
+    const double elapsed = util::now_sec() - t0;
+
+    printf("verify: %u jobs, %u failed in %.3f s (%.0f jobs/s)\n",
+            unsigned(jobs.size()),
+            failed,
+            elapsed,
+            elapsed > 0 ? jobs.size() / elapsed : 0.0);
+
+    return failed ? 1 : 0;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+static int run_batch( const cmd_args_t::cfg_t& batch_config )
+{
+    batch_t jobs;
+    std::string msg;
+
+    if (! load_batch( batch_config.batch_fname, jobs, msg ))
+    {
+        fprintf(stderr, "Error loading \"%s\" : '%s'\n", 
+                batch_config.batch_fname.c_str(),
+                msg.c_str());
+        return 1;
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Build the preamble of every job
+//
+    for (batch_t::iterator i = jobs.begin(); i != jobs.end(); ++i)
+    {
+        util::trace_span_t span( "build_job" );
+        span.arg( "line", i->line );
+
+        std::vector< char* > argv;
+        argv.push_back( const_cast<char*>( batch_config.app_fname.c_str() ) );
+
+        for (size_t a = 0; a < i->args.size(); ++a)
+        {
+            argv.push_back( &i->args[a][0] );
+        }
+
+        cmd_args_t args( int(argv.size()), &argv[0] );
+
+        if (args.config.error.empty() && 
+                (args.config.show_help || 
+                 args.config.show_version || 
+                 args.config.list_boards || 
+                 ! args.config.trace_fname.empty() || 
+                 ! args.config.batch_fname.empty() ||
+                 ! args.config.patch_path.empty() ||
+                 ! args.config.bundle_fname.empty() ||
+                 args.config.list_variants))
+        {
+            args.config.error = "--help, --ver, --list-boards, --trace, --batch, --patch-all, "
+                "--bundle and --bundle-list not allowed in a job";
+        }
+
+        if (! args.config.error.empty())
+        {
+            fprintf(stderr, "%s:%i: %s\n", 
+                    batch_config.batch_fname.c_str(), i->line,
+                    args.config.error.c_str());
+            return 1;
+        }
+
+        i->config = args.config;
+        i->config.verify = i->config.verify || batch_config.verify;
+        i->config.journal = i->config.journal || batch_config.journal;
+        i->config.sync = i->config.sync || batch_config.sync;
+
+#ifndef WIN32
+        // one commit for the whole batch: durable if any job asks for it
+        if (i->config.sync)
+        {
+            output_txn.set_sync( true );
+        }
+#endif
+
+        if (! build_preamble( i->config, i->boot_spi_data ))
+        {
+            fprintf(stderr, "%s:%i: job failed\n", 
+                    batch_config.batch_fname.c_str(), i->line);
+            return 1;
+        }
+    }
+
+
+    if ( batch_config.verify )
+    {
+        return verify_batch( batch_config, jobs );
+    }
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Write the outputs
+//
+    const double t0 = util::now_sec();
+    unsigned long long bytes = 0;
+    std::string engine = batch_config.io_engine;
+    bool ok = true;
+
+#ifdef HAVE_IO_URING
+    util::uring_copier_t copier;
+
+    if (engine == "uring" && ! copier.init())
+    {
+        perror("io_uring not available, falling back to stdio");
+        engine = "stdio";
+    }
+
+    if (engine == "uring")
+    {
+        unsigned int n_stdio = 0;
+
+        ok = write_outputs_uring( batch_config, jobs, copier, bytes, n_stdio );
+
+        if (! copier.uses_fixed_buffers())
+        {
+            engine += ", unregistered buffers";
+        }
+
+        if (n_stdio > 0)
+        {
+            char buf[ 64 ];
+            snprintf( buf, sizeof(buf), ", %u of %u jobs by stdio", 
+                    n_stdio, unsigned( jobs.size() ) );
+            engine += buf;
+        }
+    }
+#else
+    if (engine == "uring")
+    {
+        fprintf(stderr, "io_uring not available, falling back to stdio\n");
+        engine = "stdio";
+    }
+#endif
+
+    if (engine == "stdio")
+    {
+        for (batch_t::iterator i = jobs.begin(); i != jobs.end(); ++i)
+        {
+            const cmd_args_t::cfg_t& config = i->config;
+            util::trace_span_t span( "write_job" );
+            span.arg( "line", i->line );
+
+            const size_t mark = staged_outputs();
+
+            if (! write_outputs( config, i->boot_spi_data ))
+            {
+                // the images of the other jobs are still committed
+                rollback_outputs( mark );
+
+                fprintf(stderr, "%s:%i: job failed\n", 
+                        batch_config.batch_fname.c_str(), i->line);
+                ok = false;
+                continue;
+            }
+
+            if ( config.verify )
+            {
+                continue;
+            }
+
+            if ( config.replacepreamble && ! config.dst_fname.empty() )
+            {
+                bytes += boot_spi_data_t::get_data_size();
+            }
+            else if ( ! config.dst_fname.empty() && ! config.src_fname.empty() )
+            {
+                bytes += file_size( output_path( config.dst_fname ) );
+            }
+
+            if ( ! config.layout_fname.empty() )
+            {
+                bytes += file_size( config.flash_fname );
+            }
+
+            if ( ! config.prb_fname.empty() )
+            {
+                bytes += boot_spi_data_t::get_data_size();
+            }
+        }
+    }
+
+    // the images of all the jobs at once (and, with --sync, made durable)
+    ok = commit_outputs() && ok;
+
+    const double elapsed = util::now_sec() - t0;
+
+
+//////////////////////////////////////////////////////////////////////////////
+// Print out the preamble info (--show)
+//
+    for (batch_t::iterator i = jobs.begin(); i != jobs.end(); ++i)
+    {
+        if ( i->config.show_info )
+        {
+            printf("%s:%i:\n", batch_config.batch_fname.c_str(), i->line);
+            i->boot_spi_data.show();
+        }
+    }
+
+    printf("batch: %u images, %llu bytes written in %.3f s (%.1f MB/s, %s)\n",
+            unsigned(jobs.size()),
+            bytes,
+            elapsed,
+            elapsed > 0 ? double(bytes) / (1024.0*1024.0) / elapsed : 0.0,
+            engine.c_str());
+
+    return ok ? 0 : 1;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+static int run_scan( const cmd_args_t::cfg_t& config )
+{
+#ifdef WIN32
+    fprintf(stderr, "--scan is not supported on this platform\n");
+    return 1;
+#else
+    image_scanner_t scanner( 
+            config.out_format == "csv" ? image_scanner_t::CSV : image_scanner_t::JSONL,
+            stdout );
+
+    const double t0 = util::now_sec();
+    bool walk_ok = true;
+
+    scanner.header();
+
+    util::run_workers< std::string >( 
+            config.jobs ? config.jobs : util::default_workers(),
+            [&]( util::work_queue_t< std::string > & queue )
+            {
+                util::trace_span_t span( "walk" );
+                span.arg( "path", config.scan_path );
+
+                walk_ok = util::walk_paths( config.scan_path, 
+                        [&]( const std::string & path ) { queue.push( path ); },
+                        config.jobs ? config.jobs : util::default_workers() );
+            },
+            [&]( const std::string & path ) 
+            { 
+                util::tracer_t::instance().name_thread( "scan worker" );
+                util::trace_span_t span( "scan_file" );
+                span.arg( "file", path );
+
+                scanner.scan_file( path ); 
+            });
+
+    const double elapsed = util::now_sec() - t0;
+
+    if (! walk_ok)
+    {
+        fprintf(stderr, "Warning: \"%s\" not (completely) readable\n", 
+                config.scan_path.c_str());
+    }
+
+    fprintf(stderr, "scan: %lu images, %lu valid, %lu errors in %.3f s (%.0f images/s)\n",
+            scanner.files(),
+            scanner.valid(),
+            scanner.errors(),
+            elapsed,
+            elapsed > 0 ? scanner.files() / elapsed : 0.0);
+
+    return walk_ok && scanner.errors() == 0 ? 0 : 1;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// Pack the images found in config.bundle_path (as --scan finds them) into
+// the bundle config.bundle_fname, one variant per image
+static int run_bundle( const cmd_args_t::cfg_t& config )
+{
+#ifdef WIN32
+    fprintf(stderr, "--bundle is not supported on this platform\n");
+    return 1;
+#else
+    const double t0 = util::now_sec();
+    std::vector< std::string > images;
+    bool walk_ok = true;
+
+    {
+        util::trace_span_t span( "walk" );
+        span.arg( "path", config.bundle_path );
+
+        walk_ok = util::walk_paths( config.bundle_path, 
+                [&]( const std::string & path ) { images.push_back( path ); } );
+    }
+
+    if (! walk_ok)
+    {
+        fprintf(stderr, "Warning: \"%s\" not (completely) readable\n", 
+                config.bundle_path.c_str());
+    }
+
+    // the same bundle whatever the order of the directory entries
+    std::sort( images.begin(), images.end() );
+
+    output_txn.set_sync( config.sync );
+
+    util::trace_span_t span( "bundle" );
+    span.arg( "file", config.bundle_fname );
+
+    image_bundle_t::stats_t stats;
+    std::string msg;
+    std::string path;
+    int fd = -1;
+
+    if (! stage_output( config.bundle_fname, path ) ||
+            (fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 )) < 0)
+    {
+        perror("Error creating bundle file");
+        rollback_outputs( 0 );
+        return 1;
+    }
+
+    bool ok = image_bundle_t::create( images, fd, stats, msg );
+
+    ok = close( fd ) == 0 && ok;
+
+    if (! ok)
+    {
+        if (msg.empty()) msg = strerror( errno );
+
+        fprintf(stderr, "Error creating bundle \"%s\" : '%s'\n", 
+                config.bundle_fname.c_str(), msg.c_str());
+        rollback_outputs( 0 );
+        return 1;
+    }
+
+    if (! commit_outputs())
+    {
+        return 1;
+    }
+
+    span.arg( "variants", stats.variants );
+    span.arg( "bytes", stats.bytes );
+
+    fprintf(stderr, "bundle: %lu variants, %lu payloads, %lu files skipped, "
+            "%llu bytes (%llu as images) in %.3f s\n",
+            stats.variants,
+            stats.payloads,
+            stats.skipped,
+            stats.bytes,
+            stats.image_bytes,
+            util::now_sec() - t0);
+
+    return walk_ok ? 0 : 1;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+// One line per variant of a bundle: name, payload number, image size
+static int run_bundle_list( const cmd_args_t::cfg_t& config )
+{
+#ifdef WIN32
+    fprintf(stderr, "--bundle-list is not supported on this platform\n");
+    return 1;
+#else
+    image_bundle_t bundle;
+    std::string msg;
+
+    if (! bundle.open( config.from_bundle_fname, msg ))
+    {
+        fprintf(stderr, "Error reading \"%s\" : '%s'\n", 
+                config.from_bundle_fname.c_str(), msg.c_str());
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < bundle.size(); ++i)
+    {
+        printf("%s\t%u\t%lld\n", 
+                bundle.name( i ).c_str(), bundle.payload_of( i ), bundle.image_size( i ));
+    }
+
+    return 0;
+#endif
+}
+
+
+//------------------------------------------------------------------------------
+
+
+#ifndef WIN32
+enum patch_status_t { PATCHED, UNCHANGED, SKIPPED, FAILED };
+
+static const char * const patch_status_name[] = { "patched", "unchanged", "skipped", "error" };
+
+
+// Apply the edits to the preamble of the image at path, mapped in memory;
+// the preamble is only written if it changes. dev receives the filesystem
+// of a patched image
+static patch_status_t patch_image_file( const cmd_args_t::cfg_t& config, 
+        const preamble_edits_t& edits,
+        const boot_spi_data_t * base,
+        const std::string& path,
+        dev_t& dev,
+        std::string& msg )
+{
+    const size_t size = boot_spi_data_t::get_data_size();
+    const int fd = open( path.c_str(), O_RDWR );
+    struct stat st;
+
+    if (fd < 0 || fstat( fd, &st ) != 0)
+    {
+        msg = strerror( errno );
+        if (fd >= 0) close( fd );
+        return FAILED;
+    }
+
+    if ((unsigned long long) st.st_size < size)
+    {
+        close( fd );
+        msg = "shorter than the preamble";
+        return SKIPPED;
+    }
+
+    unsigned char * map = (unsigned char *) mmap( 0, size, PROT_READ | PROT_WRITE, 
+            MAP_SHARED, fd, 0 );
+
+    close( fd );
+
+    if (map == MAP_FAILED)
+    {
+        msg = strerror( errno );
+        return FAILED;
+    }
+
+    patch_status_t status = UNCHANGED;
+    boot_spi_data_t data;
+
+    if (base)
+    {
+        data = *base; // --bin
+    }
+    else
+    {
+        data.load_from_memory( map );
+    }
+
+    if (! base && ! data.view().has_boot_sign())
+    {
+        msg = "no BOOT signature";
+        status = SKIPPED;
+    }
+    else if (! apply_edits( config, edits, data ))
+    {
+        status = FAILED;
+    }
+    else
+    {
+        // --addr without --cfg: the pairs of the image are rebased
+        if (config.rebase && edits.lst.empty())
+        {
+            const cfg_pair_range_t pairs = data.view().cfg_pairs();
+            unsigned int idx = 0;
 
-                    config.rebase = true;
+            for (cfg_pair_range_t::const_iterator i = pairs.begin(); i != pairs.end(); ++i, ++idx)
+            {
+                const cfg_pair_t pair = *i;
 
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == GET_TRGADDR )
-                {
-                    unsigned int addr = 0;
-                    sscanf( sArg.c_str(), "%x",  &addr );
-                    config.trgaddr = addr;
+                data.set_cfg_pair( int(idx), 
+                        mc_config_t::rebase_addr( config.baddr, config.newaddr, pair.addr ),
+                        pair.data );
+            }
+        }
 
-                    config.patchtrgaddr = true;
+        if (memcmp( map, data.get_data(), size ) != 0)
+        {
+            memcpy( map, data.get_data(), size );
+            status = PATCHED;
+            dev = st.st_dev;
+        }
+    }
 
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == GET_SRCADDR )
-                {
-                    unsigned int addr = 0;
-                    sscanf( sArg.c_str(), "%x",  &addr );
-                    config.srcaddr = addr;
+    if (munmap( map, size ) != 0)
+    {
+        msg = strerror( errno );
+        return FAILED;
+    }
 
-                    config.patchsrcaddr = true;
+    return status;
+}
+#endif
 
-                    s = CONTINUE_PARSING;
-                }
-                else if (s == GET_EXEADDR )
-                {
-                    unsigned int addr = 0;
-                    sscanf( sArg.c_str(), "%x",  &addr );
-                    config.exeaddr = addr;
 
-                    config.patchexeaddr = true;
+//------------------------------------------------------------------------------
 
-                    s = CONTINUE_PARSING;
-                }
-                else //ERROR
-                { 
-                    config.error = std::string("'") + sArg + "' syntax error";
 
-                    break; // error
-                }
+// Patch in place the preamble of every image found in <dir|glob>
+// (--patch-all) on a worker pool; the patched images are made durable
+// at the end by one syncfs() per filesystem
+static int run_patch_all( const cmd_args_t::cfg_t& config )
+{
+#ifdef WIN32
+    fprintf(stderr, "--patch-all is not supported on this platform\n");
+    return 1;
+#else
+    // the edits are read once, and only read by the workers
+    util::arena_scope_t arena_scope( parse_arena );
 
-            } // for
+    preamble_edits_t edits;
+    boot_spi_data_t base;
+    boot_spi_data_t check;
 
-            switch (s)
-            {
-                case GET_CFGFILE:
-                    config.error = "Missing <cfg_file> argument";
-                    break;
+    if (! load_edits( config, edits ))
+    {
+        return 1;
+    }
 
-                case GET_DATFILE:
-                    config.error = "Missing <dat_file> argument";
-                    break;
+    check.set_default();
 
-                case GET_PBLFILE:
-                    config.error = "Missing <preamble_file> argument";
-                    break;
+    if (! config.bin_fname.empty() && ! base.load_from_file( config.bin_fname ))
+    {
+        perror("Error loading file");
+        return 1;
+    }
 
-                case GET_BADDR:
-                    config.error = "Missing <baddr> and <newaddr> arguments";
-                    break;
+    // errors not depending on the image (e.g. .dat offsets) are reported once
+    if (! apply_edits( config, edits, check ))
+    {
+        return 1;
+    }
 
-                case GET_NEWADDR:
-                    config.error = "Missing <newaddr> argument";
-                    break;
+    const double t0 = util::now_sec();
+    unsigned long n_files = 0, n_patched = 0, n_unchanged = 0, n_skipped = 0, n_errors = 0;
+    std::map< dev_t, std::string > patched_devs;
+    std::mutex mtx;
+    bool walk_ok = true;
 
-                case GET_TRGADDR:
-                    config.error = "Missing <trgaddr> argument";
-                    break;
+    util::run_workers< std::string >( 
+            config.jobs ? config.jobs : util::default_workers(),
+            [&]( util::work_queue_t< std::string > & queue )
+            {
+                util::trace_span_t span( "walk" );
+                span.arg( "path", config.patch_path );
 
-                case GET_SRCADDR:
-                    config.error = "Missing <srcaddr> argument";
-                    break;
+                walk_ok = util::walk_paths( config.patch_path, 
+                        [&]( const std::string & path ) { queue.push( path ); },
+                        config.jobs ? config.jobs : util::default_workers() );
+            },
+            [&]( const std::string & path ) 
+            { 
+                util::tracer_t::instance().name_thread( "patch worker" );
+                util::trace_span_t span( "patch_file" );
+                span.arg( "file", path );
 
-                case GET_EXEADDR:
-                    config.error = "Missing <exeaddr> argument";
-                    break;
+                dev_t dev = 0;
+                std::string msg;
+                const patch_status_t status = patch_image_file( config, edits, 
+                        config.bin_fname.empty() ? 0 : &base, path, dev, msg );
 
-                case GET_SRCDSTPARAM:
-                    config.error = 
-                        "Missing -s <bootcode_file> or -d <spiboot_file> argument";
-                    break;
+                span.arg( "status", patch_status_name[ status ] );
 
-                case GET_SRCPARAM:
-                    config.error = "Missing -s <bootcode_file> argument";
-                    break;
+                std::lock_guard< std::mutex > lock( mtx );
 
-                case GET_DSTPARAM:
-                    config.error = "Missing -d <spiboot_file> argument";
-                    break;
+                ++n_files;
 
-                default:
-                    if (s != CONTINUE_PARSING)
-                    {
-                        if (config.error.empty())
-                            config.error = "Syntax error";
-                    }
-                    break;
+                switch (status)
+                {
+                    case PATCHED:   ++n_patched; patched_devs[ dev ] = path; break;
+                    case UNCHANGED: ++n_unchanged; break;
+                    case SKIPPED:   ++n_skipped; break;
+                    case FAILED:    ++n_errors; break;
+                }
 
-            } // switch     
+                printf("%s: %s%s%s\n", path.c_str(), patch_status_name[ status ], 
+                        msg.empty() ? "" : ", ", msg.c_str());
+            });
+
+    // one flush of the page cache per filesystem for the whole set
+    util::trace_span_t sync_span( "sync" );
+    sync_span.arg( "filesystems", (long long) patched_devs.size() );
+
+    for (std::map< dev_t, std::string >::const_iterator i = patched_devs.begin(); 
+            i != patched_devs.end(); ++i)
+    {
+        const int fd = open( i->second.c_str(), O_RDONLY );
+
+        if (fd < 0 || syncfs( fd ) != 0)
+        {
+            fprintf(stderr, "Error syncing the filesystem of \"%s\" : '%s'\n", 
+                    i->second.c_str(), strerror( errno ));
+            ++n_errors;
         }
-};
+
+        if (fd >= 0) close( fd );
+    }
+
+    sync_span.end();
+
+    const double elapsed = util::now_sec() - t0;
+
+    if (! walk_ok)
+    {
+        fprintf(stderr, "Warning: \"%s\" not (completely) readable\n", 
+                config.patch_path.c_str());
+    }
+
+    fprintf(stderr, "patch: %lu images, %lu patched, %lu unchanged, %lu skipped, "
+            "%lu errors in %.3f s (%u filesystems synced)\n",
+            n_files, n_patched, n_unchanged, n_skipped, n_errors, elapsed,
+            unsigned( patched_devs.size() ));
+
+    return walk_ok && n_errors == 0 ? 0 : 1;
+#endif
+}
+
 
 //::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::::
 #ifdef WIN32
@@ -1290,182 +5717,69 @@ int main(int argc, char* argv[])
         return 0;
     }
 
-    boot_spi_data_t boot_spi_data;
-
-
-//////////////////////////////////////////////////////////////////////////////
-// Process bynary file (--bin)
-//
-    if (! args.config.bin_fname.empty())
-    {
-        if (! boot_spi_data.load_from_file( args.config.bin_fname ) )
-        {
-            perror("Error loading file");
-            return 1;
-        }
-    }
-    else
-    {
-        boot_spi_data.set_default();
-    }
-
-
-//////////////////////////////////////////////////////////////////////////////
-// Process cfg file (--cfg)
-//
-    mc_config_t::assignlist_t lst;
-
-    if (! args.config.cfg_fname.empty())
+#ifndef WIN32
+    if (args.config.show_stats)
     {
-        mc_config_t cfg;
-        std::string msg;
-
-        if (! cfg.compile_cfg( args.config.cfg_fname, lst, msg) )
-        {
-            if (msg.empty())
-            {
-                fprintf(stderr, "Cannot compile file '%s'\n", 
-                        args.config.cfg_fname.c_str());
-            }
-            else
-            {
-                fprintf(stderr, "Error compiling \"%s\" : '%s'\n", 
-                        args.config.cfg_fname.c_str(),
-                        msg.c_str());
-            }
-
-            return 1;
-        }
+        run_start_sec = util::now_sec();
+        atexit( show_run_stats );
     }
+#endif
 
-
-//////////////////////////////////////////////////////////////////////////////
-// Process dat file (--dat)
-//
-    mc_config_t::assignlist_t datlst;
-
-    if (! args.config.dat_fname.empty())
+    if (! args.config.trace_fname.empty())
     {
-        mc_config_t cfg;
-        std::string msg;
-
-        if (! cfg.compile_dat( args.config.dat_fname, datlst, msg) )
-        {
-            if (msg.empty())
-            {
-                fprintf(stderr, "Cannot compile file '%s'\n", 
-                        args.config.dat_fname.c_str());
-            }
-            else
-            {
-                fprintf(stderr, "Error compiling \"%s\" : '%s'\n", 
-                        args.config.dat_fname.c_str(),
-                        msg.c_str());
-            }
-
-            return 1;
-        }
+        trace_fname = args.config.trace_fname;
+        util::tracer_t::enable();
+        util::tracer_t::instance().name_thread( "main" );
+        atexit( save_trace );
     }
 
-
-//////////////////////////////////////////////////////////////////////////////
-// Rebase address (--addr)
-//
-    if (args.config.rebase)
+    if (args.config.list_boards)
     {
-        mc_config_t::rebase_immr( args.config.baddr, args.config.newaddr, lst );
+        show_boards();
+        return 0;
     }
 
-
-//////////////////////////////////////////////////////////////////////////////
-// Patch preamble 
-//
-
-    //--tga
-    if (args.config.patchtrgaddr)
+    if (! args.config.batch_fname.empty())
     {
-        boot_spi_data.set_target_addr( args.config.trgaddr );
+        return run_batch( args.config );
     }
 
-    //--sra
-    if (args.config.patchsrcaddr)
+    if (! args.config.scan_path.empty())
     {
-        boot_spi_data.set_src_addr( args.config.srcaddr );
+        return run_scan( args.config );
     }
 
-    //--exe
-    if (args.config.patchexeaddr)
+    if (! args.config.patch_path.empty())
     {
-        boot_spi_data.set_exest_addr( args.config.exeaddr );
+        return run_patch_all( args.config );
     }
 
-    // process .cfg patch list
-    if (!lst.empty())
+    if (! args.config.bundle_fname.empty())
     {
-        boot_spi_data.set_n_cfg_pairs( lst.size() );
-
-        int idx = 0;
-
-        for (mc_config_t::assignlist_t::const_iterator i = lst.begin();
-                i != lst.end();
-                ++i, ++idx)
-        {
-            boot_spi_data.set_cfg_pair( idx, i->first, i->second );
-        }
+        return run_bundle( args.config );
     }
 
-    // process .dat patch list
-    if (!datlst.empty())
+    if (args.config.list_variants)
     {
-        for (mc_config_t::assignlist_t::const_iterator i = datlst.begin();
-                i != datlst.end();
-                ++i)
-        {
-            boot_spi_data.patch_dword_at( i->first, i->second );
-        }
+        return run_bundle_list( args.config );
     }
 
+#ifndef WIN32
+    output_txn.set_sync( args.config.sync );
+#endif
 
-//////////////////////////////////////////////////////////////////////////////
-// Modify the preamble of an existing spi-flash boot image (--patch)
-//
-    if ( args.config.replacepreamble && ! args.config.dst_fname.empty() )
-    {
-        if (! boot_spi_data.patch( args.config.dst_fname ))
-        {
-            perror("Error patching spi-flash image file");
-            return 1;
-        }
-    }
-
+    boot_spi_data_t boot_spi_data;
 
-//////////////////////////////////////////////////////////////////////////////
-// Merge preamble and source boot image in order to create 
-// a new spi-flash boot image (--spi)
-//
-    if ( ! args.config.replacepreamble && 
-            ! args.config.dst_fname.empty() &&
-            ! args.config.src_fname.empty() )
+    if (! build_preamble( args.config, boot_spi_data ) ||
+            ! write_outputs( args.config, boot_spi_data ))
     {
-        if (! boot_spi_data.attach_to( args.config.src_fname, 
-                    args.config.dst_fname ))
-        {
-            perror("Error creating spi-flash image file");
-            return 1;
-        }
+        rollback_outputs( 0 );
+        return 1;
     }
 
-
-//////////////////////////////////////////////////////////////////////////////
-// Create a new preable binary file (--prb)
-//
-    if ( ! args.config.prb_fname.empty() )
+    if (! commit_outputs())
     {
-        if (! boot_spi_data.save( args.config.prb_fname ))
-        {
-            perror("Error creating preamble file");
-            return 1;
-        }
+        return 1;
     }
 
 
@@ -1474,7 +5788,8 @@ int main(int argc, char* argv[])
 //
     if ( args.config.show_info )
     {
-        boot_spi_data.show();
+        // keep the standard output clean if it carries an image
+        boot_spi_data.show( args.writes_to_stdout() ? stderr : stdout );
     }
 
     return 0;
@@ -1486,17 +5801,6 @@ int main(int argc, char* argv[])
 
 //::::::::::::::::::::::::::::::: boot_spi_data_t ::::::::::::::::::::::::::::::
 
-unsigned char boot_spi_data_t::preamble_bin[ 108 ] = 
-{
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x42, 0x4F, 0x4F, 0x54, 0x00, 0x00, 0x00, 0x00,
-    0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00,
-    0x00, 0x00, 0x00, 0x00, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    0x11, 0x07, 0xF0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 
-};
+constexpr preamble_image_t boot_spi_data_t::default_preamble;
 
 
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___CHECK_H__
+#define ___CHECK_H__
+
+#include <stdio.h>
+
+
+/*
+   What the tests share: check() prints and counts a failed check, going
+   on with the next one; main() returns check_report( ... )
+ */
+inline int & check_failures() throw()
+{
+    static int failures = 0;
+    return failures;
+}
+
+
+inline void check( bool ok, const char * where, const char * what ) throw()
+{
+    if (! ok)
+    {
+        fprintf(stderr, "%s: %s\n", where, what);
+        ++check_failures();
+    }
+}
+
+
+// The exit status of the test: 0 if every check passed
+inline int check_report( const char * passed ) throw()
+{
+    if (check_failures())
+    {
+        fprintf(stderr, "%d check(s) failed\n", check_failures());
+        return 1;
+    }
+
+    printf("%s\n", passed);
+    return 0;
+}
+
+#endif
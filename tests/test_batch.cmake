@@ -0,0 +1,54 @@
+# --batch end to end, run by ctest as
+#   cmake -DSPIDYBOOT=<spidyboot> -DWORK=<dir> -P test_batch.cmake
+#
+# A --patch job writing a --prb file too: the io_uring engine must copy each
+# output with its own request (the preamble file is a new file, the image
+# is patched in place), and give the same files as the stdio engine
+
+file(REMOVE_RECURSE ${WORK})
+file(MAKE_DIRECTORY ${WORK})
+
+file(WRITE ${WORK}/payload.bin "user's code of the batch test\n")
+
+foreach(IO stdio uring)
+    execute_process(
+        COMMAND ${SPIDYBOOT} --board p1020rdb_533M --len 80000 --spi
+            -s ${WORK}/payload.bin -d ${WORK}/${IO}.img
+        RESULT_VARIABLE RC OUTPUT_QUIET)
+
+    if(NOT RC EQUAL 0)
+        message(FATAL_ERROR "--spi ${IO}.img failed: ${RC}")
+    endif()
+
+    file(WRITE ${WORK}/${IO}.jobs
+        "--patch ${WORK}/${IO}.img --tga 11000000 --prb ${WORK}/${IO}.prb\n"
+        "--board p1020rdb_533M --len 80000 --spi -s ${WORK}/payload.bin "
+        "-d ${WORK}/${IO}_2.img --prb ${WORK}/${IO}_2.prb\n")
+
+    execute_process(
+        COMMAND ${SPIDYBOOT} --batch ${WORK}/${IO}.jobs --io ${IO}
+        RESULT_VARIABLE RC OUTPUT_VARIABLE OUT ERROR_VARIABLE ERR)
+
+    if(NOT RC EQUAL 0)
+        message(FATAL_ERROR "--batch --io ${IO} failed: ${RC}\n${OUT}${ERR}")
+    endif()
+
+    # each .prb is the preamble of its image
+    foreach(IMG ${IO} ${IO}_2)
+        file(READ ${WORK}/${IMG}.img HEAD LIMIT 1024 HEX)
+        file(READ ${WORK}/${IMG}.prb PRB HEX)
+
+        if(NOT HEAD STREQUAL PRB)
+            message(FATAL_ERROR "--io ${IO}: ${IMG}.prb is not the preamble of ${IMG}.img")
+        endif()
+    endforeach()
+endforeach()
+
+foreach(F .img .prb _2.img _2.prb)
+    file(READ ${WORK}/stdio${F} A HEX)
+    file(READ ${WORK}/uring${F} B HEX)
+
+    if(NOT A STREQUAL B)
+        message(FATAL_ERROR "stdio${F} and uring${F} differ")
+    endif()
+endforeach()
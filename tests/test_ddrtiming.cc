@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+/*
+   --ddr-delays on the shipped board profiles: every delay pair of the
+   list is counted before or after MEM_EN, wherever it sits, and merge/fix
+   rewrite those delays instead of adding new ones
+ */
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "boards.h"
+#include "ddrtiming.h"
+#include "check.h"
+
+
+// The pair list of a profile, as --board loads it
+static std::vector< cfg_pair_t > pairs_of( const board_profile_t & b )
+{
+    std::map< unsigned int, unsigned int > dw;
+
+    for (unsigned int i = 0; i < b.n_pairs; ++i)
+    {
+        dw[ b.pairs[i].ofs ] = b.pairs[i].value;
+    }
+
+    std::vector< cfg_pair_t > pairs;
+
+    for (unsigned int i = 0; i < dw[ preamble_layout_t::OFS_CFG_PAIRS_NUM ]; ++i)
+    {
+        cfg_pair_t p;
+        p.addr = dw[ preamble_layout_t::cfg_addr_ofs( i ) ];
+        p.data = dw[ preamble_layout_t::cfg_data_ofs( i ) ];
+        pairs.push_back( p );
+    }
+
+    return pairs;
+}
+
+
+static unsigned long long delays_of( const std::vector< cfg_pair_t > & pairs,
+        std::vector< cfg_pair_t > * others = 0 )
+{
+    unsigned long long sum = 0;
+
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        if (pairs[i].addr == ddr_delays_t::DELAY_ADDR)
+        {
+            sum += pairs[i].data;
+        }
+        else if (others)
+        {
+            others->push_back( pairs[i] );
+        }
+    }
+
+    return sum;
+}
+
+
+static bool same( const std::vector< cfg_pair_t > & a, const std::vector< cfg_pair_t > & b )
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (a[i].addr != b[i].addr || a[i].data != b[i].data)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+static void test_profile( const board_profile_t & b )
+{
+    const std::vector< cfg_pair_t > orig = pairs_of( b );
+    std::vector< cfg_pair_t > orig_others;
+    const unsigned long long total = delays_of( orig, &orig_others );
+
+    ddr_delays_t delays( 1000 );
+    std::string msg;
+
+    // report: every delay is counted, nothing is changed
+    std::vector< cfg_pair_t > pairs = orig;
+    std::vector< ddr_delays_t::ctrl_t > ctrls;
+
+    check( delays.run( pairs, ddr_delays_t::REPORT, ctrls, msg ), b.name, msg.c_str() );
+    check( same( pairs, orig ), b.name, "report changed the pair list" );
+
+    if (ctrls.empty())
+    {
+        return;
+    }
+
+    check( ctrls.size() == 1, b.name, "more than one DDR controller" );
+    check( ctrls[0].pre + ctrls[0].post == total, b.name, "delay pairs not counted" );
+
+    // merge: same total, at most one delay on each side of MEM_EN
+    std::vector< ddr_delays_t::ctrl_t > merged;
+    std::vector< cfg_pair_t > merged_others;
+    pairs = orig;
+
+    check( delays.run( pairs, ddr_delays_t::MERGE, merged, msg ), b.name, msg.c_str() );
+    check( delays_of( pairs, &merged_others ) == total, b.name, "merge changed the total delay" );
+    check( same( merged_others, orig_others ), b.name, "merge changed the other writes" );
+    check( pairs.size() <= orig_others.size() + 2, b.name, "merge left more than two delays" );
+
+    // fix: the delays become the minimum, found again as they were written
+    std::vector< ddr_delays_t::ctrl_t > fixed, again;
+    std::vector< cfg_pair_t > fixed_others;
+    pairs = orig;
+
+    check( delays.run( pairs, ddr_delays_t::FIX, fixed, msg ), b.name, msg.c_str() );
+    check( delays_of( pairs, &fixed_others ) == fixed[0].new_pre + fixed[0].new_post, 
+            b.name, "fix wrote a wrong total delay" );
+    check( same( fixed_others, orig_others ), b.name, "fix changed the other writes" );
+    check( pairs.size() <= orig_others.size() + 2, b.name, "fix left more than two delays" );
+
+    check( delays.run( pairs, ddr_delays_t::REPORT, again, msg ), b.name, msg.c_str() );
+    check( again[0].pre == fixed[0].new_pre && again[0].post == fixed[0].new_post, 
+            b.name, "fixed delays not found again" );
+}
+
+
+//------------------------------------------------------------------------------
+
+
+int main()
+{
+    for (unsigned int i = 0; i < board_profile_t::count(); ++i)
+    {
+        test_profile( board_profile_t::at( i ) );
+    }
+
+    // the 0x100 delay is two writes away from MEM_EN
+    std::string msg;
+    const board_profile_t * b = board_profile_t::find( "p1020rdb_533M", msg );
+    std::vector< cfg_pair_t > pairs = pairs_of( *b );
+    std::vector< ddr_delays_t::ctrl_t > ctrls;
+    ddr_delays_t delays( 1000 );
+
+    delays.run( pairs, ddr_delays_t::FIX, ctrls, msg );
+    check( ctrls.size() == 1 && ctrls[0].pre == 0x100, b->name, "0x100 delay not found" );
+    check( pairs_of( *b ).size() + 1 == pairs.size(), b->name, 
+            "fix added a delay before MEM_EN" );
+
+    return check_report( "board profiles checked" );
+}
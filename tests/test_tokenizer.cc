@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+/*
+   memory_stream and the tokenizer reading from it, as the .cfg/.dat 
+   parsers do for a configuration held in memory (compile_cfg/compile_dat
+   over a buffer, and every file, read into one first)
+ */
+
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "tokenizer.h"
+#include "check.h"
+
+
+template <class T> static std::vector< std::string > lines_of( util::memory_stream< T > & ms )
+{
+    std::vector< std::string > lines;
+    T line;
+
+    while (ms.get_line( line, '\n' ))
+    {
+        lines.push_back( std::string( line.begin(), line.end() ) );
+    }
+
+    return lines;
+}
+
+
+// The tokens of a .dat, blanks, empty lines and comments skipped
+template <class T> static std::vector< std::string > tokens_of( util::memory_stream< T > & ms )
+{
+    typedef util::tokenizer_t< T > tokenizer_t;
+
+    tokenizer_t tknzr( ms );
+    typename tokenizer_t::token_class_set_t blnk_cls, sngt_cls, comment_cls;
+
+    blnk_cls.insert(" ");
+    sngt_cls.insert(":");
+    comment_cls.insert("#");
+
+    tknzr.register_token_blank( blnk_cls );
+    tknzr.register_token_atomic( sngt_cls );
+    tknzr.register_token_linestyle_comment( comment_cls );
+
+    std::vector< std::string > tokens;
+    typename tokenizer_t::token_t token;
+
+    while (tknzr.get_next_token( token ) && token.tkncls != tokenizer_t::END_OF_STREAM)
+    {
+        if (token.tkncls != tokenizer_t::BLANK && 
+                token.tkncls != tokenizer_t::EMPTY_LINE &&
+                token.tkncls != tokenizer_t::LINESTYLE_COMMENT)
+        {
+            tokens.push_back( std::string( token.value.begin(), token.value.end() ) );
+        }
+    }
+
+    return tokens;
+}
+
+
+//------------------------------------------------------------------------------
+
+
+static void test_last_line()
+{
+    const char with[] = "80:ff702110\n84:43080000\n";
+    const char without[] = "80:ff702110\n84:43080000";
+
+    util::memory_stream< std::string > a( with, sizeof(with) - 1 );
+    util::memory_stream< std::string > b( without, sizeof(without) - 1 );
+
+    const std::vector< std::string > la = lines_of( a ), lb = lines_of( b );
+
+    check( la.size() == 2 && lb.size() == 2, "last line", "wrong number of lines" );
+    check( la == lb, "last line", "lines differ with and without the last delimiter" );
+    check( lb.size() == 2 && lb[1] == "84:43080000", "last line", "last line not read whole" );
+    check( b.eof() && b.tell() == long( sizeof(without) - 1 ), "last line", "not at the end" );
+
+    util::memory_stream< std::string > ta( with, sizeof(with) - 1 );
+    util::memory_stream< std::string > tb( without, sizeof(without) - 1 );
+    const std::vector< std::string > ka = tokens_of( ta ), kb = tokens_of( tb );
+
+    check( ka.size() == 6 && ka == kb, "last line", "tokens differ with and without the last delimiter" );
+}
+
+
+static void test_empty()
+{
+    util::memory_stream< std::string > ms( "", 0 );
+    std::string line( "x" );
+
+    check( ms.eof(), "empty", "not at the end" );
+    check( ! ms.get_line( line, '\n' ), "empty", "a line read" );
+    check( ms.tell() == 0, "empty", "bytes read" );
+
+    util::memory_stream< std::string > nul( 0, 0 );
+    check( nul.eof() && ! nul.get_line( line, '\n' ), "empty", "a line read from no buffer" );
+
+    util::memory_stream< std::string > tk( "", 0 );
+    check( tokens_of( tk ).empty(), "empty", "tokens read" );
+
+    // a lone delimiter is one empty line
+    util::memory_stream< std::string > nl( "\n", 1 );
+    const std::vector< std::string > l = lines_of( nl );
+    check( l.size() == 1 && l[0].empty(), "empty", "lone delimiter" );
+}
+
+
+static void test_literal()
+{
+    // the terminator is not part of the stream
+    util::memory_stream< std::string > ms( "80:ff702110 # comment\n84:43080000" );
+
+    const std::vector< std::string > l = lines_of( ms );
+
+    check( l.size() == 2 && l[1] == "84:43080000", "literal", "terminator read as data" );
+    check( ms.tell() == long( sizeof("80:ff702110 # comment\n84:43080000") - 1 ), 
+            "literal", "wrong length" );
+
+    util::memory_stream< std::string > tk( "80:ff702110 # comment\n84:43080000" );
+    const std::vector< std::string > t = tokens_of( tk );
+
+    check( t.size() == 6 && t[0] == "80" && t[1] == ":" && t[5] == "43080000", 
+            "literal", "wrong tokens" );
+
+    util::memory_stream< std::string > e( "" );
+    check( e.eof() && e.tell() == 0, "literal", "empty literal not empty" );
+}
+
+
+// The parsers tokenize into strings of the job arena
+static void test_arena()
+{
+    util::arena_t arena;
+    util::arena_scope_t scope( arena );
+
+    util::memory_stream< util::arena_string_t > ms( "80:ff702110\n84:43080000" );
+    const std::vector< std::string > t = tokens_of( ms );
+
+    check( t.size() == 6 && t[5] == "43080000", "arena", "wrong tokens" );
+    check( arena.allocs() > 0, "arena", "nothing allocated from the arena" );
+}
+
+
+//------------------------------------------------------------------------------
+
+
+int main()
+{
+    test_last_line();
+    test_empty();
+    test_literal();
+    test_arena();
+
+    return check_report( "memory_stream checked" );
+}
@@ -39,7 +39,9 @@
 #include <map>
 #include <list>
 #include <algorithm>
+#include <memory>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 
 namespace util 
@@ -60,16 +62,17 @@ namespace util
             FILE* _fstrm;
 
         public:
-            enum { MAX_LINE_LEN = 256 };
+            enum { MAX_LINE_LEN = 4096 };
 
 
 
             file_stream( const T & filename ) throw() : _filename(filename), _fstrm(0) { }
 
 
+            // "-" stands for the standard input
             bool open() throw() 
             {
-                _fstrm = fopen( _filename.c_str(), "r" );
+                _fstrm = _filename == "-" ? stdin : fopen( _filename.c_str(), "r" );
 
                 return _fstrm ? true : false;
             }
@@ -81,11 +84,18 @@ namespace util
             }
 
 
+            // Bytes read so far, -1 if unknown
+            long tell() const throw() 
+            { 
+                return _fstrm ? ftell(_fstrm) : -1; 
+            }
+
+
             bool close() throw() 
             {
                 if (_fstrm) 
                 {
-                    bool ok = 0 == fclose(_fstrm);
+                    bool ok = _fstrm == stdin || 0 == fclose(_fstrm);
                     _fstrm = 0;
 
                     return ok;
@@ -147,6 +157,60 @@ namespace util
     };    
 
 
+    /*
+       Stream over a span of memory (e.g. a config received over a socket or
+       generated in-process), read in place: the span is not copied and must
+       outlive the stream. A last line with no delimiter is returned as well.
+     */
+    template <class T> class memory_stream : public base_stream<T>
+    {
+        private:
+            const char * _begin;
+            const char * _pos;
+            const char * _end;
+
+        public:
+            memory_stream( const char * data, size_t len ) throw() :
+                _begin(data), _pos(data), _end(data + len) { }
+
+
+            // A string literal, its terminator excluded
+            template <size_t N>
+            explicit memory_stream( const char (&literal)[N] ) throw() :
+                _begin(literal), _pos(literal), _end(literal + N - 1) { }
+
+
+            // Bytes read so far
+            long tell() const throw()
+            {
+                return long( _pos - _begin );
+            }
+
+
+            virtual bool eof() const throw()
+            {
+                return _pos >= _end;
+            }
+
+
+            virtual bool get_line(T & line, char delimiter) throw()
+            {
+                if (_pos >= _end)
+                {
+                    return false;
+                }
+
+                const char * eol =
+                    static_cast< const char * >( memchr( _pos, delimiter, _end - _pos ) );
+
+                line.assign( _pos, eol ? eol : _end );
+                _pos = eol ? eol + 1 : _end;
+
+                return true;
+            }
+    };
+
+
     template <class T> class tokenizer_t 
     {
         public:
@@ -162,7 +226,14 @@ namespace util
                 TOKEN_CLASS_CNT
             };
 
-            typedef std::set< T > token_class_set_t;
+            // containers allocate as the string type does (e.g. from an arena)
+            template <class U> struct alloc_of
+            {
+                typedef typename std::allocator_traits< 
+                    typename T::allocator_type >::template rebind_alloc< U > type;
+            };
+
+            typedef std::set< T, std::less< T >, typename alloc_of< T >::type > token_class_set_t;
 
         private:
             base_stream<T> & _strm;
@@ -221,7 +292,7 @@ namespace util
 
         private:
             token_t _last_processed_token;
-            typedef std::list< token_t > _rtoken_list_t;
+            typedef std::list< token_t, typename alloc_of< token_t >::type > _rtoken_list_t;
             bool _rtoken_enable;
             _rtoken_list_t _rtoken_list;
             typename _rtoken_list_t::const_iterator _rtoken_list_it;
@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___TRACE_H__
+#define ___TRACE_H__
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+
+
+namespace util
+{
+
+    /*
+       Recorder of Chrome trace events (--trace): the spans are kept in memory
+       as complete ("X") events and saved as a JSON file which can be loaded
+       by chrome://tracing or Perfetto. Every thread has its own track.
+       Tracing is off by default, then a span costs the test of a flag.
+     */
+    class tracer_t
+    {
+        private:
+            struct event_t
+            {
+                const char * name;
+                long long ts;
+                long long dur;
+                unsigned int tid;
+                std::string args;
+            };
+
+            std::vector< event_t > _events;
+            std::map< unsigned int, std::string > _threads;
+            std::mutex _mtx;
+            std::chrono::steady_clock::time_point _t0;
+            unsigned int _n_threads;
+
+            tracer_t() : _t0( std::chrono::steady_clock::now() ), _n_threads(0) {}
+
+            static bool & flag() throw()
+            {
+                static bool on = false;
+                return on;
+            }
+
+
+            static void append_json_str( std::string & s, const std::string & v )
+            {
+                s += '"';
+
+                for (size_t i = 0; i < v.size(); ++i)
+                {
+                    const unsigned char c = v[i];
+
+                    if (c == '"' || c == '\\')
+                    {
+                        s += '\\';
+                        s += c;
+                    }
+                    else if (c < 0x20)
+                    {
+                        char buf[ 8 ];
+                        snprintf( buf, sizeof(buf), "\\u%04x", c );
+                        s += buf;
+                    }
+                    else
+                    {
+                        s += c;
+                    }
+                }
+
+                s += '"';
+            }
+
+
+        public:
+            static tracer_t & instance()
+            {
+                static tracer_t tracer;
+                return tracer;
+            }
+
+
+            static bool on() throw()
+            {
+                return flag();
+            }
+
+
+            static void enable()
+            {
+                instance();
+                flag() = true;
+            }
+
+
+            //--------------------------------------------------------------------------
+
+
+            long long now_us() const throw()
+            {
+                return std::chrono::duration_cast< std::chrono::microseconds >(
+                        std::chrono::steady_clock::now() - _t0 ).count();
+            }
+
+
+            // Track of the calling thread, numbered in order of appearance
+            unsigned int tid()
+            {
+                static thread_local unsigned int id = 0;
+
+                if (! id)
+                {
+                    std::lock_guard< std::mutex > lock( _mtx );
+                    id = ++_n_threads;
+                }
+
+                return id;
+            }
+
+
+            void name_thread( const char * name )
+            {
+                if (on())
+                {
+                    const unsigned int id = tid();
+
+                    std::lock_guard< std::mutex > lock( _mtx );
+                    _threads[ id ] = name;
+                }
+            }
+
+
+            void add( const char * name, long long ts, const std::string & args )
+            {
+                event_t ev = { name, ts, now_us() - ts, tid(), args };
+
+                std::lock_guard< std::mutex > lock( _mtx );
+                _events.push_back( ev );
+            }
+
+
+            //--------------------------------------------------------------------------
+
+
+            static void add_arg( std::string & args, const char * key, const std::string & v )
+            {
+                args += args.empty() ? "\"" : ",\"";
+                args += key;
+                args += "\":";
+                append_json_str( args, v );
+            }
+
+
+            static void add_arg( std::string & args, const char * key, long long v )
+            {
+                char buf[ 32 ];
+                snprintf( buf, sizeof(buf), "%lld", v );
+
+                args += args.empty() ? "\"" : ",\"";
+                args += key;
+                args += "\":";
+                args += buf;
+            }
+
+
+            //--------------------------------------------------------------------------
+
+
+            bool save( const std::string & filename )
+            {
+                std::lock_guard< std::mutex > lock( _mtx );
+
+                FILE * f = fopen( filename.c_str(), "w" );
+                if (!f) return false;
+
+                std::string s = "{\"traceEvents\":[\n";
+                bool ok = true;
+
+                for (unsigned int id = 1; id <= _n_threads; ++id)
+                {
+                    std::map< unsigned int, std::string >::const_iterator i = _threads.find( id );
+                    std::string args;
+
+                    add_arg( args, "name", i != _threads.end() ?
+                            i->second : "thread " + std::to_string( id ) );
+
+                    s += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":";
+                    s += std::to_string( id ) + ",\"args\":{" + args + "}},\n";
+                }
+
+                for (size_t i = 0; i < _events.size(); ++i)
+                {
+                    const event_t & ev = _events[i];
+
+                    s += "{\"name\":\"";
+                    s += ev.name;
+                    s += "\",\"cat\":\"spidyboot\",\"ph\":\"X\",\"ts\":" + std::to_string( ev.ts ) +
+                        ",\"dur\":" + std::to_string( ev.dur ) +
+                        ",\"pid\":1,\"tid\":" + std::to_string( ev.tid ) +
+                        ",\"args\":{" + ev.args + "}},\n";
+
+                    if (s.size() > 64 * 1024)
+                    {
+                        ok = fwrite( s.data(), 1, s.size(), f ) == s.size() && ok;
+                        s.clear();
+                    }
+                }
+
+                // trailing metadata, so that every event line ends with a comma
+                s += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"spidyboot\"}}\n";
+                s += "],\"displayTimeUnit\":\"ms\"}\n";
+
+                ok = fwrite( s.data(), 1, s.size(), f ) == s.size() && ok;
+
+                return fclose( f ) == 0 && ok;
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Scoped span: recorded from its construction to its destruction on the
+       track of the calling thread, tagged with the arguments given by arg()
+     */
+    class trace_span_t
+    {
+        private:
+            const char * _name;
+            long long _ts;
+            bool _on;
+            std::string _args;
+
+            trace_span_t( const trace_span_t& );
+            trace_span_t & operator=( const trace_span_t& );
+
+        public:
+            explicit trace_span_t( const char * name ) :
+                _name(name), _ts(0), _on( tracer_t::on() )
+            {
+                if (_on) _ts = tracer_t::instance().now_us();
+            }
+
+
+            ~trace_span_t()
+            {
+                end();
+            }
+
+
+            // Closes the span before the end of its scope
+            void end()
+            {
+                if (_on) tracer_t::instance().add( _name, _ts, _args );
+                _on = false;
+            }
+
+
+            bool on() const throw()
+            {
+                return _on;
+            }
+
+
+            void arg( const char * key, const std::string & v )
+            {
+                if (_on) tracer_t::add_arg( _args, key, v );
+            }
+
+
+            void arg( const char * key, long long v )
+            {
+                if (_on) tracer_t::add_arg( _args, key, v );
+            }
+    };
+
+}
+
+#endif
@@ -0,0 +1,491 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___TXN_H__
+#define ___TXN_H__
+
+#ifndef WIN32
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+
+namespace util
+{
+
+    inline bool pwrite_all( int fd, const unsigned char * p, size_t n, off_t ofs ) throw()
+    {
+        while (n > 0)
+        {
+            const ssize_t wb = pwrite( fd, p, n, ofs );
+
+            if (wb < 0 && errno == EINTR) continue;
+            if (wb <= 0) return false;
+
+            p += wb;
+            n -= wb;
+            ofs += wb;
+        }
+
+        return true;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Journal of an in-place patch (--patch --journal): the new content of
+       the head of an image, with a checksum telling a complete journal from
+       an interrupted write. A complete journal is replayed (the patch is
+       rolled forward), a torn one is dropped: the image was not touched yet.
+     */
+    class patch_journal_t
+    {
+        private:
+            static const char * magic() throw() { return "SPJOURN1"; }
+            enum { MAGIC_SIZE = 8 };
+
+
+            // Fletcher-32 over the bytes
+            static unsigned int checksum( const unsigned char * p, size_t n ) throw()
+            {
+                unsigned int a = 0xffff, b = 0xffff;
+
+                for (size_t i = 0; i < n; ++i)
+                {
+                    a = (a + p[i]) % 65535;
+                    b = (b + a) % 65535;
+                }
+
+                return (b << 16) | a;
+            }
+
+
+        public:
+            static std::string name( const std::string & image )
+            {
+                return image + ".journal";
+            }
+
+
+            // Journal: magic, length (4 bytes, big endian), data, checksum
+            static bool save( const std::string & image, const unsigned char * data, size_t len )
+            {
+                std::vector< unsigned char > j( magic(), magic() + MAGIC_SIZE );
+
+                for (int s = 24; s >= 0; s -= 8) j.push_back( (unsigned char) (len >> s) );
+
+                j.insert( j.end(), data, data + len );
+
+                const unsigned int sum = checksum( &j[0], j.size() );
+
+                for (int s = 24; s >= 0; s -= 8) j.push_back( (unsigned char) (sum >> s) );
+
+                const int fd = open( name( image ).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+                if (fd < 0) return false;
+
+                const bool ok = pwrite_all( fd, &j[0], j.size(), 0 );
+
+                return close( fd ) == 0 && ok;
+            }
+
+
+            // Write the content of the journal of image (if any, and complete)
+            // at the head of image, then remove the journal. Returns 1 if the
+            // patch has been rolled forward, 0 if there was nothing to do,
+            // -1 on errors
+            static int recover( const std::string & image )
+            {
+                const std::string jname = name( image );
+                const int fd = open( jname.c_str(), O_RDONLY );
+
+                if (fd < 0)
+                {
+                    return errno == ENOENT ? 0 : -1;
+                }
+
+                std::vector< unsigned char > j;
+                unsigned char buf[ 4096 ];
+                ssize_t rb;
+
+                while ((rb = read( fd, buf, sizeof(buf) )) > 0 || (rb < 0 && errno == EINTR))
+                {
+                    if (rb > 0) j.insert( j.end(), buf, buf + rb );
+                }
+
+                close( fd );
+
+                if (rb < 0) return -1;
+
+                size_t len = 0;
+                bool complete = j.size() >= MAGIC_SIZE + 8 &&
+                    memcmp( &j[0], magic(), MAGIC_SIZE ) == 0;
+
+                if (complete)
+                {
+                    for (int i = 0; i < 4; ++i) len = (len << 8) | j[ MAGIC_SIZE + i ];
+
+                    complete = j.size() == MAGIC_SIZE + 4 + len + 4;
+                }
+
+                if (complete)
+                {
+                    unsigned int sum = 0;
+
+                    for (int i = 0; i < 4; ++i) sum = (sum << 8) | j[ j.size() - 4 + i ];
+
+                    complete = sum == checksum( &j[0], j.size() - 4 );
+                }
+
+                int ret = 0;
+
+                if (complete)
+                {
+                    const int img = open( image.c_str(), O_WRONLY );
+
+                    if (img < 0 || ! pwrite_all( img, &j[ MAGIC_SIZE + 4 ], len, 0 ) ||
+                            fdatasync( img ) != 0)
+                    {
+                        if (img >= 0) close( img );
+                        return -1;
+                    }
+
+                    close( img );
+                    ret = 1;
+                }
+
+                return unlink( jname.c_str() ) == 0 ? ret : -1;
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Outputs of a run committed as a group: every file is written to a
+       temporary next to its target, and in-place patches are journaled;
+       commit() renames the temporaries over the targets and applies the
+       patches, so that a crash or a full disk never leaves a half-written
+       image. With sync, the whole group is made durable by two barriers
+       (before and after the renames), each one a syncfs() per filesystem
+       (an fsync for a single file) instead of an fsync per file.
+     */
+    class output_txn_t
+    {
+        private:
+            struct entry_t
+            {
+                std::string tmp;                   // temporary, or journal
+                std::string dst;
+                std::vector< unsigned char > data; // patch of the head of dst
+            };
+
+            std::vector< entry_t > _entries;
+            bool _sync;
+
+
+            static std::string dir_of( const std::string & path )
+            {
+                const size_t p = path.rfind( '/' );
+
+                return p == std::string::npos ? "." : p == 0 ? "/" : path.substr( 0, p );
+            }
+
+
+            static bool sync_path( const std::string & path, bool whole_fs ) throw()
+            {
+                const int fd = open( path.c_str(), O_RDONLY );
+                if (fd < 0) return false;
+
+                const bool ok = (whole_fs ? syncfs( fd ) : fsync( fd )) == 0;
+                close( fd );
+
+                return ok;
+            }
+
+
+            // Make durable what has been written so far; after the renames
+            // (names) a single file needs its directory synced
+            bool barrier( bool names, std::string & msg )
+            {
+                if (_entries.size() == 1)
+                {
+                    const entry_t & e = _entries[0];
+                    const std::string path = ! names ? e.tmp : e.data.empty() ? dir_of( e.dst ) : e.dst;
+
+                    if (! sync_path( path, false ))
+                    {
+                        msg = "\"" + path + "\": " + strerror( errno );
+                        return false;
+                    }
+
+                    return true;
+                }
+
+                std::map< dev_t, std::string > fs;
+                struct stat st;
+
+                for (size_t i = 0; i < _entries.size(); ++i)
+                {
+                    const std::string & path = names ? _entries[i].dst : _entries[i].tmp;
+
+                    if (stat( path.c_str(), &st ) == 0) fs[ st.st_dev ] = path;
+                }
+
+                for (std::map< dev_t, std::string >::const_iterator i = fs.begin(); i != fs.end(); ++i)
+                {
+                    if (! sync_path( i->second, true ))
+                    {
+                        msg = "\"" + i->second + "\": " + strerror( errno );
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+
+
+            // After a failed commit: the temporaries not renamed yet go, the
+            // journals stay, to be recovered by the next --patch
+            void abandon() throw()
+            {
+                for (size_t i = 0; i < _entries.size(); ++i)
+                {
+                    if (_entries[i].data.empty() && ! _entries[i].tmp.empty())
+                    {
+                        unlink( _entries[i].tmp.c_str() );
+                    }
+                }
+
+                _entries.clear();
+            }
+
+
+        public:
+            output_txn_t() : _sync(false) {}
+
+            ~output_txn_t()
+            {
+                rollback( 0 );
+            }
+
+
+            void set_sync( bool sync ) throw()
+            {
+                _sync = sync;
+            }
+
+
+            size_t size() const throw()
+            {
+                return _entries.size();
+            }
+
+
+            //--------------------------------------------------------------------------
+
+
+            // Path to write instead of dst: a new empty temporary next to it,
+            // with the permissions dst has (or would get), or dst itself when
+            // it exists and is not a regular file (e.g. a device or a symlink)
+            bool stage( const std::string & dst, std::string & path )
+            {
+                struct stat st;
+                const bool exists = lstat( dst.c_str(), &st ) == 0;
+
+                if (dst == "-" || (exists && ! S_ISREG( st.st_mode )))
+                {
+                    path = dst;
+                    return true;
+                }
+
+                // the extension is kept (e.g. .gz selects the compression)
+                const size_t p = dst.rfind( '/' );
+                const size_t b = p == std::string::npos ? 0 : p + 1;
+                const size_t x = dst.rfind( '.' );
+                const std::string ext = x != std::string::npos && x > b ? dst.substr( x ) : "";
+
+                std::string tmp = dst.substr( 0, b ) + "." + 
+                    dst.substr( b, dst.size() - b - ext.size() ) + ".XXXXXX" + ext;
+
+                const int fd = mkstemps( &tmp[0], int( ext.size() ) );
+                if (fd < 0) return false;
+
+                mode_t mode = exists ? st.st_mode & 07777 : 0;
+
+                if (! exists)
+                {
+                    const mode_t mask = umask( 0 );
+                    umask( mask );
+                    mode = 0666 & ~mask;
+                }
+
+                if (fchmod( fd, mode ) != 0 || close( fd ) != 0)
+                {
+                    unlink( tmp.c_str() );
+                    return false;
+                }
+
+                entry_t e;
+                e.tmp = tmp;
+                e.dst = dst;
+                _entries.push_back( e );
+
+                path = tmp;
+                return true;
+            }
+
+
+            // Journal the patch of the first len bytes of image, applied by
+            // commit()
+            bool stage_patch( const std::string & image, const unsigned char * data, size_t len )
+            {
+                if (! patch_journal_t::save( image, data, len ))
+                {
+                    return false;
+                }
+
+                entry_t e;
+                e.tmp = patch_journal_t::name( image );
+                e.dst = image;
+                e.data.assign( data, data + len );
+                _entries.push_back( e );
+
+                return true;
+            }
+
+
+            // Where dst is being written: its temporary, if staged
+            const std::string & path_of( const std::string & dst ) const throw()
+            {
+                // the last staged first, that is usually the one looked for
+                for (size_t i = _entries.size(); i-- > 0; )
+                {
+                    if (_entries[i].dst == dst && _entries[i].data.empty())
+                    {
+                        return _entries[i].tmp;
+                    }
+                }
+
+                return dst;
+            }
+
+
+            // Drop the output staged as the temporary path
+            void discard( const std::string & path ) throw()
+            {
+                for (size_t i = _entries.size(); i-- > 0; )
+                {
+                    if (_entries[i].tmp == path)
+                    {
+                        unlink( path.c_str() );
+                        _entries.erase( _entries.begin() + i );
+                        return;
+                    }
+                }
+            }
+
+
+            // Drop the outputs staged after the first <mark> ones
+            void rollback( size_t mark ) throw()
+            {
+                while (_entries.size() > mark)
+                {
+                    unlink( _entries.back().tmp.c_str() );
+                    _entries.pop_back();
+                }
+            }
+
+
+            //--------------------------------------------------------------------------
+
+
+            bool commit( std::string & msg )
+            {
+                if (_entries.empty()) return true;
+
+                if (_sync && ! barrier( false, msg ))
+                {
+                    rollback( 0 );
+                    return false;
+                }
+
+                for (size_t i = 0; i < _entries.size(); ++i)
+                {
+                    entry_t & e = _entries[i];
+                    bool ok = true;
+
+                    if (e.data.empty())
+                    {
+                        ok = rename( e.tmp.c_str(), e.dst.c_str() ) == 0;
+                    }
+                    else
+                    {
+                        const int fd = open( e.dst.c_str(), O_WRONLY );
+
+                        ok = fd >= 0 && pwrite_all( fd, &e.data[0], e.data.size(), 0 );
+
+                        if (fd >= 0) ok = close( fd ) == 0 && ok;
+                    }
+
+                    if (! ok)
+                    {
+                        msg = "\"" + e.dst + "\": " + strerror( errno );
+                        abandon();
+                        return false;
+                    }
+
+                    if (e.data.empty()) e.tmp.clear(); // renamed
+                }
+
+                if (_sync && ! barrier( true, msg ))
+                {
+                    abandon();
+                    return false;
+                }
+
+                // the patches are durable (or not asked to be), their
+                // journals can go
+                for (size_t i = 0; i < _entries.size(); ++i)
+                {
+                    if (! _entries[i].data.empty()) unlink( _entries[i].tmp.c_str() );
+                }
+
+                _entries.clear();
+
+                return true;
+            }
+    };
+
+}
+
+#endif // WIN32
+
+#endif
@@ -0,0 +1,621 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___URING_H__
+#define ___URING_H__
+
+#include <string>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "directio.h"
+#endif
+
+
+namespace util
+{
+
+    /*
+       Write <dst> = <prefix> + content of <src>.
+       If <src> is empty only the prefix is written; if <truncate> is false
+       <dst> must already exist and be at least <min_size> bytes long
+       (in-place patch).
+     */
+    struct copy_req_t
+    {
+        std::string src;
+        std::string dst;
+        const unsigned char * prefix;
+        size_t prefix_len;
+        bool truncate;
+        long long min_size;
+
+        int err;             // errno of the failed operation, 0 on success
+        long long written;
+
+        copy_req_t() throw() :
+            prefix(0), prefix_len(0), truncate(true), min_size(0), err(0), written(0) {}
+    };
+
+
+#ifdef HAVE_IO_URING
+
+    /*
+       Minimal io_uring wrapper built directly on top of the raw system calls
+       (no liburing dependency).
+     */
+    class uring_t
+    {
+        private:
+            int _fd;
+            unsigned _entries;
+
+            void * _sq_ptr;
+            size_t _sq_sz;
+            void * _cq_ptr;
+            size_t _cq_sz;
+            struct io_uring_sqe * _sqes;
+            size_t _sqes_sz;
+
+            unsigned * _sq_head;
+            unsigned * _sq_tail;
+            unsigned * _sq_mask;
+            unsigned * _sq_array;
+            unsigned _sqe_tail;
+            unsigned _submitted_tail;
+
+            unsigned * _cq_head;
+            unsigned * _cq_tail;
+            unsigned * _cq_mask;
+            struct io_uring_cqe * _cqes;
+
+            uring_t( const uring_t& );
+            uring_t& operator=( const uring_t& );
+
+        public:
+            uring_t() throw() :
+                _fd(-1), _entries(0),
+                _sq_ptr(MAP_FAILED), _sq_sz(0), _cq_ptr(MAP_FAILED), _cq_sz(0),
+                _sqes((struct io_uring_sqe *) MAP_FAILED), _sqes_sz(0),
+                _sq_head(0), _sq_tail(0), _sq_mask(0), _sq_array(0),
+                _sqe_tail(0), _submitted_tail(0),
+                _cq_head(0), _cq_tail(0), _cq_mask(0), _cqes(0) {}
+
+
+            bool init( unsigned entries ) throw()
+            {
+                struct io_uring_params p;
+                memset( &p, 0, sizeof(p) );
+
+                _fd = (int) syscall( __NR_io_uring_setup, entries, &p );
+
+                if (_fd < 0)
+                {
+                    return false;
+                }
+
+                _entries = p.sq_entries;
+
+                _sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+                _cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+                const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+                if (single_mmap)
+                {
+                    _sq_sz = _cq_sz = _sq_sz > _cq_sz ? _sq_sz : _cq_sz;
+                }
+
+                _sq_ptr = mmap( 0, _sq_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING );
+
+                if (_sq_ptr == MAP_FAILED)
+                {
+                    return false;
+                }
+
+                _cq_ptr = single_mmap ? _sq_ptr : mmap( 0, _cq_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING );
+
+                if (_cq_ptr == MAP_FAILED)
+                {
+                    return false;
+                }
+
+                _sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+                _sqes = (struct io_uring_sqe *) mmap( 0, _sqes_sz,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES );
+
+                if (_sqes == MAP_FAILED)
+                {
+                    return false;
+                }
+
+                char * sq = (char *) _sq_ptr;
+                char * cq = (char *) _cq_ptr;
+
+                _sq_head  = (unsigned *) (sq + p.sq_off.head);
+                _sq_tail  = (unsigned *) (sq + p.sq_off.tail);
+                _sq_mask  = (unsigned *) (sq + p.sq_off.ring_mask);
+                _sq_array = (unsigned *) (sq + p.sq_off.array);
+
+                _cq_head  = (unsigned *) (cq + p.cq_off.head);
+                _cq_tail  = (unsigned *) (cq + p.cq_off.tail);
+                _cq_mask  = (unsigned *) (cq + p.cq_off.ring_mask);
+                _cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+                _sqe_tail = _submitted_tail = *_sq_tail;
+
+                return true;
+            }
+
+
+            bool register_buffers( const struct iovec * iov, unsigned n ) throw()
+            {
+                return syscall( __NR_io_uring_register, _fd,
+                        IORING_REGISTER_BUFFERS, iov, n ) == 0;
+            }
+
+
+            struct io_uring_sqe * get_sqe() throw()
+            {
+                const unsigned head = __atomic_load_n( _sq_head, __ATOMIC_ACQUIRE );
+
+                if (_sqe_tail - head >= _entries)
+                {
+                    return 0;
+                }
+
+                const unsigned idx = _sqe_tail & *_sq_mask;
+                _sq_array[ idx ] = idx;
+                ++_sqe_tail;
+
+                struct io_uring_sqe * sqe = &_sqes[ idx ];
+                memset( sqe, 0, sizeof(*sqe) );
+
+                return sqe;
+            }
+
+
+            // Submit the queued entries and wait for at least wait_nr completions
+            int submit_and_wait( unsigned wait_nr ) throw()
+            {
+                const unsigned to_submit = _sqe_tail - _submitted_tail;
+
+                __atomic_store_n( _sq_tail, _sqe_tail, __ATOMIC_RELEASE );
+                _submitted_tail = _sqe_tail;
+
+                int ret = 0;
+
+                do
+                {
+                    ret = (int) syscall( __NR_io_uring_enter, _fd, to_submit, wait_nr,
+                            wait_nr ? IORING_ENTER_GETEVENTS : 0, (void*) 0, 0 );
+                }
+                while (ret < 0 && errno == EINTR);
+
+                return ret;
+            }
+
+
+            struct io_uring_cqe * peek_cqe() throw()
+            {
+                const unsigned head = *_cq_head;
+                const unsigned tail = __atomic_load_n( _cq_tail, __ATOMIC_ACQUIRE );
+
+                return head == tail ? 0 : &_cqes[ head & *_cq_mask ];
+            }
+
+
+            void cqe_seen() throw()
+            {
+                __atomic_store_n( _cq_head, *_cq_head + 1, __ATOMIC_RELEASE );
+            }
+
+
+            ~uring_t() throw()
+            {
+                if (_sqes != MAP_FAILED) munmap( _sqes, _sqes_sz );
+                if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr) munmap( _cq_ptr, _cq_sz );
+                if (_sq_ptr != MAP_FAILED) munmap( _sq_ptr, _sq_sz );
+                if (_fd >= 0) close( _fd );
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Runs a set of copy requests on io_uring: a pool of registered buffers
+       cycles between reads and writes, so chunks of many requests are in
+       flight at the same time and each submission carries a batch of them.
+     */
+    class uring_copier_t
+    {
+        public:
+            enum
+            {
+                SLOTS = 16,
+                CHUNK_SIZE = 256*1024
+            };
+
+        private:
+            struct job_t
+            {
+                int src;
+                int dst;
+                long long next_src_ofs;
+                bool started;
+                bool eof;
+                bool done;
+                int inflight;
+
+                job_t() throw() : src(-1), dst(-1), next_src_ofs(0),
+                    started(false), eof(false), done(false), inflight(0) {}
+            };
+
+            struct slot_t
+            {
+                int job;
+                bool writing;
+                size_t data_ofs;
+                size_t len;
+                size_t done;
+                long long dst_ofs;
+            };
+
+            uring_t _ring;
+            aligned_buffer_t _pool;
+            struct iovec _iov[ SLOTS ];
+            bool _fixed;
+
+            unsigned char * _buf( int slot ) throw()
+            {
+                return _pool.data() + size_t(slot) * CHUNK_SIZE;
+            }
+
+        public:
+            uring_copier_t() throw() : _fixed(false) {}
+
+
+            bool init() throw()
+            {
+                if (! _ring.init( SLOTS ) || ! _pool.alloc( SLOTS * CHUNK_SIZE, 4096 ))
+                {
+                    return false;
+                }
+
+                for (int i = 0; i < SLOTS; ++i)
+                {
+                    _iov[i].iov_base = _buf( i );
+                    _iov[i].iov_len = CHUNK_SIZE;
+                }
+
+                // Not fatal: registration is limited by RLIMIT_MEMLOCK
+                _fixed = _ring.register_buffers( _iov, SLOTS );
+
+                return true;
+            }
+
+
+            bool uses_fixed_buffers() const throw() { return _fixed; }
+
+
+            bool run( std::vector< copy_req_t > & reqs ) throw()
+            {
+                std::vector< job_t > jobs( reqs.size() );
+                slot_t slot[ SLOTS ];
+                int free_slot[ SLOTS ];
+                int n_free = SLOTS;
+                int inflight = 0;
+                size_t next_job = 0;
+                size_t first_active = 0;
+
+                for (int i = 0; i < SLOTS; ++i)
+                {
+                    free_slot[i] = SLOTS - 1 - i;
+                }
+
+                bool all_ok = true;
+
+                while (true)
+                {
+                    // Assign free buffers to the first jobs still having data to read
+                    while (n_free > 0)
+                    {
+                        while (first_active < next_job &&
+                                (jobs[first_active].eof || jobs[first_active].done))
+                        {
+                            ++first_active;
+                        }
+
+                        size_t j = first_active;
+
+                        if (j == next_job)
+                        {
+                            if (next_job == reqs.size())
+                            {
+                                break;
+                            }
+
+                            ++next_job;
+
+                            if (! _start( reqs[j], jobs[j] ))
+                            {
+                                all_ok = false;
+                                continue;
+                            }
+                        }
+
+                        const int s = free_slot[ --n_free ];
+
+                        if (! _issue_read( reqs[j], jobs[j], int(j), s, slot[s] ))
+                        {
+                            free_slot[ n_free++ ] = s;
+                            break; // ring full
+                        }
+
+                        ++inflight;
+                    }
+
+                    if (inflight == 0)
+                    {
+                        break;
+                    }
+
+                    if (_ring.submit_and_wait( 1 ) < 0)
+                    {
+                        return false;
+                    }
+
+                    struct io_uring_cqe * cqe = 0;
+
+                    while ((cqe = _ring.peek_cqe()) != 0)
+                    {
+                        const int s = int( cqe->user_data );
+                        const int res = cqe->res;
+                        _ring.cqe_seen();
+
+                        slot_t & sl = slot[s];
+                        copy_req_t & req = reqs[ sl.job ];
+                        job_t & job = jobs[ sl.job ];
+
+                        bool release = false;
+
+                        if (res < 0)
+                        {
+                            if (! req.err) req.err = -res;
+                            job.eof = true;
+                            release = true;
+                        }
+                        else if (! sl.writing)
+                        {
+                            const size_t requested = CHUNK_SIZE - sl.data_ofs;
+
+                            if (size_t(res) < requested)
+                            {
+                                job.eof = true;
+                            }
+
+                            sl.len = sl.data_ofs + res;
+                            sl.writing = true;
+                            sl.done = 0;
+
+                            release = sl.len == 0 || ! _issue_write( s, sl, job );
+                        }
+                        else
+                        {
+                            sl.done += res;
+                            req.written += res;
+
+                            release = sl.done == sl.len || res == 0 ||
+                                ! _issue_write( s, sl, job );
+
+                            if (res == 0 && ! req.err) req.err = EIO;
+                        }
+
+                        if (release)
+                        {
+                            --inflight;
+                            --job.inflight;
+                            free_slot[ n_free++ ] = s;
+
+                            if (job.eof && job.inflight == 0)
+                            {
+                                _finish( req, job );
+                                all_ok = all_ok && req.err == 0;
+                            }
+                        }
+                    }
+                }
+
+                return all_ok;
+            }
+
+        private:
+            bool _start( copy_req_t & req, job_t & job ) throw()
+            {
+                job.started = true;
+
+                if (! req.src.empty())
+                {
+                    job.src = open( req.src.c_str(), O_RDONLY );
+
+                    if (job.src < 0)
+                    {
+                        req.err = errno;
+                        job.done = true;
+                        return false;
+                    }
+                }
+
+                job.dst = open( req.dst.c_str(),
+                        O_WRONLY | (req.truncate ? O_CREAT | O_TRUNC : 0), 0644 );
+
+                struct stat st;
+
+                if (job.dst < 0 ||
+                        fstat( job.dst, &st ) < 0 ||
+                        (! S_ISBLK( st.st_mode ) && st.st_size < req.min_size))
+                {
+                    req.err = job.dst < 0 ? errno : EINVAL;
+                    _finish( req, job );
+                    return false;
+                }
+
+                return true;
+            }
+
+
+            void _finish( copy_req_t & req, job_t & job ) throw()
+            {
+                if (job.src >= 0) close( job.src );
+
+                if (job.dst >= 0 && close( job.dst ) < 0 && ! req.err)
+                {
+                    req.err = errno;
+                }
+
+                job.src = job.dst = -1;
+                job.done = true;
+            }
+
+
+            bool _issue_read( const copy_req_t & req, job_t & job,
+                    int j, int s, slot_t & sl ) throw()
+            {
+                const bool first = job.next_src_ofs == 0 && ! job.inflight;
+
+                sl.job = j;
+                sl.writing = false;
+                sl.data_ofs = first ? req.prefix_len : 0;
+                sl.dst_ofs = first ? 0 : job.next_src_ofs + req.prefix_len;
+
+                if (first)
+                {
+                    memcpy( _buf( s ), req.prefix, req.prefix_len );
+                }
+
+                if (job.src < 0)
+                {
+                    // prefix only: skip the read stage
+                    sl.writing = true;
+                    sl.len = sl.data_ofs;
+                    sl.done = 0;
+
+                    if (! _issue_write( s, sl, job ))
+                    {
+                        return false;
+                    }
+
+                    job.eof = true;
+                    return true;
+                }
+
+                struct io_uring_sqe * sqe = _ring.get_sqe();
+
+                if (! sqe)
+                {
+                    return false;
+                }
+
+                const size_t len = CHUNK_SIZE - sl.data_ofs;
+
+                _prep( sqe, false, job.src, s, _buf( s ) + sl.data_ofs, len,
+                        job.next_src_ofs );
+
+                job.next_src_ofs += len;
+                ++job.inflight;
+
+                return true;
+            }
+
+
+            bool _issue_write( int s, slot_t & sl, job_t & job ) throw()
+            {
+                struct io_uring_sqe * sqe = _ring.get_sqe();
+
+                if (! sqe)
+                {
+                    return false;
+                }
+
+                _prep( sqe, true, job.dst, s, _buf( s ) + sl.done, sl.len - sl.done,
+                        sl.dst_ofs + sl.done );
+
+                if (job.src < 0 && sl.done == 0)
+                {
+                    ++job.inflight;
+                }
+
+                return true;
+            }
+
+
+            void _prep( struct io_uring_sqe * sqe, bool write, int fd, int s,
+                    unsigned char * buf, size_t len, long long ofs ) throw()
+            {
+                sqe->fd = fd;
+                sqe->off = ofs;
+                sqe->user_data = s;
+
+                if (_fixed)
+                {
+                    sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                    sqe->addr = (unsigned long) buf;
+                    sqe->len = (unsigned) len;
+                    sqe->buf_index = (unsigned short) s;
+                }
+                else
+                {
+                    _iov[s].iov_base = buf;
+                    _iov[s].iov_len = len;
+                    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+                    sqe->addr = (unsigned long) &_iov[s];
+                    sqe->len = 1;
+                }
+            }
+    };
+
+#endif // HAVE_IO_URING
+
+}
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___VERIFY_H__
+#define ___VERIFY_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__GLIBC__)
+#include <unistd.h>
+#include <sys/stat.h>
+#define HAVE_CMP_STREAM
+#endif
+
+
+namespace util
+{
+
+    // Index of the first byte where a and b differ, n if they are equal
+    inline size_t first_diff( const unsigned char * a, const unsigned char * b, size_t n ) throw()
+    {
+        size_t i = 0;
+
+#ifdef __SSE2__
+        // 64 bytes per round, the mismatching lane is searched afterwards
+        for (; i + 64 <= n; i += 64)
+        {
+            const __m128i e0 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*) (a + i) ),
+                    _mm_loadu_si128( (const __m128i*) (b + i) ) );
+            const __m128i e1 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*) (a + i + 16) ),
+                    _mm_loadu_si128( (const __m128i*) (b + i + 16) ) );
+            const __m128i e2 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*) (a + i + 32) ),
+                    _mm_loadu_si128( (const __m128i*) (b + i + 32) ) );
+            const __m128i e3 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i*) (a + i + 48) ),
+                    _mm_loadu_si128( (const __m128i*) (b + i + 48) ) );
+
+            const __m128i all = _mm_and_si128( _mm_and_si128( e0, e1 ), _mm_and_si128( e2, e3 ) );
+
+            if (_mm_movemask_epi8( all ) != 0xffff)
+            {
+                break;
+            }
+        }
+
+        for (; i + 16 <= n; i += 16)
+        {
+            const unsigned int ne = ~unsigned( _mm_movemask_epi8( _mm_cmpeq_epi8(
+                            _mm_loadu_si128( (const __m128i*) (a + i) ),
+                            _mm_loadu_si128( (const __m128i*) (b + i) ) ) ) ) & 0xffff;
+
+            if (ne)
+            {
+                return i + __builtin_ctz( ne );
+            }
+        }
+#endif
+
+        for (; i < n; ++i)
+        {
+            if (a[i] != b[i])
+            {
+                break;
+            }
+        }
+
+        return i;
+    }
+
+
+#ifdef HAVE_CMP_STREAM
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Compares what is written to it with the content of an existing file
+       (--verify), stopping at the first difference. Writes to the first
+       <hold> bytes (e.g. a preamble that is patched after the payload) are
+       kept and only compared by finish(), once they are final.
+     */
+    class image_comparer_t
+    {
+        public:
+            enum result_t
+            {
+                SAME,
+                DIFFERS,   // at offset()
+                SHORTER,   // the file ends at offset()
+                LONGER     // the file goes on after offset()
+            };
+
+            enum { CHUNK_SIZE = 256 * 1024 };
+
+        private:
+            int _fd;
+            size_t _hold;
+            std::vector< unsigned char > _held;
+            std::vector< unsigned char > _buf;
+            unsigned long long _pos;
+            unsigned long long _end;
+            size_t _held_len;
+            result_t _result;
+            unsigned long long _offset;
+            int _err;
+
+            image_comparer_t( const image_comparer_t& );
+            image_comparer_t & operator=( const image_comparer_t& );
+
+
+            bool mismatch( result_t result, unsigned long long offset ) throw()
+            {
+                _result = result;
+                _offset = offset;
+                return false;
+            }
+
+
+            // Compare n bytes at offset ofs of the file
+            bool compare( const unsigned char * data, size_t n, unsigned long long ofs )
+            {
+                while (n > 0)
+                {
+                    const size_t chunk = n < _buf.size() ? n : _buf.size();
+                    const ssize_t rb = pread( _fd, &_buf[0], chunk, off_t( ofs ) );
+
+                    if (rb < 0)
+                    {
+                        if (errno == EINTR) continue;
+
+                        _err = errno;
+                        return false;
+                    }
+
+                    const size_t k = first_diff( &_buf[0], data, size_t( rb ) );
+
+                    if (k < size_t( rb ))
+                    {
+                        return mismatch( DIFFERS, ofs + k );
+                    }
+
+                    if (size_t( rb ) < chunk)
+                    {
+                        return mismatch( SHORTER, ofs + rb );
+                    }
+
+                    data += rb;
+                    ofs += rb;
+                    n -= rb;
+                }
+
+                return true;
+            }
+
+
+        public:
+            explicit image_comparer_t( int fd, size_t hold = 0 ) :
+                _fd(fd), _hold(hold), _held(hold), _buf(CHUNK_SIZE), _pos(0), _end(0), _held_len(0),
+                _result(SAME), _offset(0), _err(0)
+            {}
+
+
+            void set_hold( size_t hold )
+            {
+                _hold = hold;
+                _held.resize( hold );
+            }
+
+
+            // False at the first difference (or read error)
+            bool write( const unsigned char * data, size_t n )
+            {
+                if (_result != SAME || _err)
+                {
+                    return false;
+                }
+
+                if (_pos < _hold)
+                {
+                    const size_t k = size_t( _hold - _pos ) < n ? size_t( _hold - _pos ) : n;
+
+                    memcpy( &_held[ size_t( _pos ) ], data, k );
+
+                    if (_pos + k > _held_len) _held_len = size_t( _pos + k );
+
+                    data += k;
+                    n -= k;
+                    _pos += k;
+                }
+
+                if (n > 0 && ! compare( data, n, _pos ))
+                {
+                    return false;
+                }
+
+                _pos += n;
+                if (_pos > _end) _end = _pos;
+
+                return true;
+            }
+
+
+            void seek( unsigned long long pos ) throw()
+            {
+                _pos = pos;
+            }
+
+
+            unsigned long long tell() const throw()
+            {
+                return _pos;
+            }
+
+
+            unsigned long long end() const throw()
+            {
+                return _end;
+            }
+
+
+            // Compare the held bytes and, if whole, the length of the file
+            bool finish( bool whole )
+            {
+                if (_result != SAME || _err)
+                {
+                    return false;
+                }
+
+                if (_held_len && ! compare( &_held[0], _held_len, 0 ))
+                {
+                    return false;
+                }
+
+                struct stat st;
+
+                if (whole && fstat( _fd, &st ) == 0 &&
+                        (unsigned long long) st.st_size > _end)
+                {
+                    return mismatch( LONGER, _end );
+                }
+
+                return true;
+            }
+
+
+            result_t result() const throw()
+            {
+                return _result;
+            }
+
+
+            unsigned long long offset() const throw()
+            {
+                return _offset;
+            }
+
+
+            int error() const throw()
+            {
+                return _err;
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    namespace cmp_stream
+    {
+        inline ssize_t write( void * cookie, const char * buf, size_t size )
+        {
+            image_comparer_t * c = static_cast< image_comparer_t* >( cookie );
+
+            if (! c->write( (const unsigned char*) buf, size ))
+            {
+                errno = c->error() ? c->error() : EIO;
+                return -1;
+            }
+
+            return ssize_t(size);
+        }
+
+
+        inline int seek( void * cookie, off64_t * pos, int whence )
+        {
+            image_comparer_t * c = static_cast< image_comparer_t* >( cookie );
+
+            const long long from =
+                whence == SEEK_SET ? 0 :
+                whence == SEEK_CUR ? (long long) c->tell() : (long long) c->end();
+
+            if (from + *pos < 0)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+
+            c->seek( (unsigned long long) (from + *pos) );
+            *pos = off64_t( c->tell() );
+
+            return 0;
+        }
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Returns a write-only stream comparing what is written to it by means
+       of cmp, which is not owned by the stream
+     */
+    inline FILE * cmp_fopen( image_comparer_t & cmp )
+    {
+        cookie_io_functions_t io;
+
+        io.read = 0;
+        io.write = cmp_stream::write;
+        io.seek = cmp_stream::seek;
+        io.close = 0;
+
+        FILE * f = fopencookie( &cmp, "wb", io );
+
+        if (f)
+        {
+            setvbuf( f, 0, _IOFBF, image_comparer_t::CHUNK_SIZE );
+        }
+
+        return f;
+    }
+
+#endif // HAVE_CMP_STREAM
+
+}
+
+#endif
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2012 acaldmail@gmail.com
+ *
+ * Author: Antonino Calderone <acaldmail@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston,
+ * MA 02111-1307 USA
+ */
+
+#ifndef ___WORKQUEUE_H__
+#define ___WORKQUEUE_H__
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+namespace util
+{
+
+    /*
+       Bounded multi-producer/multi-consumer queue: producers block while the
+       queue is full, so walking a huge tree never buffers it all.
+     */
+    template <class T> class work_queue_t
+    {
+        private:
+            std::deque< T > _items;
+            size_t _capacity;
+            bool _closed;
+
+            std::mutex _mtx;
+            std::condition_variable _not_empty;
+            std::condition_variable _not_full;
+
+        public:
+            explicit work_queue_t( size_t capacity = 1024 ) throw() :
+                _capacity(capacity), _closed(false) {}
+
+
+            void push( const T & item )
+            {
+                std::unique_lock<std::mutex> lock( _mtx );
+                _not_full.wait( lock, [this]() { return _items.size() < _capacity; } );
+
+                _items.push_back( item );
+                _not_empty.notify_one();
+            }
+
+
+            // Returns false once the queue is closed and drained
+            bool pop( T & item )
+            {
+                std::unique_lock<std::mutex> lock( _mtx );
+                _not_empty.wait( lock, [this]() { return _closed || ! _items.empty(); } );
+
+                if (_items.empty())
+                {
+                    return false;
+                }
+
+                item = _items.front();
+                _items.pop_front();
+                _not_full.notify_one();
+
+                return true;
+            }
+
+
+            void close()
+            {
+                std::lock_guard<std::mutex> lock( _mtx );
+                _closed = true;
+                _not_empty.notify_all();
+            }
+    };
+
+
+    //--------------------------------------------------------------------------
+
+
+    inline unsigned int default_workers() throw()
+    {
+        unsigned int n = std::thread::hardware_concurrency();
+        return n ? n : 1;
+    }
+
+
+    //--------------------------------------------------------------------------
+
+
+    /*
+       Runs worker( item ) for every item produced by producer( queue ) on
+       n_workers threads; returns once all items have been processed.
+     */
+    template <class T, class P, class W>
+    void run_workers( unsigned int n_workers, P producer, W worker )
+    {
+        work_queue_t< T > queue( 4 * 1024 );
+        std::vector< std::thread > workers;
+
+        for (unsigned int i = 0; i < (n_workers ? n_workers : 1); ++i)
+        {
+            workers.push_back( std::thread( [&queue, &worker]()
+            {
+                T item;
+
+                while (queue.pop( item ))
+                {
+                    worker( item );
+                }
+            }));
+        }
+
+        producer( queue );
+        queue.close();
+
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i].join();
+        }
+    }
+
+}
+
+#endif